@@ -112,13 +112,19 @@ static void signal_handler(int sig)
 
     for(i = 0; i < global.outcnt; i++) {
         global.out[i].stop(global.out[i].param.id);
-        pthread_cond_destroy(&global.in[i].db_update);
-        pthread_mutex_destroy(&global.in[i].db);
         /*for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
             if (global.out[i].param.argv[j] != NULL)
                 free(global.out[i].param.argv[j]);
         }*/
     }
+
+    /* inputs wait on consumers_changed and outputs signal it, so it goes
+       once both are stopped */
+    for(i = 0; i < global.incnt; i++) {
+        pthread_cond_destroy(&global.in[i].db_update);
+        pthread_cond_destroy(&global.in[i].consumers_changed);
+        pthread_mutex_destroy(&global.in[i].db);
+    }
     usleep(1000 * 1000);
 
     /* close handles of input plugins */
@@ -220,10 +226,18 @@ int main(int argc, char *argv[])
 
         switch(c) {
         case 'i':
+            if(global.incnt >= MAX_INPUT_PLUGINS) {
+                fprintf(stderr, "at most %d input plugins are supported\n", MAX_INPUT_PLUGINS);
+                exit(EXIT_FAILURE);
+            }
             input[global.incnt++] = strdup(optarg);
             break;
 
         case 'o':
+            if(global.outcnt >= MAX_OUTPUT_PLUGINS) {
+                fprintf(stderr, "at most %d output plugins are supported\n", MAX_OUTPUT_PLUGINS);
+                exit(EXIT_FAILURE);
+            }
             output[global.outcnt++] = strdup(optarg);
             break;
 
@@ -298,12 +312,18 @@ int main(int argc, char *argv[])
             closelog();
             exit(EXIT_FAILURE);
         }
+        if(pthread_cond_init(&global.in[i].consumers_changed, NULL) != 0) {
+            LOG("could not initialize condition variable\n");
+            closelog();
+            exit(EXIT_FAILURE);
+        }
 
         tmp = (size_t)(strchr(input[i], ' ') - input[i]);
         global.in[i].stop      = 0;
         global.in[i].context   = NULL;
         global.in[i].buf       = NULL;
         global.in[i].size      = 0;
+        global.in[i].motion.score = -1;
         global.in[i].plugin = (tmp > 0) ? strndup(input[i], tmp) : strdup(input[i]);
         global.in[i].handle = dlopen(global.in[i].plugin, RTLD_LAZY);
         if(!global.in[i].handle) {
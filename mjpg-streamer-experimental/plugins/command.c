@@ -0,0 +1,328 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../mjpg_streamer.h"
+#include "command.h"
+
+#define DEFAULT_WORKERS 1
+#define DEFAULT_LENGTH 16
+
+extern char **environ;
+
+/******************************************************************************
+Description.: sets the defaults of a pool that is not started yet
+Input Value.: pool
+Return Value: -
+******************************************************************************/
+void command_pool_init(command_pool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->workers = DEFAULT_WORKERS;
+    pool->length = DEFAULT_LENGTH;
+    pool->overflow = COMMAND_DROP_NEWEST;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+}
+
+/******************************************************************************
+Description.: takes one of the options listed in COMMAND_HELP
+Input Value.: pool, name of the option without dashes and its value
+Return Value: 0 if ok, -1 if the value is invalid
+******************************************************************************/
+int command_pool_option(command_pool *pool, const char *name, const char *value)
+{
+    if(strcmp(name, "cmdthreads") == 0) {
+        pool->workers = atoi(value);
+        return pool->workers > 0 ? 0 : -1;
+    }
+    if(strcmp(name, "cmdqueue") == 0) {
+        pool->length = atoi(value);
+        return pool->length > 0 ? 0 : -1;
+    }
+    if(strcmp(name, "cmdoverflow") == 0) {
+        if(strcmp(value, "newest") == 0)
+            pool->overflow = COMMAND_DROP_NEWEST;
+        else if(strcmp(value, "oldest") == 0)
+            pool->overflow = COMMAND_DROP_OLDEST;
+        else
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+/******************************************************************************
+Description.: copies the environment and sets MJPG_FILE in the copy, setenv()
+              would change it for every thread
+Input Value.: file name
+Return Value: the environment, NULL if there is not enough memory
+******************************************************************************/
+static char **command_environment(const char *file)
+{
+    char **env;
+    int i, n = 0;
+
+    for(i = 0; environ[i] != NULL; i++);
+    env = malloc((i + 2) * sizeof(char *) + strlen("MJPG_FILE=") + strlen(file) + 1);
+    if(env == NULL)
+        return NULL;
+
+    env[n] = (char *)(env + i + 2);
+    sprintf(env[n++], "MJPG_FILE=%s", file);
+    for(i = 0; environ[i] != NULL; i++) {
+        if(strncmp(environ[i], "MJPG_FILE=", 10) != 0)
+            env[n++] = environ[i];
+    }
+    env[n] = NULL;
+    return env;
+}
+
+/******************************************************************************
+Description.: runs the command for a file and waits for it
+Input Value.: pool, file name
+Return Value: exit status of the command, -1 if it could not be started
+******************************************************************************/
+static int command_run(command_pool *pool, const char *file)
+{
+    char *argv[] = { "/bin/sh", "-c", pool->script, "sh", (char *)file, NULL };
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    char **env;
+    pid_t pid;
+    int rc, status;
+
+    env = command_environment(file);
+    if(env == NULL)
+        return -1;
+
+    /* the server ignores SIGPIPE and the threads may block signals, the
+       command gets the defaults */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    rc = posix_spawn(&pid, argv[0], NULL, &attr, argv, env);
+    posix_spawnattr_destroy(&attr);
+    free(env);
+    if(rc != 0) {
+        LOG("could not run the command: %s\n", strerror(rc));
+        return -1;
+    }
+
+    while(waitpid(pid, &status, 0) < 0) {
+        if(errno != EINTR) {
+            perror("waitpid()");
+            return -1;
+        }
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/******************************************************************************
+Description.: a worker of the pool, takes the oldest file from the queue and
+              runs the command for it, until the pool is stopped and the
+              queue is empty
+Input Value.: pool
+Return Value: NULL
+******************************************************************************/
+static void *command_worker(void *arg)
+{
+    command_pool *pool = arg;
+    struct timespec start, end;
+    char *file, **slot;
+    long ms;
+    int rc;
+
+    pthread_mutex_lock(&pool->mutex);
+    slot = &pool->running[pool->started++];
+    while(1) {
+        while(pool->count == 0 && !pool->stop)
+            pthread_cond_wait(&pool->changed, &pool->mutex);
+        if(pool->count == 0)
+            break;
+
+        file = pool->queue[pool->head];
+        pool->queue[pool->head] = NULL;
+        pool->head = (pool->head + 1) % pool->length;
+        pool->count--;
+        *slot = file;
+        pthread_mutex_unlock(&pool->mutex);
+
+        DBG("calling command %s \"%s\"\n", pool->command, file);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = command_run(pool, file);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        if(rc != 0) {
+            LOG("command failed (return value %d)\n", rc);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        *slot = NULL;
+        free(file);
+        pool->done++;
+        if(rc != 0)
+            pool->failed++;
+        pool->latency_total += ms;
+        if(ms > pool->latency_max)
+            pool->latency_max = ms;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: starts the workers of the pool
+Input Value.: pool, command line that gets the file name as argument
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+int command_pool_start(command_pool *pool, const char *command)
+{
+    int i;
+
+    pool->command = command;
+    pool->script = malloc(strlen(command) + sizeof(" \"$1\""));
+    pool->queue = calloc(pool->length, sizeof(char *));
+    pool->running = calloc(pool->workers, sizeof(char *));
+    pool->threads = calloc(pool->workers, sizeof(pthread_t));
+    if(pool->script == NULL || pool->queue == NULL || pool->running == NULL || pool->threads == NULL) {
+        LOG("not enough memory\n");
+        command_pool_stop(pool);
+        return -1;
+    }
+    sprintf(pool->script, "%s \"$1\"", command);
+
+    for(i = 0; i < pool->workers; i++) {
+        if(pthread_create(&pool->threads[i], NULL, command_worker, pool) != 0) {
+            LOG("could not start the command threads\n");
+            pool->workers = i;
+            command_pool_stop(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: waits until the commands for all queued files have run and
+              releases the pool
+Input Value.: pool
+Return Value: -
+******************************************************************************/
+void command_pool_stop(command_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(i = 0; pool->threads != NULL && i < pool->workers; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for(i = 0; pool->queue != NULL && i < pool->length; i++)
+        free(pool->queue[i]);
+    free(pool->queue);
+    free(pool->running);
+    free(pool->threads);
+    free(pool->script);
+    pool->queue = pool->running = NULL;
+    pool->threads = NULL;
+    pool->script = NULL;
+    pool->count = 0;
+}
+
+/******************************************************************************
+Description.: queues a file for the command, never waits. If the queue is
+              full the file or the oldest queued one is skipped, depending
+              on the overflow setting.
+Input Value.: pool, file name
+Return Value: -
+******************************************************************************/
+void command_submit(command_pool *pool, const char *file)
+{
+    char *copy = strdup(file);
+
+    if(copy == NULL) {
+        LOG("not enough memory\n");
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->queue == NULL || pool->stop) {
+        free(copy);
+        copy = NULL;
+    } else if(pool->count == pool->length) {
+        pool->dropped++;
+        if(pool->overflow == COMMAND_DROP_OLDEST) {
+            DBG("command queue full, skipping %s\n", pool->queue[pool->head]);
+            free(pool->queue[pool->head]);
+            pool->queue[pool->head] = NULL;
+            pool->head = (pool->head + 1) % pool->length;
+            pool->count--;
+        } else {
+            DBG("command queue full, skipping %s\n", copy);
+            free(copy);
+            copy = NULL;
+        }
+    }
+    if(copy != NULL) {
+        pool->queue[(pool->head + pool->count) % pool->length] = copy;
+        pool->count++;
+        pthread_cond_signal(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/******************************************************************************
+Description.: tells if the command still has to run or is running for a file,
+              which must not be deleted then
+Input Value.: pool, file name
+Return Value: 1 if it is pending, 0 otherwise
+******************************************************************************/
+int command_pending(command_pool *pool, const char *file)
+{
+    int i, pending = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for(i = 0; pool->queue != NULL && i < pool->count && !pending; i++)
+        pending = strcmp(pool->queue[(pool->head + i) % pool->length], file) == 0;
+    for(i = 0; pool->running != NULL && i < pool->started && !pending; i++)
+        pending = pool->running[i] != NULL && strcmp(pool->running[i], file) == 0;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return pending;
+}
@@ -0,0 +1,81 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <pthread.h>
+
+/*
+ * Runs the --command of an output plugin for every saved file, without
+ * holding up the plugin. The file names are queued and a fixed number of
+ * threads spawn the command for them, through the shell as system() did,
+ * with the name as "$1" and in MJPG_FILE.
+ *
+ * If the commands can not keep up the queue fills, then either the new file
+ * or the oldest queued one is skipped, the plugin never waits. The queued
+ * files still get their command when the pool is stopped.
+ */
+
+#define COMMAND_HELP \
+    " [-cmdthreads ]..........: commands that may run at the same time,\n" \
+    "                           default 1, which keeps them in order\n" \
+    " [-cmdqueue ]............: files that may wait for a command, default 16\n" \
+    " [-cmdoverflow ].........: which file to skip once the queue is full,\n" \
+    "                           \"newest\" (default) or \"oldest\"\n"
+
+enum _command_overflow {
+    COMMAND_DROP_NEWEST,
+    COMMAND_DROP_OLDEST
+};
+
+typedef struct _command_pool command_pool;
+struct _command_pool {
+    /* settings, may be changed before command_pool_start() */
+    int workers;
+    int length;
+    int overflow;
+
+    const char *command;
+    char *script;               // command "$1"
+    char **queue;               // file names, NULL for free slots
+    char **running;             // file of each worker
+    int head, count;
+    pthread_t *threads;
+    int started, stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    /* statistics, only written under the mutex */
+    unsigned int done;
+    unsigned int failed;
+    unsigned int dropped;
+    unsigned int latency_max;   // ms
+    unsigned long long latency_total;
+};
+
+void command_pool_init(command_pool *pool);
+int command_pool_option(command_pool *pool, const char *name, const char *value);
+int command_pool_start(command_pool *pool, const char *command);
+void command_pool_stop(command_pool *pool);
+void command_submit(command_pool *pool, const char *file);
+int command_pending(command_pool *pool, const char *file);
+
+#endif
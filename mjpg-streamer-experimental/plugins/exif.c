@@ -0,0 +1,288 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mjpg_streamer.h"
+#include "exif.h"
+
+/* TIFF field types */
+#define TYPE_ASCII 2
+#define TYPE_SHORT 3
+#define TYPE_LONG 4
+#define TYPE_RATIONAL 5
+#define TYPE_UNDEFINED 7
+
+#define HEADER 10               // APP1 marker, length and "Exif\0\0"
+
+/******************************************************************************
+Description.: turns the timestamp of a frame into wall clock time, the
+              timestamps of V4L2 drivers run on the monotonic clock
+Input Value.: wall receives the time, timestamp is the one of the input,
+              zero if it has none, then it is now
+Return Value: -
+******************************************************************************/
+void exif_wall_time(struct timeval *wall, const struct timeval *timestamp)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    *wall = *timestamp;
+    if(wall->tv_sec == 0 && wall->tv_usec == 0) {
+        *wall = now;
+    } else if(labs((long)(wall->tv_sec - now.tv_sec)) > 24 * 3600) {
+        struct timespec mono;
+        long long us;
+
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        us = (long long)wall->tv_sec * 1000000 + wall->tv_usec +
+             ((long long)now.tv_sec * 1000000 + now.tv_usec) -
+             ((long long)mono.tv_sec * 1000000 + mono.tv_nsec / 1000);
+        wall->tv_sec = us / 1000000;
+        wall->tv_usec = us % 1000000;
+    }
+}
+
+/******************************************************************************
+Description.: copies the metadata of the current frame of an input
+Input Value.: info receives the metadata, in is the input, the caller must
+              hold its db mutex
+Return Value: -
+******************************************************************************/
+void exif_capture(exif_info *info, const struct _input *in)
+{
+    int i;
+
+    exif_wall_time(&info->time, &in->timestamp);
+    info->sequence = in->sequence;
+
+    info->exposure = info->exposure_auto = -1;
+    for(i = 0; i < in->parametercount; i++) {
+        const control *c = &in->in_parameters[i];
+        if(c->ctrl.id == V4L2_CID_EXPOSURE_ABSOLUTE)
+            info->exposure = c->value;
+        else if(c->ctrl.id == V4L2_CID_EXPOSURE_AUTO)
+            info->exposure_auto = c->value != V4L2_EXPOSURE_MANUAL;
+    }
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* a TIFF directory being written, values that do not fit into their entry
+   go behind it */
+typedef struct _ifd_writer {
+    unsigned char *tiff;        // the offsets are relative to the TIFF header
+    int entry;                  // where the next entry goes
+    int data;                   // where the next value goes
+} ifd_writer;
+
+static void ifd_begin(ifd_writer *w, unsigned char *tiff, int offset, int entries)
+{
+    w->tiff = tiff;
+    put16(tiff + offset, entries);
+    w->entry = offset + 2;
+    w->data = offset + 2 + 12 * entries + 4;
+    put32(tiff + w->data - 4, 0);       // no further directory
+}
+
+/* entries have to be added in the order of their tags */
+static void ifd_add(ifd_writer *w, int tag, int type, int count, const void *value, int length)
+{
+    unsigned char *e = w->tiff + w->entry;
+
+    put16(e, tag);
+    put16(e + 2, type);
+    put32(e + 4, count);
+    if(length <= 4) {
+        memset(e + 8, 0, 4);
+        memcpy(e + 8, value, length);
+    } else {
+        put32(e + 8, w->data);
+        memcpy(w->tiff + w->data, value, length);
+        w->data += (length + 1) & ~1;   // values start at even offsets
+    }
+    w->entry += 12;
+}
+
+static void ifd_ascii(ifd_writer *w, int tag, const char *s)
+{
+    ifd_add(w, tag, TYPE_ASCII, strlen(s) + 1, s, strlen(s) + 1);
+}
+
+static void ifd_short(ifd_writer *w, int tag, unsigned int v)
+{
+    unsigned char b[2];
+    put16(b, v);
+    ifd_add(w, tag, TYPE_SHORT, 1, b, 2);
+}
+
+static void ifd_long(ifd_writer *w, int tag, unsigned int v)
+{
+    unsigned char b[4];
+    put32(b, v);
+    ifd_add(w, tag, TYPE_LONG, 1, b, 4);
+}
+
+static void ifd_rational(ifd_writer *w, int tag, unsigned int numerator, unsigned int denominator)
+{
+    unsigned char b[8];
+    put32(b, numerator);
+    put32(b + 4, denominator);
+    ifd_add(w, tag, TYPE_RATIONAL, 1, b, 8);
+}
+
+/******************************************************************************
+Description.: builds the APP1 Exif segment, big endian with the date in IFD0
+              and the rest in the Exif IFD
+Input Value.: the metadata, camera id or NULL, segment receives the segment
+              and has EXIF_SEGMENT_MAX bytes
+Return Value: length of the segment
+******************************************************************************/
+static int build_exif(const exif_info *info, const char *camera, const struct tm *tm, unsigned char *segment)
+{
+    unsigned char *tiff = segment + HEADER;
+    char date[20], zone[8], subsec[8];
+    int offset = tm->tm_gmtoff / 60;   // minutes east of UTC
+    ifd_writer w;
+
+    strftime(date, sizeof(date), "%Y:%m:%d %H:%M:%S", tm);
+    snprintf(zone, sizeof(zone), "%c%02d:%02d", offset < 0 ? '-' : '+', abs(offset) / 60 % 24, abs(offset) % 60);
+    snprintf(subsec, sizeof(subsec), "%06ld", (long)info->time.tv_usec);
+
+    segment[0] = 0xFF;
+    segment[1] = JPEG_APP1;
+    memcpy(segment + 4, "Exif\0\0", 6);
+    memcpy(tiff, "MM\0\x2A\0\0\0\x08", 8);
+
+    ifd_begin(&w, tiff, 8, 3);
+    ifd_ascii(&w, 0x0131, "MJPG-streamer " SOURCE_VERSION);        // Software
+    ifd_ascii(&w, 0x0132, date);                                    // DateTime
+    ifd_long(&w, 0x8769, w.data);                                   // Exif IFD
+
+    ifd_begin(&w, tiff, w.data, 5 + (info->exposure >= 0) + (info->exposure_auto >= 0) +
+              (camera != NULL && *camera != '\0'));
+    if(info->exposure >= 0)
+        ifd_rational(&w, 0x829A, info->exposure, 10000);            // ExposureTime
+    ifd_add(&w, 0x9000, TYPE_UNDEFINED, 4, "0232", 4);              // ExifVersion
+    ifd_ascii(&w, 0x9003, date);                                    // DateTimeOriginal
+    ifd_ascii(&w, 0x9011, zone);                                    // OffsetTimeOriginal
+    ifd_long(&w, 0x9211, info->sequence);                           // ImageNumber
+    ifd_ascii(&w, 0x9291, subsec);                                  // SubSecTimeOriginal
+    if(info->exposure_auto >= 0)
+        ifd_short(&w, 0xA402, !info->exposure_auto);                // ExposureMode
+    if(camera != NULL && *camera != '\0')
+        ifd_ascii(&w, 0xA431, camera);                              // BodySerialNumber
+
+    put16(segment + 2, HEADER - 2 + w.data);
+    return HEADER + w.data;
+}
+
+/******************************************************************************
+Description.: builds a COM segment with the metadata as text, for frames
+              which already have an Exif segment
+Input Value.: the metadata, camera id or NULL, segment receives the segment
+              and has EXIF_SEGMENT_MAX bytes
+Return Value: length of the segment
+******************************************************************************/
+static int build_comment(const exif_info *info, const char *camera, unsigned char *segment)
+{
+    char *text = (char *)segment + 4;
+    int size = EXIF_SEGMENT_MAX - 4, length;
+
+    length = snprintf(text, size, "MJPG-streamer time=%ld.%06ld sequence=%u",
+                      (long)info->time.tv_sec, (long)info->time.tv_usec, info->sequence);
+    if(camera != NULL && *camera != '\0')
+        length += snprintf(text + length, size - length, " camera=%s", camera);
+    if(info->exposure >= 0)
+        length += snprintf(text + length, size - length, " exposure=%d", info->exposure);
+    if(info->exposure_auto >= 0)
+        length += snprintf(text + length, size - length, " exposure_auto=%d", info->exposure_auto);
+
+    segment[0] = 0xFF;
+    segment[1] = JPEG_COM;
+    put16(segment + 2, 2 + length);
+    return 4 + length;
+}
+
+/******************************************************************************
+Description.: puts the metadata into a frame, without copying the frame: an
+              Exif segment goes behind the SOI, or behind a JFIF segment that
+              has to stay first. If the camera sent an Exif segment already,
+              a COM segment behind the application segments is used instead
+Input Value.: the metadata, camera id or NULL, the JPEG and its size, segment
+              receives the new segment and has EXIF_SEGMENT_MAX bytes, splice
+              receives the stamped frame
+Return Value: 0 if ok, -1 if it is not a JPEG, splice then has the frame as it
+              is
+******************************************************************************/
+int exif_stamp(const exif_info *info, const char *camera, const unsigned char *jpeg, int size,
+               unsigned char *segment, jpeg_splice *splice)
+{
+    char id[EXIF_CAMERA_MAX];
+    jpeg_segment s;
+    struct tm tm;
+    time_t t = info->time.tv_sec;
+    int exif = 0, at, behind, length;
+
+    jpeg_splice_init(splice, jpeg, size);
+
+    memset(&s, 0, sizeof(s));
+    if(jpeg_next_segment(jpeg, size, &s) <= 0)
+        return -1;
+    at = behind = s.next;
+    while(jpeg_next_segment(jpeg, size, &s) > 0 && s.marker >= JPEG_APP0 && s.marker <= JPEG_APP0 + 15) {
+        if(s.marker == JPEG_APP0 && s.offset == 2)
+            at = s.next;
+        else if(s.marker == JPEG_APP1 && s.length >= 6 && memcmp(s.data, "Exif\0\0", 6) == 0)
+            exif = 1;
+        behind = s.next;
+    }
+
+    if(camera != NULL) {
+        snprintf(id, sizeof(id), "%s", camera);
+        camera = id;
+    }
+
+    if(exif) {
+        length = build_comment(info, camera, segment);
+        at = behind;
+    } else {
+        if(localtime_r(&t, &tm) == NULL)
+            return -1;
+        length = build_exif(info, camera, &tm, segment);
+    }
+
+    return jpeg_splice_insert(splice, at, segment, length);
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <sys/time.h>
+
+#include "jpeg_tools.h"
+
+/*
+ * Capture metadata for the frames an output sends or records: when the frame
+ * was taken, its sequence number, the camera it came from and the exposure
+ * the input reports. The frame itself is not touched, exif_stamp() builds an
+ * APP1 Exif segment of a few hundred bytes and splices it in behind the SOI,
+ * so the cost is the same for every frame size.
+ *
+ * Frames that already carry an Exif segment of the camera keep it, a second
+ * one would hide it from most readers. They get the same data as a text COM
+ * segment instead.
+ *
+ * Outputs copy the metadata with exif_capture() while they hold the db lock,
+ * together with the frame, and stamp the frame later, when it is written.
+ */
+
+#define EXIF_HELP \
+    " [-exif ID ].............: put the capture time, sequence number and\n" \
+    "                           exposure into every frame as Exif, along\n" \
+    "                           with this camera id\n"
+
+#define EXIF_SEGMENT_MAX 512    // bytes exif_stamp() may need for the segment
+#define EXIF_CAMERA_MAX 64      // of the camera id, including the terminator
+
+struct _input;
+
+typedef struct _exif_info exif_info;
+struct _exif_info {
+    struct timeval time;        // wall clock time of the capture
+    unsigned int sequence;
+    int exposure;               // in 100 µs, -1 if unknown
+    int exposure_auto;          // 1 automatic, 0 manual, -1 if unknown
+};
+
+void exif_wall_time(struct timeval *wall, const struct timeval *timestamp);
+void exif_capture(exif_info *info, const struct _input *in);
+int exif_stamp(const exif_info *info, const char *camera, const unsigned char *jpeg, int size,
+               unsigned char *segment, jpeg_splice *splice);
+
+#endif
@@ -21,6 +21,7 @@
 *******************************************************************************/
 
 #include <syslog.h>
+#include <sys/time.h>
 #include "../mjpg_streamer.h"
 #define INPUT_PLUGIN_PREFIX " i: "
 #define IPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", INPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
@@ -49,6 +50,25 @@ struct _input_format {
     char currentResolution;
 };
 
+/* uncompressed picture of the current frame, for inputs that can provide one */
+typedef struct _input_raw input_raw;
+struct _input_raw {
+    unsigned int format;        // V4L2_PIX_FMT_*, 0 if the input only has the JPEG
+    unsigned int width;
+    unsigned int height;
+    int planes;
+    unsigned char *plane[3];
+    unsigned int stride[3];     // bytes per line of each plane
+};
+
+/* result of the motion detection of inputs started with -motion */
+typedef struct _input_motion input_motion;
+struct _input_motion {
+    int score;                  // permille of changed macroblocks, -1 if not measured
+    int active;                 // a motion event is going on
+    unsigned int events;        // events since the input started
+};
+
 /* structure to store variables/functions for input plugin */
 typedef struct _input input;
 struct _input {
@@ -76,6 +96,25 @@ struct _input {
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /* frames published since the input started, written together with buf */
+    unsigned int sequence;
+
+    /* inputs that set encode publish the raw picture only, buf and size are
+       filled in by encode() the first time somebody asks for the JPEG,
+       always go through input_jpeg() to read them */
+    input_raw raw;
+    int jpeg_ready;
+
+    /* outputs that wait for frames, see input_subscribe(), an input may go
+       idle while there are none and waits on consumers_changed to resume */
+    int consumers;
+    int jpeg_consumers;         // those of them that read the JPEG
+    pthread_cond_t consumers_changed;
+    struct timeval resume_requested; // when consumers last went up from 0
+
+    /* motion of the current frame, written together with buf */
+    input_motion motion;
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
@@ -86,4 +125,107 @@ struct _input {
     int (*stop)(int);
     int (*run)(int);
     int (*cmd)(int plugin, unsigned int control_id, unsigned int group, int value, char *value_str);
+    int (*encode)(int id); // optional, writes raw to buf, returns the size or -1
 };
+
+/******************************************************************************
+Description.: makes buf and size hold the JPEG of the current frame, a raw
+              frame gets encoded here, but only once, by the first caller
+Input Value.: in is the input, the caller must hold its db mutex
+Return Value: size of the JPEG in buf, 0 if there is none
+******************************************************************************/
+static inline int input_jpeg(input *in)
+{
+    if(in->encode != NULL && !in->jpeg_ready) {
+        int size = in->encode(in->param.id);
+        in->size = size < 0 ? 0 : size;
+        in->jpeg_ready = 1;
+    }
+    return in->size;
+}
+
+/******************************************************************************
+Description.: counts an output in or out, see input_subscribe()
+Input Value.: in is the input, change is 1 or -1, jpeg tells if the output
+              reads the JPEG, the caller must not hold the db mutex
+Return Value: -
+******************************************************************************/
+static inline void input_count_consumer(input *in, int change, int jpeg)
+{
+    pthread_mutex_lock(&in->db);
+    if(change > 0 && in->consumers++ == 0) {
+        gettimeofday(&in->resume_requested, NULL);
+        pthread_cond_broadcast(&in->consumers_changed);
+    } else if(change < 0 && in->consumers > 0 && --in->consumers == 0) {
+        pthread_cond_broadcast(&in->consumers_changed);
+    }
+    if(jpeg && (change > 0 || in->jpeg_consumers > 0))
+        in->jpeg_consumers += change;
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: registers an output that waits for the JPEG of frames of this
+              input, call input_unsubscribe() once it stops doing so.
+              An input may stop capturing while nobody is subscribed, so an
+              output that waits on db_update without subscribing only gets
+              frames while others keep the input busy. Outputs that serve
+              clients subscribe while one wants frames, outputs that take
+              every frame for as long as they run.
+              Inputs that publish raw frames compress them before publishing
+              while there are JPEG consumers, otherwise only the first
+              input_jpeg() of a frame does
+Input Value.: in is the input, the caller must not hold its db mutex
+Return Value: -
+******************************************************************************/
+static inline void input_subscribe(input *in)
+{
+    input_count_consumer(in, 1, 1);
+}
+
+/******************************************************************************
+Description.: counterpart of input_subscribe()
+Input Value.: in is the input, the caller must not hold its db mutex
+Return Value: -
+******************************************************************************/
+static inline void input_unsubscribe(input *in)
+{
+    input_count_consumer(in, -1, 1);
+}
+
+/******************************************************************************
+Description.: like input_subscribe(), for outputs that read the raw frame
+              if there is one, they keep the input busy without making it
+              compress every frame
+Input Value.: in is the input, the caller must not hold its db mutex
+Return Value: -
+******************************************************************************/
+static inline void input_subscribe_raw(input *in)
+{
+    input_count_consumer(in, 1, 0);
+}
+
+/******************************************************************************
+Description.: counterpart of input_subscribe_raw()
+Input Value.: in is the input, the caller must not hold its db mutex
+Return Value: -
+******************************************************************************/
+static inline void input_unsubscribe_raw(input *in)
+{
+    input_count_consumer(in, -1, 0);
+}
+
+/******************************************************************************
+Description.: for inputs coming back from idle, the time it took them since
+              the first output subscribed again
+Input Value.: in is the input
+Return Value: latency in milliseconds
+******************************************************************************/
+static inline long input_resume_latency(input *in)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - in->resume_requested.tv_sec) * 1000 +
+           (now.tv_usec - in->resume_requested.tv_usec) / 1000;
+}
@@ -31,9 +31,13 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../motion.h"
 
 #define INPUT_PLUGIN_NAME "FILE input plugin"
 
@@ -42,11 +46,31 @@ typedef enum _read_mode {
     ExistingFiles
 } read_mode;
 
+/* a file loaded into memory, the buffers get passed around and reused */
+typedef struct _frame {
+    unsigned char *buf;
+    size_t capacity;
+    int size;
+    char path[PATH_MAX];
+} frame;
+
+/* a preloaded file of --loop, pointing into the arena */
+typedef struct _clip_frame {
+    unsigned char *buf;
+    int size;
+    int stamp;  // offset of the sequence number, -1 if the frame is not stamped
+} clip_frame;
+
+/* JPEG comment segment carrying the sequence number, inserted behind SOI */
+#define STAMP_DIGITS 12
+#define STAMP_SIZE (4 + STAMP_DIGITS)
+
 /* private functions and variables to this plugin */
 static pthread_t   worker;
 static globals     *pglobal;
 
 void *worker_thread(void *);
+void *readahead_thread(void *);
 void worker_cleanup(void *);
 void help(void);
 
@@ -56,10 +80,35 @@ static char *filename = NULL;
 static int rm = 0;
 static int plugin_number;
 static read_mode mode = NewFilesOnly;
+static int prefetch = 4;
+static int loop = 0;
+static int stamp = 0;
+static int detect = 0;
+static motion_detector motion;
 
 /* global variables for this plugin */
 static int fd, rc, wd, size;
 static struct inotify_event *ev;
+static size_t buf_capacity; // of pglobal->in[plugin_number].buf
+static frame back;          // filled while the consumers read the global buffer
+
+/* the directory listing served with --existing */
+static struct dirent **fileList;
+static int fileCount = 0;
+static int currentFileNumber = 0;
+
+/* ring of frames the read-ahead thread loads in advance for --existing */
+static pthread_t   readahead;
+static int         readahead_running = 0;
+static frame       *ring;
+static int         ring_head = 0, ring_count = 0, readahead_failed = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ring_changed = PTHREAD_COND_INITIALIZER;
+
+/* all files of the folder for --loop, the frames are published straight from here */
+static unsigned char *arena;
+static clip_frame *clip;
+static int clip_length = 0;
 
 /*** plugin interface functions ***/
 int input_init(input_parameter *param, int id)
@@ -91,6 +140,14 @@ int input_init(input_parameter *param, int id)
             {"name", required_argument, 0, 0},
             {"e", no_argument, 0, 0},
             {"existing", no_argument, 0, 0},
+            {"p", required_argument, 0, 0},
+            {"prefetch", required_argument, 0, 0},
+            {"l", no_argument, 0, 0},
+            {"loop", no_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"s", no_argument, 0, 0},
+            {"stamp", no_argument, 0, 0},
+            {"motion", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -151,6 +208,53 @@ int input_init(input_parameter *param, int id)
             DBG("case 10,11\n");
             mode = ExistingFiles;
             break;
+
+            /* p, prefetch */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            prefetch = atoi(optarg);
+            if(prefetch < 0) {
+                help();
+                return 1;
+            }
+            break;
+
+            /* l, loop */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            loop = 1;
+            mode = ExistingFiles;
+            break;
+
+            /* fps */
+        case 16:
+            DBG("case 16\n");
+            delay = atof(optarg);
+            if(delay < 0) {
+                help();
+                return 1;
+            }
+            delay = (delay > 0) ? 1.0 / delay : 0;
+            break;
+
+            /* s, stamp */
+        case 17:
+        case 18:
+            DBG("case 17,18\n");
+            stamp = 1;
+            break;
+
+            /* motion */
+        case 19:
+            DBG("case 19\n");
+            if(motion_init(&motion, optarg) == -1) {
+                help();
+                return 1;
+            }
+            detect = 1;
+            break;
         default:
             DBG("default case\n");
             help();
@@ -166,10 +270,23 @@ int input_init(input_parameter *param, int id)
         return 1;
     }
 
+    if(loop && rm) {
+        IPRINT("ERROR: files can not be deleted when they are played in a loop\n");
+        return 1;
+    }
+
     IPRINT("folder to watch...: %s\n", folder);
     IPRINT("forced delay......: %.4f\n", delay);
     IPRINT("delete file.......: %s\n", (rm) ? "yes, delete" : "no, do not delete");
     IPRINT("filename must be..: %s\n", (filename == NULL) ? "-no filter for certain filename set-" : filename);
+    if(loop) {
+        IPRINT("loop playback.....: from memory%s\n", stamp ? ", frames stamped with a sequence number" : "");
+    } else if(mode == ExistingFiles) {
+        IPRINT("read ahead........: %d files\n", prefetch);
+    }
+    if(detect) {
+        IPRINT("motion detection..: %d permille of the macroblocks, threshold %d\n", motion.trigger, motion.threshold);
+    }
 
     param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
@@ -232,21 +349,381 @@ void help(void)
     " [-r | --remove ].......: remove/delete JPEG file after reading\n" \
     " [-n | --name ].........: ignore changes unless filename matches\n" \
     " [-e | --existing ].....: serve the existing *.jpg files from the specified directory\n" \
+    " [-p | --prefetch ].....: number of files loaded ahead of time with --existing,\n" \
+    "                          defaults to 4, 0 loads each file when it is due\n" \
+    " [-l | --loop ].........: load all *.jpg files of the folder into memory once\n" \
+    "                          and play them in a loop, for benchmarking outputs\n" \
+    " [-fps ]................: frames per second instead of a delay, fractions are\n" \
+    "                          allowed, 0 plays as fast as possible\n" \
+    " [-s | --stamp ]........: with --loop, put a sequence number into every frame\n" \
+    "                          as a JPEG comment\n" \
+    MOTION_HELP \
     " ---------------------------------------------------------------\n");
 }
 
-/* the single writer thread */
-void *worker_thread(void *arg)
+/******************************************************************************
+Description.: reads until the buffer is full or the file ends
+Input Value.: file is the descriptor, buf receives at most length bytes
+Return Value: number of bytes read, -1 on errors
+******************************************************************************/
+static ssize_t read_fully(int file, unsigned char *buf, size_t length)
+{
+    size_t filled = 0;
+    ssize_t rc;
+
+    while(filled < length) {
+        rc = read(file, buf + filled, length - filled);
+        if(rc == -1 && errno == EINTR)
+            continue;
+        if(rc == -1) {
+            perror("could not read from file");
+            return -1;
+        }
+        if(rc == 0)
+            break;
+        filled += rc;
+    }
+
+    return filled;
+}
+
+/******************************************************************************
+Description.: reads a whole file into a frame, the buffer of the frame is
+              reused and only replaced if the file does not fit
+Input Value.: path of the file, f is the frame to fill
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int load_file(const char *path, frame *f)
 {
-    char buffer[1<<16];
     int file;
-    size_t filesize = 0;
     struct stat stats;
-    struct dirent **fileList;
-    int fileCount = 0;
-    int currentFileNumber = 0;
-    char hasJpgFile = 0;
-    struct timeval timestamp;
+    ssize_t length;
+
+    file = open(path, O_RDONLY);
+    if(file == -1) {
+        perror("could not open file for reading");
+        return -1;
+    }
+
+    /* approximate size of file */
+    if(fstat(file, &stats) == -1) {
+        perror("could not read statistics of file");
+        close(file);
+        return -1;
+    }
+
+    if(f->capacity < (size_t)stats.st_size) {
+        free(f->buf);
+        f->capacity = 0;
+        f->buf = malloc(stats.st_size + (1 << 16));
+        if(f->buf == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            close(file);
+            return -1;
+        }
+        f->capacity = stats.st_size + (1 << 16);
+    }
+
+    length = read_fully(file, f->buf, stats.st_size);
+    close(file);
+    if(length == -1)
+        return -1;
+
+    f->size = length;
+    return 0;
+}
+
+/******************************************************************************
+Description.: makes a loaded frame the current one, only the buffers are
+              exchanged while holding the lock, the frame gets the old buffer
+Input Value.: f is the frame to publish
+Return Value: -
+******************************************************************************/
+static void publish_frame(frame *f)
+{
+    input *in = &pglobal->in[plugin_number];
+    unsigned char *tmp;
+    size_t tmp_capacity;
+
+    if(detect)
+        motion_feed_jpeg(&motion, f->buf, f->size);
+
+    pthread_mutex_lock(&in->db);
+
+    tmp = in->buf;
+    tmp_capacity = buf_capacity;
+    in->buf = f->buf;
+    buf_capacity = f->capacity;
+    in->size = f->size;
+    gettimeofday(&in->timestamp, NULL);
+    in->sequence++;
+    if(detect)
+        motion_publish(&motion, &in->motion);
+    f->buf = tmp;
+    f->capacity = tmp_capacity;
+
+    DBG("new frame published (size: %d)\n", in->size);
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: picks the next *.jpg file of the directory listing, starts
+              over at the beginning once the end is reached
+Input Value.: path receives the name of the file including the folder
+Return Value: 0 if ok, -1 if there is no jpg file at all
+******************************************************************************/
+static int next_file(char *path, size_t length)
+{
+    const char *name;
+    int i;
+
+    for(i = 0; i < fileCount; i++) {
+        name = fileList[currentFileNumber]->d_name;
+        currentFileNumber = (currentFileNumber + 1) % fileCount;
+        if((strstr(name, ".jpg") != NULL) || (strstr(name, ".JPG") != NULL)) {
+            DBG("serving file: %s\n", name);
+            snprintf(path, length, "%s%s", folder, name);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No files with jpg/JPG extension in the folder\n");
+    return -1;
+}
+
+/******************************************************************************
+Description.: loads every *.jpg file of the listing into one arena for --loop,
+              with --stamp room for a comment segment is left behind SOI
+Input Value.: -
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int preload_files(void)
+{
+    struct stat stats;
+    size_t total = 0, offset = 0;
+    char path[PATH_MAX];
+    const char *name;
+    ssize_t length;
+    int i, file;
+
+    clip = calloc(fileCount > 0 ? fileCount : 1, sizeof(clip_frame));
+    if(clip == NULL) {
+        fprintf(stderr, "could not allocate memory\n");
+        return -1;
+    }
+
+    /* first pass, just find out how large the arena has to be */
+    for(i = 0; i < fileCount; i++) {
+        name = fileList[i]->d_name;
+        if((strstr(name, ".jpg") == NULL) && (strstr(name, ".JPG") == NULL))
+            continue;
+        snprintf(path, sizeof(path), "%s%s", folder, name);
+        if(stat(path, &stats) == -1) {
+            perror("could not read statistics of file");
+            return -1;
+        }
+        clip[clip_length++].size = stats.st_size;
+        total += stats.st_size + (stamp ? STAMP_SIZE : 0);
+    }
+
+    if(clip_length == 0) {
+        fprintf(stderr, "No files with jpg/JPG extension in the folder\n");
+        return -1;
+    }
+
+    arena = malloc(total);
+    if(arena == NULL) {
+        fprintf(stderr, "could not allocate %lu bytes for the frames\n", (unsigned long)total);
+        return -1;
+    }
+
+    clip_length = 0;
+    for(i = 0; i < fileCount; i++) {
+        clip_frame *f;
+
+        name = fileList[i]->d_name;
+        if((strstr(name, ".jpg") == NULL) && (strstr(name, ".JPG") == NULL))
+            continue;
+        snprintf(path, sizeof(path), "%s%s", folder, name);
+        file = open(path, O_RDONLY);
+        if(file == -1) {
+            perror("could not open file for reading");
+            return -1;
+        }
+
+        f = &clip[clip_length++];
+        f->buf = arena + offset;
+        f->stamp = -1;
+        length = read_fully(file, f->buf, f->size);
+        close(file);
+        if(length == -1)
+            return -1;
+        f->size = length;
+
+        /* move everything behind SOI up, the comment goes in between */
+        if(stamp && length >= 2 && f->buf[0] == 0xFF && f->buf[1] == 0xD8) {
+            memmove(f->buf + 2 + STAMP_SIZE, f->buf + 2, length - 2);
+            f->buf[2] = 0xFF;
+            f->buf[3] = 0xFE;
+            f->buf[4] = 0;
+            f->buf[5] = STAMP_SIZE - 2;
+            memset(f->buf + 6, '0', STAMP_DIGITS);
+            f->stamp = 6;
+            f->size += STAMP_SIZE;
+        }
+        offset += f->size;
+    }
+
+    IPRINT("preloaded %d frames, %lu bytes\n", clip_length, (unsigned long)offset);
+    return 0;
+}
+
+/******************************************************************************
+Description.: publishes a preloaded frame without copying it, the consumers
+              only read the global buffer while holding the lock, so the
+              sequence number can be written in place under that lock
+Input Value.: f is the frame, sequence the number to stamp into it
+Return Value: -
+******************************************************************************/
+static void publish_clip_frame(clip_frame *f, unsigned int sequence)
+{
+    input *in = &pglobal->in[plugin_number];
+    char digits[STAMP_DIGITS + 1];
+
+    if(detect)
+        motion_feed_jpeg(&motion, f->buf, f->size);
+
+    pthread_mutex_lock(&in->db);
+
+    if(f->stamp >= 0) {
+        snprintf(digits, sizeof(digits), "%0*u", STAMP_DIGITS, sequence);
+        memcpy(f->buf + f->stamp, digits, STAMP_DIGITS);
+    }
+    in->buf = f->buf;
+    in->size = f->size;
+    gettimeofday(&in->timestamp, NULL);
+    in->sequence++;
+    if(detect)
+        motion_publish(&motion, &in->motion);
+
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: waits for the slot of the next frame, the slots are absolute
+              deadlines one delay apart, so the time spent on loading and
+              publishing does not add up and fractional rates stay exact
+Input Value.: deadline is the slot of the current frame, it is advanced
+Return Value: -
+******************************************************************************/
+static void wait_next_slot(struct timespec *deadline)
+{
+    long long period = delay * 1000000000.0, late;
+    struct timespec now;
+
+    if(period <= 0)
+        return;
+
+    deadline->tv_sec += period / 1000000000;
+    deadline->tv_nsec += period % 1000000000;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+
+    /* if we fell behind by more than a frame, e.g. waiting for a new file,
+       start over from now instead of catching up with a burst */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = (now.tv_sec - deadline->tv_sec) * 1000000000LL + (now.tv_nsec - deadline->tv_nsec);
+    if(late > period) {
+        *deadline = now;
+        return;
+    }
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+}
+
+static void unlock_ring(void *arg)
+{
+    pthread_mutex_unlock(&ring_mutex);
+}
+
+/******************************************************************************
+Description.: loads the next files of the listing while the worker thread
+              is serving the current one, so the disk is never waited for
+Input Value.: arg is unused
+Return Value: NULL
+******************************************************************************/
+void *readahead_thread(void *arg)
+{
+    frame *f;
+
+    while(!pglobal->stop) {
+        pthread_mutex_lock(&ring_mutex);
+        pthread_cleanup_push(unlock_ring, NULL);
+        while(ring_count == prefetch)
+            pthread_cond_wait(&ring_changed, &ring_mutex);
+        /* the slot behind the last loaded one is not touched by the worker */
+        f = &ring[(ring_head + ring_count) % prefetch];
+        pthread_cleanup_pop(1);
+
+        if(next_file(f->path, sizeof(f->path)) == -1 || load_file(f->path, f) == -1) {
+            pthread_mutex_lock(&ring_mutex);
+            readahead_failed = 1;
+            pthread_cond_broadcast(&ring_changed);
+            pthread_mutex_unlock(&ring_mutex);
+            break;
+        }
+
+        pthread_mutex_lock(&ring_mutex);
+        ring_count++;
+        pthread_cond_broadcast(&ring_changed);
+        pthread_mutex_unlock(&ring_mutex);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: takes the oldest frame the read-ahead thread loaded, it is
+              exchanged with the given one whose buffer gets reused
+Input Value.: f receives the frame
+Return Value: 0 if ok, -1 if the read-ahead thread gave up
+******************************************************************************/
+static int take_prefetched(frame *f)
+{
+    frame tmp;
+    int result = -1;
+
+    pthread_mutex_lock(&ring_mutex);
+    pthread_cleanup_push(unlock_ring, NULL);
+    while(ring_count == 0 && !readahead_failed)
+        pthread_cond_wait(&ring_changed, &ring_mutex);
+
+    if(ring_count > 0) {
+        tmp = ring[ring_head];
+        ring[ring_head] = *f;
+        *f = tmp;
+        ring_head = (ring_head + 1) % prefetch;
+        ring_count--;
+        pthread_cond_broadcast(&ring_changed);
+        result = 0;
+    }
+    pthread_cleanup_pop(1);
+
+    return result;
+}
+
+/* the single writer thread */
+void *worker_thread(void *arg)
+{
+    struct timespec deadline;
+    unsigned int sequence = 0;
+    int position = 0;
 
     if (mode == ExistingFiles) {
         fileCount = scandir(folder, &fileList, 0, alphasort);
@@ -259,7 +736,27 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    if (loop) {
+        if(preload_files() == -1)
+            goto thread_quit;
+    } else if (mode == ExistingFiles && prefetch > 0) {
+        ring = calloc(prefetch, sizeof(frame));
+        if(ring == NULL || pthread_create(&readahead, 0, readahead_thread, NULL) != 0) {
+            fprintf(stderr, "could not start read-ahead thread\n");
+            goto thread_quit;
+        }
+        readahead_running = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
     while(!pglobal->stop) {
+        if (loop) {
+            publish_clip_frame(&clip[position], sequence++);
+            position = (position + 1) % clip_length;
+            wait_next_slot(&deadline);
+            continue;
+        }
+
         if (mode == NewFilesOnly) {
             /* wait for new frame, read will block until something happens */
             rc = read(fd, ev, size);
@@ -280,104 +777,40 @@ void *worker_thread(void *arg)
             }
 
             /* prepare filename */
-            snprintf(buffer, sizeof(buffer), "%s%s", folder, ev->name);
+            snprintf(back.path, sizeof(back.path), "%s%s", folder, ev->name);
 
             /* check if the filename matches specified parameter (if given) */
             if((filename != NULL) && (strcmp(filename, ev->name) != 0)) {
                 DBG("ignoring this change (specified filename does not match)\n");
                 continue;
             }
-            DBG("new file detected: %s\n", buffer);
-        } else {
-            if ((strstr(fileList[currentFileNumber]->d_name, ".jpg") != NULL) ||
-                (strstr(fileList[currentFileNumber]->d_name, ".JPG") != NULL)) {
-                hasJpgFile = 1;
-                DBG("serving file: %s\n", fileList[currentFileNumber]->d_name);
-                snprintf(buffer, sizeof(buffer), "%s%s", folder, fileList[currentFileNumber]->d_name);
-                currentFileNumber++;
-                if (currentFileNumber == fileCount)
-                    currentFileNumber = 0;
-            } else {
-                currentFileNumber++;
-                if (currentFileNumber == fileCount) {
-                    if(hasJpgFile == 0) {
-                        perror("No files with jpg/JPG extension in the folder\n");
-                        goto thread_quit;
-                    } else {
-                        // There are some jpeg files, the last one just happens not to be one
-                        currentFileNumber = 0;
-                    }
-                }
-                continue;
-            }
-        }
+            DBG("new file detected: %s\n", back.path);
 
-        /* open file for reading */
-        rc = file = open(buffer, O_RDONLY);
-        if(rc == -1) {
-            perror("could not open file for reading");
-            break;
-        }
-
-        /* approximate size of file */
-        rc = fstat(file, &stats);
-        if(rc == -1) {
-            perror("could not read statistics of file");
-            close(file);
-            break;
-        }
-
-        filesize = stats.st_size;
-
-        /* copy frame from file to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
-        /* allocate memory for frame */
-        if(pglobal->in[plugin_number].buf != NULL)
-            free(pglobal->in[plugin_number].buf);
-
-        pglobal->in[plugin_number].buf = malloc(filesize + (1 << 16));
-
-        if(pglobal->in[plugin_number].buf == NULL) {
-            fprintf(stderr, "could not allocate memory\n");
-            break;
-        }
-
-        if((pglobal->in[plugin_number].size = read(file, pglobal->in[plugin_number].buf, filesize)) == -1) {
-            perror("could not read from file");
-            free(pglobal->in[plugin_number].buf); pglobal->in[plugin_number].buf = NULL; pglobal->in[plugin_number].size = 0;
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-            close(file);
-            break;
+            if(load_file(back.path, &back) == -1)
+                break;
+        } else if (readahead_running) {
+            if(take_prefetched(&back) == -1)
+                break;
+        } else {
+            if(next_file(back.path, sizeof(back.path)) == -1 || load_file(back.path, &back) == -1)
+                break;
         }
 
-        gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
-        DBG("new frame copied (size: %d)\n", pglobal->in[plugin_number].size);
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-
-        close(file);
+        /* the file was read without holding the lock, just hand it over */
+        publish_frame(&back);
 
         /* delete file if necessary */
         if(rm) {
-            rc = unlink(buffer);
+            rc = unlink(back.path);
             if(rc == -1) {
                 perror("could not remove/delete file");
             }
         }
 
-        if(delay != 0)
-            usleep(1000 * 1000 * delay);
+        wait_next_slot(&deadline);
     }
 
 thread_quit:
-    while (fileCount--) {
-       free(fileList[fileCount]);
-    }
-    free(fileList);
-
     DBG("leaving input thread, calling cleanup function now\n");
     /* call cleanup handler, signal with the parameter */
     pthread_cleanup_pop(1);
@@ -388,6 +821,7 @@ thread_quit:
 void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
+    int i;
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -397,9 +831,42 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
+    /* the read-ahead thread uses the listing and the ring, stop it first */
+    if(readahead_running) {
+        pthread_cancel(readahead);
+        pthread_join(readahead, NULL);
+        readahead_running = 0;
+    }
+    if(ring != NULL) {
+        for(i = 0; i < prefetch; i++)
+            free(ring[i].buf);
+        free(ring);
+        ring = NULL;
+    }
+
+    while (fileCount > 0) {
+       free(fileList[--fileCount]);
+    }
+    if (mode == ExistingFiles)
+        free(fileList);
+
+    /* with --loop the global buffer points into the arena */
+    if(arena != NULL) {
+        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        pglobal->in[plugin_number].buf = NULL;
+        pglobal->in[plugin_number].size = 0;
+        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        free(arena);
+        arena = NULL;
+    }
+    free(clip);
+    clip = NULL;
+
     if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    free(back.buf);
 
     free(ev);
+    motion_free(&motion);
 
     if (mode == NewFilesOnly) {
         rc = inotify_rm_watch(fd, wd);
@@ -413,8 +880,3 @@ void worker_cleanup(void *arg)
         }
     }
 }
-
-
-
-
-
@@ -34,6 +34,8 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <limits.h>
+#include <sys/time.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
@@ -42,19 +44,100 @@
 
 /* private functions and variables to this plugin */
 static pthread_t   worker;
+static int         worker_running = 0;
 static globals     *pglobal;
 static pthread_mutex_t controls_mutex;
-static int plugin_number;
 
 void *worker_thread(void *);
 void worker_cleanup(void *);
 
 #define INPUT_PLUGIN_NAME "HTTP Input plugin"
 
-struct extractor_state  proxy;
+/* read-only controls exporting the health of the upstream */
+enum {
+    CTRL_CONNECTION = V4L2_CID_PRIVATE_BASE,
+    CTRL_FRAMES,
+    CTRL_KBYTES,
+    CTRL_RECONNECTS,
+    CTRL_FAILURES,
+    CTRL_BACKOFF,
+    CTRL_STALLS,
+    CTRL_SOURCE,
+    CTRL_SWITCHES,
+    CTRL_COUNT = CTRL_SWITCHES - V4L2_CID_PRIVATE_BASE + 1
+};
+
+static const char *control_names[CTRL_COUNT] = {
+    "Upstream connection",
+    "Frames received",
+    "kBytes received",
+    "Reconnects",
+    "Connect failures",
+    "Reconnect delay (ms)",
+    "Stalls",
+    "Active source",
+    "Source switches"
+};
+
+#define MAX_SOURCES (MAX_SECONDARIES + 1)
+
+typedef struct _context context;
+
+/* one upstream of a camera, the primary or one of its secondaries */
+typedef struct {
+    struct extractor_state proxy;
+    context *owner;
+} source;
+
+/* every instance of the plugin relays one camera into its own input slot,
+   the frames are taken from the active source only */
+struct _context {
+    int id;
+    source sources[MAX_SOURCES]; // [0] is the primary
+    int source_count;
+    int active;
+    unsigned int frames;   // published, from whichever source was active
+    unsigned int switches;
+    int buf_size; // capacity of pglobal->in[id].buf
+};
+
+static context *contexts[MAX_INPUT_PLUGINS];
 
 /*** plugin interface functions ***/
 
+/******************************************************************************
+Description.: registers the health statistics as read-only generic controls
+Input Value.: in is the input slot of the instance
+Return Value: -
+******************************************************************************/
+static void init_controls(input *in)
+{
+    int i;
+
+    in->in_parameters = calloc(CTRL_COUNT, sizeof(control));
+    if(in->in_parameters == NULL) {
+        IPRINT("could not allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < CTRL_COUNT; i++) {
+        control *ctrl = &in->in_parameters[i];
+        ctrl->group = IN_CMD_GENERIC;
+        ctrl->menuitems = NULL;
+        ctrl->value = 0;
+        ctrl->class_id = 0;
+        ctrl->ctrl.id = V4L2_CID_PRIVATE_BASE + i;
+        ctrl->ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+        ctrl->ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+        snprintf((char *)ctrl->ctrl.name, sizeof(ctrl->ctrl.name), "%s", control_names[i]);
+        ctrl->ctrl.minimum = 0;
+        ctrl->ctrl.maximum = INT_MAX;
+        ctrl->ctrl.step = 1;
+        ctrl->ctrl.default_value = 0;
+    }
+    in->parametercount = CTRL_COUNT;
+}
+
 /******************************************************************************
 Description.: parse input parameters
 Input Value.: param contains the command line string and a pointer to globals
@@ -65,8 +148,10 @@ Return Value: 0 if everything is ok
 int input_init(input_parameter *param, int plugin_no)
 {
     int i;
+    context *pctx;
+    struct extractor_state *primary;
 
-    if(pthread_mutex_init(&controls_mutex, NULL) != 0) {
+    if(pglobal == NULL && pthread_mutex_init(&controls_mutex, NULL) != 0) {
         IPRINT("could not initialize mutex variable\n");
         exit(EXIT_FAILURE);
     }
@@ -77,16 +162,59 @@ int input_init(input_parameter *param, int plugin_no)
     for(i = 0; i < param->argc; i++) {
         DBG("argv[%d]=%s\n", i, param->argv[i]);
     }
-    init_mjpg_proxy( &proxy );
+
+    pctx = calloc(1, sizeof(context));
+    if(pctx == NULL) {
+        IPRINT("error allocating context");
+        exit(EXIT_FAILURE);
+    }
+    pctx->id = plugin_no;
+    primary = &pctx->sources[0].proxy;
+    init_mjpg_proxy(primary);
 
     reset_getopt();
-    if (parse_cmd_line(&proxy, param->argc, param->argv))
+    if (parse_cmd_line(primary, param->argc, param->argv)) {
+       close_mjpg_proxy(primary);
+       free(pctx);
        return 1;
+    }
 
-    pglobal = param->global;
+    /* the secondaries inherit the timing settings of the primary */
+    pctx->source_count = 1;
+    for(i = 0; i < primary->secondary_count; i++) {
+        struct extractor_state *secondary = &pctx->sources[pctx->source_count].proxy;
+        init_mjpg_proxy(secondary);
+        if(!parse_url(secondary, primary->secondary_urls[i])) {
+            close_mjpg_proxy(secondary);
+            while(--pctx->source_count >= 0)
+                close_mjpg_proxy(&pctx->sources[pctx->source_count].proxy);
+            free(pctx);
+            return 1;
+        }
+        secondary->connect_timeout = primary->connect_timeout;
+        secondary->max_backoff = primary->max_backoff;
+        secondary->max_gap = primary->max_gap;
+        secondary->enabled = primary->race;
+        pctx->source_count++;
+    }
 
-    IPRINT("host.............: %s\n", proxy.hostname);
-    IPRINT("port.............: %s\n", proxy.port);
+    pglobal = param->global;
+    pglobal->in[plugin_no].context = pctx;
+    contexts[plugin_no] = pctx;
+    init_controls(&pglobal->in[plugin_no]);
+
+    IPRINT("host.............: %s\n", primary->hostname);
+    IPRINT("port.............: %s\n", primary->port);
+    IPRINT("path.............: %s\n", primary->path);
+    IPRINT("frame gap........: %d ms\n", primary->max_gap);
+    for(i = 1; i < pctx->source_count; i++) {
+        IPRINT("secondary........: %s:%s%s\n", pctx->sources[i].proxy.hostname,
+               pctx->sources[i].proxy.port, pctx->sources[i].proxy.path);
+    }
+    if(pctx->source_count > 1) {
+        IPRINT("standby..........: %s, switching back after %d s\n",
+               primary->race ? "racing" : "on demand", primary->hysteresis / 1000);
+    }
 
     return 0;
 }
@@ -98,46 +226,211 @@ Return Value: 0
 ******************************************************************************/
 int input_stop(int id)
 {
-    DBG("will cancel input thread\n");
-    pthread_cancel(worker);
+    /* the worker is shared, the first instance to be stopped cancels it */
+    if(worker_running) {
+        DBG("will cancel input thread\n");
+        worker_running = 0;
+        pthread_cancel(worker);
+    }
     return 0;
 }
 
 /******************************************************************************
-Description.: starts the worker thread and allocates memory
+Description.: tells if a source delivers frames within its frame gap
+Input Value.: src is the source, now the current time in ms
+Return Value: 1 if the source is healthy, 0 if it is stalled or down
+******************************************************************************/
+static int source_healthy(source *src, long long now)
+{
+    if(src->proxy.connection != STREAMING)
+        return 0;
+    return src->proxy.max_gap == 0 || now - src->proxy.last_frame <= src->proxy.max_gap;
+}
+
+/******************************************************************************
+Description.: mirrors the statistics of the sources into the controls, the
+              connection state and delay are those of the active source
+Input Value.: pctx is the context of the instance
+Return Value: -
+******************************************************************************/
+static void update_controls(context *pctx)
+{
+    control *ctrls = pglobal->in[pctx->id].in_parameters;
+    struct extractor_state *active = &pctx->sources[pctx->active].proxy;
+    unsigned long long bytes = 0;
+    unsigned int reconnects = 0, failures = 0, stalls = 0;
+    int i;
+
+    for(i = 0; i < pctx->source_count; i++) {
+        bytes += pctx->sources[i].proxy.bytes;
+        reconnects += pctx->sources[i].proxy.reconnects;
+        failures += pctx->sources[i].proxy.failures;
+        stalls += pctx->sources[i].proxy.stalls;
+    }
+
+    ctrls[CTRL_CONNECTION - V4L2_CID_PRIVATE_BASE].value = active->connection;
+    ctrls[CTRL_FRAMES - V4L2_CID_PRIVATE_BASE].value = pctx->frames;
+    ctrls[CTRL_KBYTES - V4L2_CID_PRIVATE_BASE].value = bytes / 1024;
+    ctrls[CTRL_RECONNECTS - V4L2_CID_PRIVATE_BASE].value = reconnects;
+    ctrls[CTRL_FAILURES - V4L2_CID_PRIVATE_BASE].value = failures;
+    ctrls[CTRL_BACKOFF - V4L2_CID_PRIVATE_BASE].value = active->backoff;
+    ctrls[CTRL_STALLS - V4L2_CID_PRIVATE_BASE].value = stalls;
+    ctrls[CTRL_SOURCE - V4L2_CID_PRIVATE_BASE].value = pctx->active;
+    ctrls[CTRL_SWITCHES - V4L2_CID_PRIVATE_BASE].value = pctx->switches;
+}
+
+/******************************************************************************
+Description.: makes another source the active one, standbys that were only
+              connected on demand are dropped once the primary is back
+Input Value.: pctx is the context, index the source to switch to
+Return Value: -
+******************************************************************************/
+static void switch_source(context *pctx, int index)
+{
+    struct extractor_state *primary = &pctx->sources[0].proxy;
+    int i;
+
+    IPRINT("input %d switched from source %d to %d (%s:%s)\n", pctx->id, pctx->active, index,
+           pctx->sources[index].proxy.hostname, pctx->sources[index].proxy.port);
+    pctx->active = index;
+    pctx->switches++;
+
+    if(index == 0 && !primary->race) {
+        for(i = 1; i < pctx->source_count; i++)
+            enable_upstream(&pctx->sources[i].proxy, 0);
+    }
+}
+
+/******************************************************************************
+Description.: publishes a frame by exchanging the global buffer with the one
+              the extractor filled, the old global buffer is handed back to
+              the extractor to be filled next, so nothing gets copied
+              frames of standby sources are dropped unless the active source
+              is stalled, or the standby is preferred and has been healthy
+              for the hysteresis time, then it becomes the active one
+Input Value.: arg is the source, data and size point to the extractor's buffer
+              and its capacity, length is the size of the frame in it
+Return Value: -
+******************************************************************************/
+void on_image_received(void *arg, char ** data, int * size, int length){
+        source *src = arg;
+        context *pctx = src->owner;
+        input *in = &pglobal->in[pctx->id];
+        int index = src - pctx->sources;
+        unsigned char *tmp;
+        int tmp_size;
+        long long now;
+
+        if(index != pctx->active) {
+            now = now_ms();
+            if(!source_healthy(&pctx->sources[pctx->active], now) ||
+               (index < pctx->active && now - src->proxy.streak_start >= pctx->sources[0].proxy.hysteresis))
+                switch_source(pctx, index);
+            else
+                return;
+        }
+
+        pthread_mutex_lock(&in->db);
+
+        tmp = in->buf;
+        tmp_size = pctx->buf_size;
+        in->buf = (unsigned char *)*data;
+        in->size = length;
+        gettimeofday(&in->timestamp, NULL);
+        in->sequence++;
+        pctx->buf_size = *size;
+        *data = (char *)tmp;
+        *size = tmp_size;
+
+        /* signal fresh_frame */
+        pthread_cond_broadcast(&in->db_update);
+        pthread_mutex_unlock(&in->db);
+
+        pctx->frames++;
+        update_controls(pctx);
+}
+
+/******************************************************************************
+Description.: mirrors the connection state into the controls and the log,
+              connects the on demand standbys once the active source fails
+Input Value.: arg is the source
+Return Value: -
+******************************************************************************/
+void on_status_changed(void *arg)
+{
+    source *src = arg;
+    context *pctx = src->owner;
+    int index = src - pctx->sources, i;
+    static const char *names[] = { "disconnected", "connecting", "streaming" };
+
+    update_controls(pctx);
+
+    if(src->proxy.connection != CONNECTING) {
+        IPRINT("input %d source %d (%s:%s) %s, frames: %u, reconnects: %u, stalls: %u, connect failures: %u\n",
+               pctx->id, index, src->proxy.hostname, src->proxy.port, names[src->proxy.connection],
+               src->proxy.frames, src->proxy.reconnects, src->proxy.stalls, src->proxy.failures);
+    }
+
+    if(index == pctx->active && src->proxy.connection == DISCONNECTED) {
+        for(i = 0; i < pctx->source_count; i++)
+            enable_upstream(&pctx->sources[i].proxy, 1);
+    }
+}
+
+/******************************************************************************
+Description.: allocates the frame buffer, registers the sources and starts
+              the worker thread shared by all instances if not running yet
 Input Value.: -
 Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
+    context *pctx = contexts[id];
+    int i;
+
+    pctx->buf_size = BUFFER_SIZE;
+    pglobal->in[id].buf = malloc(pctx->buf_size);
     if(pglobal->in[id].buf == NULL) {
         fprintf(stderr, "could not allocate memory\n");
         exit(EXIT_FAILURE);
     }
 
+    for(i = 0; i < pctx->source_count; i++) {
+        source *src = &pctx->sources[i];
+        src->owner = pctx;
+        src->proxy.context = src;
+        src->proxy.on_image_received = on_image_received;
+        src->proxy.on_status_changed = on_status_changed;
+        src->proxy.should_stop = &pglobal->stop;
+        if(!add_upstream(&src->proxy)) {
+            fprintf(stderr, "could not register upstream\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(worker_running)
+        return 0;
+
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
         free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
+    worker_running = 1;
     pthread_detach(worker);
 
     return 0;
 }
 
-
-void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
-        pglobal->in[plugin_number].size = length;
-        memcpy(pglobal->in[plugin_number].buf, data, pglobal->in[plugin_number].size);
-
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-
+/******************************************************************************
+Description.: the statistics are read-only, there is nothing to set
+Input Value.: -
+Return Value: -1
+******************************************************************************/
+int input_cmd(int plugin, unsigned int control_id, unsigned int group, int value, char *value_str)
+{
+    DBG("control %d of input %d is read-only\n", control_id, plugin);
+    return -1;
 }
 
 void *worker_thread(void *arg)
@@ -146,9 +439,7 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
-    proxy.on_image_received = on_image_received;
-    proxy.should_stop =  & pglobal->stop;
-    connect_and_stream(&proxy);
+    run_upstreams(&pglobal->stop);
 
     IPRINT("leaving input thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
@@ -164,6 +455,7 @@ Return Value: -
 void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
+    int i, j;
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -172,10 +464,12 @@ void worker_cleanup(void *arg)
 
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
-    close_mjpg_proxy(&proxy);
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    for(i = 0; i < MAX_INPUT_PLUGINS; i++) {
+        if(contexts[i] == NULL)
+            continue;
+        for(j = 0; j < contexts[i]->source_count; j++)
+            close_mjpg_proxy(&contexts[i]->sources[j].proxy);
+        if(pglobal->in[i].buf != NULL) free(pglobal->in[i].buf);
+        pglobal->in[i].buf = NULL;
+    }
 }
-
-
-
-
@@ -0,0 +1,200 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+// Throughput of the MJPEG part extraction, without the network: a multipart
+// stream is built in memory and fed to extract_data() in chunks of random
+// size, the way recv() hands it over. Runs once with Content-Length headers
+// and once without, where the parts are found by searching for the boundary.
+// A plain memcpy() of the stream is timed as the upper bound.
+//
+// mjpg_proxy_bench [-n FRAMES] [-c MAX_CHUNK] [FILE.jpg...]
+//
+// Without files a frame of 100 KB is made up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "mjpg-proxy.h"
+
+struct frame {
+    char * data;
+    int length;
+};
+
+static struct frame * frames;
+static int frame_count, received, broken;
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// checks every frame against the one that was sent, the buffer stays with the parser
+static void on_image(void * context, char ** data, int * size, int length) {
+    struct frame * expected = &frames[received++ % frame_count];
+    if (length != expected->length || memcmp(*data, expected->data, length) != 0)
+        broken++;
+}
+
+static char * build_stream(int count, int with_length, size_t * size) {
+    size_t total = 256, n = 0;
+    char * stream;
+    int i;
+
+    for (i = 0; i < count; i++)
+        total += frames[i % frame_count].length + 128;
+    if ((stream = malloc(total)) == NULL)
+        return NULL;
+
+    n += sprintf(stream + n, "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: multipart/x-mixed-replace;boundary=boundarydonotcross\r\n\r\n"
+                 "--boundarydonotcross\r\n");
+    for (i = 0; i < count; i++) {
+        struct frame * f = &frames[i % frame_count];
+        if (with_length)
+            n += sprintf(stream + n, "Content-Type: image/jpeg\r\nContent-Length: %d\r\n"
+                         "X-Timestamp: 0.000000\r\n\r\n", f->length);
+        else
+            n += sprintf(stream + n, "Content-Type: image/jpeg\r\n\r\n");
+        memcpy(stream + n, f->data, f->length);
+        n += f->length;
+        n += sprintf(stream + n, "\r\n--boundarydonotcross\r\n");
+    }
+    *size = n;
+    return stream;
+}
+
+static void run(const char * name, int count, int with_length, int max_chunk) {
+    static struct extractor_state state;
+    static char * copy;
+    int stop = 0;
+    unsigned int seed = 1;
+    size_t size, at, chunk;
+    char * stream;
+    double start, parse, plain;
+
+    if ((stream = build_stream(count, with_length, &size)) == NULL || (copy = realloc(copy, size)) == NULL) {
+        fprintf(stderr, "not enough memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    init_mjpg_proxy(&state);
+    state.should_stop = &stop;
+    state.on_image_received = on_image;
+    received = broken = 0;
+
+    start = seconds();
+    for (at = 0; at < size; at += chunk) {
+        chunk = 1 + rand_r(&seed) % max_chunk;
+        if (chunk > size - at)
+            chunk = size - at;
+        extract_data(&state, stream + at, chunk);
+    }
+    parse = seconds() - start;
+
+    // the pages of the copy are faulted in before, the parser's buffer is warm too
+    memset(copy, 0, size);
+    seed = 1;
+    start = seconds();
+    for (at = 0; at < size; at += chunk) {
+        chunk = 1 + rand_r(&seed) % max_chunk;
+        if (chunk > size - at)
+            chunk = size - at;
+        memcpy(copy + at, stream + at, chunk);
+    }
+    plain = seconds() - start;
+
+    printf("%-16s %6d frames %6d broken %9.1f MB/s %9.0f frames/s   memcpy %9.1f MB/s\n",
+           name, received, broken, size / parse / 1e6, received / parse, size / plain / 1e6);
+
+    close_mjpg_proxy(&state);
+    free(stream);
+    if (received != count || broken > 0)
+        exit(EXIT_FAILURE);
+}
+
+static int load(const char * path, struct frame * f) {
+    FILE * file = fopen(path, "rb");
+    long length;
+
+    if (file == NULL)
+        return 0;
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    rewind(file);
+    f->data = malloc(length);
+    f->length = length;
+    if (f->data == NULL || fread(f->data, 1, length, file) != (size_t)length) {
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    return 1;
+}
+
+int main(int argc, char * argv []) {
+    int count = 1000, max_chunk = 4096, c, i;
+
+    while ((c = getopt(argc, argv, "n:c:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'c':
+            max_chunk = atoi(optarg);
+            break;
+        default:
+            count = 0;
+            break;
+        }
+    }
+    if (count < 1 || max_chunk < 1) {
+        fprintf(stderr, "Usage: %s [-n FRAMES] [-c MAX_CHUNK] [FILE.jpg...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    frame_count = argc > optind ? argc - optind : 1;
+    frames = calloc(frame_count, sizeof(*frames));
+    if (argc > optind) {
+        for (i = 0; i < frame_count; i++) {
+            if (!load(argv[optind + i], &frames[i])) {
+                perror(argv[optind + i]);
+                return EXIT_FAILURE;
+            }
+        }
+    } else {
+        frames[0].length = 100000;
+        frames[0].data = malloc(frames[0].length);
+        srand(1);
+        for (i = 0; i < frames[0].length; i++)
+            frames[0].data[i] = rand();
+        frames[0].data[0] = 0xff;
+        frames[0].data[1] = 0xd8;
+        frames[0].data[frames[0].length - 2] = 0xff;
+        frames[0].data[frames[0].length - 1] = 0xd9;
+    }
+
+    run("Content-Length", count, 1, max_chunk);
+    run("boundary search", count, 0, max_chunk);
+    return EXIT_SUCCESS;
+}
@@ -26,8 +26,13 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 
 
 #include "version.h"
@@ -43,66 +48,225 @@
 #define NETBUFFER_SIZE 1024 * 4
 #define TRUE 1
 #define FALSE 0
+#define CRLFCRLF 0x0d0a0d0a
+#define MAX_EVENTS 64
+#define TICK_MS 100
+#define RECV_ROUNDS 16
 
 const char * CONTENT_LENGTH = "Content-Length:";
-// TODO: this must be decoupled from mjpeg-streamer
+const char * CONTENT_TYPE = "Content-Type:";
+// used if the upstream does not tell its boundary, this is what mjpg-streamer sends
 const char * BOUNDARY =     "--boundarydonotcross";
 
 void init_extractor_state(struct extractor_state * state) {
     state->length = 0;
     state->part = HEADER;
     state->last_four_bytes = 0;
-    state->contentlength.string = CONTENT_LENGTH;
-    state->boundary.string = BOUNDARY;
-    search_pattern_reset(&state->contentlength);
-    search_pattern_reset(&state->boundary);
+    state->header_length = 0;
+    state->content_length = -1;
+    state->skip = FALSE;
+}
+
+// makes room for at least size bytes in state->buffer
+// returns FALSE if the frame can not be stored
+int reserve_buffer(struct extractor_state * state, int size) {
+    char * tmp;
+    if (size <= state->buffer_size)
+        return TRUE;
+    if (size > MAX_BUFFER_SIZE)
+        return FALSE;
+    if ((tmp = realloc(state->buffer, size)) == NULL)
+        return FALSE;
+    state->buffer = tmp;
+    state->buffer_size = size;
+    return TRUE;
 }
 
 void init_mjpg_proxy(struct extractor_state * state){
     state->hostname = strdup("localhost");
     state->port = strdup("8080");
+    state->path = strdup("/?action=stream");
+    state->sockfd = -1;
+    state->connection = DISCONNECTED;
+    state->addresses = NULL;
+    state->address = NULL;
+    state->deadline = 0;
+    state->connect_timeout = 5000;
+    state->backoff = MIN_BACKOFF;
+    state->max_backoff = 30000;
+    state->enabled = TRUE;
+    state->max_gap = 5000;
+    state->last_frame = 0;
+    state->streak_start = 0;
+    state->frames = 0;
+    state->bytes = 0;
+    state->reconnects = 0;
+    state->failures = 0;
+    state->stalls = 0;
+    state->secondary_count = 0;
+    state->race = FALSE;
+    state->hysteresis = 10000;
+    state->context = NULL;
+    state->on_image_received = NULL;
+    state->on_status_changed = NULL;
+    state->buffer = NULL;
+    state->buffer_size = 0;
+    if (!reserve_buffer(state, BUFFER_SIZE)) {
+        fprintf(stderr, "could not allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(state->boundary, BOUNDARY);
+
+    init_extractor_state(state);
+}
+
+// takes the boundary out of a "multipart/x-mixed-replace; boundary=..." value
+// the delimiter in the stream is the boundary prefixed by "--", some cameras
+// already put the dashes into the header, so they are not added twice
+void parse_boundary(struct extractor_state * state, char * value) {
+    char * start, * end;
+
+    if ((start = strcasestr(value, "boundary=")) == NULL)
+        return;
+    start += strlen("boundary=");
+    if (*start == '"')
+        start++;
+    end = start + strcspn(start, "\";, \t");
+    if (end == start || end - start > BOUNDARY_SIZE - 3)
+        return;
+
+    snprintf(state->boundary, BOUNDARY_SIZE, "%s%.*s", strncmp(start, "--", 2) ? "--" : "", (int)(end - start), start);
+    DBG("Boundary found: %s\n", state->boundary);
+}
 
+// picks the values we care about out of a complete header block
+// the block is zero terminated and every line ends with CRLF
+void parse_header(struct extractor_state * state) {
+    char * line = state->header, * end;
+    int cl_length = strlen(CONTENT_LENGTH), ct_length = strlen(CONTENT_TYPE);
+
+    state->content_length = -1;
+    while ((end = strstr(line, "\r\n")) != NULL) {
+        *end = 0;
+        if (strncasecmp(line, CONTENT_LENGTH, cl_length) == 0) {
+            state->content_length = atoi(line + cl_length);
+            DBG("Content length found: %d\n", state->content_length);
+        } else if (strncasecmp(line, CONTENT_TYPE, ct_length) == 0 &&
+                   strcasestr(line + ct_length, "multipart/") != NULL) {
+            parse_boundary(state, line + ct_length);
+        }
+        line = end + 2;
+    }
+}
+
+// hands the collected frame to the callback and resets the fsm for the next part
+void image_complete(struct extractor_state * state) {
+    long long now;
+
+    if (!state->skip) {
+        DBG("Image of length %d received\n", (int)state->length);
+        now = now_ms();
+        if (state->streak_start == 0 || (state->max_gap > 0 && now - state->last_frame > state->max_gap))
+            state->streak_start = now;
+        state->last_frame = now;
+        state->frames++;
+        state->backoff = MIN_BACKOFF; // the upstream is healthy again
+        if (state->on_image_received) // callback
+          state->on_image_received(state->context, &state->buffer, &state->buffer_size, state->length);
+    }
     init_extractor_state(state);
 }
 
+// collects header bytes until the empty line, returns the number of bytes consumed
+int extract_header(struct extractor_state * state, char * buffer, int length) {
+    int i;
+    for (i = 0; i < length; i++) {
+        state->last_four_bytes = (state->last_four_bytes << 8) | (unsigned char)buffer[i];
+        if (state->header_length < HEADER_BUFFER_SIZE - 1)
+            state->header[state->header_length++] = buffer[i];
+        if (state->last_four_bytes != CRLFCRLF)
+            continue;
+
+        state->header[state->header_length] = 0;
+        state->header_length = 0;
+        state->last_four_bytes = 0;
+
+        // stray empty lines are no part headers
+        if (strcmp(state->header, "\r\n\r\n") == 0)
+            continue;
+
+        // the HTTP response itself only tells us the boundary
+        if (strncmp(state->header, "HTTP/", 5) == 0) {
+            parse_header(state);
+            state->content_length = -1;
+            continue;
+        }
+
+        parse_header(state);
+        state->part = CONTENT;
+        if (state->content_length > 0 && !reserve_buffer(state, state->content_length)) {
+            fprintf(stderr, "Can not store a frame of %d bytes, dropping it\n", state->content_length);
+            state->skip = TRUE;
+        } else if (state->content_length == 0) {
+            init_extractor_state(state);
+        }
+        return i + 1;
+    }
+    return i;
+}
+
 // main method
-// we process all incoming buffer byte per byte and extract binary data from it to state->buffer
-// if boundary is detected, then callback for image processing is run
-// TODO; decouple from mjpeg streamer and ensure content-length processing
-//       for that, we must properly work with headers, not just detect them
+// headers are collected and parsed, frame data is copied in bulk to state->buffer
+// if the part announced its Content-Length exactly that many bytes are taken,
+// otherwise the data is searched for the boundary
+// once a frame is complete the callback for image processing is run
 void extract_data(struct extractor_state * state, char * buffer, int length) {
-    int i;
-    for (i = 0; i < length && !*(state->should_stop); i++) {
+    int i = 0, n, from, boundary_length;
+    char * match;
+    while (i < length && !*(state->should_stop)) {
         switch (state->part) {
         case HEADER:
-            push_byte(&state->last_four_bytes, buffer[i]);
-            if (is_crlfcrlf(state->last_four_bytes))
-                state->part = CONTENT;
-            else if (is_crlf(state->last_four_bytes))
-                search_pattern_reset(&state->contentlength);
-            else {
-                search_pattern_compare(&state->contentlength, buffer[i]);
-                if (search_pattern_matches(&state->contentlength)) {
-                    DBG("Content length found\n");
-                    search_pattern_reset(&state->contentlength);
-                }
-            }
+            i += extract_header(state, buffer + i, length - i);
             break;
 
         case CONTENT:
-            if (state->length >= BUFFER_SIZE - 1) {
-                perror("Buffer too small\n");
+            if (state->content_length >= 0) {
+                n = min(length - i, state->content_length - state->length);
+                if (!state->skip)
+                    memcpy(state->buffer + state->length, buffer + i, n);
+                state->length += n;
+                i += n;
+                if (state->length == state->content_length)
+                    image_complete(state);
                 break;
             }
-            state->buffer[state->length++] = buffer[i];
-            search_pattern_compare(&state->boundary, buffer[i]);
-            if (search_pattern_matches(&state->boundary)) {
-                state->length -= (strlen(state->boundary.string)+2); // magic happens here
-                DBG("Image of length %d received\n", (int)state->length);
-                if (state->on_image_received) // callback
-                  state->on_image_received(state->buffer, state->length);
-                init_extractor_state(state); // reset fsm
+
+            boundary_length = strlen(state->boundary);
+            if (state->length == state->buffer_size &&
+                !reserve_buffer(state, state->buffer_size * 2)) {
+                // keep just enough to recognize a boundary spanning the cut
+                if (!state->skip)
+                    perror("Buffer too small\n");
+                memmove(state->buffer, state->buffer + state->length - boundary_length + 1, boundary_length - 1);
+                state->length = boundary_length - 1;
+                state->skip = TRUE;
             }
+            n = min(length - i, state->buffer_size - state->length);
+            from = state->length >= boundary_length ? state->length - boundary_length + 1 : 0;
+            memcpy(state->buffer + state->length, buffer + i, n);
+            state->length += n;
+            i += n;
+
+            match = memmem(state->buffer + from, state->length - from, state->boundary, boundary_length);
+            if (match == NULL)
+                break;
+
+            // everything behind the boundary belongs to the next part
+            i -= state->length - (match - state->buffer + boundary_length);
+            state->length = match - state->buffer;
+            if (state->length >= 2 && state->buffer[state->length - 2] == '\r' && state->buffer[state->length - 1] == '\n')
+                state->length -= 2;
+            image_complete(state);
             break;
         }
 
@@ -110,22 +274,38 @@ void extract_data(struct extractor_state * state, char * buffer, int length) {
 
 }
 
-char request [] = "GET /?action=stream HTTP/1.0\r\n\r\n";
-
-void send_request_and_process_response(struct extractor_state * state) {
-    int recv_length;
+// receives whatever the socket has for us, returns FALSE if the connection is gone
+int receive_data(struct extractor_state * state) {
+    int recv_length, rounds;
     char netbuffer[NETBUFFER_SIZE];
 
-    init_extractor_state(state);
-    
-    // send request
-    send(state->sockfd, request, sizeof(request), 0);
-
-    // and listen for answer until sockerror or THEY stop us 
-    // TODO: we must handle EINTR here, it really might occur
-    while ( (recv_length = recv(state->sockfd, netbuffer, sizeof(netbuffer), 0)) > 0 && !*(state->should_stop))
-        extract_data(state, netbuffer, recv_length);
-
+    // the socket is level triggered, so give the other upstreams a chance after a few rounds
+    for (rounds = 0; rounds < RECV_ROUNDS && !*(state->should_stop); rounds++) {
+        if (state->part == CONTENT && state->content_length >= 0 && !state->skip) {
+            // the length is known, let the kernel copy the rest of the frame straight into place
+            recv_length = recv(state->sockfd, state->buffer + state->length, state->content_length - state->length, 0);
+            if (recv_length > 0) {
+                state->bytes += recv_length;
+                state->length += recv_length;
+                if (state->length == state->content_length)
+                    image_complete(state);
+                continue;
+            }
+        } else {
+            recv_length = recv(state->sockfd, netbuffer, sizeof(netbuffer), 0);
+            if (recv_length > 0) {
+                state->bytes += recv_length;
+                extract_data(state, netbuffer, recv_length);
+                continue;
+            }
+        }
+        if (recv_length < 0 && errno == EINTR)
+            continue;
+        if (recv_length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TRUE;
+        return FALSE;
+    }
+    return TRUE;
 }
 
 // TODO:this must be reworked to decouple from mjpeg-streamer
@@ -139,6 +319,24 @@ fprintf(stderr, " --------------------------------------------------------------
                 " [-h | --help]............: show this message\n"
                 " [-H | --host]............: select host to data from, localhost is default\n"
                 " [-p | --port]............: port, defaults to 8080\n"
+                " [-u | --url].............: stream URL like http://host:port/path, instead of\n"
+                "                            -H and -p, the path defaults to /?action=stream\n"
+                " [-t | --timeout].........: connect timeout in seconds, defaults to 5\n"
+                " [-b | --backoff].........: upper limit of the reconnect delay in seconds,\n"
+                "                            it starts at 0.5 s and doubles with every failure\n"
+                " [-g | --gap].............: longest gap between two frames in ms, a stream\n"
+                "                            silent for longer is stalled and gets reconnected,\n"
+                "                            defaults to 5000, 0 disables the watchdog\n"
+                " [-s | --secondary].......: URL of another source of the same camera, can be\n"
+                "                            given up to 3 times, the frames of the first healthy\n"
+                "                            one are used while the primary is stalled or down\n"
+                " [-r | --race]............: keep the secondaries streaming all the time, this\n"
+                "                            makes the switch instant but costs bandwidth\n"
+                " [-y | --hysteresis]......: seconds the primary has to stream without a stall\n"
+                "                            before it is switched back to, defaults to 10\n"
+                " ---------------------------------------------------------------\n"
+                " All instances of this plugin share one thread, so many cameras can be\n"
+                " relayed by passing one -i \"input_http.so ...\" per camera.\n"
                 " ---------------------------------------------------------------\n", program_name);
 }
 // TODO: this must be reworked, too. I don't know how
@@ -146,6 +344,31 @@ void show_version() {
     printf("Version - %s\n", VERSION);
 }
 
+// splits http://host[:port][/path] into its parts
+int parse_url(struct extractor_state * state, const char * url) {
+    const char * host, * end, * colon;
+
+    if (strncasecmp(url, "http://", 7) != 0) {
+        fprintf(stderr, "Only http:// URLs are supported: %s\n", url);
+        return FALSE;
+    }
+    host = url + 7;
+    end = host + strcspn(host, "/");
+    colon = memchr(host, ':', end - host);
+    if ((colon ? colon : end) == host) {
+        fprintf(stderr, "No host in URL: %s\n", url);
+        return FALSE;
+    }
+
+    free(state->hostname);
+    free(state->port);
+    free(state->path);
+    state->hostname = strndup(host, (colon ? colon : end) - host);
+    state->port = colon ? strndup(colon + 1, end - colon - 1) : strdup("80");
+    state->path = strdup(*end ? end : "/");
+    return TRUE;
+}
+
 int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
     while (TRUE) {
         static struct option long_options [] = {
@@ -153,11 +376,18 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
             {"version", no_argument, 0, 'v'},
             {"host", required_argument, 0, 'H'},
             {"port", required_argument, 0, 'p'},
+            {"url", required_argument, 0, 'u'},
+            {"timeout", required_argument, 0, 't'},
+            {"backoff", required_argument, 0, 'b'},
+            {"gap", required_argument, 0, 'g'},
+            {"secondary", required_argument, 0, 's'},
+            {"race", no_argument, 0, 'r'},
+            {"hysteresis", required_argument, 0, 'y'},
             {0,0,0,0}
         };
 
         int index = 0, c = 0;
-        c = getopt_long_only(argc,argv, "hvH:p:", long_options, &index);
+        c = getopt_long_only(argc,argv, "hvH:p:u:t:b:g:s:ry:", long_options, &index);
 
         if (c==-1) break;
 
@@ -183,62 +413,321 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
                 free(state->port);
                 state->port = strdup(optarg);
                 break;
+            case 'u' :
+                if (!parse_url(state, optarg))
+                    return 1;
+                break;
+            case 't' :
+                state->connect_timeout = atoi(optarg) * 1000;
+                if (state->connect_timeout <= 0) {
+                    show_help(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b' :
+                state->max_backoff = atoi(optarg) * 1000;
+                if (state->max_backoff < MIN_BACKOFF) {
+                    show_help(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'g' :
+                state->max_gap = atoi(optarg);
+                if (state->max_gap < 0) {
+                    show_help(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's' :
+                if (state->secondary_count >= MAX_SECONDARIES) {
+                    fprintf(stderr, "At most %d secondary URLs are supported\n", MAX_SECONDARIES);
+                    return 1;
+                }
+                state->secondary_urls[state->secondary_count++] = strdup(optarg);
+                break;
+            case 'r' :
+                state->race = TRUE;
+                break;
+            case 'y' :
+                state->hysteresis = atoi(optarg) * 1000;
+                if (state->hysteresis < 0) {
+                    show_help(argv[0]);
+                    return 1;
+                }
+                break;
             }
     }
 
   return 0;
 }
 
-// TODO: consider using hints for http
+/*
+ * All upstreams are driven by a single thread. Sockets are non-blocking and
+ * watched with epoll, connect timeouts and reconnect delays are deadlines
+ * checked on every turn of the loop.
+ */
+static int epollfd = -1;
+static struct extractor_state * upstreams[MAX_UPSTREAMS];
+static int upstream_count = 0;
+static pthread_mutex_t upstreams_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-// TODO: consider moving delays to plugin command line arguments
-void connect_and_stream(struct extractor_state * state){
-    struct addrinfo * info, * rp;
-    int errorcode;
-    while (TRUE) {
-        errorcode = getaddrinfo(state->hostname, state->port, NULL, &info);
-        if (errorcode) {
-            perror(gai_strerror(errorcode));
-        };
-        for (rp = info ; rp != NULL; rp = rp->ai_next) {
-            state->sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-            if (state->sockfd <0) {
-                perror("Can't allocate socket, will continue probing\n");
-                continue;
-            }
+void set_connection(struct extractor_state * state, int connection) {
+    state->connection = connection;
+    if (state->on_status_changed)
+        state->on_status_changed(state->context);
+}
 
-            DBG("socket value is %d\n", state->sockfd);
-            if (connect(state->sockfd, (struct sockaddr *) rp->ai_addr, rp->ai_addrlen)>=0 ) {
-                DBG("connected to host\n");
-                break;
-            }
+// closes the socket and schedules the next attempt, the delay doubles with
+// every failure and is randomized so that many upstreams do not reconnect in lockstep
+void schedule_reconnect(struct extractor_state * state, const char * reason) {
+    int delay;
+
+    if (state->sockfd >= 0) {
+        close(state->sockfd);
+        state->sockfd = -1;
+    }
+    if (state->addresses) {
+        freeaddrinfo(state->addresses);
+        state->addresses = NULL;
+        state->address = NULL;
+    }
+
+    if (state->connection == STREAMING)
+        state->reconnects++;
+    else
+        state->failures++;
+
+    delay = state->backoff / 2 + rand_r(&state->seed) % (state->backoff / 2 + 1);
+    state->backoff = state->backoff * 2 > state->max_backoff ? state->max_backoff : state->backoff * 2;
+    state->deadline = now_ms() + delay;
+
+    fprintf(stderr, "%s:%s %s, will retry in %d ms\n", state->hostname, state->port, reason, delay);
+    set_connection(state, DISCONNECTED);
+}
+
+void on_connected(struct extractor_state * state) {
+    char request[HEADER_BUFFER_SIZE];
+    struct epoll_event ev;
+    int length;
+
+    length = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", state->path, state->hostname);
+    if (length >= (int)sizeof(request) || send(state->sockfd, request, length, MSG_NOSIGNAL) != length) {
+        schedule_reconnect(state, "can't send request");
+        return;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = state;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, state->sockfd, &ev);
+
+    freeaddrinfo(state->addresses);
+    state->addresses = NULL;
+    state->address = NULL;
 
+    init_extractor_state(state);
+    strcpy(state->boundary, BOUNDARY);
+    state->deadline = 0;
+    state->last_frame = now_ms();  // the watchdog starts counting now
+    state->streak_start = 0;
+    DBG("connected to %s:%s\n", state->hostname, state->port);
+    set_connection(state, STREAMING);
+}
+
+// starts a non-blocking connect to the next address of the upstream
+void connect_next_address(struct extractor_state * state) {
+    struct epoll_event ev;
+
+    if (state->sockfd >= 0) {
+        close(state->sockfd);
+        state->sockfd = -1;
+    }
+
+    for (; state->address != NULL; state->address = state->address->ai_next) {
+        struct addrinfo * rp = state->address;
+
+        state->sockfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+        if (state->sockfd < 0) {
+            perror("Can't allocate socket, will continue probing\n");
+            continue;
+        }
+        DBG("socket value is %d\n", state->sockfd);
+
+        ev.events = EPOLLOUT;
+        ev.data.ptr = state;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, state->sockfd, &ev) < 0) {
+            perror("epoll_ctl");
             close(state->sockfd);
+            state->sockfd = -1;
+            continue;
+        }
 
+        if (connect(state->sockfd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            state->address = rp->ai_next;
+            on_connected(state);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            state->address = rp->ai_next;
+            state->deadline = now_ms() + state->connect_timeout;
+            set_connection(state, CONNECTING);
+            return;
         }
 
-        freeaddrinfo(info);
+        close(state->sockfd);
+        state->sockfd = -1;
+    }
 
-        if (rp==NULL) {
-            perror("Can't connect to server, will retry in 5 sec");
-            sleep(5);
+    schedule_reconnect(state, "can't connect to server");
+}
+
+void start_connect(struct extractor_state * state) {
+    struct addrinfo hints;
+    int errorcode;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // name resolution still blocks, use addresses or /etc/hosts entries for a large relay
+    errorcode = getaddrinfo(state->hostname, state->port, &hints, &state->addresses);
+    if (errorcode) {
+        state->addresses = NULL;
+        schedule_reconnect(state, gai_strerror(errorcode));
+        return;
+    }
+    state->address = state->addresses;
+    connect_next_address(state);
+}
+
+void handle_event(struct extractor_state * state, unsigned int events) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    switch (state->connection) {
+    case CONNECTING:
+        if (getsockopt(state->sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            DBG("connect failed: %s\n", strerror(error));
+            connect_next_address(state);
+        } else {
+            on_connected(state);
         }
-        else
-        {
-            send_request_and_process_response(state);
-            
-            DBG ("Closing socket\n");
-            close (state->sockfd);
-            if (*state->should_stop)
-              break;
-            sleep(1);
-        };
+        break;
+
+    case STREAMING:
+        if (!receive_data(state))
+            schedule_reconnect(state, "connection closed");
+        break;
+    }
+}
+
+void check_deadlines(struct extractor_state * state, long long now) {
+    // a stream can stall without the socket ever being closed
+    if (state->connection == STREAMING && state->max_gap > 0 && now - state->last_frame > state->max_gap) {
+        state->stalls++;
+        schedule_reconnect(state, "stalled");
+        return;
+    }
+
+    if (!state->enabled || state->deadline == 0 || now < state->deadline)
+        return;
+
+    switch (state->connection) {
+    case DISCONNECTED:
+        start_connect(state);
+        break;
+    case CONNECTING:
+        DBG("connect to %s:%s timed out\n", state->hostname, state->port);
+        connect_next_address(state);
+        break;
+    }
+}
+
+int add_upstream(struct extractor_state * state) {
+    int result = FALSE;
+
+    pthread_mutex_lock(&upstreams_mutex);
+    if (epollfd < 0 && (epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+    } else if (upstream_count >= MAX_UPSTREAMS) {
+        fprintf(stderr, "Too many upstreams, at most %d are supported\n", MAX_UPSTREAMS);
+    } else {
+        state->seed = (unsigned int)now_ms() ^ (upstream_count << 16);
+        state->deadline = state->enabled ? now_ms() : 0;  // connect right away
+        upstreams[upstream_count++] = state;
+        result = TRUE;
     }
+    pthread_mutex_unlock(&upstreams_mutex);
+    return result;
+}
+
+void run_upstreams(int * should_stop) {
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    while (!*should_stop) {
+        n = epoll_wait(epollfd, events, MAX_EVENTS, TICK_MS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        pthread_mutex_lock(&upstreams_mutex);
+        for (i = 0; i < n; i++)
+            handle_event(events[i].data.ptr, events[i].events);
 
+        long long now = now_ms();
+        for (i = 0; i < upstream_count; i++)
+            check_deadlines(upstreams[i], now);
+        pthread_mutex_unlock(&upstreams_mutex);
+    }
+}
+
+void enable_upstream(struct extractor_state * state, int enabled) {
+    if (enabled == state->enabled)
+        return;
+    state->enabled = enabled;
+    if (enabled) {
+        state->backoff = MIN_BACKOFF;
+        state->deadline = now_ms();
+        return;
+    }
+
+    // dropped quietly, this is no failure of the upstream
+    if (state->sockfd >= 0)
+        close(state->sockfd);
+    state->sockfd = -1;
+    if (state->addresses)
+        freeaddrinfo(state->addresses);
+    state->addresses = NULL;
+    state->address = NULL;
+    state->deadline = 0;
+    state->connection = DISCONNECTED;
 }
 
 void close_mjpg_proxy(struct extractor_state * state){
+    int i;
+
+    if (state->sockfd >= 0)
+        close(state->sockfd);
+    state->sockfd = -1;
+    if (state->addresses)
+        freeaddrinfo(state->addresses);
+    state->addresses = NULL;
     free(state->hostname);
     free(state->port);
+    free(state->path);
+    for (i = 0; i < state->secondary_count; i++)
+        free(state->secondary_urls[i]);
+    state->secondary_count = 0;
+    free(state->buffer);
+    state->buffer = NULL;
 }
 
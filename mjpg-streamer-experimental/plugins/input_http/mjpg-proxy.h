@@ -20,6 +20,8 @@
 #ifndef MJPG_PROXY_H
 #define MJPG_PROXY_H
 
+#include <netdb.h>
+
 #include "misc.h"
 
 
@@ -32,26 +34,79 @@
 #endif
 
 #define BUFFER_SIZE 1024 * 256
+#define MAX_BUFFER_SIZE 1024 * 1024 * 64
+#define HEADER_BUFFER_SIZE 1024 * 4
+#define BOUNDARY_SIZE 128
+#define MAX_UPSTREAMS 256
+#define MAX_SECONDARIES 3
+#define MIN_BACKOFF 500
+
+// connection states of an upstream
+#define DISCONNECTED 0
+#define CONNECTING 1
+#define STREAMING 2
 
 struct extractor_state {
     
     char * port;
     char * hostname;
+    char * path;
 
-    // this is current result
-    char buffer [BUFFER_SIZE];
+    // this is current result, the buffer grows to fit the largest frame seen
+    char * buffer;
+    int buffer_size;
     int length;
 
+    int sockfd;
+
+    // connection handling, driven by run_upstreams()
+    int connection;
+    struct addrinfo * addresses;
+    struct addrinfo * address;  // next one to try
+    long long deadline;         // ms, end of the connect timeout or time of the next attempt
+    int connect_timeout;        // ms
+    int backoff;                // ms, reconnect delay, doubles up to max_backoff
+    int max_backoff;
+    unsigned int seed;
+    int enabled;                // standby upstreams are only connected when needed
+
+    // frame gap watchdog, a stream that stays silent longer than max_gap is reconnected
+    int max_gap;                // ms, 0 disables the watchdog
+    long long last_frame;       // ms, time of the last frame or of the connect
+    long long streak_start;     // ms, since then frames arrived without a stall
+
+    // health statistics
+    unsigned int frames;
+    unsigned long long bytes;
+    unsigned int reconnects;
+    unsigned int failures;
+    unsigned int stalls;
+
+    // failover settings from the command line, the plugin turns the URLs
+    // into upstreams of their own
+    char * secondary_urls[MAX_SECONDARIES];
+    int secondary_count;
+    int race;                   // keep the secondaries streaming all the time
+    int hysteresis;             // ms, the primary has to be healthy that long before switching back
+
     // this is inner state of a parser
 
-    int sockfd;
     int part;
     int last_four_bytes;
-    struct search_pattern contentlength;
-    struct search_pattern boundary;
+
+    // headers of the current part, parsed once the empty line arrives
+    char header [HEADER_BUFFER_SIZE];
+    int header_length;
+    int content_length; // -1 if the part did not announce its length
+    int skip;           // set while a frame too large for the buffer is thrown away
+    char boundary [BOUNDARY_SIZE]; // delimiter line, taken from the Content-Type of the response
 
     int * should_stop;
-    void (*on_image_received)(char * data, int length);
+    void * context;
+    // the callback takes over the frame buffer and hands back one to fill next,
+    // so frames get published without copying them
+    void (*on_image_received)(void * context, char ** data, int * size, int length);
+    void (*on_status_changed)(void * context);
         
 };
 
@@ -59,7 +114,23 @@ void init_mjpg_proxy(struct extractor_state  * state);
 
 int parse_cmd_line(struct extractor_state * out_state, int argc, char * argv []);
 
-void connect_and_stream(struct extractor_state * state);
+int parse_url(struct extractor_state * state, const char * url);
+
+// feeds bytes of the stream to the parser, complete frames go to on_image_received
+void extract_data(struct extractor_state * state, char * buffer, int length);
+
+// monotonic clock in ms, the time base of all deadlines
+long long now_ms(void);
+
+// registers the upstream with the shared loop, it connects on the next turn
+// unless it was disabled before
+int add_upstream(struct extractor_state * state);
+
+// drives all registered upstreams until *should_stop is set
+void run_upstreams(int * should_stop);
+
+// connects or drops a registered upstream, call it from the callbacks only
+void enable_upstream(struct extractor_state * state, int enabled);
 
 void close_mjpg_proxy(struct extractor_state * state);
 
@@ -7,12 +7,15 @@
 
 #include "opencv2/opencv.hpp"
 
+#include "../../input_opencv.h"
+
 using namespace cv;
 using namespace std;
 
 // exports for the filter
 extern "C" {
     bool filter_init(const char * args, void** filter_ctx);
+    int filter_capabilities(void* filter_ctx);
     void filter_process(void* filter_ctx, Mat &src, Mat &dst);
     void filter_free(void* filter_ctx);
 }
@@ -26,6 +29,16 @@ bool filter_init(const char * args, void** filter_ctx) {
     return true;
 }
 
+/**
+    Optional. Tells the OpenCV plugin what the filter can do. Return
+    FILTER_STATELESS only if filter_process can be called from several threads
+    at once, then -fthreads runs it in parallel. Without this function the
+    filter is called from a single thread.
+*/
+int filter_capabilities(void* filter_ctx) {
+    return FILTER_STATELESS;
+}
+
 /**
     Called by the OpenCV plugin upon each frame
 */
@@ -0,0 +1,24 @@
+
+#
+# Filters that do nothing, for filter_py_bench. Their cost is the cost of
+# the bridge between OpenCV and python. Set BENCH_FILTER=out to get the one
+# that writes to an output array instead of returning its input.
+#
+
+import os
+
+import numpy as np
+
+
+def identity(img):
+    return img
+
+
+def identity_out(img, out):
+    np.copyto(out, img)
+
+
+def init_filter():
+    if os.environ.get('BENCH_FILTER') == 'out':
+        return identity_out
+    return identity
@@ -360,3 +360,20 @@ PyObject* NDArrayConverter::toNDArray(const cv::Mat& m)
     Py_INCREF(o);
     return o;
 }
+
+cv::MatAllocator* NDArrayConverter::allocator()
+{
+    return &g_numpyAllocator;
+}
+
+bool NDArrayConverter::isNDArray(const cv::Mat& m)
+{
+    return m.u != NULL && m.allocator == &g_numpyAllocator && m.u->userdata != NULL;
+}
+
+// reading the counts without the GIL is fine, once a buffer is unshared
+// nobody but its owner can get hold of it again
+bool NDArrayConverter::isUnshared(const cv::Mat& m)
+{
+    return isNDArray(m) && m.u->refcount == 1 && Py_REFCNT((PyObject*)m.u->userdata) == 1;
+}
@@ -10,6 +10,13 @@ public:
     
     bool toMat(PyObject* o, cv::Mat &m);
     PyObject* toNDArray(const cv::Mat& mat);
+    
+    // allocator that puts the data of a Mat into a numpy array
+    static cv::MatAllocator* allocator();
+    // true if toNDArray() can hand out m without copying it
+    static bool isNDArray(const cv::Mat& m);
+    // true if neither another Mat nor python refers to the data of m
+    static bool isUnshared(const cv::Mat& m);
 };
 
 # endif
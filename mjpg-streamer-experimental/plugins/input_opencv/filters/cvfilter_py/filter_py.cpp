@@ -7,6 +7,7 @@
 
 #include <libgen.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "opencv2/opencv.hpp"
 #include <Python.h>
@@ -25,14 +26,72 @@ extern "C" {
 
 static int python_loaded = 0;
 
+#define POOL_SIZE 8
+
+/**
+    Frames backed by numpy arrays that get reused once nobody, neither a Mat
+    nor python, refers to them anymore. The encoder of input_opencv may still
+    hold a frame while the next one is filtered, so one buffer is not enough.
+*/
+struct FramePool {
+    Mat frames[POOL_SIZE];
+    int count;
+    
+    Mat acquire(const Mat &like) {
+        int i;
+        for (i = 0; i < count; i++) {
+            if (frames[i].size == like.size && frames[i].type() == like.type() &&
+                NDArrayConverter::isUnshared(frames[i]))
+                return frames[i];
+        }
+        
+        Mat frame;
+        frame.allocator = NDArrayConverter::allocator();
+        frame.create(like.dims, like.size.p, like.type());
+        
+        // replace an idle frame of another size, or keep the new one
+        for (i = 0; i < count; i++) {
+            if (NDArrayConverter::isUnshared(frames[i]))
+                break;
+        }
+        if (i < POOL_SIZE) {
+            frames[i] = frame;
+            count = max(count, i + 1);
+        }
+        return frame;
+    }
+    
+    void clear() {
+        for (int i = 0; i < count; i++)
+            frames[i].release();
+        count = 0;
+    }
+};
+
 struct Context {
     NDArrayConverter converter;
     
     PyObject *pModule;
     PyObject *filter_fn;
-    PyObject *lastRetval;
     
     PyThreadState *pMainThread;
+    
+    // the filter takes a second argument to write its result to
+    bool wants_out;
+    FramePool out_pool;
+    
+    // async mode, the filter runs in a thread of its own and always gets
+    // the most recent frame, older ones are dropped
+    bool async;
+    pthread_t thread;
+    bool thread_running;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    bool stop;
+    FramePool in_pool;
+    Mat pending;            // waiting to be filtered, replaced by newer frames
+    Mat latest;             // last result of the filter
+    unsigned long dropped;
 };
 
 
@@ -56,6 +115,113 @@ static PyObject* get_import(const char * args) {
     return obj;
 }
 
+// number of parameters the filter callable takes, bound methods without self
+static int count_arguments(PyObject *fn) {
+    PyObject *inspect, *signature, *parameters;
+    int count = 1;
+    
+    inspect = PyImport_ImportModule("inspect");
+    if (inspect != NULL) {
+        signature = PyObject_CallMethod(inspect, "signature", "O", fn);
+        if (signature != NULL) {
+            parameters = PyObject_GetAttrString(signature, "parameters");
+            if (parameters != NULL)
+                count = PyObject_Length(parameters);
+            Py_XDECREF(parameters);
+            Py_DECREF(signature);
+        }
+        Py_DECREF(inspect);
+    }
+    if (PyErr_Occurred())
+        PyErr_Clear();
+    return count;
+}
+
+/**
+    Runs the python filter on src, the GIL must be held. Both arrays passed to
+    python share their data with the Mats, and so does the result if it is a
+    C contiguous array. Returns false if python failed.
+*/
+static bool call_filter(Context *ctx, Mat &src, Mat &dst) {
+    PyObject *ndArray, *outArray = NULL, *pArgs, *result;
+    Mat out;
+    bool ok = true;
+    
+    ndArray = ctx->converter.toNDArray(src);
+    if (ndArray == NULL) {
+        PyErr_Print();
+        return false;
+    }
+    
+    if (ctx->wants_out) {
+        out = ctx->out_pool.acquire(src);
+        outArray = ctx->converter.toNDArray(out);
+        pArgs = PyTuple_Pack(2, ndArray, outArray);
+        Py_DECREF(ndArray);
+        Py_DECREF(outArray);
+    } else {
+        pArgs = PyTuple_New(1);
+        PyTuple_SetItem(pArgs, 0, ndArray); // takes ownership of ndarray
+    }
+    
+    result = PyObject_CallObject(ctx->filter_fn, pArgs);
+    Py_DECREF(pArgs);
+    
+    if (result == NULL) {
+        PyErr_Print();
+        return false;
+    }
+    
+    // the Mat keeps a reference to the array it got, so the result can go
+    if (result == Py_None) {
+        // the filter wrote its result to the output array, or nothing at all
+        dst = ctx->wants_out ? out : src;
+    } else if (ctx->wants_out && result == outArray) {
+        dst = out;
+    } else if (!ctx->converter.toMat(result, dst)) {
+        PyErr_Print();
+        ok = false;
+    }
+    Py_DECREF(result);
+    return ok;
+}
+
+/**
+    Async mode. Waits for frames without holding the GIL, and only takes it
+    while python runs, so the capture keeps going no matter how slow the
+    filter is.
+*/
+static void *filter_thread(void *arg) {
+    Context *ctx = (Context*)arg;
+    Mat src, dst;
+    
+    while (true) {
+        pthread_mutex_lock(&ctx->mutex);
+        while (!ctx->stop && ctx->pending.empty())
+            pthread_cond_wait(&ctx->changed, &ctx->mutex);
+        if (ctx->stop) {
+            pthread_mutex_unlock(&ctx->mutex);
+            break;
+        }
+        src = ctx->pending;
+        ctx->pending.release();
+        pthread_mutex_unlock(&ctx->mutex);
+        
+        PyGILState_STATE gil_state = PyGILState_Ensure();
+        bool ok = call_filter(ctx, src, dst);
+        PyGILState_Release(gil_state);
+        
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->latest = ok ? dst : src;
+        pthread_mutex_unlock(&ctx->mutex);
+        
+        src.release();
+        dst.release();
+    }
+    
+    return NULL;
+}
+
 /**
     Initializes the filter. If you return something, it will be passed to the
     filter_process function, and should be freed by the filter_free function
@@ -65,12 +231,20 @@ bool filter_init(const char * args, void** filter_ctx) {
     PyObject *sys, *sys_path = NULL;
     PyObject *pModuleDir, *pModuleName, *pFunc;
     Context * ctx;
-    char * dupargs, *mod_name, *mod_dir;
+    string path, options;
+    
+    // the path of the script, optionally followed by "async"
+    path = args;
+    if (path.find(' ') != string::npos) {
+        options = path.substr(path.find(' ') + 1);
+        path = path.substr(0, path.find(' '));
+    }
     
-    if (strlen(args) < 3) {
+    if (path.length() < 3) {
         fprintf(stderr, "Need to specify python filter module via --fargs\n");
         return false;
     }
+    args = path.c_str();
     
     // don't initialize python more than once
     if (python_loaded == 0) {
@@ -141,8 +315,23 @@ bool filter_init(const char * args, void** filter_ctx) {
         return false;
     }
     
+    ctx->wants_out = count_arguments(ctx->filter_fn) >= 2;
+    ctx->async = options.find("async") != string::npos;
+    fprintf(stderr, "python filter: %s, %s\n", ctx->wants_out ? "writes to an output array" : "returns its result",
+            ctx->async ? "runs in its own thread" : "runs for every frame");
+    
     // done with initialization, let go of the GIL
     ctx->pMainThread = PyEval_SaveThread();
+    
+    if (ctx->async) {
+        pthread_mutex_init(&ctx->mutex, NULL);
+        pthread_cond_init(&ctx->changed, NULL);
+        if (pthread_create(&ctx->thread, NULL, filter_thread, ctx) != 0) {
+            fprintf(stderr, "could not start the python filter thread\n");
+            return false;
+        }
+        ctx->thread_running = true;
+    }
     return true;
 }
 
@@ -171,40 +360,36 @@ Mat filter_init_frame(void *filter_ctx) {
 void filter_process(void* filter_ctx, Mat &src, Mat &dst) {
     
     Context *ctx = (Context*)filter_ctx;
-    PyObject *ndArray, *pArgs;
     
-    PyGILState_STATE gil_state = PyGILState_Ensure();
-    
-    ndArray = ctx->converter.toNDArray(src);
-    if (ndArray == NULL) {
-        PyErr_Print();
-        PyGILState_Release(gil_state);
-        dst = src;
+    if (ctx->async) {
+        // the capture reuses src, so the filter thread gets a copy, in a
+        // numpy array that is handed to python as is
+        Mat copy = ctx->in_pool.acquire(src);
+        src.copyTo(copy);
+        
+        pthread_mutex_lock(&ctx->mutex);
+        if (!ctx->pending.empty())
+            ctx->dropped++;
+        ctx->pending = copy;
+        dst = ctx->latest.empty() ? src : ctx->latest;
+        pthread_cond_signal(&ctx->changed);
+        pthread_mutex_unlock(&ctx->mutex);
         return;
     }
-        
-    pArgs = PyTuple_New(1);
-    PyTuple_SetItem(pArgs, 0, ndArray); // takes ownership of ndarray
     
-    // see below for rationale
-    Py_XDECREF(ctx->lastRetval);
+    PyGILState_STATE gil_state = PyGILState_Ensure();
     
-    // call the python function, store the object until next time, that way the
-    // underlying Mat object doesn't get deallocated
-    ctx->lastRetval = PyObject_CallObject(ctx->filter_fn, pArgs);
-    if (ctx->lastRetval == NULL) {
-        PyErr_Print();
-        dst = src;
-    } else {
-        if (ctx->lastRetval != Py_None) {
-            if (!ctx->converter.toMat(ctx->lastRetval, dst)) {
-                PyErr_Print();
-                dst = src;
-            }
-        }    
+    // captured frames should already live in numpy arrays, see filter_init_frame,
+    // if not, move this slot over once, later captures reuse the array
+    if (!NDArrayConverter::isNDArray(src)) {
+        Mat frame;
+        frame.allocator = NDArrayConverter::allocator();
+        src.copyTo(frame);
+        src = frame;
     }
     
-    Py_DECREF(pArgs);
+    if (!call_filter(ctx, src, dst))
+        dst = src;
     
     // done with GIL
     PyGILState_Release(gil_state);
@@ -219,11 +404,27 @@ void filter_free(void* filter_ctx) {
     
     Context * ctx = (Context*)filter_ctx;
     
+    // the thread needs the GIL to finish, so stop it before taking it
+    if (ctx->thread_running) {
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->stop = true;
+        pthread_cond_signal(&ctx->changed);
+        pthread_mutex_unlock(&ctx->mutex);
+        pthread_join(ctx->thread, NULL);
+        ctx->thread_running = false;
+        fprintf(stderr, "python filter dropped %lu frames\n", ctx->dropped);
+    }
+    
     if (ctx->pMainThread != NULL) {
         PyEval_RestoreThread(ctx->pMainThread);
     }
     
-    Py_XDECREF(ctx->lastRetval);
+    // the frames hold references to numpy arrays
+    ctx->pending.release();
+    ctx->latest.release();
+    ctx->in_pool.clear();
+    ctx->out_pool.clear();
+    
     Py_XDECREF(ctx->filter_fn);
     Py_XDECREF(ctx->pModule);
     
@@ -0,0 +1,107 @@
+/**
+    Measures what the python bridge costs per frame: frames are handed to
+    filter_process the way input_opencv does it, through a filter script that
+    does nothing, see bench_filter.py. A plain copy of the frame is timed as
+    a reference. In async mode the time is the one for handing a frame to
+    the python thread.
+
+    filter_py_bench [-n FRAMES] [-w WIDTH] [-h HEIGHT] [-a] [SCRIPT.py]
+
+    Without a script bench_filter.py next to this file is used.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+
+#include "opencv2/opencv.hpp"
+
+using namespace cv;
+using namespace std;
+
+extern "C" {
+    bool filter_init(const char * args, void** filter_ctx);
+    Mat filter_init_frame(void* filter_ctx);
+    void filter_process(void* filter_ctx, Mat &src, Mat &dst);
+    void filter_free(void* filter_ctx);
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv []) {
+    int count = 1000, width = 640, height = 480, c, i;
+    bool async = false, usage = false;
+    string args = BENCH_FILTER;
+    void *ctx = NULL;
+    double start, bridge, plain;
+    Mat src, dst, copy;
+    
+    while ((c = getopt(argc, argv, "n:w:h:a")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'a':
+            async = true;
+            break;
+        default:
+            usage = true;
+            break;
+        }
+    }
+    if (usage || count < 1 || width < 1 || height < 1 || argc > optind + 1) {
+        fprintf(stderr, "Usage: %s [-n FRAMES] [-w WIDTH] [-h HEIGHT] [-a] [SCRIPT.py]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > optind)
+        args = argv[optind];
+    if (async)
+        args += " async";
+    
+    if (!filter_init(args.c_str(), &ctx)) {
+        if (ctx != NULL)
+            filter_free(ctx);
+        return EXIT_FAILURE;
+    }
+    
+    // like the capture of input_opencv, which reads into this frame
+    src = filter_init_frame(ctx);
+    src.create(height, width, CV_8UC3);
+    randu(src, Scalar::all(0), Scalar::all(255));
+    
+    // the first call sets up the arrays and the pool
+    filter_process(ctx, src, dst);
+    dst.release();
+    
+    start = seconds();
+    for (i = 0; i < count; i++) {
+        filter_process(ctx, src, dst);
+        dst.release();
+    }
+    bridge = seconds() - start;
+    
+    copy.create(height, width, CV_8UC3);
+    start = seconds();
+    for (i = 0; i < count; i++)
+        src.copyTo(copy);
+    plain = seconds() - start;
+    
+    printf("%dx%d %s: %9.1f us/frame   copy %9.1f us/frame\n", width, height,
+           async ? "async" : "sync", bridge * 1e6 / count, plain * 1e6 / count);
+    
+    src.release();
+    filter_free(ctx);
+    return EXIT_SUCCESS;
+}
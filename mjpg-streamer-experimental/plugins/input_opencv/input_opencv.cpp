@@ -23,6 +23,9 @@
 #include <getopt.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <limits.h>
 #include <vector>
 
 #include "input_opencv.h"
@@ -51,7 +54,8 @@ typedef struct {
         br_set, br,
         sa_set, sa,
         gain_set, gain,
-        ex_set, ex;
+        ex_set, ex,
+        fthreads_set, fthreads;
 } context_settings;
 
 // filter functions
@@ -59,6 +63,24 @@ typedef bool (*filter_init_fn)(const char * args, void** filter_ctx);
 typedef Mat (*filter_init_frame_fn)(void* filter_ctx);
 typedef void (*filter_process_fn)(void* filter_ctx, Mat &src, Mat &dst);
 typedef void (*filter_free_fn)(void* filter_ctx);
+typedef int (*filter_capabilities_fn)(void* filter_ctx);
+
+/* capture, filter and publish run in threads of their own, connected by queues
+   of slot indices, so a frame can be captured while the previous one is
+   filtered and the one before is published. Stateless filters can run in
+   several threads, the last stage puts their results back into capture order.
+   Frames are published uncompressed, the JPEG is only encoded if an output
+   asks for it */
+#define MAX_FILTER_THREADS 8
+#define MAX_SLOTS (MAX_FILTER_THREADS + 2)
+#define QUEUE_SIZE (MAX_SLOTS + MAX_FILTER_THREADS) // all slots and the end markers
+
+typedef struct {
+    int items[QUEUE_SIZE];
+    int head, count;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} slot_queue;
 
 
 typedef struct {
@@ -74,16 +96,56 @@ typedef struct {
     filter_init_frame_fn filter_init_frame;
     filter_process_fn filter_process;
     filter_free_fn filter_free;
+    int filter_threads;
+    
+    // the pipeline, the worker thread publishes
+    pthread_t   capture_thread, filter_thread[MAX_FILTER_THREADS];
+    bool        pipeline_running;
+    int         slots;
+    Mat         src[MAX_SLOTS], dst[MAX_SLOTS];
+    struct timeval timestamp[MAX_SLOTS];
+    unsigned int sequence[MAX_SLOTS];
+    long        filter_us[MAX_SLOTS];   // time the filter took on the frame
+    long        filter_avg, filter_max; // shown in the controls
+    time_t      filter_max_since;
+    bool        resumed[MAX_SLOTS];     // first frame after being idle
+    bool        idle_drop;              // skip frames while no output wants them
+    slot_queue  free_slots, captured, filtered;
+    
+    // published alternately, the consumers only read the published one under
+    // the lock, so the other one can be written without holding it
+    Mat frame[2];
+    int published;
+    
+    // the JPEG of each frame, encoded before the frame gets published while
+    // outputs are subscribed, otherwise on demand under the lock
+    vector<uchar> jpeg_buffer[2];
+    vector<int> compression_params;
     
 } context;
 
 
 void *worker_thread(void *);
 void worker_cleanup(void *);
+static int encode_frame(int id);
 
 #define INPUT_PLUGIN_NAME "OpenCV Input plugin"
 static char plugin_name[] = INPUT_PLUGIN_NAME;
 
+/* read-only controls exporting the filter timing */
+enum {
+    CTRL_FILTER_THREADS = V4L2_CID_PRIVATE_BASE,
+    CTRL_FILTER_AVG,
+    CTRL_FILTER_MAX,
+    CTRL_COUNT = CTRL_FILTER_MAX - V4L2_CID_PRIVATE_BASE + 1
+};
+
+static const char *control_names[CTRL_COUNT] = {
+    "Filter threads",
+    "Filter time avg (us)",
+    "Filter time max (us)"
+};
+
 // arrays to be assigned
 static int *marker_color, *marker_start, *marker_mid, *marker_end, num_angles, num_markers, *angles, old_angle = INT_MAX, ang = 0;
 //static int angle = 11;
@@ -222,6 +284,8 @@ static void help() {
     fprintf(stderr,
     " [-f | --fps ]..........: frames per second\n" \
     " [-q | --quality ] .....: set quality of JPEG encoding\n" \
+    " [-idle ]...............: \"drop\" frames unfiltered while no output\n" \
+    "                          wants them, default: \"off\"\n" \
     " ---------------------------------------------------------------\n" \
     " Optional parameters (may not be supported by all cameras):\n\n"
     " [-br ].................: Set image brightness (integer)\n"\
@@ -234,6 +298,8 @@ static void help() {
     " Optional filter plugin:\n" \
     " [ -filter ]............: filter plugin .so\n" \
     " [ -fargs ].............: filter plugin arguments\n" \
+    " [ -fthreads ]..........: number of threads running the filter, only\n" \
+    "                          used if the filter says it is stateless\n" \
     " ---------------------------------------------------------------\n\n"\
     );
 }
@@ -248,9 +314,43 @@ static context_settings* init_settings() {
     }
     
     settings->quality = 80;
+    settings->fthreads = 1;
     return settings;
 }
 
+/******************************************************************************
+Description.: registers the filter timing as read-only generic controls
+Input Value.: in is the input slot of the instance
+Return Value: -
+******************************************************************************/
+static void init_controls(input *in)
+{
+    int i;
+
+    in->in_parameters = (control*)calloc(CTRL_COUNT, sizeof(control));
+    if (in->in_parameters == NULL) {
+        IPRINT("could not allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < CTRL_COUNT; i++) {
+        control *ctrl = &in->in_parameters[i];
+        ctrl->group = IN_CMD_GENERIC;
+        ctrl->menuitems = NULL;
+        ctrl->value = 0;
+        ctrl->class_id = 0;
+        ctrl->ctrl.id = V4L2_CID_PRIVATE_BASE + i;
+        ctrl->ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+        ctrl->ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+        snprintf((char *)ctrl->ctrl.name, sizeof(ctrl->ctrl.name), "%s", control_names[i]);
+        ctrl->ctrl.minimum = 0;
+        ctrl->ctrl.maximum = INT_MAX;
+        ctrl->ctrl.step = 1;
+        ctrl->ctrl.default_value = 0;
+    }
+    in->parametercount = CTRL_COUNT;
+}
+
 /*** plugin interface functions ***/
 
 /******************************************************************************
@@ -271,8 +371,10 @@ int input_init(input_parameter *param, int plugin_no)
     input * in;
     context *pctx;
     context_settings *settings;
+    filter_capabilities_fn filter_capabilities;
     
     pctx = new context();
+    pctx->filter_threads = 1;
     
     settings = pctx->init_settings = init_settings();
     pglobal = param->global;
@@ -308,6 +410,8 @@ int input_init(input_parameter *param, int plugin_no)
             {"ex", required_argument, 0, 0},
             {"filter", required_argument, 0, 0},
             {"fargs", required_argument, 0, 0},
+            {"fthreads", required_argument, 0, 0},
+            {"idle", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
     
@@ -371,6 +475,23 @@ int input_init(input_parameter *param, int plugin_no)
             filter_args = optarg;
             break;
             
+        /* fthreads */
+        OPTION_INT(17, fthreads)
+            settings->fthreads = MIN(MAX(settings->fthreads, 1), MAX_FILTER_THREADS);
+            break;
+            
+        /* idle */
+        case 18:
+            if (strcasecmp("off", optarg) == 0) {
+                pctx->idle_drop = false;
+            } else if (strcasecmp("drop", optarg) == 0) {
+                pctx->idle_drop = true;
+            } else {
+                fprintf(stderr, "Invalid value '%s' for -idle (off or drop required)\n", optarg);
+                return 1;
+            }
+            break;
+            
         default:
             help();
             return 1;
@@ -441,12 +562,21 @@ int input_init(input_parameter *param, int plugin_no)
         
         // optional functions
         pctx->filter_init_frame = (filter_init_frame_fn)dlsym(pctx->filter_handle, "filter_init_frame");
+        filter_capabilities = (filter_capabilities_fn)dlsym(pctx->filter_handle, "filter_capabilities");
         
         // initialize it
         if (!pctx->filter_init(filter_args, &pctx->filter_ctx)) {
             goto fatal_error;
         }
         
+        // only filters that keep no state between frames may run in parallel
+        if (filter_capabilities != NULL && (filter_capabilities(pctx->filter_ctx) & FILTER_STATELESS)) {
+            pctx->filter_threads = settings->fthreads;
+        } else if (settings->fthreads > 1) {
+            IPRINT("filter is not stateless, it runs in a single thread\n");
+        }
+        IPRINT("filter threads .. : %d\n", pctx->filter_threads);
+        
     } else {
         pctx->filter_handle = NULL;
         pctx->filter_ctx = NULL;
@@ -454,6 +584,9 @@ int input_init(input_parameter *param, int plugin_no)
         pctx->filter_free = NULL;
     }
     
+    init_controls(in);
+    in->in_parameters[CTRL_FILTER_THREADS - V4L2_CID_PRIVATE_BASE].value = pctx->filter_threads;
+    
     // read JSON to get markers
     ret = parse_json(&marker_color, &marker_start, &marker_mid, &marker_end, &num_angles, &num_markers, &angles);
 
@@ -518,6 +651,7 @@ int input_run(int id)
     
     in->buf = NULL;
     in->size = 0;
+    in->encode = encode_frame;
     
     if(pthread_create(&pctx->worker, 0, worker_thread, in) != 0) {
         worker_cleanup(in);
@@ -529,11 +663,255 @@ int input_run(int id)
     return 0;
 }
 
+static void queue_init(slot_queue *q)
+{
+    q->head = q->count = 0;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+/* never blocks, a queue can hold every slot of the pipeline */
+static void queue_push(slot_queue *q, int item)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->items[(q->head + q->count) % QUEUE_SIZE] = item;
+    q->count++;
+    pthread_cond_signal(&q->changed);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void unlock_queue(void *arg)
+{
+    pthread_mutex_unlock(&((slot_queue*)arg)->mutex);
+}
+
+/* waits for the next slot, -1 marks the end of the stream */
+static int queue_pop(slot_queue *q)
+{
+    int item;
+    
+    pthread_mutex_lock(&q->mutex);
+    pthread_cleanup_push(unlock_queue, q);
+    while (q->count == 0)
+        pthread_cond_wait(&q->changed, &q->mutex);
+    item = q->items[q->head];
+    q->head = (q->head + 1) % QUEUE_SIZE;
+    q->count--;
+    pthread_cleanup_pop(1);
+    
+    return item;
+}
+
+/******************************************************************************
+Description.: first stage, reads frames from the camera into free slots
+Input Value.: arg is the input
+Return Value: NULL
+******************************************************************************/
+static void *capture_thread(void *arg)
+{
+    input * in = (input*)arg;
+    context *pctx = (context*)in->context;
+    unsigned int sequence = 0;
+    bool idle = false;
+    int slot;
+    
+    while (!pglobal->stop) {
+        slot = queue_pop(&pctx->free_slots);
+        if (!pctx->capture.read(pctx->src[slot]))
+            break; // TODO
+        
+        // keep reading so the camera does not serve stale frames on resume,
+        // but spare the filter while nobody is interested
+        if (pctx->idle_drop && in->consumers == 0) {
+            idle = true;
+            queue_push(&pctx->free_slots, slot);
+            continue;
+        }
+        pctx->resumed[slot] = idle;
+        idle = false;
+        
+        gettimeofday(&pctx->timestamp[slot], NULL);
+        pctx->sequence[slot] = sequence++;
+        queue_push(&pctx->captured, slot);
+    }
+    
+    queue_push(&pctx->captured, -1);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: second stage, runs the filter on captured frames, there may be
+              several of these threads, each takes whatever frame is next
+Input Value.: arg is the input
+Return Value: NULL
+******************************************************************************/
+static void *filter_thread(void *arg)
+{
+    input * in = (input*)arg;
+    context *pctx = (context*)in->context;
+    struct timespec start, end;
+    int slot;
+    
+    while ((slot = queue_pop(&pctx->captured)) >= 0) {
+        // call the filter function
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pctx->filter_process(pctx->filter_ctx, pctx->src[slot], pctx->dst[slot]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pctx->filter_us[slot] = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+        queue_push(&pctx->filtered, slot);
+    }
+    
+    // pass the end marker on to the other filter threads, then to the encoder
+    queue_push(&pctx->captured, -1);
+    queue_push(&pctx->filtered, -1);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: mirrors the time the filter took into the controls, the average
+              follows the recent frames, the maximum is of the last second
+Input Value.: in is the input, us the time of the frame in microseconds
+Return Value: -
+******************************************************************************/
+static void update_filter_time(input *in, long us)
+{
+    context *pctx = (context*)in->context;
+    time_t now = time(NULL);
+
+    pctx->filter_avg = pctx->filter_avg == 0 ? us : pctx->filter_avg + (us - pctx->filter_avg) / 16;
+    if (now != pctx->filter_max_since) {
+        pctx->filter_max = 0;
+        pctx->filter_max_since = now;
+    }
+    pctx->filter_max = MAX(pctx->filter_max, us);
+
+    in->in_parameters[CTRL_FILTER_AVG - V4L2_CID_PRIVATE_BASE].value = pctx->filter_avg;
+    in->in_parameters[CTRL_FILTER_MAX - V4L2_CID_PRIVATE_BASE].value = pctx->filter_max;
+}
+
+/******************************************************************************
+Description.: encodes the published frame, input_jpeg() calls this with the
+              db mutex held the first time an output needs the JPEG, which
+              only happens for frames published while no output was
+              subscribed
+Input Value.: id of the input
+Return Value: size of the JPEG in buf, -1 on error
+******************************************************************************/
+static int encode_frame(int id)
+{
+    input * in = &pglobal->in[id];
+    context *pctx = (context*)in->context;
+    int type = in->raw.format == V4L2_PIX_FMT_GREY ? CV_8UC1 : CV_8UC3;
+    
+    if (in->raw.format == 0)
+        return -1;
+    
+    vector<uchar> &jpeg = pctx->jpeg_buffer[pctx->published];
+    Mat frame(in->raw.height, in->raw.width, type, in->raw.plane[0], in->raw.stride[0]);
+    if (!imencode(".jpg", frame, jpeg, pctx->compression_params) || jpeg.empty()) {
+        fprintf(stderr, "could not encode frame\n");
+        return -1;
+    }
+    
+    // std::vector is guaranteed to be contiguous
+    in->buf = &jpeg[0];
+    return jpeg.size();
+}
+
+/******************************************************************************
+Description.: last stage, moves a filtered frame into the spare frame,
+              compresses it if outputs are subscribed and publishes it, only
+              the hand-over happens under the lock
+Input Value.: in is the input, slot holds the frame, next selects the frame
+              and is flipped once it got published
+Return Value: -
+******************************************************************************/
+static void publish_frame(input *in, int slot, int *next)
+{
+    context *pctx = (context*)in->context;
+    Mat &frame = pctx->frame[*next];
+    vector<uchar> &jpeg = pctx->jpeg_buffer[*next];
+    unsigned int format;
+    bool encoded = false;
+    long resume_latency = 0;
+    
+    update_filter_time(in, pctx->filter_us[slot]);
+    
+    // take whatever Mat the filter returned, the filter or the capture stage
+    // may write to it again once the slot is handed back. If nothing else
+    // refers to it the Mats are just swapped, the filter then gets the old
+    // spare frame to write into, which no consumer reads anymore
+    Mat &dst = pctx->dst[slot];
+    switch (dst.type()) {
+    case CV_8UC3: format = V4L2_PIX_FMT_BGR24; break;
+    case CV_8UC1: format = V4L2_PIX_FMT_GREY; break;
+    default:      format = 0; break;
+    }
+    if (format != 0) {
+        if (dst.u != NULL && dst.u->refcount == 1)
+            swap(frame, dst);
+        else
+            dst.copyTo(frame);
+    }
+    struct timeval timestamp = pctx->timestamp[slot];
+    bool resumed = pctx->resumed[slot];
+    
+    // the slot is not needed anymore, let the capture stage have it
+    queue_push(&pctx->free_slots, slot);
+    
+    if (format == 0 || frame.empty()) {
+        fprintf(stderr, "unsupported frame type, dropping it\n");
+        return;
+    }
+    
+    // the spare JPEG is not read by anyone either, so compress before taking
+    // the lock, consumers only wait for the pointer to be swapped
+    if (in->jpeg_consumers > 0) {
+        encoded = imencode(".jpg", frame, jpeg, pctx->compression_params) && !jpeg.empty();
+        if (!encoded)
+            fprintf(stderr, "could not encode frame\n");
+    }
+    
+    pthread_mutex_lock(&in->db);
+    
+    in->raw.format = format;
+    in->raw.width = frame.cols;
+    in->raw.height = frame.rows;
+    in->raw.planes = 1;
+    in->raw.plane[0] = frame.data;
+    in->raw.stride[0] = frame.step[0];
+    if (encoded) {
+        in->buf = &jpeg[0];
+        in->size = jpeg.size();
+        in->jpeg_ready = 1;
+    } else {
+        in->jpeg_ready = 0;
+        in->size = 0;
+    }
+    pctx->published = *next;
+    in->timestamp = timestamp;
+    in->sequence++;
+    if (resumed)
+        resume_latency = input_resume_latency(in);
+    
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+    
+    if (resumed)
+        IPRINT("resumed from idle after %ld ms\n", resume_latency);
+    
+    *next ^= 1;
+}
+
 void *worker_thread(void *arg)
 {
     input * in = (input*)arg;
     context *pctx = (context*)in->context;
     context_settings *settings = (context_settings*)pctx->init_settings;
+    int slot, next = 0, i;
+    unsigned int expected = 0;
+    bool pending[MAX_SLOTS] = { false };
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, arg);
@@ -559,46 +937,57 @@ void *worker_thread(void *arg)
     CVOPT_SET(CAP_PROP_EXPOSURE, ex, "exposure")
     
     /* setup imencode options */
-    vector<int> compression_params;
-    compression_params.push_back(IN_CMD_JPEG_QUALITY);
-    compression_params.push_back(settings->quality); // 1-100
+    pctx->compression_params.push_back(IN_CMD_JPEG_QUALITY);
+    pctx->compression_params.push_back(settings->quality); // 1-100
     
     free(settings);
     pctx->init_settings = NULL;
     settings = NULL;
     
-    Mat src, dst;
-    vector<uchar> jpeg_buffer;
+    queue_init(&pctx->free_slots);
+    queue_init(&pctx->captured);
+    queue_init(&pctx->filtered);
     
-    // this exists so that the numpy allocator can assign a custom allocator to
-    // the mat, so that it doesn't need to copy the data each time
-    if (pctx->filter_init_frame != NULL)
-        src = pctx->filter_init_frame(pctx->filter_ctx);
+    // one slot being captured, one being published, one per filter thread
+    pctx->slots = pctx->filter_threads + 2;
+    for (slot = 0; slot < pctx->slots; slot++) {
+        // this exists so that the numpy allocator can assign a custom allocator to
+        // the mat, so that it doesn't need to copy the data each time
+        if (pctx->filter_init_frame != NULL)
+            pctx->src[slot] = pctx->filter_init_frame(pctx->filter_ctx);
+        queue_push(&pctx->free_slots, slot);
+    }
     
-    while (!pglobal->stop) {
-        if (!pctx->capture.read(src))
-            break; // TODO
-            
-        // call the filter function
-        pctx->filter_process(pctx->filter_ctx, src, dst);
-            
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&in->db);
-        
-        // take whatever Mat it returns, and write it to jpeg buffer
-        imencode(".jpg", dst, jpeg_buffer, compression_params);
-        
-        // TODO: what to do if imencode returns an error?
-        
-        // std::vector is guaranteed to be contiguous
-        in->buf = &jpeg_buffer[0];
-        in->size = jpeg_buffer.size();
+    if (pthread_create(&pctx->capture_thread, 0, capture_thread, in) != 0) {
+        fprintf(stderr, "could not start capture thread\n");
+        goto thread_quit;
+    }
+    for (i = 0; i < pctx->filter_threads; i++) {
+        if (pthread_create(&pctx->filter_thread[i], 0, filter_thread, in) != 0) {
+            fprintf(stderr, "could not start filter thread\n");
+            pctx->filter_threads = i;
+            pctx->pipeline_running = true;
+            goto thread_quit;
+        }
+    }
+    pctx->pipeline_running = true;
+    
+    /* last stage, publish */
+    while ((slot = queue_pop(&pctx->filtered)) >= 0) {
         
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&in->db_update);
-        pthread_mutex_unlock(&in->db);
+        // parallel filters may finish out of order, hold frames back until it is their turn
+        pending[slot] = true;
+        for (slot = 0; slot < pctx->slots; slot++) {
+            if (pending[slot] && pctx->sequence[slot] == expected) {
+                pending[slot] = false;
+                expected++;
+                publish_frame(in, slot, &next);
+                slot = -1; // start over, the next one may be waiting as well
+            }
+        }
     }
     
+thread_quit:
     IPRINT("leaving input thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
 
@@ -616,6 +1005,25 @@ void worker_cleanup(void *arg)
     if (in->context != NULL) {
         context *pctx = (context*)in->context;
         
+        // the other stages use the context and the filter, stop them first
+        if (pctx->pipeline_running) {
+            pthread_cancel(pctx->capture_thread);
+            for (int i = 0; i < pctx->filter_threads; i++)
+                pthread_cancel(pctx->filter_thread[i]);
+            pthread_join(pctx->capture_thread, NULL);
+            for (int i = 0; i < pctx->filter_threads; i++)
+                pthread_join(pctx->filter_thread[i], NULL);
+            pctx->pipeline_running = false;
+        }
+        
+        // the published frame lives in the context
+        pthread_mutex_lock(&in->db);
+        in->buf = NULL;
+        in->size = 0;
+        in->raw.format = 0;
+        in->jpeg_ready = 1;
+        pthread_mutex_unlock(&in->db);
+        
         if (pctx->filter_free != NULL && pctx->filter_ctx != NULL) {
             pctx->filter_free(pctx->filter_ctx);
             pctx->filter_free = NULL;
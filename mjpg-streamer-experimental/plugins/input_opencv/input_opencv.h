@@ -5,9 +5,15 @@
 extern "C" {
 #endif
 
+#include <getopt.h>
+
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
 
+/* bits a filter plugin may return from its optional filter_capabilities()
+   export, they are part of the filter interface and must not change */
+#define FILTER_STATELESS 0x1   // filter_process keeps no state between frames and may run in parallel
+
 int input_init(input_parameter* param, int id);
 int input_stop(int id);
 int input_run(int id);
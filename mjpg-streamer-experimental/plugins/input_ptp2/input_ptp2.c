@@ -278,6 +278,7 @@ void* capture(void* arg)
 		pthread_mutex_unlock(&control_mutex);
 		CAMERA_CHECK_GP(res, "gp_file_unref");
 		global->in[plugin_id].size = xsize;
+		global->in[plugin_id].sequence++;
 		DBG("Read %d bytes from camera.\n", global->in[plugin_id].size);
 		pthread_cond_broadcast(&global->in[plugin_id].db_update);
 		pthread_mutex_unlock(&global->in[plugin_id].db);
@@ -242,6 +242,7 @@ void *worker_thread(void *arg)
         i = (i + 1) % LENGTH_OF(pics->sequence);
         pglobal->in[plugin_number].size = pics->sequence[i].size;
         memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
+        pglobal->in[plugin_number].sequence++;
 
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
@@ -47,7 +47,6 @@
 
 #ifndef NO_LIBJPEG
     #include "jpeg_utils.h"
-    #include "huffman.h"
 #endif
 
 #include "dynctrl.h"
@@ -76,6 +75,14 @@ static struct timeval timestamp;
 static int softfps = -1;
 static unsigned int timeout = 5;
 static unsigned int dv_timings = 0;
+static enum v4l2_memory memory = V4L2_MEMORY_MMAP;
+
+/* what to do while no output is subscribed to the frames */
+static enum {
+    IDLE_OFF,       // keep publishing
+    IDLE_DROP,      // keep capturing, but do not publish
+    IDLE_PAUSE      // stop streaming until an output subscribes
+} idle = IDLE_OFF;
 
 static const struct {
   const char * k;
@@ -97,6 +104,12 @@ static const struct {
 };
 
 void *cam_thread(void *);
+static int wait_for_consumers(input *in);
+static void detect_motion(context *pctx, const unsigned char *frame);
+#ifndef NO_LIBJPEG
+static int is_raw_format(unsigned int format);
+static int encode_frame(int id);
+#endif
 void cam_cleanup(void *);
 void help(void);
 int input_cmd(int plugin, unsigned int control, unsigned int group, int value, char *value_string);
@@ -215,6 +228,9 @@ int input_init(input_parameter *param, int id)
             {"softfps", required_argument, 0, 0},
             {"timeout", required_argument, 0, 0},
             {"dv_timings", no_argument, 0, 0},
+            {"userptr", no_argument, 0, 0},
+            {"idle", required_argument, 0, 0},
+            {"motion", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -387,6 +403,31 @@ int input_init(input_parameter *param, int id)
             DBG("case 42\n");
             dv_timings = 1;
             break;
+        case 43:
+            DBG("case 43\n");
+            memory = V4L2_MEMORY_USERPTR;
+            break;
+        case 44:
+            DBG("case 44\n");
+            if (strcasecmp("off", optarg) == 0) {
+                idle = IDLE_OFF;
+            } else if (strcasecmp("drop", optarg) == 0) {
+                idle = IDLE_DROP;
+            } else if (strcasecmp("pause", optarg) == 0) {
+                idle = IDLE_PAUSE;
+            } else {
+                fprintf(stderr, "Invalid value '%s' for -idle (off, drop or pause required)\n", optarg);
+                return 1;
+            }
+            break;
+        case 45:
+            DBG("case 45\n");
+            if (motion_init(&pctx->motion, optarg) < 0) {
+                fprintf(stderr, "Invalid value '%s' for -motion\n", optarg);
+                return 1;
+            }
+            pctx->detect = 1;
+            break;
        default:
            DBG("default case\n");
            help();
@@ -448,16 +489,24 @@ int input_init(input_parameter *param, int id)
     DBG("vdIn pn: %d\n", id);
     /* open video device and prepare data structure */
     pctx->videoIn->dv_timings = dv_timings;
+    pctx->videoIn->memory = memory;
     if(init_videoIn(pctx->videoIn, dev, width, height, fps, format, 1, pctx->pglobal, id, tvnorm) < 0) {
         IPRINT("init_VideoIn failed\n");
         closelog();
         exit(EXIT_FAILURE);
     }
 
+    IPRINT("Buffer I/O........: %s\n", pctx->videoIn->memory == V4L2_MEMORY_USERPTR ? "USERPTR" : "MMAP");
+
     if (softfps > 0) {
         IPRINT("Framedrop FPS.....: %d\n", softfps);
     }
 
+    if (pctx->detect) {
+        IPRINT("Motion detection..: %d permille of the macroblocks, threshold %d\n",
+               pctx->motion.trigger, pctx->motion.threshold);
+    }
+
     /*
      * recent linux-uvc driver (revision > ~#125) requires to use dynctrls
      * for pan/tilt/focus/...
@@ -502,6 +551,10 @@ int input_run(int id)
         exit(EXIT_FAILURE);
     }
 
+    #ifndef NO_LIBJPEG
+    in->encode = encode_frame;
+    #endif
+
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     pthread_create(&(pctx->threadID), NULL, cam_thread, in);
@@ -551,6 +604,11 @@ void help(void)
     "                          set your camera to its maximum fps to avoid stuttering\n" \
     " [-timeout] ............: Timeout for device querying (seconds)\n" \
     " [-dv_timings] .........: Enable DV timings queriyng and events processing\n" \
+    " [-userptr] ............: Capture into user allocated buffers (V4L2_MEMORY_USERPTR)\n" \
+    "                          instead of copying out of mmap()ed driver buffers\n" \
+    " [-idle] ...............: while no output wants frames \"drop\" them or\n" \
+    "                          \"pause\" streaming, default: \"off\"\n" \
+    MOTION_HELP \
     " ---------------------------------------------------------------\n");
 
     fprintf(stderr, "\n"\
@@ -585,7 +643,8 @@ void *cam_thread(void *arg)
     context_settings *settings = pcontext->init_settings;
     
     unsigned int every_count = 0;
-    int quality = settings->quality;
+    long resume_latency = 0;
+    pcontext->quality = settings->quality;
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(cam_cleanup, in);
@@ -678,6 +737,13 @@ void *cam_thread(void *arg)
             usleep(1); // maybe not the best way so FIXME
         }
 
+        /* nobody wants frames, stop streaming until somebody does */
+        if (idle == IDLE_PAUSE && in->consumers == 0) {
+            if (wait_for_consumers(in) < 0) {
+                goto endloop;
+            }
+        }
+
         fd_set rd_fds; // for capture
         fd_set ex_fds; // for capture
         fd_set wr_fds; // for output
@@ -724,6 +790,12 @@ void *cam_thread(void *arg)
                 goto endloop;
             }
 
+            if (idle == IDLE_DROP && in->consumers == 0) {
+                DBG("dropping frame, no consumers\n");
+                pcontext->idle = 1;
+                goto other_select_handlers;
+            }
+
             if ( every_count < every - 1 ) {
                 DBG("dropping %d frame for every=%d\n", every_count + 1, every);
                 ++every_count;
@@ -741,7 +813,7 @@ void *cam_thread(void *arg)
              * For example a VGA (640x480) webcam picture is normally >= 8kByte large,
              * corrupted frames are smaller.
              */
-            if(pcontext->videoIn->tmpbytesused < minimum_size) {
+            if(pcontext->videoIn->tmpbytesused == 0 || pcontext->videoIn->tmpbytesused < minimum_size) {
                 DBG("dropping too small frame, assuming it as broken\n");
                 goto other_select_handlers;
             }
@@ -769,45 +841,101 @@ void *cam_thread(void *arg)
                 DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
             }
 
-            /* copy JPG picture to global buffer */
-            pthread_mutex_lock(&pglobal->in[pcontext->id].db);
-
             /*
-             * If capturing in YUV mode convert to JPEG now.
-             * This compression requires many CPU cycles, so try to avoid YUV format.
-             * Getting JPEGs straight from the webcam, is one of the major advantages of
-             * Linux-UVC compatible devices.
+             * If capturing in YUV mode the frame is published uncompressed
+             * together with its JPEG. The JPEG is compressed before the lock
+             * is taken, and only while outputs are subscribed, otherwise
+             * encode_frame() does it if an output asks for it after all.
+             * This compression requires many CPU cycles, so
+             * try to avoid YUV format unless the outputs want the pixels.
+             * Getting JPEGs straight from the webcam, is one of the major
+             * advantages of Linux-UVC compatible devices.
              */
             #ifndef NO_LIBJPEG
-            if ((pcontext->videoIn->formatIn == V4L2_PIX_FMT_YUYV) ||
-            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_UYVY) ||
-            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB24) ||
-            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ) {
-                DBG("compressing frame from input: %d\n", (int)pcontext->id);
-                pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
+            if (is_raw_format(pcontext->videoIn->formatIn)) {
+                /* copy it to the spare buffer while the lock is not held */
+                int next = pcontext->raw_next, jpeg_size = 0;
+                if (pcontext->raw_size[next] < pcontext->videoIn->framesizeIn) {
+                    free(pcontext->raw[next]);
+                    pcontext->raw_size[next] = pcontext->videoIn->framesizeIn;
+                    pcontext->raw[next] = malloc(pcontext->raw_size[next]);
+                    if (pcontext->raw[next] == NULL) {
+                        pcontext->raw_size[next] = 0;
+                        IPRINT("not enough memory for the raw frame\n");
+                        goto endloop;
+                    }
+                }
+                memcpy(pcontext->raw[next], pcontext->videoIn->frameptr, pcontext->videoIn->framesizeIn);
+                detect_motion(pcontext, pcontext->raw[next]);
+
+                if (in->jpeg_consumers > 0) {
+                    if (pcontext->jpeg_capacity < pcontext->videoIn->framesizeIn) {
+                        free(pcontext->jpeg);
+                        pcontext->jpeg_capacity = pcontext->videoIn->framesizeIn;
+                        pcontext->jpeg = malloc(pcontext->jpeg_capacity);
+                        if (pcontext->jpeg == NULL) {
+                            pcontext->jpeg_capacity = 0;
+                            IPRINT("not enough memory for the JPEG\n");
+                            goto endloop;
+                        }
+                    }
+                    jpeg_size = compress_frame_to_jpeg(pcontext->raw[next], pcontext->videoIn->formatIn,
+                                                       pcontext->videoIn->width, pcontext->videoIn->height,
+                                                       pcontext->jpeg, pcontext->jpeg_capacity, pcontext->quality);
+                }
+
+                pthread_mutex_lock(&pglobal->in[pcontext->id].db);
+                DBG("publishing raw frame from input: %d\n", (int)pcontext->id);
+                pglobal->in[pcontext->id].raw.format = pcontext->videoIn->formatIn;
+                pglobal->in[pcontext->id].raw.width = pcontext->videoIn->width;
+                pglobal->in[pcontext->id].raw.height = pcontext->videoIn->height;
+                pglobal->in[pcontext->id].raw.planes = 1;
+                pglobal->in[pcontext->id].raw.plane[0] = pcontext->raw[next];
+                pglobal->in[pcontext->id].raw.stride[0] = pcontext->videoIn->framesizeIn / pcontext->videoIn->height;
+                if (jpeg_size > 0) {
+                    memcpy(pglobal->in[pcontext->id].buf, pcontext->jpeg, jpeg_size);
+                    pglobal->in[pcontext->id].size = jpeg_size;
+                    pglobal->in[pcontext->id].jpeg_ready = 1;
+                } else {
+                    pglobal->in[pcontext->id].size = 0;
+                    pglobal->in[pcontext->id].jpeg_ready = 0;
+                }
                 /* copy this frame's timestamp to user space */
                 pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
+                pcontext->raw_next ^= 1;
             } else {
             #endif
+                detect_motion(pcontext, pcontext->videoIn->frameptr);
+
+                /* copy JPG picture to global buffer */
+                pthread_mutex_lock(&pglobal->in[pcontext->id].db);
                 DBG("copying frame from input: %d\n", (int)pcontext->id);
-                pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
+                pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->frameptr, pcontext->videoIn->tmpbytesused);
+                pglobal->in[pcontext->id].raw.format = 0;
+                pglobal->in[pcontext->id].jpeg_ready = 1;
                 /* copy this frame's timestamp to user space */
                 pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
             #ifndef NO_LIBJPEG
             }
             #endif
+            in->sequence++;
 
-#if 0
-            /* motion detection can be done just by comparing the picture size, but it is not very accurate!! */
-            if((prev_size - global->size)*(prev_size - global->size) > 4 * 1024 * 1024) {
-                DBG("motion detected (delta: %d kB)\n", (prev_size - global->size) / 1024);
+            if (pcontext->detect) {
+                motion_publish(&pcontext->motion, &in->motion);
+            }
+
+            if (pcontext->idle) {
+                resume_latency = input_resume_latency(in);
             }
-            prev_size = global->size;
-#endif
 
             /* signal fresh_frame */
             pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
             pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+
+            if (pcontext->idle) {
+                IPRINT("resumed from idle after %ld ms\n", resume_latency);
+                pcontext->idle = 0;
+            }
         }
 
 other_select_handlers:
@@ -834,6 +962,104 @@ endloop:
     return NULL;
 }
 
+static void unlock_db(void *arg)
+{
+    pthread_mutex_unlock(&((input*)arg)->db);
+}
+
+/******************************************************************************
+Description.: stops streaming while no output is subscribed to the frames
+Input Value.: in is the input
+Return Value: 0 once streaming is back on, -1 on error
+******************************************************************************/
+static int wait_for_consumers(input *in)
+{
+    context *pctx = (context*)in->context;
+
+    IPRINT("no consumers, pausing the stream\n");
+    if (video_pause(pctx->videoIn) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&in->db);
+    pthread_cleanup_push(unlock_db, in);
+    while (in->consumers == 0 && !pglobal->stop) {
+        pthread_cond_wait(&in->consumers_changed, &in->db);
+    }
+    pthread_cleanup_pop(1);
+
+    pctx->idle = 1;
+    return video_resume(pctx->videoIn);
+}
+
+/******************************************************************************
+Description.: runs the motion detection on the grabbed frame, outside of the
+              db lock. JPEGs are read in the DCT domain, YUV frames on their
+              luma and RGB24 frames on the green channel
+Input Value.: pctx is the camera, frame the picture in the format of the device
+Return Value: -
+******************************************************************************/
+static void detect_motion(context *pctx, const unsigned char *frame)
+{
+    struct vdIn *vd = pctx->videoIn;
+
+    if (!pctx->detect) {
+        return;
+    }
+
+    switch (vd->formatIn) {
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_JPEG:
+        motion_feed_jpeg(&pctx->motion, frame, vd->tmpbytesused);
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        motion_feed_luma(&pctx->motion, frame, 2, vd->framesizeIn / vd->height, vd->width, vd->height);
+        break;
+    case V4L2_PIX_FMT_UYVY:
+        motion_feed_luma(&pctx->motion, frame + 1, 2, vd->framesizeIn / vd->height, vd->width, vd->height);
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        motion_feed_luma(&pctx->motion, frame + 1, 3, vd->framesizeIn / vd->height, vd->width, vd->height);
+        break;
+    default:
+        pctx->motion.score = -1;
+        break;
+    }
+}
+
+#ifndef NO_LIBJPEG
+/******************************************************************************
+Description.: tells if frames of this format are published uncompressed
+Input Value.: V4L2_PIX_FMT_* of the device
+Return Value: 1 if compress_frame_to_jpeg() can encode them, 0 otherwise
+******************************************************************************/
+static int is_raw_format(unsigned int format)
+{
+    return format == V4L2_PIX_FMT_YUYV ||
+           format == V4L2_PIX_FMT_UYVY ||
+           format == V4L2_PIX_FMT_RGB24 ||
+           format == V4L2_PIX_FMT_RGB565;
+}
+
+/******************************************************************************
+Description.: compresses the published raw frame, input_jpeg() calls this
+              with the db mutex held the first time the JPEG is needed, which
+              only happens for frames published while no output was
+              subscribed
+Input Value.: id of the input
+Return Value: size of the JPEG in buf
+******************************************************************************/
+static int encode_frame(int id)
+{
+    input *in = &pglobal->in[id];
+    context *pctx = (context*)in->context;
+
+    DBG("compressing frame from input: %d\n", id);
+    return compress_frame_to_jpeg(in->raw.plane[0], in->raw.format, in->raw.width, in->raw.height,
+                                  in->buf, pctx->videoIn->framesizeIn, pctx->quality);
+}
+#endif
+
 /******************************************************************************
 Description.:
 Input Value.:
@@ -853,9 +1079,23 @@ void cam_cleanup(void *arg)
         pctx->videoIn = NULL;
     }
     
+    pthread_mutex_lock(&in->db);
     free(in->buf);
     in->buf = NULL;
     in->size = 0;
+    in->raw.format = 0;
+    in->jpeg_ready = 1;
+    pthread_mutex_unlock(&in->db);
+
+    free(pctx->raw[0]);
+    free(pctx->raw[1]);
+    pctx->raw[0] = pctx->raw[1] = NULL;
+    pctx->raw_size[0] = pctx->raw_size[1] = 0;
+    free(pctx->jpeg);
+    pctx->jpeg = NULL;
+    pctx->jpeg_capacity = 0;
+
+    motion_free(&pctx->motion);
 }
 
 /******************************************************************************
@@ -31,6 +31,7 @@
 #include <linux/videodev2.h>
 
 #include "v4l2uvc.h"
+#include "jpeg_utils.h"
 
 #define OUTPUT_BUF_SIZE  4096
 
@@ -139,24 +140,36 @@ Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersiz
 Return Value: the buffer will contain the compressed data
 ******************************************************************************/
 int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
+{
+    return compress_frame_to_jpeg(vd->frameptr, vd->formatIn, vd->width, vd->height, buffer, size, quality);
+}
+
+/******************************************************************************
+Description.: same as above, but for a frame that is not the last grabbed one
+Input Value.: frame, its V4L2_PIX_FMT_* format and size, destination buffer,
+              buffersize and quality
+Return Value: number of bytes written to buffer
+******************************************************************************/
+int compress_frame_to_jpeg(const unsigned char *frame, unsigned int format, int width, int height, unsigned char *buffer, int size, int quality)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
+    unsigned char *line_buffer;
+    const unsigned char *yuyv;
     int z;
-    static int written;
+    int written;
 
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
+    line_buffer = calloc(width * 3, 1);
+    yuyv = frame;
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
     /* jpeg_stdio_dest (&cinfo, file); */
     dest_buffer(&cinfo, buffer, size, &written);
 
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
     cinfo.input_components = 3;
     cinfo.in_color_space = JCS_RGB;
 
@@ -166,13 +179,13 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
     jpeg_start_compress(&cinfo, TRUE);
 
     z = 0;
-    if (vd->formatIn == V4L2_PIX_FMT_YUYV) {
-        while(cinfo.next_scanline < vd->height) {
+    if (format == V4L2_PIX_FMT_YUYV) {
+        while(cinfo.next_scanline < height) {
             int x;
             unsigned char *ptr = line_buffer;
 
 
-            for(x = 0; x < vd->width; x++) {
+            for(x = 0; x < width; x++) {
                 int r, g, b;
                 int y, u, v;
 
@@ -200,12 +213,12 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
             row_pointer[0] = line_buffer;
             jpeg_write_scanlines(&cinfo, row_pointer, 1);
         }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB24) {
-        while(cinfo.next_scanline < vd->height) {
+    } else if (format == V4L2_PIX_FMT_RGB24) {
+        while(cinfo.next_scanline < height) {
             int x;
             unsigned char *ptr = line_buffer;
 
-            for(x = 0; x < vd->width; x++) {
+            for(x = 0; x < width; x++) {
                 *(ptr++) = yuyv[0];
                 *(ptr++) = yuyv[1];
                 *(ptr++) = yuyv[2];
@@ -215,12 +228,12 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
             row_pointer[0] = line_buffer;
             jpeg_write_scanlines(&cinfo, row_pointer, 1);
         }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB565) {
-        while(cinfo.next_scanline < vd->height) {
+    } else if (format == V4L2_PIX_FMT_RGB565) {
+        while(cinfo.next_scanline < height) {
             int x;
             unsigned char *ptr = line_buffer;
 
-            for(x = 0; x < vd->width; x++) {
+            for(x = 0; x < width; x++) {
                 /*
                 unsigned int tb = ((unsigned char)raw[i+1] << 8) + (unsigned char)raw[i];
                 r =  ((unsigned char)(raw[i+1]) & 248);
@@ -237,13 +250,13 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
             row_pointer[0] = line_buffer;
             jpeg_write_scanlines(&cinfo, row_pointer, 1);
         }
-    }  else if (vd->formatIn == V4L2_PIX_FMT_UYVY) {
-        while(cinfo.next_scanline < vd->height) {
+    }  else if (format == V4L2_PIX_FMT_UYVY) {
+        while(cinfo.next_scanline < height) {
             int x;
             unsigned char *ptr = line_buffer;
 
 
-            for(x = 0; x < vd->width; x++) {
+            for(x = 0; x < width; x++) {
                 int r, g, b;
                 int y, u, v;
 
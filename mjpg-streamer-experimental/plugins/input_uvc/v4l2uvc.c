@@ -26,7 +26,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include "v4l2uvc.h"
-#include "huffman.h"
+#include "../jpeg_tools.h"
 #include "dynctrl.h"
 
 static int debug = 0;
@@ -255,6 +255,7 @@ static int init_framebuffer(struct vdIn *vd) {
             fprintf(stderr, "Unknown vd->formatIn\n");
             return -1;
     }
+    vd->frameptr = vd->tmpbuffer ? vd->tmpbuffer : vd->framebuffer;
     return -!vd->framebuffer;
 }
 
@@ -267,6 +268,45 @@ static void free_framebuffer(struct vdIn *vd) {
     vd->framebuffer = NULL;
 }
 
+/******************************************************************************
+Description.: hands buffer "index" back to the driver
+Input Value.: vd is the device, index the buffer number
+Return Value: result of the VIDIOC_QBUF ioctl
+******************************************************************************/
+static int queue_buffer(struct vdIn *vd, int index)
+{
+    memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
+    vd->buf.index = index;
+    vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vd->buf.memory = vd->memory;
+    if(vd->memory == V4L2_MEMORY_USERPTR) {
+        vd->buf.m.userptr = (unsigned long) vd->mem[index];
+        vd->buf.length = vd->memlength[index];
+    }
+    return xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
+}
+
+/******************************************************************************
+Description.: unmaps (MMAP) or frees (USERPTR) the capture buffers
+Input Value.: vd is the device, streaming must already be stopped
+Return Value: -
+******************************************************************************/
+static void release_buffers(struct vdIn *vd)
+{
+    int i;
+    for(i = 0; i < NB_BUFFER; i++) {
+        if(vd->mem[i] == NULL || vd->mem[i] == MAP_FAILED)
+            continue;
+        if(vd->memory == V4L2_MEMORY_USERPTR)
+            free(vd->mem[i]);
+        else
+            munmap(vd->mem[i], vd->memlength[i]);
+        vd->mem[i] = NULL;
+    }
+    vd->heldbuffer = -1;
+    vd->frameptr = NULL;
+}
+
 static int init_v4l2(struct vdIn *vd)
 {
     int i;
@@ -429,55 +469,82 @@ static int init_v4l2(struct vdIn *vd)
     /*
      * request buffers
      */
+    if(vd->memory != V4L2_MEMORY_USERPTR)
+        vd->memory = V4L2_MEMORY_MMAP;
+
     memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
     vd->rb.count = NB_BUFFER;
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->rb.memory = V4L2_MEMORY_MMAP;
+    vd->rb.memory = vd->memory;
 
     ret = xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb);
+    if(ret < 0 && vd->memory == V4L2_MEMORY_USERPTR) {
+        fprintf(stderr, " i: %s does not support USERPTR i/o, falling back to MMAP\n", vd->videodevice);
+        vd->memory = V4L2_MEMORY_MMAP;
+        vd->rb.count = NB_BUFFER;
+        vd->rb.memory = V4L2_MEMORY_MMAP;
+        ret = xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb);
+    }
     if(ret < 0) {
         perror("Unable to allocate buffers");
         goto fatal;
     }
 
-    /*
-     * map the buffers
-     */
-    for(i = 0; i < NB_BUFFER; i++) {
-        memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-        vd->buf.index = i;
-        vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vd->buf.memory = V4L2_MEMORY_MMAP;
-        ret = xioctl(vd->fd, VIDIOC_QUERYBUF, &vd->buf);
-        if(ret < 0) {
-            perror("Unable to query buffer");
-            goto fatal;
+    vd->heldbuffer = -1;
+    if(vd->memory == V4L2_MEMORY_USERPTR) {
+        /*
+         * allocate the buffers ourselves, the driver DMAs the frames straight
+         * into them and the grabber hands them out without an extra copy
+         */
+        long pagesize = sysconf(_SC_PAGESIZE);
+        size_t length = (vd->fmt.fmt.pix.sizeimage + pagesize - 1) & ~(pagesize - 1);
+
+        for(i = 0; i < NB_BUFFER; i++) {
+            if(posix_memalign(&vd->mem[i], pagesize, length) != 0) {
+                vd->mem[i] = NULL;
+                perror("Unable to allocate user buffer");
+                goto fatal;
+            }
+            vd->memlength[i] = length;
+            if(debug)
+                fprintf(stderr, "User buffer %d allocated at address %p, length: %zu.\n", i, vd->mem[i], length);
         }
+    } else {
+        /*
+         * map the buffers
+         */
+        for(i = 0; i < NB_BUFFER; i++) {
+            memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
+            vd->buf.index = i;
+            vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            vd->buf.memory = V4L2_MEMORY_MMAP;
+            ret = xioctl(vd->fd, VIDIOC_QUERYBUF, &vd->buf);
+            if(ret < 0) {
+                perror("Unable to query buffer");
+                goto fatal;
+            }
 
-        if(debug)
-            fprintf(stderr, "length: %u offset: %u\n", vd->buf.length, vd->buf.m.offset);
+            if(debug)
+                fprintf(stderr, "length: %u offset: %u\n", vd->buf.length, vd->buf.m.offset);
 
-        vd->mem[i] = mmap(0 /* start anywhere */ ,
-                          vd->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
-                          vd->buf.m.offset);
-        if(vd->mem[i] == MAP_FAILED) {
-            perror("Unable to map buffer");
-            goto fatal;
+            vd->mem[i] = mmap(0 /* start anywhere */ ,
+                              vd->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
+                              vd->buf.m.offset);
+            if(vd->mem[i] == MAP_FAILED) {
+                perror("Unable to map buffer");
+                goto fatal;
+            }
+            vd->memlength[i] = vd->buf.length;
+            if(debug)
+                fprintf(stderr, "Buffer mapped at address %p.\n", vd->mem[i]);
         }
-        if(debug)
-            fprintf(stderr, "Buffer mapped at address %p.\n", vd->mem[i]);
     }
 
     /*
      * Queue the buffers.
      */
     for(i = 0; i < NB_BUFFER; ++i) {
-        memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-        vd->buf.index = i;
-        vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vd->buf.memory = V4L2_MEMORY_MMAP;
-        ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-        if(ret < 0) {
+        if(queue_buffer(vd, i) < 0) {
             perror("Unable to queue buffer");
             goto fatal;;
         }
@@ -518,6 +585,38 @@ static int video_disable(struct vdIn *vd, streaming_state disabledState)
     return 0;
 }
 
+/******************************************************************************
+Description.: stops streaming but keeps the buffers, see video_resume()
+Input Value.: vd is the device
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int video_pause(struct vdIn *vd)
+{
+    if(video_disable(vd, STREAMING_PAUSED) < 0)
+        return -1;
+    /* STREAMOFF took every buffer away from the driver, including a held one */
+    vd->heldbuffer = -1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: hands all buffers back to the driver and restarts streaming
+Input Value.: vd is the device
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int video_resume(struct vdIn *vd)
+{
+    int i;
+
+    for(i = 0; i < NB_BUFFER; i++) {
+        if(queue_buffer(vd, i) < 0) {
+            perror("Unable to queue buffer");
+            return -1;
+        }
+    }
+    return video_enable(vd);
+}
+
 int video_set_dv_timings(struct vdIn *vd)
 {
     struct v4l2_dv_timings timings;
@@ -567,51 +666,22 @@ int video_handle_event(struct vdIn *vd)
 }
 
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
-******************************************************************************/
-int is_huffman(unsigned char *buf)
-{
-    unsigned char *ptbuf;
-    int i = 0;
-    ptbuf = buf;
-    while(((ptbuf[0] << 8) | ptbuf[1]) != 0xffda) {
-        if(i++ > 2048)
-            return 0;
-        if(((ptbuf[0] << 8) | ptbuf[1]) == 0xffc4)
-            return 1;
-        ptbuf++;
-    }
-    return 0;
-}
-
-/******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: copies a frame of the camera, MJPEG cameras leave out the
+              Huffman tables, the standard ones are put in front of the frame
+              header then
+Input Value.: out is the buffer, it needs room for the tables too, buf and
+              size the frame
+Return Value: size of the copy
 ******************************************************************************/
 int memcpy_picture(unsigned char *out, unsigned char *buf, int size)
 {
-    unsigned char *ptdeb, *ptlimit, *ptcur = buf;
-    int sizein, pos = 0;
-
-    if(!is_huffman(buf)) {
-        ptdeb = ptcur = buf;
-        ptlimit = buf + size;
-        while((((ptcur[0] << 8) | ptcur[1]) != 0xffc0) && (ptcur < ptlimit))
-            ptcur++;
-        if(ptcur >= ptlimit)
-            return pos;
-        sizein = ptcur - ptdeb;
-
-        memcpy(out + pos, buf, sizein); pos += sizein;
-        memcpy(out + pos, dht_data, sizeof(dht_data)); pos += sizeof(dht_data);
-        memcpy(out + pos, ptcur, size - sizein); pos += size - sizein;
-    } else {
-        memcpy(out + pos, ptcur, size); pos += size;
-    }
-    return pos;
+    jpeg_splice splice;
+    jpeg_info info;
+
+    jpeg_splice_init(&splice, buf, size);
+    if(jpeg_parse_header(buf, size, &info) == 0 && info.dht_segments == 0)
+        jpeg_splice_insert(&splice, info.sof_offset, jpeg_std_dht, sizeof(jpeg_std_dht));
+    return jpeg_splice_copy(&splice, out);
 }
 
 int uvcGrab(struct vdIn *vd)
@@ -623,9 +693,20 @@ int uvcGrab(struct vdIn *vd)
         if(video_enable(vd))
             goto err;
     }
+
+    /* the frame of the previous grab has been consumed, return its buffer */
+    if(vd->heldbuffer >= 0) {
+        ret = queue_buffer(vd, vd->heldbuffer);
+        vd->heldbuffer = -1;
+        if(ret < 0) {
+            perror("Unable to requeue buffer");
+            goto err;
+        }
+    }
+
     memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->buf.memory = V4L2_MEMORY_MMAP;
+    vd->buf.memory = vd->memory;
 
     ret = xioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
     if(ret < 0) {
@@ -641,17 +722,27 @@ int uvcGrab(struct vdIn *vd)
             /* Prevent crash
              * on empty image */
             fprintf(stderr, "Ignoring empty buffer ...\n");
+            /* frameptr may still point at the buffer of the previous grab,
+               which is back with the driver, the caller skips this one */
+            vd->tmpbytesused = 0;
             break;
         }
 
         /* memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
 
         memcpy (vd->tmpbuffer, vd->mem[vd->buf.index], HEADERFRAME1);
-        memcpy (vd->tmpbuffer + HEADERFRAME1, dht_data, sizeof(dht_data));
-        memcpy (vd->tmpbuffer + HEADERFRAME1 + sizeof(dht_data), vd->mem[vd->buf.index] + HEADERFRAME1, (vd->buf.bytesused - HEADERFRAME1));
+        memcpy (vd->tmpbuffer + HEADERFRAME1, jpeg_std_dht, sizeof(jpeg_std_dht));
+        memcpy (vd->tmpbuffer + HEADERFRAME1 + sizeof(jpeg_std_dht), vd->mem[vd->buf.index] + HEADERFRAME1, (vd->buf.bytesused - HEADERFRAME1));
         */
 
-        memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+        if(vd->memory == V4L2_MEMORY_USERPTR) {
+            /* keep the buffer dequeued until the next grab instead of copying it */
+            vd->frameptr = vd->mem[vd->buf.index];
+            vd->heldbuffer = vd->buf.index;
+        } else {
+            memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+            vd->frameptr = vd->tmpbuffer;
+        }
         vd->tmpbytesused = vd->buf.bytesused;
         vd->tmptimestamp = vd->buf.timestamp;
 
@@ -663,10 +754,15 @@ int uvcGrab(struct vdIn *vd)
     case V4L2_PIX_FMT_RGB565:
     case V4L2_PIX_FMT_YUYV:
     case V4L2_PIX_FMT_UYVY:
-        if(vd->buf.bytesused > vd->framesizeIn) {
+        if(vd->memory == V4L2_MEMORY_USERPTR && vd->buf.bytesused >= vd->framesizeIn) {
+            vd->frameptr = vd->mem[vd->buf.index];
+            vd->heldbuffer = vd->buf.index;
+        } else if(vd->buf.bytesused > vd->framesizeIn) {
             memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->framesizeIn);
+            vd->frameptr = vd->framebuffer;
         } else {
             memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->buf.bytesused);
+            vd->frameptr = vd->framebuffer;
         }
         vd->tmpbytesused = vd->buf.bytesused;
         vd->tmptimestamp = vd->buf.timestamp;
@@ -676,10 +772,12 @@ int uvcGrab(struct vdIn *vd)
         break;
     }
 
-    ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-    if(ret < 0) {
-        perror("Unable to requeue buffer");
-        goto err;
+    if(vd->heldbuffer < 0) {
+        ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
+        if(ret < 0) {
+            perror("Unable to requeue buffer");
+            goto err;
+        }
     }
 
     return 0;
@@ -693,6 +791,7 @@ int close_v4l2(struct vdIn *vd)
 {
     if(vd->streamingState == STREAMING_ON)
         video_disable(vd, STREAMING_OFF);
+    release_buffers(vd);
     free_framebuffer(vd);
     free(vd->videodevice);
     free(vd->status);
@@ -976,10 +1075,7 @@ int setResolution(struct vdIn *vd, int width, int height)
     }
 
     DBG("Unmap buffers\n");
-    int i;
-    for (i = 0; i < NB_BUFFER; i++) {
-        munmap(vd->mem[i], vd->buf.length);
-    }
+    release_buffers(vd);
 
     if (CLOSE_VIDEO(vd->fd) == 0) {
         DBG("Device closed successfully\n");
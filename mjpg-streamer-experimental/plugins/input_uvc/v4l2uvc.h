@@ -41,6 +41,7 @@
 #include <linux/videodev2.h>
 
 #include "../../mjpg_streamer.h"
+#include "../motion.h"
 #define NB_BUFFER 4
 
 
@@ -83,6 +84,10 @@ struct vdIn {
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers rb;
     void *mem[NB_BUFFER];
+    size_t memlength[NB_BUFFER];
+    enum v4l2_memory memory;     // V4L2_MEMORY_MMAP (default) or V4L2_MEMORY_USERPTR
+    int heldbuffer;              // USERPTR: index of the dequeued buffer frameptr points into, or -1
+    unsigned char *frameptr;     // data of the last grabbed frame (tmpbuffer, framebuffer or a USERPTR buffer)
     unsigned char *tmpbuffer;
     unsigned char *framebuffer;
     streaming_state streamingState;
@@ -144,6 +149,21 @@ typedef struct {
     pthread_mutex_t controls_mutex;
     struct vdIn *videoIn;
     context_settings *init_settings;
+
+    /* uncompressed frames are published from these alternately, they get
+       compressed into jpeg before the lock is taken while outputs are
+       subscribed, otherwise only if an output asks for the JPEG */
+    unsigned char *raw[2];
+    int raw_size[2];
+    int raw_next;
+    unsigned char *jpeg;
+    int jpeg_capacity;
+    int quality;
+
+    int idle; // set while no frames got published for lack of consumers
+
+    int detect; // -motion was given
+    motion_detector motion;
 } context;
 
 int init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd);
@@ -156,6 +176,8 @@ int uvcGrab(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
 int video_enable(struct vdIn *vd);
+int video_pause(struct vdIn *vd);
+int video_resume(struct vdIn *vd);
 int video_set_dv_timings(struct vdIn *vd);
 int video_handle_event(struct vdIn *vd);
 
@@ -0,0 +1,326 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "jpeg_decoder.h"
+#include "jpeg_tools.h"
+
+/******************************************************************************
+Description.: builds the decoding tables of a DHT entry, unless they were
+              built from the same entry before
+Input Value.: decoder, h is the table, counts the 16 code counts followed by
+              the symbols, as jpeg_parse_dht() found them
+Return Value: 0 if ok, -1 if the table is broken
+******************************************************************************/
+static int build_huffman(jpeg_decoder *d, jpeg_huffman *h, const unsigned char *counts)
+{
+    int len, i, k = 0, code = 0, total = 0;
+
+    for(len = 0; len < 16; len++)
+        total += counts[len];
+    if(h->source_size == 16 + total && memcmp(h->source, counts, 16 + total) == 0)
+        return 0;
+
+    h->source_size = 0;
+    memset(h->fast_len, 0, sizeof(h->fast_len));
+    memcpy(h->symbols, counts + 16, total);
+
+    for(len = 1; len <= 16; len++) {
+        h->valptr[len] = k;
+        h->mincode[len] = code;
+        for(i = 0; i < counts[len - 1]; i++, k++, code++) {
+            if(code >= (1 << len))
+                return -1;
+            if(len <= JPEG_LOOKUP_BITS) {
+                int shift = JPEG_LOOKUP_BITS - len, j;
+                for(j = 0; j < (1 << shift); j++) {
+                    h->fast_len[(code << shift) | j] = len;
+                    h->fast_sym[(code << shift) | j] = h->symbols[k];
+                }
+            }
+        }
+        h->maxcode[len] = counts[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    /* an AC code and the bits of its value, where both fit into the lookup */
+    for(i = 0; i < (1 << JPEG_LOOKUP_BITS); i++) {
+        int rs = h->fast_sym[i], len = h->fast_len[i], s = rs & 15;
+        jpeg_fast_ac *f = &h->fast_ac[i];
+
+        memset(f, 0, sizeof(*f));
+        if(len == 0 || len + s > JPEG_LOOKUP_BITS || (s == 0 && rs != 0x00 && rs != 0xf0))
+            continue;
+        f->bits = len + s;
+        if(rs == 0x00) {
+            f->advance = 64;                            // end of block
+        } else if(rs == 0xf0) {
+            f->advance = 16;                            // sixteen zeros
+        } else {
+            int v = (i >> (JPEG_LOOKUP_BITS - len - s)) & ((1 << s) - 1);
+            if(v < (1 << (s - 1)))
+                v -= (1 << s) - 1;
+            f->advance = (rs >> 4) + 1;
+            f->value = v;
+        }
+    }
+
+    memcpy(h->source, counts, 16 + total);
+    h->source_size = 16 + total;
+    d->tables_built++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the headers of a frame up to its entropy coded data
+Input Value.: decoder, JPEG and its size
+Return Value: 0 if the MCUs can be decoded now, -1 if the frame is broken or
+              not baseline, e.g. progressive
+******************************************************************************/
+int jpeg_decoder_open(jpeg_decoder *d, const unsigned char *jpeg, int size)
+{
+    jpeg_info info;
+    int i, n;
+
+    if(jpeg_parse_header(jpeg, size, &info) < 0 || (info.sof != JPEG_SOF0 && info.sof != JPEG_SOF1) ||
+       info.precision != 8 || info.width < 1 || info.height < 1)
+        return -1;
+
+    /* cameras may leave out the DHT, which means the standard tables */
+    if(info.dht[0][0] == NULL && jpeg_parse_dht(jpeg_std_dht + 4, sizeof(jpeg_std_dht) - 4, info.dht) < 0)
+        return -1;
+
+    d->width = info.width;
+    d->height = info.height;
+    d->ncomp = info.components;
+    d->hmax = d->vmax = 1;
+    for(i = 0; i < d->ncomp; i++) {
+        jpeg_component *c = &d->comp[i];
+        c->id = info.id[i];
+        c->h = info.h[i];
+        c->v = info.v[i];
+        c->tq = info.tq[i];
+        if(c->h > d->hmax) d->hmax = c->h;
+        if(c->v > d->vmax) d->vmax = c->v;
+    }
+    for(i = 0; i < 4; i++) {
+        const unsigned char *q = info.dqt[i];
+        for(n = 0; q != NULL && n < 64; n++)
+            d->quant[i][n] = info.dqt_precision[i] ? (q[2 * n] << 8) | q[2 * n + 1] : q[n];
+    }
+    d->restart_interval = info.restart_interval;
+
+    d->ns = info.scan_components;
+    for(n = 0; n < d->ns; n++) {
+        const unsigned char *dc = info.dht[0][info.scan_dc[n]], *ac = info.dht[1][info.scan_ac[n]];
+
+        /* the luma has to come first */
+        if((n == 0) != (info.scan_index[n] == 0) || dc == NULL || ac == NULL)
+            return -1;
+        d->scan_dc[n] = &d->dc[info.scan_dc[n]];
+        d->scan_ac[n] = &d->ac[info.scan_ac[n]];
+        if(build_huffman(d, &d->dc[info.scan_dc[n]], dc) < 0 || build_huffman(d, &d->ac[info.scan_ac[n]], ac) < 0)
+            return -1;
+        d->blocks[n] = d->ns == 1 ? 1 : info.h[info.scan_index[n]] * info.v[info.scan_index[n]];
+        d->pred[n] = 0;
+    }
+
+    if(d->ns == 1) {
+        /* not interleaved, every block is an MCU of its own */
+        jpeg_component *c = &d->comp[0];
+        d->mcux = ((d->width * c->h + d->hmax - 1) / d->hmax + 7) / 8;
+        d->mcuy = ((d->height * c->v + d->vmax - 1) / d->vmax + 7) / 8;
+        d->luma_h = d->luma_v = 1;
+    } else {
+        d->mcux = (d->width + 8 * d->hmax - 1) / (8 * d->hmax);
+        d->mcuy = (d->height + 8 * d->vmax - 1) / (8 * d->vmax);
+        d->luma_h = d->comp[0].h;
+        d->luma_v = d->comp[0].v;
+    }
+    d->mcus = 0;
+
+    d->p = jpeg + info.scan_offset;
+    d->end = jpeg + size;
+    d->acc = 0;
+    d->count = 0;
+    return 0;
+}
+
+/* stops at markers, the decoder then reads zeros */
+static inline void fill_bits(jpeg_decoder *d)
+{
+    while(d->count <= 56) {
+        unsigned int b = 0;
+        if(d->p < d->end) {
+            b = *d->p;
+            if(b == 0xff) {
+                if(d->p + 1 < d->end && d->p[1] == 0x00)
+                    d->p += 2;
+                else
+                    b = 0; // a marker, stay in front of it
+            } else {
+                d->p++;
+            }
+        }
+        d->acc = (d->acc << 8) | b;
+        d->count += 8;
+    }
+}
+
+static inline unsigned int peek_bits(jpeg_decoder *d, int n)
+{
+    return (unsigned int)(d->acc >> (d->count - n)) & ((1u << n) - 1);
+}
+
+/* a value of s bits, sign extended */
+static inline int get_value(jpeg_decoder *d, int s)
+{
+    int v;
+    if(d->count < 16)
+        fill_bits(d);
+    v = peek_bits(d, s);
+    d->count -= s;
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+static inline int decode_huffman(jpeg_decoder *d, const jpeg_huffman *h)
+{
+    unsigned int look;
+    int len;
+
+    if(d->count < 16)
+        fill_bits(d);
+
+    look = peek_bits(d, JPEG_LOOKUP_BITS);
+    if((len = h->fast_len[look]) != 0) {
+        d->count -= len;
+        return h->fast_sym[look];
+    }
+
+    for(len = JPEG_LOOKUP_BITS + 1; len <= 16; len++) {
+        int code = peek_bits(d, len);
+        if(code <= h->maxcode[len]) {
+            d->count -= len;
+            return h->symbols[h->valptr[len] + code - h->mincode[len]];
+        }
+    }
+    return -1;
+}
+
+/******************************************************************************
+Description.: entropy decodes one block
+Input Value.: decoder, the tables of the component, its DC predictor and
+              where the coefficients go in zigzag order, NULL to skip them
+Return Value: 0 if ok, -1 if the data is broken
+******************************************************************************/
+static inline int decode_block(jpeg_decoder *d, const jpeg_huffman *dc, const jpeg_huffman *ac, int *pred, short *coef)
+{
+    int s, k;
+
+    if((s = decode_huffman(d, dc)) < 0 || s > 15)
+        return -1;
+    if(s)
+        *pred += get_value(d, s);
+    if(coef != NULL) {
+        memset(coef, 0, 64 * sizeof(*coef));
+        coef[0] = *pred;
+    }
+
+    for(k = 1; k < 64; ) {
+        const jpeg_fast_ac *f;
+        int rs;
+
+        if(d->count < 16)
+            fill_bits(d);
+        f = &ac->fast_ac[peek_bits(d, JPEG_LOOKUP_BITS)];
+        if(f->bits) {
+            d->count -= f->bits;
+            k += f->advance;
+            if(coef != NULL && f->value) {
+                if(k > 64)
+                    return -1;
+                coef[k - 1] = f->value;
+            }
+            continue;
+        }
+
+        if((rs = decode_huffman(d, ac)) < 0)
+            return -1;
+        s = rs & 15;
+        if(s == 0) {
+            if(rs != 0xf0)
+                break;          // end of block
+            k += 16;
+        } else {
+            k += rs >> 4;
+            if(coef == NULL) {
+                if(d->count < 16)
+                    fill_bits(d);
+                d->count -= s;
+            } else if(k > 63) {
+                return -1;
+            } else {
+                coef[k] = get_value(d, s);
+            }
+            k++;
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: decodes the next MCU of the frame opened last, restart markers
+              are taken care of
+Input Value.: decoder, dc receives the DC coefficient of every luma block,
+              coef the coefficients of every luma block in zigzag order, both
+              quantized, both may be NULL, the blocks are in the order of the
+              MCU, luma_h of them per row
+Return Value: number of luma blocks, -1 if the data is broken
+******************************************************************************/
+int jpeg_decoder_mcu(jpeg_decoder *d, int *dc, short (*coef)[64])
+{
+    int n, b;
+
+    if(d->restart_interval && d->mcus == d->restart_interval) {
+        /* drop the padding bits and step over the RSTn marker */
+        d->count = 0;
+        while(d->p + 1 < d->end && !(d->p[0] == 0xff && d->p[1] >= 0xd0 && d->p[1] <= 0xd7))
+            d->p++;
+        d->p += 2;
+        memset(d->pred, 0, sizeof(d->pred));
+        d->mcus = 0;
+    }
+    d->mcus++;
+
+    for(b = 0; b < d->blocks[0]; b++) {
+        if(decode_block(d, d->scan_dc[0], d->scan_ac[0], &d->pred[0], coef != NULL ? coef[b] : NULL) < 0)
+            return -1;
+        if(dc != NULL)
+            dc[b] = d->pred[0];
+    }
+    for(n = 1; n < d->ns; n++) {
+        for(b = 0; b < d->blocks[n]; b++)
+            if(decode_block(d, d->scan_dc[n], d->scan_ac[n], &d->pred[n], NULL) < 0)
+                return -1;
+    }
+    return d->blocks[0];
+}
@@ -0,0 +1,104 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include <stdint.h>
+
+/*
+ * Entropy decoder for baseline JPEG frames, for the plugins that look at the
+ * DCT coefficients and have no use for pixels. jpeg_decoder_open() reads the
+ * headers of a frame, then jpeg_decoder_mcu() decodes one MCU after the
+ * other, giving the luma coefficients to those who ask for them and skipping
+ * everything else as fast as it can be skipped.
+ *
+ * Huffman codes of up to JPEG_LOOKUP_BITS bits are decoded with one table
+ * lookup, AC coefficients whose code and value fit together in a single
+ * lookup. The tables are kept from frame to frame and only built again when a
+ * DHT differs from the one they were built from, cameras send the same tables
+ * with every frame or none at all. A decoder allocates nothing, zero it to
+ * set it up.
+ */
+
+#define JPEG_LOOKUP_BITS 11
+#define JPEG_MAX_COMPONENTS 4
+#define JPEG_MAX_LUMA_BLOCKS 16         // luma blocks of an MCU, 4x4 sampled
+
+/* an AC code together with its value, bits is 0 where it takes the slow path */
+typedef struct _jpeg_fast_ac jpeg_fast_ac;
+struct _jpeg_fast_ac {
+    unsigned char bits;         // code and value
+    unsigned char advance;      // coefficients the position moves, 64 at the end of the block
+    short value;                // of the last of them, 0 for a run of zeros
+};
+
+typedef struct _jpeg_huffman jpeg_huffman;
+struct _jpeg_huffman {
+    unsigned char fast_len[1 << JPEG_LOOKUP_BITS];      // 0 if the code is longer
+    unsigned char fast_sym[1 << JPEG_LOOKUP_BITS];
+    jpeg_fast_ac fast_ac[1 << JPEG_LOOKUP_BITS];
+    int maxcode[17];            // largest code of each length, -1 if none
+    int mincode[17];
+    int valptr[17];             // index of the first symbol of each length
+    unsigned char symbols[256];
+
+    /* the DHT entry the tables were built from, 0 bytes if none */
+    int source_size;
+    unsigned char source[16 + 256];
+};
+
+typedef struct _jpeg_component jpeg_component;
+struct _jpeg_component {
+    int id, h, v, tq;
+};
+
+typedef struct _jpeg_decoder jpeg_decoder;
+struct _jpeg_decoder {
+    /* the frame opened last */
+    int width, height;
+    int ncomp, hmax, vmax;
+    jpeg_component comp[JPEG_MAX_COMPONENTS];   // the luma is the first one
+    unsigned short quant[4][64];                // in zigzag order
+    int restart_interval;
+    int mcux, mcuy;             // MCUs per row and column
+    int luma_h, luma_v;         // luma blocks per MCU in each direction
+
+    /* Huffman tables built, rather than found unchanged */
+    unsigned int tables_built;
+
+    /* the scan */
+    jpeg_huffman dc[4], ac[4];
+    int ns;
+    int blocks[JPEG_MAX_COMPONENTS];
+    const jpeg_huffman *scan_dc[JPEG_MAX_COMPONENTS], *scan_ac[JPEG_MAX_COMPONENTS];
+    int pred[JPEG_MAX_COMPONENTS];
+    int mcus;                   // since the last restart marker
+
+    /* the bit reader */
+    const unsigned char *p, *end;
+    uint64_t acc;
+    int count;                  // valid bits in acc
+};
+
+int jpeg_decoder_open(jpeg_decoder *d, const unsigned char *jpeg, int size);
+int jpeg_decoder_mcu(jpeg_decoder *d, int *dc, short (*coef)[64]);
+
+#endif
@@ -0,0 +1,464 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "jpeg_tools.h"
+
+/* the tables of section K.3 of the standard as a DHT segment, for frames
+   without one, as MJPEG cameras send them */
+const unsigned char jpeg_std_dht[JPEG_STD_DHT_SIZE] = {
+    0xff, 0xc4, 0x01, 0xa2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+    0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x01, 0x00, 0x03,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+    0x0a, 0x0b, 0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05,
+    0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04,
+    0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22,
+    0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15,
+    0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+    0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+    0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95,
+    0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8,
+    0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2,
+    0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5,
+    0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+    0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9,
+    0xfa, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05,
+    0x04, 0x04, 0x00, 0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04,
+    0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33,
+    0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25,
+    0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+    0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+    0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94,
+    0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+    0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+/******************************************************************************
+Description.: finds the next marker of a frame. The entropy coded data behind
+              a SOS is skipped with memchr(), stuffed bytes, fill bytes and
+              restart markers are stepped over
+Input Value.: the JPEG and its size, segment is the one found last, zeroed
+              before the first call, which finds the SOI
+Return Value: 1 if a segment was found, 0 at the end of the frame,
+              -1 if it is not a JPEG or a length runs past the end
+******************************************************************************/
+int jpeg_next_segment(const unsigned char *jpeg, int size, jpeg_segment *segment)
+{
+    const unsigned char *p, *end = jpeg + size, *ff;
+    int marker, length;
+
+    if(segment->marker == 0) {
+        if(size < 2 || jpeg[0] != 0xFF || jpeg[1] != JPEG_SOI)
+            return -1;
+        segment->marker = JPEG_SOI;
+        segment->offset = 0;
+        segment->data = jpeg + 2;
+        segment->length = 0;
+        segment->next = 2;
+        return 1;
+    }
+    if(segment->marker == JPEG_EOI)
+        return 0;
+
+    for(p = jpeg + segment->next; ; p = ff + 1) {
+        if(end - p < 2 || (ff = memchr(p, 0xFF, end - p - 1)) == NULL)
+            return 0;
+        marker = ff[1];
+        if(marker != 0x00 && marker != 0xFF && marker != 0x01 && (marker < 0xD0 || marker > 0xD7))
+            break;
+    }
+
+    segment->marker = marker;
+    segment->offset = ff - jpeg;
+    if(marker == JPEG_SOI || marker == JPEG_EOI) {
+        segment->data = ff + 2;
+        segment->length = 0;
+        segment->next = segment->offset + 2;
+        return 1;
+    }
+
+    if(end - ff < 4)
+        return -1;
+    length = (ff[2] << 8) | ff[3];
+    if(length < 2 || length > end - ff - 2)
+        return -1;
+    segment->data = ff + 4;
+    segment->length = length - 2;
+    segment->next = segment->offset + 2 + length;
+    return 1;
+}
+
+/******************************************************************************
+Description.: finds the tables of a DQT segment
+Input Value.: payload of the segment and its length, tables and precision
+              receive the tables defined
+Return Value: 0 if ok, -1 if the segment is broken
+******************************************************************************/
+int jpeg_parse_dqt(const unsigned char *data, int length, const unsigned char *tables[4], int precision[4])
+{
+    while(length > 0) {
+        int pq = data[0] >> 4, tq = data[0] & 15, size = 1 + 64 * (pq + 1);
+        if(pq > 1 || tq > 3 || size > length)
+            return -1;
+        tables[tq] = data + 1;
+        precision[tq] = pq;
+        data += size;
+        length -= size;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: finds the tables of a DHT segment
+Input Value.: payload of the segment and its length, tables receives the
+              tables defined, [0] the DC and [1] the AC ones
+Return Value: 0 if ok, -1 if the segment is broken
+******************************************************************************/
+int jpeg_parse_dht(const unsigned char *data, int length, const unsigned char *tables[2][4])
+{
+    while(length > 0) {
+        int tc = data[0] >> 4, th = data[0] & 15, total = 0, i;
+        if(tc > 1 || th > 3 || length < 17)
+            return -1;
+        for(i = 1; i <= 16; i++)
+            total += data[i];
+        if(total > 256 || 17 + total > length)
+            return -1;
+        tables[tc][th] = data + 1;
+        data += 17 + total;
+        length -= 17 + total;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads a frame header
+Input Value.: info, the SOFn segment
+Return Value: 0 if ok, -1 if broken
+******************************************************************************/
+static int read_sof(jpeg_info *info, const jpeg_segment *s)
+{
+    const unsigned char *p = s->data;
+    int i;
+
+    if(s->length < 6)
+        return -1;
+    info->sof = s->marker;
+    info->sof_offset = s->offset;
+    info->precision = p[0];
+    info->height = (p[1] << 8) | p[2];
+    info->width = (p[3] << 8) | p[4];
+    info->components = p[5];
+    if(info->components < 1 || info->components > 4 || s->length < 6 + 3 * info->components)
+        return -1;
+
+    for(i = 0; i < info->components; i++) {
+        info->id[i] = p[6 + 3 * i];
+        info->h[i] = p[7 + 3 * i] >> 4;
+        info->v[i] = p[7 + 3 * i] & 15;
+        info->tq[i] = p[8 + 3 * i];
+        if(info->h[i] < 1 || info->h[i] > 4 || info->v[i] < 1 || info->v[i] > 4 || info->tq[i] > 3)
+            return -1;
+    }
+
+    info->subsampling = JPEG_SUBSAMPLING_OTHER;
+    if(info->components == 1) {
+        info->subsampling = JPEG_SUBSAMPLING_GRAY;
+    } else if(info->components == 3 && info->h[1] == 1 && info->v[1] == 1 && info->h[2] == 1 && info->v[2] == 1) {
+        switch(info->h[0] << 4 | info->v[0]) {
+        case 0x11: info->subsampling = JPEG_SUBSAMPLING_444; break;
+        case 0x21: info->subsampling = JPEG_SUBSAMPLING_422; break;
+        case 0x22: info->subsampling = JPEG_SUBSAMPLING_420; break;
+        case 0x41: info->subsampling = JPEG_SUBSAMPLING_411; break;
+        case 0x12: info->subsampling = JPEG_SUBSAMPLING_440; break;
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the header of the first scan
+Input Value.: info, the SOS segment
+Return Value: 0 if ok, -1 if broken
+******************************************************************************/
+static int read_sos(jpeg_info *info, const jpeg_segment *s)
+{
+    const unsigned char *p = s->data;
+    int n, i;
+
+    if(info->sof == 0 || s->length < 1)
+        return -1;
+    info->scan_components = p[0];
+    if(info->scan_components < 1 || info->scan_components > info->components || s->length < 4 + 2 * p[0])
+        return -1;
+
+    for(n = 0; n < info->scan_components; n++) {
+        for(i = 0; i < info->components; i++)
+            if(info->id[i] == p[1 + 2 * n])
+                break;
+        if(i == info->components || (p[2 + 2 * n] >> 4) > 3 || (p[2 + 2 * n] & 15) > 3)
+            return -1;
+        info->scan_index[n] = i;
+        info->scan_dc[n] = p[2 + 2 * n] >> 4;
+        info->scan_ac[n] = p[2 + 2 * n] & 15;
+    }
+
+    info->sos_offset = s->offset;
+    info->scan_offset = s->next;
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the headers of a frame up to its first scan
+Input Value.: the JPEG and its size, info to fill, its pointers point into
+              the frame
+Return Value: 0 if ok, -1 if there is no scan or a header is broken
+******************************************************************************/
+int jpeg_parse_header(const unsigned char *jpeg, int size, jpeg_info *info)
+{
+    jpeg_segment s;
+
+    memset(info, 0, sizeof(*info));
+    memset(&s, 0, sizeof(s));
+
+    while(jpeg_next_segment(jpeg, size, &s) > 0) {
+        switch(s.marker) {
+        case JPEG_DQT:
+            if(jpeg_parse_dqt(s.data, s.length, info->dqt, info->dqt_precision) < 0)
+                return -1;
+            break;
+        case JPEG_DHT:
+            if(jpeg_parse_dht(s.data, s.length, info->dht) < 0)
+                return -1;
+            info->dht_segments++;
+            break;
+        case JPEG_DRI:
+            if(s.length < 2)
+                return -1;
+            info->restart_interval = (s.data[0] << 8) | s.data[1];
+            break;
+        case JPEG_SOS:
+            return read_sos(info, &s);
+        case JPEG_EOI:
+            return -1;
+        default:
+            /* SOF0 to SOF15, but for DHT, JPG and DAC */
+            if((s.marker & 0xF0) == 0xC0 && s.marker != JPEG_DHT && s.marker != 0xC8 && s.marker != 0xCC &&
+               read_sof(info, &s) < 0)
+                return -1;
+            break;
+        }
+    }
+    return -1;
+}
+
+/******************************************************************************
+Description.: checks if a frame is complete, a frame that was cut short lacks
+              the EOI at its end, zeros some cameras pad frames with are
+              ignored
+Input Value.: the JPEG and its size
+Return Value: offset of the EOI marker, -1 if the frame is not complete
+******************************************************************************/
+int jpeg_eoi(const unsigned char *jpeg, int size)
+{
+    int end = size;
+
+    if(size < 4 || jpeg[0] != 0xFF || jpeg[1] != JPEG_SOI)
+        return -1;
+    while(end > 4 && jpeg[end - 1] == 0x00)
+        end--;
+    if(jpeg[end - 2] != 0xFF || jpeg[end - 1] != JPEG_EOI)
+        return -1;
+    return end - 2;
+}
+
+/******************************************************************************
+Description.: tells where an application segment can be put into a frame,
+              behind the SOI and the JFIF or Exif segments that have to come
+              first
+Input Value.: the JPEG and its size
+Return Value: offset, -1 if it is not a JPEG
+******************************************************************************/
+int jpeg_app_offset(const unsigned char *jpeg, int size)
+{
+    jpeg_segment s;
+    int offset;
+
+    memset(&s, 0, sizeof(s));
+    if(jpeg_next_segment(jpeg, size, &s) <= 0)
+        return -1;
+    for(offset = s.next; jpeg_next_segment(jpeg, size, &s) > 0; offset = s.next)
+        if(s.marker != JPEG_APP0 && s.marker != JPEG_APP1)
+            break;
+    return offset;
+}
+
+/******************************************************************************
+Description.: starts a rewrite of a frame, the frame must not change until
+              the splice was written
+Input Value.: splice, the JPEG and its size
+Return Value: -
+******************************************************************************/
+void jpeg_splice_init(jpeg_splice *splice, const unsigned char *jpeg, int size)
+{
+    splice->frame = jpeg;
+    splice->frame_size = size;
+    splice->iov[0].iov_base = (void *)jpeg;
+    splice->iov[0].iov_len = size;
+    splice->count = size > 0;
+    splice->size = size;
+}
+
+/* offset of a piece in the frame, -1 if it was put in */
+static int frame_offset(const jpeg_splice *splice, const struct iovec *iov)
+{
+    const unsigned char *base = iov->iov_base;
+
+    if(base < splice->frame || base >= splice->frame + splice->frame_size)
+        return -1;
+    return base - splice->frame;
+}
+
+static int add_piece(struct iovec *iov, int *count, const void *base, int length)
+{
+    if(length <= 0)
+        return 0;
+    if(*count == JPEG_SPLICE_PIECES)
+        return -1;
+    iov[*count].iov_base = (void *)base;
+    iov[*count].iov_len = length;
+    (*count)++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: replaces a part of the frame, nothing is copied
+Input Value.: splice, offset and length of the part in the original frame,
+              the data that takes its place, which must not point into the
+              frame and has to stay until the splice was written. Data put
+              in at the same offset before stays in front of it
+Return Value: 0 if ok, -1 if the part is outside of the frame or there are
+              too many pieces
+******************************************************************************/
+int jpeg_splice_replace(jpeg_splice *splice, int offset, int length, const void *data, int data_length)
+{
+    struct iovec iov[JPEG_SPLICE_PIECES];
+    int i, count = 0, placed = 0, size = 0;
+
+    if(offset < 0 || length < 0 || offset + length > splice->frame_size)
+        return -1;
+
+    for(i = 0; i < splice->count; i++) {
+        int at = frame_offset(splice, &splice->iov[i]), end = at + splice->iov[i].iov_len;
+
+        if(at < 0) {
+            if(add_piece(iov, &count, splice->iov[i].iov_base, splice->iov[i].iov_len) < 0)
+                return -1;
+            continue;
+        }
+
+        /* the part in front of the cut, the new data, the part behind it */
+        if(at < offset && add_piece(iov, &count, splice->frame + at, (end < offset ? end : offset) - at) < 0)
+            return -1;
+        if(end > offset + length) {
+            if(at < offset + length)
+                at = offset + length;
+            if(!placed && add_piece(iov, &count, data, data_length) < 0)
+                return -1;
+            placed = 1;
+            if(add_piece(iov, &count, splice->frame + at, end - at) < 0)
+                return -1;
+        }
+    }
+    if(!placed && add_piece(iov, &count, data, data_length) < 0)
+        return -1;
+
+    for(i = 0; i < count; i++)
+        size += iov[i].iov_len;
+    memcpy(splice->iov, iov, count * sizeof(iov[0]));
+    splice->count = count;
+    splice->size = size;
+    return 0;
+}
+
+int jpeg_splice_insert(jpeg_splice *splice, int offset, const void *data, int length)
+{
+    return jpeg_splice_replace(splice, offset, 0, data, length);
+}
+
+/******************************************************************************
+Description.: gathers the rewritten frame into a buffer
+Input Value.: splice, buffer of at least splice->size bytes
+Return Value: bytes written
+******************************************************************************/
+int jpeg_splice_copy(const jpeg_splice *splice, unsigned char *out)
+{
+    int i, pos = 0;
+
+    for(i = 0; i < splice->count; i++) {
+        memcpy(out + pos, splice->iov[i].iov_base, splice->iov[i].iov_len);
+        pos += splice->iov[i].iov_len;
+    }
+    return pos;
+}
+
+/******************************************************************************
+Description.: writes pieces like writev(), but goes on where a short write
+              stopped until all of them are written
+Input Value.: file descriptor, the pieces, which get changed, and how many,
+              not more than writev() takes
+Return Value: 0 if ok, -1 with errno set
+******************************************************************************/
+int jpeg_writev(int fd, struct iovec *iov, int count)
+{
+    ssize_t rc;
+
+    while(count > 0) {
+        rc = writev(fd, iov, count);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0)
+            return -1;
+        while(count > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef JPEG_TOOLS_H
+#define JPEG_TOOLS_H
+
+#include <sys/uio.h>
+
+/*
+ * The marker level of JPEG frames, for the plugins that need to look into a
+ * frame or change its headers: walking the segments, the frame header and
+ * tables, whether the frame is complete, and rewriting the headers.
+ *
+ * Nothing here touches the entropy coded data beyond searching it for the
+ * next marker. A rewritten frame is a jpeg_splice, a list of pieces which
+ * mostly point into the original frame. writev() and sendmsg() take the
+ * pieces as they are, jpeg_writev() also finishes short writes, and
+ * jpeg_splice_copy() gathers them where a single buffer is needed.
+ */
+
+#define JPEG_SOF0 0xC0          // baseline
+#define JPEG_SOF1 0xC1          // extended sequential
+#define JPEG_SOF2 0xC2          // progressive
+#define JPEG_DHT  0xC4
+#define JPEG_SOI  0xD8
+#define JPEG_EOI  0xD9
+#define JPEG_SOS  0xDA
+#define JPEG_DQT  0xDB
+#define JPEG_DRI  0xDD
+#define JPEG_APP0 0xE0
+#define JPEG_APP1 0xE1
+#define JPEG_COM  0xFE
+
+/* one marker and its payload */
+typedef struct _jpeg_segment jpeg_segment;
+struct _jpeg_segment {
+    int marker;                 // the byte behind 0xFF, 0 before the walk
+    int offset;                 // of the marker in the frame
+    const unsigned char *data;  // the payload behind the length field
+    int length;                 // of the payload, 0 for markers without one
+    int next;                   // where the walk goes on
+};
+
+enum _jpeg_subsampling {
+    JPEG_SUBSAMPLING_OTHER,
+    JPEG_SUBSAMPLING_GRAY,
+    JPEG_SUBSAMPLING_444,
+    JPEG_SUBSAMPLING_422,
+    JPEG_SUBSAMPLING_420,
+    JPEG_SUBSAMPLING_411,
+    JPEG_SUBSAMPLING_440
+};
+
+/* the headers of a frame up to its first scan */
+typedef struct _jpeg_info jpeg_info;
+struct _jpeg_info {
+    int sof;                    // marker of the frame header, JPEG_SOF0...
+    int sof_offset;
+    int precision;
+    int width, height;
+    int components;
+    int id[4], h[4], v[4], tq[4];       // of every component
+    int subsampling;
+    int restart_interval;
+
+    /* the 64 entries of every table in zigzag order, 2 bytes each if the
+       precision is 1, NULL if the frame does not define it */
+    const unsigned char *dqt[4];
+    int dqt_precision[4];
+
+    /* the 16 code counts followed by the symbols, dht[0] are the DC
+       tables, dht[1] the AC tables, NULL if not defined */
+    const unsigned char *dht[2][4];
+    int dht_segments;
+
+    /* the first scan */
+    int sos_offset;
+    int scan_offset;            // of its entropy coded data
+    int scan_components;
+    int scan_index[4];          // component of each part of the scan
+    int scan_dc[4], scan_ac[4]; // their tables
+};
+
+#define JPEG_STD_DHT_SIZE 420
+extern const unsigned char jpeg_std_dht[JPEG_STD_DHT_SIZE];
+
+int jpeg_next_segment(const unsigned char *jpeg, int size, jpeg_segment *segment);
+int jpeg_parse_dqt(const unsigned char *data, int length, const unsigned char *tables[4], int precision[4]);
+int jpeg_parse_dht(const unsigned char *data, int length, const unsigned char *tables[2][4]);
+int jpeg_parse_header(const unsigned char *jpeg, int size, jpeg_info *info);
+int jpeg_eoi(const unsigned char *jpeg, int size);
+int jpeg_app_offset(const unsigned char *jpeg, int size);
+
+#define JPEG_SPLICE_PIECES 16
+
+/* a frame with parts replaced or inserted, offsets refer to the original */
+typedef struct _jpeg_splice jpeg_splice;
+struct _jpeg_splice {
+    const unsigned char *frame;
+    int frame_size;
+    struct iovec iov[JPEG_SPLICE_PIECES];
+    int count;
+    int size;                   // bytes of the rewritten frame
+};
+
+void jpeg_splice_init(jpeg_splice *splice, const unsigned char *jpeg, int size);
+int jpeg_splice_replace(jpeg_splice *splice, int offset, int length, const void *data, int data_length);
+int jpeg_splice_insert(jpeg_splice *splice, int offset, const void *data, int length);
+int jpeg_splice_copy(const jpeg_splice *splice, unsigned char *out);
+int jpeg_writev(int fd, struct iovec *iov, int count);
+
+#endif
@@ -0,0 +1,221 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mjpg_streamer.h"
+#include "motion.h"
+
+/* learning rate of the background, as a shift. Changed cells are hardly
+   learnt, so moving things leave no trail, but things that stay are part of
+   the background after a few hundred frames */
+#define LEARN_STILL 4
+#define LEARN_MOVING 8
+
+#define DEFAULT_THRESHOLD 12
+#define DEFAULT_LINGER 30
+
+/******************************************************************************
+Description.: makes the cell arrays fit the grid
+Input Value.: detector and the grid size
+Return Value: 1 if the grid changed and the background has to be learnt
+              again, 0 if not, -1 if out of memory
+******************************************************************************/
+static int resize_grid(motion_detector *md, int cols, int rows)
+{
+    if(cols == md->cols && rows == md->rows)
+        return 0;
+
+    motion_free(md);
+    md->level = calloc(cols * rows, sizeof(int));
+    md->background = calloc(cols * rows, sizeof(int));
+    md->map = calloc(cols * rows, 1);
+    if(md->level == NULL || md->background == NULL || md->map == NULL) {
+        motion_free(md);
+        return -1;
+    }
+    md->cols = cols;
+    md->rows = rows;
+    return 1;
+}
+
+/******************************************************************************
+Description.: compares the levels of the current frame with the background,
+              updates the background, the score and the event state
+Input Value.: detector, fresh if the background has to be learnt again
+Return Value: the score
+******************************************************************************/
+static int update_background(motion_detector *md, int fresh)
+{
+    int i, cells = md->cols * md->rows, changed = 0;
+    long shift = 0;
+
+    if(fresh) {
+        for(i = 0; i < cells; i++)
+            md->background[i] = md->level[i] << 8;
+        memset(md->map, 0, cells);
+        md->score = 0;
+        return md->score;
+    }
+
+    /* follow changes of the overall brightness, e.g. auto exposure */
+    for(i = 0; i < cells; i++)
+        shift += md->level[i] - (md->background[i] >> 8);
+    shift /= cells;
+
+    for(i = 0; i < cells; i++) {
+        int d = md->level[i] - (md->background[i] >> 8) - shift;
+        md->map[i] = d > md->threshold || d < -md->threshold;
+        changed += md->map[i];
+        md->background[i] += ((md->level[i] << 8) - md->background[i]) >> (md->map[i] ? LEARN_MOVING : LEARN_STILL);
+    }
+
+    md->score = changed * 1000 / cells;
+    if(md->score >= md->trigger) {
+        md->quiet = 0;
+        if(!md->active) {
+            md->active = 1;
+            md->events++;
+        }
+    } else if(md->active && ++md->quiet >= md->linger) {
+        md->active = 0;
+    }
+    return md->score;
+}
+
+/******************************************************************************
+Description.: sets up a detector
+Input Value.: detector and the -motion argument TRIGGER[,THRESHOLD[,LINGER]]
+Return Value: 0 if ok, -1 if the argument is invalid
+******************************************************************************/
+int motion_init(motion_detector *md, const char *spec)
+{
+    memset(md, 0, sizeof(*md));
+    md->threshold = DEFAULT_THRESHOLD;
+    md->linger = DEFAULT_LINGER;
+    md->score = -1;
+
+    if(sscanf(spec, "%d,%d,%d", &md->trigger, &md->threshold, &md->linger) < 1 ||
+       md->trigger < 1 || md->trigger > 1000 || md->threshold < 1 || md->linger < 0)
+        return -1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: releases the cells of a detector, it can be fed again afterwards
+Input Value.: detector
+Return Value: -
+******************************************************************************/
+void motion_free(motion_detector *md)
+{
+    free(md->level);
+    free(md->background);
+    free(md->map);
+    md->level = md->background = NULL;
+    md->map = NULL;
+    md->cols = md->rows = 0;
+}
+
+/******************************************************************************
+Description.: decodes a baseline JPEG and fills the cells, one per MCU holding
+              the mean of its luma DC coefficients
+Input Value.: detector, JPEG and its size
+Return Value: the score, -1 if the frame could not be decoded
+******************************************************************************/
+static int feed_jpeg(motion_detector *md, const unsigned char *jpeg, int size)
+{
+    jpeg_decoder *d = &md->decoder;
+    int dc[JPEG_MAX_LUMA_BLOCKS], x, y, i, n, q0, fresh;
+
+    if(jpeg_decoder_open(d, jpeg, size) < 0 || (fresh = resize_grid(md, d->mcux, d->mcuy)) < 0)
+        return -1;
+    q0 = d->quant[d->comp[0].tq][0];
+
+    for(y = 0; y < d->mcuy; y++) {
+        for(x = 0; x < d->mcux; x++) {
+            int sum = 0;
+
+            if((n = jpeg_decoder_mcu(d, dc, NULL)) < 0)
+                return -1;
+            for(i = 0; i < n; i++)
+                sum += dc[i];
+            /* the DC is eight times the mean of the level shifted block */
+            md->level[y * d->mcux + x] = sum * q0 / (8 * n) + 128;
+        }
+    }
+    return update_background(md, fresh);
+}
+
+/******************************************************************************
+Description.: runs the detection on a JPEG, only baseline frames can be read
+Input Value.: detector, JPEG and its size
+Return Value: the score, -1 if the frame could not be parsed
+******************************************************************************/
+int motion_feed_jpeg(motion_detector *md, const unsigned char *jpeg, int size)
+{
+    if(feed_jpeg(md, jpeg, size) < 0)
+        md->score = -1;
+    return md->score;
+}
+
+/******************************************************************************
+Description.: runs the detection on the luma of a raw frame, one cell per
+              16x16 macroblock, sampled on every other line and column
+Input Value.: detector, first luma sample, distance between samples in bytes,
+              bytes per line, width and height in pixels
+Return Value: the score, -1 if the frame is too small
+******************************************************************************/
+int motion_feed_luma(motion_detector *md, const unsigned char *luma, int step,
+                     int stride, int width, int height)
+{
+    int cols = width / 16, rows = height / 16, x, y, i, j, fresh;
+
+    if(cols < 1 || rows < 1 || (fresh = resize_grid(md, cols, rows)) < 0)
+        return md->score = -1;
+
+    for(y = 0; y < rows; y++) {
+        for(x = 0; x < cols; x++) {
+            const unsigned char *cell = luma + y * 16 * stride + x * 16 * step;
+            int sum = 0;
+            for(j = 0; j < 16; j += 2) {
+                const unsigned char *line = cell + j * stride;
+                for(i = 0; i < 16; i += 2)
+                    sum += line[i * step];
+            }
+            md->level[y * cols + x] = sum / 64;
+        }
+    }
+    return update_background(md, fresh);
+}
+
+/******************************************************************************
+Description.: copies the result of the last frame, call it while holding the
+              db lock of the input when the frame gets published
+Input Value.: detector and the motion field of the input
+Return Value: -
+******************************************************************************/
+void motion_publish(const motion_detector *md, input_motion *result)
+{
+    result->score = md->score;
+    result->active = md->active;
+    result->events = md->events;
+}
@@ -0,0 +1,78 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include "jpeg_decoder.h"
+
+/*
+ * Motion detection on the DC coefficients of JPEG frames. Only the entropy
+ * coded data is walked, the AC coefficients are skipped without being
+ * dequantized or transformed, so the detector gets the mean brightness of
+ * every macroblock for a fraction of the cost of a decode. Raw frames are
+ * reduced to the same macroblock means directly.
+ *
+ * Inputs own one detector each, feed it every frame outside of the db lock
+ * and copy the result to in->motion with motion_publish() when they publish
+ * the frame. The frame keeps score -1 if it could not be read, e.g. because
+ * it is a progressive JPEG.
+ */
+
+#define MOTION_HELP \
+    " [-motion ].............: detect motion, TRIGGER[,THRESHOLD[,LINGER]]\n" \
+    "                          an event starts once TRIGGER permille of the\n" \
+    "                          macroblocks differ by more than THRESHOLD\n" \
+    "                          (default 12) from the background, and ends\n" \
+    "                          LINGER (default 30) quiet frames later\n"
+
+struct _input_motion;
+
+typedef struct _motion_detector motion_detector;
+struct _motion_detector {
+    /* settings */
+    int trigger;            // permille of changed macroblocks that is motion
+    int threshold;          // brightness change of a macroblock that counts
+    int linger;             // quiet frames before an event ends
+
+    /* keeps the Huffman tables from frame to frame */
+    jpeg_decoder decoder;
+
+    /* running background, one cell per macroblock */
+    int cols, rows;
+    int *level;             // mean brightness of the current frame
+    int *background;        // 8.8 fixed point
+    unsigned char *map;     // 1 where the current frame differs
+
+    /* result of the last frame */
+    int score;              // permille of changed macroblocks, -1 if unknown
+    int active;             // an event is going on
+    int quiet;              // frames since the score was last above trigger
+    unsigned int events;
+};
+
+int motion_init(motion_detector *md, const char *spec);
+void motion_free(motion_detector *md);
+int motion_feed_jpeg(motion_detector *md, const unsigned char *jpeg, int size);
+int motion_feed_luma(motion_detector *md, const unsigned char *luma, int step,
+                     int stride, int width, int height);
+void motion_publish(const motion_detector *md, struct _input_motion *result);
+
+#endif
@@ -50,7 +50,9 @@ static pthread_t worker;
 static globals *pglobal;
 static int fd, delay;
 static unsigned char *frame = NULL;
+static int frame_capacity;
 static int input_number;
+static jpeg_decoder decoder;
 
 /******************************************************************************
 Description.: print a help message
@@ -90,6 +92,80 @@ void worker_cleanup(void *arg)
 
 
 
+/******************************************************************************
+Description.: makes sure the frame buffer can hold size bytes
+Input Value.: size
+Return Value: 0 if ok, -1 if out of memory
+******************************************************************************/
+static int reserve_frame(int size)
+{
+    unsigned char *tmp;
+
+    if(size <= frame_capacity)
+        return 0;
+    if((tmp = realloc(frame, size)) == NULL)
+        return -1;
+    frame = tmp;
+    frame_capacity = size;
+    return 0;
+}
+
+/******************************************************************************
+Description.: copies the luma of the center quarter of a raw frame, which is
+              the same area the JPEG measurement looks at
+Input Value.: raw frame of the input, width and height of the copy are
+              returned in w and h
+Return Value: 0 if ok, -1 if the format has no usable luma
+******************************************************************************/
+static int copy_center_luma(const input_raw *raw, int *w, int *h)
+{
+    int x, y, offset, step;
+
+    switch(raw->format) {
+    case V4L2_PIX_FMT_GREY:  offset = 0; step = 1; break;
+    case V4L2_PIX_FMT_YUYV:  offset = 0; step = 2; break;
+    case V4L2_PIX_FMT_UYVY:  offset = 1; step = 2; break;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24: offset = 1; step = 3; break; // green is close enough
+    default:
+        return -1;
+    }
+
+    *w = raw->width / 2;
+    *h = raw->height / 2;
+    if(*w < 3 || *h < 3 || reserve_frame(*w * *h) < 0)
+        return -1;
+
+    for(y = 0; y < *h; y++) {
+        const unsigned char *src = raw->plane[0] + (y + *h / 2) * raw->stride[0] + (*w / 2) * step + offset;
+        unsigned char *dst = frame + y * *w;
+        for(x = 0; x < *w; x++, src += step)
+            dst[x] = *src;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: sharpness of a luma picture, the mean squared laplacian, which
+              like the AC energy of the JPEG blocks grows with the detail
+Input Value.: luma, its width and height
+Return Value: sharpness value
+******************************************************************************/
+static double getLumaSharpnessValue(const unsigned char *luma, int w, int h)
+{
+    double sum = 0;
+    int x, y;
+
+    for(y = 1; y < h - 1; y++) {
+        const unsigned char *p = luma + y * w;
+        for(x = 1; x < w - 1; x++) {
+            int l = 4 * p[x] - p[x - 1] - p[x + 1] - p[x - w] - p[x + w];
+            sum += l * l;
+        }
+    }
+    return sum / ((w - 2) * (h - 2));
+}
+
 /******************************************************************************
 Description.: this is the main worker thread
               it loops forever, grabs a fresh frame and calculates focus
@@ -98,11 +174,11 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int frame_size = 0;
+    int frame_size = 0, raw = 0, w = 0, h = 0;
     double sv = -1.0, max_sv = 100.0, delta = 500;
     int focus = 255, step = 10, max_focus = 100, search_focus = 1;
 
-    if((frame = malloc(256 * 1024)) == NULL) {
+    if(reserve_frame(256 * 1024) < 0) {
         OPRINT("not enough memory for worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -110,19 +186,29 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* focusing needs the sharpness of every frame, it reads the raw ones */
+    input_subscribe_raw(&pglobal->in[input_number]);
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
         pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* take the pixels if the input has them, that saves encoding and
+           decoding a JPEG */
+        raw = copy_center_luma(&pglobal->in[input_number].raw, &w, &h) == 0;
+        if(!raw) {
+            /* read buffer */
+            frame_size = input_jpeg(&pglobal->in[input_number]);
+            if(reserve_frame(frame_size) < 0)
+                frame_size = 0;
+            memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        }
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
         /* process frame */
-        sv = getFrameSharpnessValue(frame, frame_size);
+        sv = raw ? getLumaSharpnessValue(frame, w, h) : getFrameSharpnessValue(&decoder, frame, frame_size);
         DBG("sharpness is: %f\n", sv);
 
         if(search_focus || (ABS(sv - max_sv) > delta)) {
@@ -162,6 +248,8 @@ void *worker_thread(void *arg)
         }
     }
 
+    input_unsubscribe_raw(&pglobal->in[input_number]);
+
     pthread_cleanup_pop(1);
 
     return NULL;
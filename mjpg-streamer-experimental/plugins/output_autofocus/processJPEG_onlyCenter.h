@@ -1,4 +1,8 @@
-#define HUFF_EXTEND(x,s)  ((x) < (1<<((s)-1)) ? (x) + (((-1)<<(s)) + 1) : (x))
+#ifndef PROCESSJPEG_ONLYCENTER_H
+#define PROCESSJPEG_ONLYCENTER_H
 
-// haven't done restart markers, but these don't seem to appear
-double getFrameSharpnessValue(unsigned char *data, int len);
+#include "../jpeg_decoder.h"
+
+double getFrameSharpnessValue(jpeg_decoder *d, const unsigned char *data, int len);
+
+#endif
@@ -0,0 +1,433 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "mkv.h"
+#include "../jpeg_tools.h"
+
+/* element IDs, with their length marker bits */
+#define ID_EBML             0x1A45DFA3
+#define ID_EBML_VERSION     0x4286
+#define ID_EBML_READ        0x42F7
+#define ID_EBML_MAX_ID      0x42F2
+#define ID_EBML_MAX_SIZE    0x42F3
+#define ID_DOCTYPE          0x4282
+#define ID_DOCTYPE_VERSION  0x4287
+#define ID_DOCTYPE_READ     0x4285
+#define ID_SEGMENT          0x18538067
+#define ID_SEEKHEAD         0x114D9B74
+#define ID_SEEK             0x4DBB
+#define ID_SEEK_ID          0x53AB
+#define ID_SEEK_POSITION    0x53AC
+#define ID_INFO             0x1549A966
+#define ID_TIMECODE_SCALE   0x2AD7B1
+#define ID_DURATION         0x4489
+#define ID_DATE_UTC         0x4461
+#define ID_MUXING_APP       0x4D80
+#define ID_WRITING_APP      0x5741
+#define ID_TRACKS           0x1654AE6B
+#define ID_TRACK_ENTRY      0xAE
+#define ID_TRACK_NUMBER     0xD7
+#define ID_TRACK_UID        0x73C5
+#define ID_TRACK_TYPE       0x83
+#define ID_FLAG_LACING      0x9C
+#define ID_CODEC_ID         0x86
+#define ID_VIDEO            0xE0
+#define ID_PIXEL_WIDTH      0xB0
+#define ID_PIXEL_HEIGHT     0xBA
+#define ID_CLUSTER          0x1F43B675
+#define ID_TIMECODE         0xE7
+#define ID_SIMPLE_BLOCK     0xA3
+#define ID_CUES             0x1C53BB6B
+#define ID_CUE_POINT        0xBB
+#define ID_CUE_TIME         0xB3
+#define ID_CUE_POSITIONS    0xB7
+#define ID_CUE_TRACK        0xF7
+#define ID_CUE_CLUSTER      0xF1
+
+#define CLUSTER_MS 1000         // a new cluster, and a cue, every second
+#define MAX_BATCH 64            // frames per pwritev()
+#define MAX_IOV (4 * MAX_BATCH) // pieces per pwritev(), frames mostly come in one
+#define BLOCK_HEADER 9          // SimpleBlock ID, 4 byte size, track, time, flags
+#define CLUSTER_HEADER 22       // Cluster ID, 8 byte size, 8 byte Timecode
+
+/* seconds between the unix epoch and the Matroska epoch, 2001-01-01 */
+#define MKV_EPOCH 978307200LL
+
+static int put_id(unsigned char *p, unsigned int id)
+{
+    int n = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1, i;
+    for(i = 0; i < n; i++)
+        p[i] = id >> (8 * (n - 1 - i));
+    return n;
+}
+
+/* data size as vint of the given length */
+static int put_size(unsigned char *p, unsigned long long size, int length)
+{
+    int i;
+    for(i = 0; i < length; i++)
+        p[i] = size >> (8 * (length - 1 - i));
+    p[0] |= 0x80 >> (length - 1);
+    return length;
+}
+
+static int put_uint(unsigned char *p, unsigned int id, unsigned long long value, int length)
+{
+    int n = put_id(p, id), i;
+    n += put_size(p + n, length, 1);
+    for(i = 0; i < length; i++)
+        p[n + i] = value >> (8 * (length - 1 - i));
+    return n + length;
+}
+
+static int put_string(unsigned char *p, unsigned int id, const char *value)
+{
+    int n = put_id(p, id), length = strlen(value);
+    n += put_size(p + n, length, 1);
+    memcpy(p + n, value, length);
+    return n + length;
+}
+
+/* master elements get a 4 byte size that is filled in by end_master() */
+static int begin_master(unsigned char *p, int *pos, unsigned int id)
+{
+    int at;
+    *pos += put_id(p + *pos, id);
+    at = *pos;
+    *pos += 4;
+    return at;
+}
+
+static void end_master(unsigned char *p, int pos, int at)
+{
+    put_size(p + at, pos - at - 4, 4);
+}
+
+static int write_at(int fd, const unsigned char *buf, int length, off_t offset)
+{
+    ssize_t rc;
+
+    while(length > 0) {
+        rc = pwrite(fd, buf, length, offset);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0) {
+            perror("pwrite()");
+            return -1;
+        }
+        buf += rc;
+        length -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: creates a file and writes the header of the segment, the size
+              of the picture is taken from the first frame
+Input Value.: writer, path of the file, the first frame
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+int mkv_open(mkv_writer *w, const char *path, const unsigned char *jpeg, int size)
+{
+    unsigned char head[512];
+    int pos = 0, at, track, video, seekhead;
+    int info_seek, tracks_seek, cues_seek, info_at, tracks_at, segment_data;
+    long long date = ((long long)time(NULL) - MKV_EPOCH) * 1000000000LL;
+    jpeg_info info;
+
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+
+    if(jpeg_parse_header(jpeg, size, &info) < 0) {
+        fprintf(stderr, "no picture size found in the frame\n");
+        return -1;
+    }
+
+    at = begin_master(head, &pos, ID_EBML);
+    pos += put_uint(head + pos, ID_EBML_VERSION, 1, 1);
+    pos += put_uint(head + pos, ID_EBML_READ, 1, 1);
+    pos += put_uint(head + pos, ID_EBML_MAX_ID, 4, 1);
+    pos += put_uint(head + pos, ID_EBML_MAX_SIZE, 8, 1);
+    pos += put_string(head + pos, ID_DOCTYPE, "matroska");
+    pos += put_uint(head + pos, ID_DOCTYPE_VERSION, 2, 1);
+    pos += put_uint(head + pos, ID_DOCTYPE_READ, 2, 1);
+    end_master(head, pos, at);
+
+    /* unknown size until the segment is closed */
+    pos += put_id(head + pos, ID_SEGMENT);
+    w->segment_size_at = pos;
+    head[pos++] = 0x01;
+    memset(head + pos, 0xFF, 7);
+    pos += 7;
+    segment_data = pos;
+
+    /* the positions are relative to the segment data, Cues come last */
+    seekhead = begin_master(head, &pos, ID_SEEKHEAD);
+    at = begin_master(head, &pos, ID_SEEK);
+    pos += put_uint(head + pos, ID_SEEK_ID, ID_INFO, 4);
+    info_seek = pos;
+    pos += put_uint(head + pos, ID_SEEK_POSITION, 0, 8);
+    end_master(head, pos, at);
+    at = begin_master(head, &pos, ID_SEEK);
+    pos += put_uint(head + pos, ID_SEEK_ID, ID_TRACKS, 4);
+    tracks_seek = pos;
+    pos += put_uint(head + pos, ID_SEEK_POSITION, 0, 8);
+    end_master(head, pos, at);
+    at = begin_master(head, &pos, ID_SEEK);
+    pos += put_uint(head + pos, ID_SEEK_ID, ID_CUES, 4);
+    cues_seek = pos;
+    pos += put_uint(head + pos, ID_SEEK_POSITION, 0, 8);
+    end_master(head, pos, at);
+    end_master(head, pos, seekhead);
+
+    info_at = pos;
+    at = begin_master(head, &pos, ID_INFO);
+    pos += put_uint(head + pos, ID_TIMECODE_SCALE, 1000000, 3); // ms
+    w->duration_at = pos;
+    pos += put_uint(head + pos, ID_DURATION, 0, 8);             // float, set on close
+    pos += put_uint(head + pos, ID_DATE_UTC, date, 8);
+    pos += put_string(head + pos, ID_MUXING_APP, "mjpg-streamer");
+    pos += put_string(head + pos, ID_WRITING_APP, "mjpg-streamer output_file");
+    end_master(head, pos, at);
+
+    tracks_at = pos;
+    at = begin_master(head, &pos, ID_TRACKS);
+    track = begin_master(head, &pos, ID_TRACK_ENTRY);
+    pos += put_uint(head + pos, ID_TRACK_NUMBER, 1, 1);
+    pos += put_uint(head + pos, ID_TRACK_UID, 1, 1);
+    pos += put_uint(head + pos, ID_TRACK_TYPE, 1, 1);           // video
+    pos += put_uint(head + pos, ID_FLAG_LACING, 0, 1);
+    pos += put_string(head + pos, ID_CODEC_ID, "V_MJPEG");
+    video = begin_master(head, &pos, ID_VIDEO);
+    pos += put_uint(head + pos, ID_PIXEL_WIDTH, info.width, 2);
+    pos += put_uint(head + pos, ID_PIXEL_HEIGHT, info.height, 2);
+    end_master(head, pos, video);
+    end_master(head, pos, track);
+    end_master(head, pos, at);
+
+    /* now that the positions are known, fill in the SeekHead */
+    put_uint(head + info_seek, ID_SEEK_POSITION, info_at - segment_data, 8);
+    put_uint(head + tracks_seek, ID_SEEK_POSITION, tracks_at - segment_data, 8);
+    w->cues_position_at = cues_seek + 3; // behind ID and size
+
+    w->fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(w->fd < 0) {
+        perror("could not open the recording");
+        return -1;
+    }
+    if(write_at(w->fd, head, pos, 0) < 0) {
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+
+    w->segment_data = segment_data;
+    w->offset = pos;
+    return 0;
+}
+
+/******************************************************************************
+Description.: appends frames with one pwritev(), starting new clusters when
+              needed, the frames have to be in order of their time
+Input Value.: writer, the frames and how many of them
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+int mkv_write_frames(mkv_writer *w, const mkv_frame *frames, int count)
+{
+    unsigned char headers[MAX_BATCH][CLUSTER_HEADER + BLOCK_HEADER];
+    struct iovec iov[MAX_IOV], *next;
+    off_t offset = w->offset, patch_at = 0;
+    unsigned char patch[8];
+    int i = 0, n, chunk;
+    ssize_t rc;
+
+    for(chunk = 0; chunk < count; chunk += i) {
+        int batch = count - chunk < MAX_BATCH ? count - chunk : MAX_BATCH;
+
+        n = 0;
+        for(i = 0; i < batch; i++) {
+            const mkv_frame *f = &frames[chunk + i];
+            unsigned char *h = headers[i];
+            long long time = f->time < w->last_time ? w->last_time : f->time;
+            int pos = 0;
+
+            if(f->count < 1 || f->count > MKV_FRAME_PIECES)
+                return -1;
+            if(n + 1 + f->count > MAX_IOV)
+                break;
+
+            /* the block time is 16 bit relative to the cluster */
+            if(w->cluster_size_at == 0 || w->frames == 0 || time - w->cluster_time >= CLUSTER_MS) {
+                if(w->cluster_size_at != 0) {
+                    /* one cluster is closed per pwritev(), the rest of the
+                       frames go into the next one */
+                    if(patch_at != 0)
+                        break;
+                    patch_at = w->cluster_size_at;
+                    put_size(patch, offset - w->cluster_size_at - 8, 8);
+                }
+
+                if(w->cues_count == w->cues_length) {
+                    int length = w->cues_length ? 2 * w->cues_length : 256;
+                    mkv_cue *grown = realloc(w->cues, length * sizeof(mkv_cue));
+                    if(grown == NULL)
+                        return -1;
+                    w->cues = grown;
+                    w->cues_length = length;
+                }
+                w->cues[w->cues_count].time = time;
+                w->cues[w->cues_count].cluster = offset - w->segment_data;
+                w->cues_count++;
+
+                pos += put_id(h + pos, ID_CLUSTER);
+                w->cluster_size_at = offset + pos;
+                h[pos++] = 0x01;                    // unknown size
+                memset(h + pos, 0xFF, 7);
+                pos += 7;
+                pos += put_uint(h + pos, ID_TIMECODE, time, 8);
+                w->cluster_time = time;
+            }
+
+            pos += put_id(h + pos, ID_SIMPLE_BLOCK);
+            pos += put_size(h + pos, 4 + f->size, 4);
+            h[pos++] = 0x81;                        // track 1
+            h[pos++] = (time - w->cluster_time) >> 8;
+            h[pos++] = (time - w->cluster_time) & 0xFF;
+            h[pos++] = 0x80;                        // keyframe
+
+            iov[n].iov_base = h;
+            iov[n++].iov_len = pos;
+            memcpy(iov + n, f->iov, f->count * sizeof(struct iovec));
+            n += f->count;
+            offset += pos + f->size;
+            w->last_time = time;
+            w->frames++;
+        }
+        next = iov;
+        while(n > 0) {
+            rc = pwritev(w->fd, next, n, w->offset);
+            if(rc < 0 && errno == EINTR)
+                continue;
+            if(rc < 0) {
+                perror("pwritev()");
+                return -1;
+            }
+            w->offset += rc;
+            while(n > 0 && (size_t)rc >= next->iov_len) {
+                rc -= next->iov_len;
+                next++;
+                n--;
+            }
+            if(n > 0) {
+                next->iov_base = (unsigned char *)next->iov_base + rc;
+                next->iov_len -= rc;
+            }
+        }
+
+        if(patch_at != 0) {
+            if(write_at(w->fd, patch, 8, patch_at) < 0)
+                return -1;
+            patch_at = 0;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: writes the Cues and fills in the sizes and the duration, the
+              file is complete afterwards
+Input Value.: writer
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+int mkv_close(mkv_writer *w)
+{
+    unsigned char *cues, value[8];
+    int i, pos = 0, rc = 0;
+    double duration;
+    union { double d; unsigned long long u; } bits;
+
+    if(w->fd < 0)
+        return 0;
+
+    if(w->cluster_size_at != 0) {
+        put_size(value, w->offset - w->cluster_size_at - 8, 8);
+        rc |= write_at(w->fd, value, 8, w->cluster_size_at);
+        w->cluster_size_at = 0;
+    }
+
+    /* every cue point takes 27 bytes */
+    cues = malloc(8 + 27 * w->cues_count);
+    if(cues == NULL) {
+        rc = -1;
+    } else {
+        pos += put_id(cues, ID_CUES);
+        pos += put_size(cues + pos, 27 * w->cues_count, 4);
+        for(i = 0; i < w->cues_count; i++) {
+            cues[pos++] = ID_CUE_POINT;
+            cues[pos++] = 0x80 | 25;
+            pos += put_uint(cues + pos, ID_CUE_TIME, w->cues[i].time, 8);
+            cues[pos++] = ID_CUE_POSITIONS;
+            cues[pos++] = 0x80 | 13;
+            pos += put_uint(cues + pos, ID_CUE_TRACK, 1, 1);
+            pos += put_uint(cues + pos, ID_CUE_CLUSTER, w->cues[i].cluster, 8);
+        }
+        rc |= write_at(w->fd, cues, pos, w->offset);
+        free(cues);
+
+        /* point the SeekHead to the Cues */
+        for(i = 0; i < 8; i++)
+            value[i] = (unsigned long long)(w->offset - w->segment_data) >> (8 * (7 - i));
+        rc |= write_at(w->fd, value, 8, w->cues_position_at);
+        w->offset += pos;
+    }
+
+    /* the last frame lasts as long as the average frame */
+    duration = w->last_time;
+    if(w->frames > 1)
+        duration += (double)w->last_time / (w->frames - 1);
+    bits.d = duration;
+    for(i = 0; i < 8; i++)
+        value[i] = bits.u >> (8 * (7 - i));
+    rc |= write_at(w->fd, value, 8, w->duration_at + 3);
+
+    put_size(value, w->offset - w->segment_data, 8);
+    rc |= write_at(w->fd, value, 8, w->segment_size_at);
+
+    if(close(w->fd) < 0)
+        rc = -1;
+    w->fd = -1;
+    free(w->cues);
+    w->cues = NULL;
+    w->cues_count = w->cues_length = 0;
+
+    return rc ? -1 : 0;
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef MKV_H
+#define MKV_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Matroska writer for MJPEG recordings. Every frame is a SimpleBlock with
+ * its own timestamp, a new cluster starts every second and gets a cue, so
+ * players can seek to any time with one lookup in the Cues.
+ *
+ * The segment and the open cluster are written with unknown size, so a file
+ * that was not closed is still playable, mkv_close() fills in the sizes, the
+ * duration and writes the Cues.
+ */
+
+/* a frame is written as the pieces it comes in, e.g. a jpeg_splice */
+typedef struct _mkv_frame mkv_frame;
+struct _mkv_frame {
+    const struct iovec *iov;
+    int count;                  // of the pieces, at most MKV_FRAME_PIECES
+    int size;                   // of all pieces
+    long long time;             // ms since the segment started
+};
+
+#define MKV_FRAME_PIECES 16
+
+typedef struct _mkv_cue mkv_cue;
+struct _mkv_cue {
+    long long time;
+    off_t cluster;              // relative to the segment data
+};
+
+typedef struct _mkv_writer mkv_writer;
+struct _mkv_writer {
+    int fd;
+    off_t offset;               // end of the file
+    off_t segment_data;         // start of the segment payload
+    off_t segment_size_at;      // placeholders filled in by mkv_close()
+    off_t duration_at;
+    off_t cues_position_at;
+    off_t cluster_size_at;      // of the open cluster, 0 if there is none
+    long long cluster_time;
+    long long last_time;
+    unsigned int frames;
+    mkv_cue *cues;
+    int cues_count, cues_length;
+};
+
+int mkv_open(mkv_writer *w, const char *path, const unsigned char *jpeg, int size);
+int mkv_write_frames(mkv_writer *w, const mkv_frame *frames, int count);
+int mkv_close(mkv_writer *w);
+
+#endif
@@ -36,8 +36,13 @@
 #include <time.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "output_file.h"
+#include "mkv.h"
+#include "../command.h"
+#include "../exif.h"
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
@@ -45,14 +50,118 @@
 #define OUTPUT_PLUGIN_NAME "FILE output plugin"
 
 static pthread_t worker;
+static pthread_t writer;
 static globals *pglobal;
 static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
 static char *folder = "/tmp";
 static unsigned char *frame = NULL;
 static char *command = NULL;
+static command_pool commands;
 static int input_number = 0;
 static char *mjpgFileName = NULL;
 static char *linkFileName = NULL;
+static unsigned long long counter = 0;
+static struct timeval frame_time;      // when the frame in frame was taken
+static exif_info frame_exif;           // its metadata, with -exif
+static char *exifCamera = NULL;        // camera id for -exif, NULL without
+
+/* the pictures of the ringbuffer, oldest first, the folder is scanned once
+   at startup and only the writer thread uses this afterwards */
+static char **files = NULL;
+static int files_length = 0, files_head = 0, files_count = 0;
+static int dir_fd = -1;
+
+/* a frame of the pre-roll or the write queue, the buffers are swapped with
+   frame when it is handed over, not copied */
+typedef struct _ring_frame {
+    unsigned char *buf;
+    int size;
+    int capacity;
+    struct timespec taken;
+    struct timeval timestamp;   // of the input, for the recording
+    exif_info exif;             // put into the frame when it gets written
+} ring_frame;
+
+/*
+ * with -preroll only events are recorded, the frames of the last preroll ms
+ * are kept in memory and get written once a trigger arrives, followed by
+ * everything up to postroll ms after the last trigger
+ */
+static int preroll = -1, postroll = 10000;
+static int motion_trigger = 0;
+static size_t preroll_limit = 32 << 20; // bytes the pre-roll may hold
+static ring_frame *ring = NULL;
+static int ring_length = 0, ring_head = 0, ring_count = 0;
+static size_t ring_bytes = 0;
+static int trigger_pending = 0;
+static pthread_mutex_t trigger_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * frames on their way to disk, the worker only queues them and the writer
+ * thread writes them in batches, so a slow disk does not hold up the intake.
+ * The writer owns the frames from queue_head on until it removes them.
+ */
+#define WRITE_BATCH 64              // frames per pwritev()
+#define PREALLOCATE (16 << 20)      // bytes the MJPG file is extended by at once
+#define WRITEBACK (4 << 20)         // bytes after which write-back is started
+
+static ring_frame *queue = NULL;
+static int queue_length = 32, queue_head = 0, queue_count = 0;
+static int writer_running = 0, writer_stop = 0, writer_failed = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static off_t mjpg_offset = 0, mjpg_allocated = 0, mjpg_synced = 0, mjpg_dropped = 0;
+
+/*
+ * with -mkv the frames are recorded into Matroska segments, each with the
+ * time of every frame and an index of the clusters. A new segment starts
+ * after segment_time ms or segment_limit bytes, so a crash loses no more
+ * than the index of the segment being written.
+ */
+static char *mkvName = NULL;
+static off_t segment_limit = 0;
+static long segment_time = 600000;
+static mkv_writer mkv;
+static struct timeval segment_start;
+
+/* read-only controls exporting the state of the writer */
+enum {
+    CTRL_QUEUE_DEPTH,
+    CTRL_QUEUE_PEAK,
+    CTRL_FRAMES_WRITTEN,
+    CTRL_FRAMES_DROPPED,
+    CTRL_LATENCY_1MS,
+    CTRL_LATENCY_4MS,
+    CTRL_LATENCY_16MS,
+    CTRL_LATENCY_64MS,
+    CTRL_LATENCY_256MS,
+    CTRL_LATENCY_SLOWER,
+    CTRL_COMMANDS_RUN,
+    CTRL_COMMANDS_FAILED,
+    CTRL_COMMANDS_SKIPPED,
+    CTRL_COMMAND_AVERAGE,
+    CTRL_COMMAND_SLOWEST,
+    CTRL_COUNT
+};
+
+static const char *control_names[CTRL_COUNT] = {
+    "Write queue depth",
+    "Write queue peak",
+    "Frames written",
+    "Frames dropped",
+    "Writes below 1 ms",
+    "Writes below 4 ms",
+    "Writes below 16 ms",
+    "Writes below 64 ms",
+    "Writes below 256 ms",
+    "Writes slower",
+    "Commands run",
+    "Commands failed",
+    "Commands skipped",
+    "Command average ms",
+    "Command slowest ms"
+};
+static control *stats = NULL;
 
 /******************************************************************************
 Description.: print a help message
@@ -67,6 +176,11 @@ void help(void)
             " The following parameters can be passed to this plugin:\n\n" \
             " [-f | --folder ]........: folder to save pictures\n" \
             " [-m | --mjpeg ].........: save the frames to an mjpg file \n" \
+            " [-mkv ].................: record the frames with their timestamps\n" \
+            "                           into Matroska files NAME_<date>_<n>.mkv\n" \
+            " [-segsize ].............: start a new mkv file after these megabytes\n" \
+            " [-segtime ].............: start a new mkv file after these seconds,\n" \
+            "                           default 600\n" \
             " [-l | --link ]..........: link the last picture in ringbuffer as this fixed named file\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
@@ -74,6 +188,19 @@ void help(void)
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
             " [-c | --command ].......: execute command after saving picture\n"\
+            COMMAND_HELP \
+            " The following arguments record events only, in either mode\n" \
+            " [-preroll ].............: keep the frames of these seconds in memory\n" \
+            "                           and write them once recording is triggered\n" \
+            " [-postroll ]............: seconds to record after the last trigger,\n" \
+            "                           default 10\n" \
+            " [-prerollmem ]..........: megabytes the pre-roll may use, default 32\n" \
+            " [-motion ]..............: trigger while the input reports motion,\n" \
+            "                           otherwise only the \"Trigger recording\"\n" \
+            "                           command starts a recording\n" \
+            " [-q | --queue ].........: frames that may wait for the disk before\n" \
+            "                           new ones get dropped, default 32\n" \
+            EXIF_HELP \
             " ---------------------------------------------------------------\n");
 }
 
@@ -86,10 +213,6 @@ void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
 
-    if (mjpgFileName != NULL) {
-        close(fd);
-    }
-
     if(!first_run) {
         DBG("already cleaned up resources\n");
         return;
@@ -98,10 +221,64 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
+    /* let the writer empty the queue, it still uses fd */
+    if(writer_running) {
+        pthread_mutex_lock(&queue_mutex);
+        writer_stop = 1;
+        pthread_cond_broadcast(&queue_changed);
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_join(writer, NULL);
+        writer_running = 0;
+    }
+    while(queue != NULL && queue_length > 0) {
+        free(queue[--queue_length].buf);
+    }
+    free(queue);
+    queue = NULL;
+
+    while(files_count > 0) {
+        free(files[files_head]);
+        files_head = (files_head + 1) % files_length;
+        files_count--;
+    }
+    free(files);
+    files = NULL;
+    files_length = 0;
+    if(dir_fd >= 0) {
+        close(dir_fd);
+        dir_fd = -1;
+    }
+
+    /* run the commands for the files that are still queued */
+    if(command != NULL) {
+        command_pool_stop(&commands);
+        OPRINT("commands run......: %u, %u failed, %u skipped\n", commands.done, commands.failed, commands.dropped);
+    }
+
+    /* complete the index of the last segment */
+    if(mkvName != NULL && mkv.fd >= 0 && mkv_close(&mkv) < 0)
+        OPRINT("could not finish the recording\n");
+
+    /* give back what was preallocated behind the end of the MJPG file */
+    if(mjpgFileName != NULL && mjpg_allocated > mjpg_offset) {
+        if(ftruncate(fd, mjpg_offset) == -1)
+            perror("ftruncate()");
+    }
+
     if(frame != NULL) {
         free(frame);
     }
-    close(fd);
+    /* only now, the writer and the ftruncate above are done with it */
+    if(mjpgFileName != NULL)
+        close(fd);
+
+    while(ring_length > 0) {
+        free(ring[--ring_length].buf);
+    }
+    free(ring);
+    ring = NULL;
+    ring_head = ring_count = 0;
+    ring_bytes = 0;
 }
 
 /******************************************************************************
@@ -145,54 +322,646 @@ int check_for_filename(const struct dirent *entry)
 }
 
 /******************************************************************************
-Description.: delete oldest files, just keep "size" most recent files
-              This funtion MAY delete the wrong files if the time is not valid
-Input Value.: how many files to keep
-Return Value: -
+Description.: appends a picture to the index of the ringbuffer, the index
+              grows as needed
+Input Value.: name of the picture inside of the folder
+Return Value: 0 if ok, -1 if there is not enough memory
 ******************************************************************************/
-void maintain_ringbuffer(int size)
+static int remember_file(const char *name)
+{
+    char *copy;
+    int i;
+
+    if(files_count == files_length) {
+        int length = files_length > 0 ? 2 * files_length : 1024;
+        char **grown = malloc(length * sizeof(char *));
+        if(grown == NULL)
+            return -1;
+        for(i = 0; i < files_count; i++)
+            grown[i] = files[(files_head + i) % files_length];
+        free(files);
+        files = grown;
+        files_length = length;
+        files_head = 0;
+    }
+
+    if((copy = strdup(name)) == NULL)
+        return -1;
+    files[(files_head + files_count) % files_length] = copy;
+    files_count++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: opens the folder and fills the index of the ringbuffer with the
+              pictures that are already there, this is the only time the
+              folder is read
+Input Value.: -
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int scan_ringbuffer(void)
 {
     struct dirent **namelist;
-    int n, i;
-    char buffer[1<<16];
+    int n, i, rc = 0;
 
-    /* do nothing if ringbuffer is not set or wrong value is set */
-    if(size < 0) return;
+    if((dir_fd = open(folder, O_RDONLY | O_DIRECTORY)) < 0) {
+        OPRINT("could not open the folder %s\n", folder);
+        return -1;
+    }
+
+    if(ringbuffer_size < 0)
+        return 0;
 
     /* get a sorted list of directory items */
     n = scandir(folder, &namelist, check_for_filename, alphasort);
     if(n < 0) {
         perror("scandir");
-        return;
+        return -1;
     }
 
     DBG("found %d directory entries\n", n);
 
-    /* delete the first (thus oldest) number of files */
-    for(i = 0; i < (n - size); i++) {
+    for(i = 0; i < n; i++) {
+        if(rc == 0 && remember_file(namelist[i]->d_name) < 0) {
+            LOG("not enough memory\n");
+            rc = -1;
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    return rc;
+}
+
+/******************************************************************************
+Description.: delete oldest files, just keep "size" most recent files
+Input Value.: how many files to keep
+Return Value: -
+******************************************************************************/
+void maintain_ringbuffer(int size)
+{
+    char *name;
+
+    /* do nothing if ringbuffer is not set or wrong value is set */
+    if(size < 0) return;
+
+    while(files_count > size) {
+        name = files[files_head];
 
-        /* put together the folder name and the directory item */
-        snprintf(buffer, sizeof(buffer), "%s/%s", folder, namelist[i]->d_name);
+        /* keep the file until its command is done with it */
+        if(command != NULL) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", folder, name);
+            if(command_pending(&commands, path))
+                break;
+        }
+        files_head = (files_head + 1) % files_length;
+        files_count--;
 
-        DBG("delete: %s\n", buffer);
+        DBG("delete: %s/%s\n", folder, name);
 
-        /* mark item for deletion */
-        if(unlink(buffer) == -1) {
+        /* relative to the folder, the path does not need to be resolved */
+        if(unlinkat(dir_fd, name, 0) == -1) {
             perror("could not delete file");
         }
+        free(name);
+    }
+}
 
-        /* free allocated memory for name */
-        free(namelist[i]);
+/* copies the statistics of the command pool to the controls */
+static void show_command_stats(void)
+{
+    pthread_mutex_lock(&commands.mutex);
+    stats[CTRL_COMMANDS_RUN].value = commands.done;
+    stats[CTRL_COMMANDS_FAILED].value = commands.failed;
+    stats[CTRL_COMMANDS_SKIPPED].value = commands.dropped;
+    stats[CTRL_COMMAND_AVERAGE].value = commands.done ? commands.latency_total / commands.done : 0;
+    stats[CTRL_COMMAND_SLOWEST].value = commands.latency_max;
+    pthread_mutex_unlock(&commands.mutex);
+}
+
+/******************************************************************************
+Description.: writes one frame to a file of its own in ringbuffer mode, runs
+              the command and maintains the ringbuffer, called by the writer
+              thread. The file is named after the time the frame was taken,
+              not when it got written, which may be much later with a
+              pre-roll or a slow disk.
+Input Value.: the JPEG as it is to be written, the timestamp of the input
+Return Value: 0 if ok, -1 if writing failed and recording has to stop
+******************************************************************************/
+static int save_frame(const jpeg_splice *jpeg, const struct timeval *timestamp)
+{
+    char buffer1[1024] = {0}, buffer2[1024] = {0};
+    struct iovec iov[JPEG_SPLICE_PIECES];
+    const char *name;
+    struct timeval taken;
+    time_t t;
+    struct tm now;
+
+    exif_wall_time(&taken, timestamp);
+    t = taken.tv_sec;
+    if(localtime_r(&t, &now) == NULL) {
+        perror("localtime");
+        return -1;
     }
 
-    /* keep the rest, but we still have to free every result */
-    for(i = MAX(n - size, 0); i < n; i++) {
-        DBG("keep: %s\n", namelist[i]->d_name);
-        free(namelist[i]);
+    /* prepare string, add time and date values */
+    if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", &now) == 0) {
+        OPRINT("strftime returned 0\n");
+        return -1;
     }
 
-    /* free last just allocated resources */
-    free(namelist);
+    /* finish filename by adding the foldername and a counter value */
+    snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
+    name = buffer2 + strlen(folder) + 1;
+
+    counter++;
+
+    DBG("writing file: %s\n", buffer2);
+
+    /* open file for write */
+    if((fd = openat(dir_fd, name, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        OPRINT("could not open the file %s\n", buffer2);
+        return -1;
+    }
+
+    /* save picture to file */
+    memcpy(iov, jpeg->iov, jpeg->count * sizeof(struct iovec));
+    if(jpeg_writev(fd, iov, jpeg->count) < 0) {
+        OPRINT("could not write to file %s\n", buffer2);
+        perror("writev()");
+        close(fd);
+        return -1;
+    }
+
+    /* start the write-back now instead of in bursts when the cache is full */
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    close(fd);
+
+    /* link the picture as fixed name file */
+    if (linkFileName) {
+        snprintf(buffer1, sizeof(buffer1), "%s/%s", folder, linkFileName);
+        unlink(buffer1);
+        (void) link(buffer2, buffer1);
+    }
+
+    /* queue the command if user specified one, it gets the filename as argument */
+    if(command != NULL) {
+        command_submit(&commands, buffer2);
+        show_command_stats();
+    }
+
+    /*
+     * maintain ringbuffer
+     * with an exceed value the files get deleted in batches, once the
+     * ringbuffer grew by that many
+     */
+    if(ringbuffer_size >= 0) {
+        if(remember_file(name) < 0) {
+            LOG("not enough memory\n");
+            return -1;
+        }
+        if(files_count > ringbuffer_size + MAX(ringbuffer_exceed, 0)) {
+            DBG("counter: %llu, will clean-up now\n", counter);
+            maintain_ringbuffer(ringbuffer_size);
+        }
+    }
+
+    return 0;
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/******************************************************************************
+Description.: starts the write-back of everything written since the last call,
+              then waits for the range started the time before and drops it
+              from the page cache, so the cache does not fill up and get
+              flushed in one long burst. Only those two windows are touched,
+              not the whole file again.
+Input Value.: file, its end, how far its write-back was started and how far
+              it was dropped from the cache, both get updated
+Return Value: -
+******************************************************************************/
+static void write_back(int file, off_t offset, off_t *synced, off_t *dropped)
+{
+    if(offset - *synced < WRITEBACK)
+        return;
+
+    sync_file_range(file, *synced, offset - *synced, SYNC_FILE_RANGE_WRITE);
+    if(*synced > *dropped) {
+        sync_file_range(file, *dropped, *synced - *dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file, *dropped, *synced - *dropped, POSIX_FADV_DONTNEED);
+    }
+    *dropped = *synced;
+    *synced = offset;
+}
+
+/******************************************************************************
+Description.: appends frames to the MJPG file with one pwritev(), the file is
+              preallocated ahead of the writes and its write-back is started
+              every few MB, waiting for the previous range, so the page cache
+              does not fill up and get flushed in one long burst
+Input Value.: the frames as they are to be written and how many of them
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int write_mjpg(const jpeg_splice *frames, int frame_count)
+{
+    struct iovec iov[WRITE_BATCH * JPEG_SPLICE_PIECES];
+    struct iovec *next = iov;
+    ssize_t total = 0, rc;
+    int i, count = 0;
+
+    for(i = 0; i < frame_count; i++) {
+        memcpy(iov + count, frames[i].iov, frames[i].count * sizeof(struct iovec));
+        count += frames[i].count;
+        total += frames[i].size;
+    }
+
+    if(mjpg_offset + total > mjpg_allocated) {
+        off_t length = (total > PREALLOCATE) ? total : PREALLOCATE;
+        /* not every file system can, then the writes just allocate */
+        if(fallocate(fd, FALLOC_FL_KEEP_SIZE, mjpg_allocated, mjpg_offset + length - mjpg_allocated) == 0)
+            mjpg_allocated = mjpg_offset + length;
+        else
+            mjpg_allocated = mjpg_offset + total;
+    }
+
+    while(count > 0) {
+        rc = pwritev(fd, next, count, mjpg_offset);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0) {
+            OPRINT("could not write to file %s\n", mjpgFileName);
+            perror("pwritev()");
+            return -1;
+        }
+        mjpg_offset += rc;
+
+        /* continue a partial write where it stopped */
+        while(count > 0 && (size_t)rc >= next->iov_len) {
+            rc -= next->iov_len;
+            next++;
+            count--;
+        }
+        if(count > 0) {
+            next->iov_base = (unsigned char *)next->iov_base + rc;
+            next->iov_len -= rc;
+        }
+    }
+
+    write_back(fd, mjpg_offset, &mjpg_synced, &mjpg_dropped);
+    return 0;
+}
+
+/******************************************************************************
+Description.: opens the next Matroska segment, named after the time its
+              first frame was taken
+Input Value.: the first frame of the segment
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int open_segment(const ring_frame *first)
+{
+    char buffer1[1024] = {0}, buffer2[1024] = {0};
+    struct timeval taken;
+    struct tm now;
+    time_t t;
+
+    exif_wall_time(&taken, &first->timestamp);
+    t = taken.tv_sec;
+    if(localtime_r(&t, &now) == NULL ||
+       strftime(buffer1, sizeof(buffer1), "%%s/%%s_%Y_%m_%d_%H_%M_%S_%%06llu.mkv", &now) == 0) {
+        OPRINT("could not build the name of the recording\n");
+        return -1;
+    }
+    snprintf(buffer2, sizeof(buffer2), buffer1, folder, mkvName, counter++);
+
+    DBG("recording to: %s\n", buffer2);
+    if(mkv_open(&mkv, buffer2, first->buf, first->size) < 0) {
+        OPRINT("could not start the recording %s\n", buffer2);
+        return -1;
+    }
+    segment_start = first->timestamp;
+    mjpg_synced = mjpg_dropped = 0;
+    return 0;
+}
+
+/******************************************************************************
+Description.: records a batch of frames into the Matroska segment, the
+              segment is closed and a new one opened once it is long or
+              large enough, between two frames
+Input Value.: the frames, how they are to be written and how many of them
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int write_mkv(const ring_frame *frames, const jpeg_splice *jpeg, int count)
+{
+    mkv_frame pending[WRITE_BATCH];
+    long long time;
+    int i, n = 0;
+
+    for(i = 0; i < count; i++) {
+        time = (frames[i].timestamp.tv_sec - segment_start.tv_sec) * 1000LL +
+               (frames[i].timestamp.tv_usec - segment_start.tv_usec) / 1000;
+
+        if(mkv.fd >= 0 &&
+           (time >= segment_time || (segment_limit > 0 && mkv.offset >= segment_limit))) {
+            if(mkv_write_frames(&mkv, pending, n) < 0)
+                return -1;
+            n = 0;
+            if(mkv_close(&mkv) < 0) {
+                OPRINT("could not finish the recording\n");
+                return -1;
+            }
+        }
+        if(mkv.fd < 0) {
+            if(open_segment(&frames[i]) < 0)
+                return -1;
+            time = 0;
+        }
+
+        /* the writer keeps them in order if the clock of the input jumps */
+        pending[n].iov = jpeg[i].iov;
+        pending[n].count = jpeg[i].count;
+        pending[n].size = jpeg[i].size;
+        pending[n].time = time;
+        n++;
+    }
+
+    if(mkv_write_frames(&mkv, pending, n) < 0)
+        return -1;
+
+    write_back(mkv.fd, mkv.offset, &mjpg_synced, &mjpg_dropped);
+    return 0;
+}
+
+/* sorts the duration of a write into the latency histogram */
+static void count_latency(const struct timespec *start)
+{
+    static const long limits[] = { 1, 4, 16, 64, 256 };
+    struct timespec now;
+    long ms;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = elapsed_ms(start, &now);
+    for(i = 0; i < 5 && ms >= limits[i]; i++);
+    stats[CTRL_LATENCY_1MS + i].value++;
+}
+
+/******************************************************************************
+Description.: the writer thread, takes everything that is queued at once and
+              writes it, the queue is only locked to find the frames and to
+              give them back
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *writer_thread(void *arg)
+{
+    static unsigned char segments[WRITE_BATCH][EXIF_SEGMENT_MAX];
+    static jpeg_splice jpeg[WRITE_BATCH];
+    ring_frame batch[WRITE_BATCH];
+    struct timespec start;
+    int count, i, rc = 0;
+
+    if(mjpgFileName == NULL && mkvName == NULL && scan_ringbuffer() < 0) {
+        pthread_mutex_lock(&queue_mutex);
+        writer_failed = 1;
+        pthread_cond_broadcast(&queue_changed);
+        pthread_mutex_unlock(&queue_mutex);
+        return NULL;
+    }
+
+    while(1) {
+        pthread_mutex_lock(&queue_mutex);
+        while(queue_count == 0 && !writer_stop)
+            pthread_cond_wait(&queue_changed, &queue_mutex);
+        if(queue_count == 0) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        count = MIN(queue_count, WRITE_BATCH);
+        for(i = 0; i < count; i++)
+            batch[i] = queue[(queue_head + i) % queue_length];
+        pthread_mutex_unlock(&queue_mutex);
+
+        /* the metadata goes in as a segment of its own, the frames stay as
+           they are */
+        for(i = 0; i < count; i++) {
+            if(exifCamera != NULL)
+                exif_stamp(&batch[i].exif, exifCamera, batch[i].buf, batch[i].size, segments[i], &jpeg[i]);
+            else
+                jpeg_splice_init(&jpeg[i], batch[i].buf, batch[i].size);
+        }
+
+        if(mkvName != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rc = write_mkv(batch, jpeg, count);
+            count_latency(&start);
+        } else if(mjpgFileName != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rc = write_mjpg(jpeg, count);
+            count_latency(&start);
+        } else {
+            for(i = 0; i < count && rc == 0; i++) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                rc = save_frame(&jpeg[i], &batch[i].timestamp);
+                count_latency(&start);
+            }
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        queue_head = (queue_head + count) % queue_length;
+        queue_count -= count;
+        stats[CTRL_QUEUE_DEPTH].value = queue_count;
+        if(rc == 0)
+            stats[CTRL_FRAMES_WRITTEN].value += count;
+        else
+            writer_failed = 1;
+        pthread_cond_broadcast(&queue_changed);
+        pthread_mutex_unlock(&queue_mutex);
+
+        if(rc != 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static void unlock_queue(void *arg)
+{
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/******************************************************************************
+Description.: hands a frame over to the writer, the buffer is exchanged with
+              a free one of the queue. If the queue is full the frame is
+              dropped, unless wait is set.
+Input Value.: buf and capacity of the frame, its size, timestamp and
+              metadata, wait for room
+Return Value: 0 if ok or dropped, -1 if the writer failed
+******************************************************************************/
+static int queue_frame(unsigned char **buf, int *capacity, int size,
+                       const struct timeval *timestamp, const exif_info *exif, int wait)
+{
+    ring_frame *f;
+    unsigned char *tmp;
+    int tmp_capacity, result = 0;
+
+    pthread_mutex_lock(&queue_mutex);
+    /* output_stop may cancel the worker while it waits for room */
+    pthread_cleanup_push(unlock_queue, NULL);
+    while(wait && queue_count == queue_length && !writer_failed)
+        pthread_cond_wait(&queue_changed, &queue_mutex);
+    pthread_cleanup_pop(0);
+
+    if(writer_failed) {
+        result = -1;
+    } else if(queue_count == queue_length) {
+        DBG("write queue full, dropping frame\n");
+        stats[CTRL_FRAMES_DROPPED].value++;
+    } else {
+        f = &queue[(queue_head + queue_count) % queue_length];
+        tmp = f->buf;
+        tmp_capacity = f->capacity;
+        f->buf = *buf;
+        f->capacity = *capacity;
+        f->size = size;
+        f->timestamp = *timestamp;
+        f->exif = *exif;
+        *buf = tmp;
+        *capacity = tmp_capacity;
+
+        queue_count++;
+        stats[CTRL_QUEUE_DEPTH].value = queue_count;
+        if(queue_count > stats[CTRL_QUEUE_PEAK].value)
+            stats[CTRL_QUEUE_PEAK].value = queue_count;
+        pthread_cond_broadcast(&queue_changed);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    return result;
+}
+
+/******************************************************************************
+Description.: appends the current frame to the pre-roll, the oldest frames
+              are dropped once they are out of the time window or the memory
+              limit is reached. The ring grows until it holds the window.
+Input Value.: size of the current frame, now is when it was taken
+Return Value: 0 if ok, -1 if there is not enough memory
+******************************************************************************/
+static int preroll_push(int frame_size, const struct timespec *now)
+{
+    ring_frame *f;
+    unsigned char *tmp;
+    int i, tmp_capacity;
+
+    while(ring_count > 0) {
+        f = &ring[ring_head];
+        if(elapsed_ms(&f->taken, now) <= preroll && ring_bytes + frame_size <= preroll_limit)
+            break;
+        ring_bytes -= f->size;
+        ring_head = (ring_head + 1) % ring_length;
+        ring_count--;
+    }
+
+    if(ring_count == ring_length) {
+        int length = ring_length > 0 ? 2 * ring_length : 16;
+        ring_frame *grown = calloc(length, sizeof(ring_frame));
+        if(grown == NULL) {
+            LOG("not enough memory\n");
+            return -1;
+        }
+        /* unwrap the ring, the unused slots keep their buffers */
+        for(i = 0; i < ring_length; i++)
+            grown[i] = ring[(ring_head + i) % ring_length];
+        free(ring);
+        ring = grown;
+        ring_length = length;
+        ring_head = 0;
+    }
+
+    /* hand the frame over and take the buffer of the slot in exchange */
+    f = &ring[(ring_head + ring_count) % ring_length];
+    tmp = f->buf;
+    tmp_capacity = f->capacity;
+    f->buf = frame;
+    f->capacity = max_frame_size;
+    f->size = frame_size;
+    f->taken = *now;
+    f->timestamp = frame_time;
+    f->exif = frame_exif;
+    frame = tmp;
+    max_frame_size = tmp_capacity;
+
+    ring_bytes += frame_size;
+    ring_count++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: queues and empties the pre-roll, oldest frame first, all of it
+              gets written even if the intake has to wait for the writer
+Input Value.: -
+Return Value: 0 if ok, -1 if writing failed
+******************************************************************************/
+static int preroll_flush(void)
+{
+    while(ring_count > 0) {
+        ring_frame *f = &ring[ring_head];
+        if(queue_frame(&f->buf, &f->capacity, f->size, &f->timestamp, &f->exif, 1) < 0)
+            return -1;
+        ring_bytes -= f->size;
+        ring_head = (ring_head + 1) % ring_length;
+        ring_count--;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: event mode, keeps the current frame in the pre-roll or writes
+              it if recording was triggered within the last postroll ms
+Input Value.: size of the current frame, motion tells if the input reported
+              motion for it
+Return Value: 0 if ok, -1 on errors that end the recording
+******************************************************************************/
+static int record_event(int frame_size, int motion)
+{
+    static int recording = 0;
+    static struct timespec last_trigger;
+    struct timespec now;
+    int trigger;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&trigger_mutex);
+    trigger = trigger_pending || (motion_trigger && motion);
+    trigger_pending = 0;
+    pthread_mutex_unlock(&trigger_mutex);
+
+    if(trigger) {
+        if(!recording) {
+            OPRINT("recording triggered, writing %d frames of pre-roll\n", ring_count);
+            if(preroll_flush() < 0)
+                return -1;
+            recording = 1;
+        }
+        last_trigger = now;
+    }
+
+    if(!recording)
+        return preroll_push(frame_size, &now);
+
+    if(queue_frame(&frame, &max_frame_size, frame_size, &frame_time, &frame_exif, 0) < 0)
+        return -1;
+
+    if(elapsed_ms(&last_trigger, &now) > postroll) {
+        OPRINT("recording stopped, back to pre-roll\n");
+        recording = 0;
+    }
+    return 0;
 }
 
 /******************************************************************************
@@ -203,16 +972,27 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
-    char buffer1[1024] = {0}, buffer2[1024] = {0};
-    unsigned long long counter = 0;
-    time_t t;
-    struct tm *now;
+    int ok = 1, frame_size = 0, motion = 0;
     unsigned char *tmp_framebuffer = NULL;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    if(command != NULL && command_pool_start(&commands, command) < 0) {
+        OPRINT("could not start the command threads\n");
+        command = NULL;
+        ok = -1;
+    } else if((queue = calloc(queue_length, sizeof(ring_frame))) == NULL ||
+              pthread_create(&writer, 0, writer_thread, NULL) != 0) {
+        OPRINT("could not start the writer thread\n");
+        ok = -1;
+    } else {
+        writer_running = 1;
+    }
+
+    /* frames are saved for as long as this output runs */
+    input_subscribe(&pglobal->in[input_number]);
+
     while(ok >= 0 && !pglobal->stop) {
         DBG("waiting for fresh frame\n");
 
@@ -220,7 +1000,7 @@ void *worker_thread(void *arg)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
 
         /* check if buffer for frame is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -238,99 +1018,20 @@ void *worker_thread(void *arg)
 
         /* copy frame to our local buffer now */
         memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        motion = pglobal->in[input_number].motion.active;
+        frame_time = pglobal->in[input_number].timestamp;
+        if(frame_time.tv_sec == 0 && frame_time.tv_usec == 0)
+            gettimeofday(&frame_time, NULL);
+        if(exifCamera != NULL)
+            exif_capture(&frame_exif, &pglobal->in[input_number]);
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
-        if (mjpgFileName == NULL) { // single files with ringbuffer mode
-            /* prepare filename */
-            memset(buffer1, 0, sizeof(buffer1));
-            memset(buffer2, 0, sizeof(buffer2));
-
-            /* get current time */
-            t = time(NULL);
-            now = localtime(&t);
-            if(now == NULL) {
-                perror("localtime");
-                return NULL;
-            }
-
-            /* prepare string, add time and date values */
-            if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
-                OPRINT("strftime returned 0\n");
-                free(frame); frame = NULL;
-                return NULL;
-            }
-
-            /* finish filename by adding the foldername and a counter value */
-            snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
-
-            counter++;
-
-            DBG("writing file: %s\n", buffer2);
-
-            /* open file for write */
-            if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                OPRINT("could not open the file %s\n", buffer2);
-                return NULL;
-            }
-
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
-
-            close(fd);
-
-            /* link the picture as fixed name file */
-            if (linkFileName) {
-                snprintf(buffer1, sizeof(buffer1), "%s/%s", folder, linkFileName);
-                unlink(buffer1);
-                (void) link(buffer2, buffer1);
-            }
-
-            /* call the command if user specified one, pass current filename as argument */
-            if(command != NULL) {
-                memset(buffer1, 0, sizeof(buffer1));
-
-                /* buffer2 still contains the filename, pass it to the command as parameter */
-                snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
-                DBG("calling command %s", buffer1);
-
-                /* in addition provide the filename as environment variable */
-                if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
-                    LOG("setenv failed (return value %d)\n", rc);
-                }
-
-                /* execute the command now */
-                if((rc = system(buffer1)) != 0) {
-                    LOG("command failed (return value %d)\n", rc);
-                }
-            }
-
-            /*
-             * maintain ringbuffer
-             * do not maintain ringbuffer for each picture, this saves resources since
-             * each run of the maintainance function involves sorting/malloc/free operations
-             */
-            if(ringbuffer_exceed <= 0) {
-                /* keep ringbuffer excactly at specified siOUTPUT_PLUGIN_NAMEze */
-                maintain_ringbuffer(ringbuffer_size);
-            } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
-                DBG("counter: %llu, will clean-up now\n", counter);
-                maintain_ringbuffer(ringbuffer_size);
-            }
-        } else { // recording to MJPG file
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
+        if(preroll < 0) {
+            ok = queue_frame(&frame, &max_frame_size, frame_size, &frame_time, &frame_exif, 0);
+        } else {
+            ok = record_event(frame_size, motion);
         }
 
         /* if specified, wait now */
@@ -339,6 +1040,8 @@ void *worker_thread(void *arg)
         }
     }
 
+    input_unsubscribe(&pglobal->in[input_number]);
+
     /* cleanup now */
     pthread_cleanup_pop(1);
 
@@ -368,6 +1071,8 @@ int output_init(output_parameter *param, int id)
         DBG("argv[%d]=%s\n", i, param->argv[i]);
     }
 
+    command_pool_init(&commands);
+
     reset_getopt();
     while(1) {
         int option_index = 0, c = 0;
@@ -390,6 +1095,19 @@ int output_init(output_parameter *param, int id)
             {"link", required_argument, 0, 0},
             {"c", required_argument, 0, 0},
             {"command", required_argument, 0, 0},
+            {"preroll", required_argument, 0, 0},
+            {"postroll", required_argument, 0, 0},
+            {"prerollmem", required_argument, 0, 0},
+            {"motion", no_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
+            {"mkv", required_argument, 0, 0},
+            {"segsize", required_argument, 0, 0},
+            {"segtime", required_argument, 0, 0},
+            {"cmdthreads", required_argument, 0, 0},
+            {"cmdqueue", required_argument, 0, 0},
+            {"cmdoverflow", required_argument, 0, 0},
+            {"exif", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -467,6 +1185,78 @@ int output_init(output_parameter *param, int id)
             DBG("case 16,17\n");
             command = strdup(optarg);
             break;
+            /* preroll */
+        case 18:
+            DBG("case 18\n");
+            preroll = atof(optarg) * 1000;
+            if(preroll < 0) {
+                help();
+                return 1;
+            }
+            break;
+            /* postroll */
+        case 19:
+            DBG("case 19\n");
+            postroll = atof(optarg) * 1000;
+            if(postroll < 0) {
+                help();
+                return 1;
+            }
+            break;
+            /* prerollmem */
+        case 20:
+            DBG("case 20\n");
+            preroll_limit = (size_t)atoi(optarg) << 20;
+            break;
+            /* motion */
+        case 21:
+            DBG("case 21\n");
+            motion_trigger = 1;
+            break;
+            /* q, queue */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            queue_length = atoi(optarg);
+            if(queue_length < 1) {
+                help();
+                return 1;
+            }
+            break;
+            /* mkv */
+        case 24:
+            DBG("case 24\n");
+            mkvName = strdup(optarg);
+            break;
+            /* segsize */
+        case 25:
+            DBG("case 25\n");
+            segment_limit = (off_t)atoi(optarg) << 20;
+            break;
+            /* segtime */
+        case 26:
+            DBG("case 26\n");
+            segment_time = atof(optarg) * 1000;
+            if(segment_time <= 0) {
+                help();
+                return 1;
+            }
+            break;
+            /* cmdthreads, cmdqueue, cmdoverflow */
+        case 27:
+        case 28:
+        case 29:
+            DBG("case 27,28,29\n");
+            if(command_pool_option(&commands, long_options[option_index].name, optarg) < 0) {
+                help();
+                return 1;
+            }
+            break;
+            /* exif */
+        case 30:
+            DBG("case 30\n");
+            exifCamera = strdup(optarg);
+            break;
         }
     }
 
@@ -478,7 +1268,25 @@ int output_init(output_parameter *param, int id)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
     OPRINT("delay after save..: %d\n", delay);
-    if  (mjpgFileName == NULL) {
+    OPRINT("write queue.......: %d frames\n", queue_length);
+    OPRINT("Exif metadata.....: %s\n", exifCamera == NULL ? "disabled" : exifCamera);
+    if(command != NULL) {
+        OPRINT("command...........: %s, %d at a time, %d queued, skipping the %s\n", command,
+               commands.workers, commands.length, commands.overflow == COMMAND_DROP_OLDEST ? "oldest" : "newest");
+    }
+    mkv.fd = -1;
+    if(mkvName != NULL) {
+        if(mjpgFileName != NULL) {
+            OPRINT("ERROR: -mkv and -mjpeg can not be combined\n");
+            return 1;
+        }
+        OPRINT("recording.........: %s/%s_*.mkv\n", folder, mkvName);
+        if(segment_limit > 0) {
+            OPRINT("segments..........: %ld s or %ld MB\n", segment_time / 1000, (long)(segment_limit >> 20));
+        } else {
+            OPRINT("segments..........: %ld s\n", segment_time / 1000);
+        }
+    } else if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
             OPRINT("ringbuffer size...: %d to %d\n", ringbuffer_size, ringbuffer_size + ringbuffer_exceed);
         } else {
@@ -496,10 +1304,18 @@ int output_init(output_parameter *param, int id)
         }
         free(fnBuffer);
     }
+    if(preroll >= 0) {
+        OPRINT("record events....: %d ms pre-roll (at most %lu MB), %d ms post-roll\n",
+               preroll, (unsigned long)(preroll_limit >> 20), postroll);
+        OPRINT("trigger..........: %s\n", motion_trigger ? "command or motion" : "command");
+    } else if(motion_trigger) {
+        OPRINT("ERROR: -motion needs -preroll\n");
+        return 1;
+    }
 
-    param->global->out[id].parametercount = 2;
+    param->global->out[id].parametercount = (preroll >= 0 ? 3 : 2) + CTRL_COUNT;
 
-    param->global->out[id].out_parameters = (control*) calloc(2, sizeof(control));
+    param->global->out[id].out_parameters = (control*) calloc(3 + CTRL_COUNT, sizeof(control));
 
     control take_ctrl;
 	take_ctrl.group = IN_CMD_GENERIC;
@@ -533,6 +1349,38 @@ int output_init(output_parameter *param, int id)
 
 	param->global->out[id].out_parameters[1] = filename_ctrl;
 
+    control trigger_ctrl;
+	trigger_ctrl.group = IN_CMD_GENERIC;
+	trigger_ctrl.menuitems = NULL;
+	trigger_ctrl.value = 1;
+	trigger_ctrl.class_id = 0;
+
+	trigger_ctrl.ctrl.id = OUT_FILE_CMD_TRIGGER;
+	trigger_ctrl.ctrl.type = V4L2_CTRL_TYPE_BUTTON;
+	strcpy((char*) trigger_ctrl.ctrl.name, "Trigger recording");
+	trigger_ctrl.ctrl.minimum = 0;
+	trigger_ctrl.ctrl.maximum = 1;
+	trigger_ctrl.ctrl.step = 1;
+	trigger_ctrl.ctrl.default_value = 0;
+
+	param->global->out[id].out_parameters[2] = trigger_ctrl;
+
+    /* the writer statistics follow the commands */
+    stats = &param->global->out[id].out_parameters[preroll >= 0 ? 3 : 2];
+    for(i = 0; i < CTRL_COUNT; i++) {
+        stats[i].group = IN_CMD_GENERIC;
+        stats[i].menuitems = NULL;
+        stats[i].value = 0;
+        stats[i].class_id = 0;
+        stats[i].ctrl.id = V4L2_CID_PRIVATE_BASE + i;
+        stats[i].ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+        stats[i].ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+        snprintf((char*) stats[i].ctrl.name, sizeof(stats[i].ctrl.name), "%s", control_names[i]);
+        stats[i].ctrl.minimum = 0;
+        stats[i].ctrl.maximum = INT_MAX;
+        stats[i].ctrl.step = 1;
+        stats[i].ctrl.default_value = 0;
+    }
 
     return 0;
 }
@@ -575,53 +1423,59 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                             case OUT_FILE_CMD_TAKE: {
                                 if (valueStr != NULL) {
                                     int frame_size = 0;
-                                    unsigned char *tmp_framebuffer = NULL;
+                                    unsigned char *snapshot, segment[EXIF_SEGMENT_MAX];
+                                    exif_info exif;
+                                    jpeg_splice jpeg;
 
                                     if(pthread_mutex_lock(&pglobal->in[input_number].db)) {
                                         DBG("Unable to lock mutex\n");
                                         return -1;
                                     }
                                     /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
-
-                                    /* check if buffer for frame is large enough, increase it if necessary */
-                                    if(frame_size > max_frame_size) {
-                                        DBG("increasing buffer size to %d\n", frame_size);
+                                    frame_size = input_jpeg(&pglobal->in[input_number]);
 
-                                        max_frame_size = frame_size + (1 << 16);
-                                        if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                                            pthread_mutex_unlock(&pglobal->in[input_number].db);
-                                            LOG("not enough memory\n");
-                                            return -1;
-                                        }
-
-                                        frame = tmp_framebuffer;
+                                    /* a buffer of its own, the worker hands frame over to the
+                                       writer without holding the lock */
+                                    if(frame_size < 0 || (snapshot = malloc(frame_size > 0 ? frame_size : 1)) == NULL) {
+                                        pthread_mutex_unlock(&pglobal->in[input_number].db);
+                                        LOG("not enough memory\n");
+                                        return -1;
                                     }
 
                                     /* copy frame to our local buffer now */
-                                    memcpy(frame, pglobal->in[input_number].buf, frame_size);
+                                    memcpy(snapshot, pglobal->in[input_number].buf, frame_size);
+                                    if(exifCamera != NULL)
+                                        exif_capture(&exif, &pglobal->in[input_number]);
 
                                     /* allow others to access the global buffer again */
                                     pthread_mutex_unlock(&pglobal->in[input_number].db);
 
+                                    if(exifCamera != NULL)
+                                        exif_stamp(&exif, exifCamera, snapshot, frame_size, segment, &jpeg);
+                                    else
+                                        jpeg_splice_init(&jpeg, snapshot, frame_size);
+
                                     DBG("writing file: %s\n", valueStr);
 
                                     int fd;
                                     /* open file for write */
                                     if((fd = open(valueStr, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                                         OPRINT("could not open the file %s\n", valueStr);
+                                        free(snapshot);
                                         return -1;
                                     }
 
                                     /* save picture to file */
-                                    if(write(fd, frame, frame_size) < 0) {
+                                    if(jpeg_writev(fd, jpeg.iov, jpeg.count) < 0) {
                                         OPRINT("could not write to file %s\n", valueStr);
-                                        perror("write()");
+                                        perror("writev()");
                                         close(fd);
+                                        free(snapshot);
                                         return -1;
                                     }
 
                                     close(fd);
+                                    free(snapshot);
                                 } else {
                                     DBG("No filename specified\n");
                                     return -1;
@@ -631,6 +1485,12 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                 DBG("Not yet implemented\n");
                                 return -1;
                             } break;
+                            case OUT_FILE_CMD_TRIGGER: {
+                                /* the worker picks it up with the next frame */
+                                pthread_mutex_lock(&trigger_mutex);
+                                trigger_pending = 1;
+                                pthread_mutex_unlock(&trigger_mutex);
+                            } break;
                             default: {
                                 DBG("Unknown command\n");
                                 return -1;
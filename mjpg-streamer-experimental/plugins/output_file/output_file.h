@@ -3,5 +3,6 @@
 
 #define OUT_FILE_CMD_TAKE           1
 #define OUT_FILE_CMD_FILENAME       2
+#define OUT_FILE_CMD_TRIGGER        3
 
 #endif
@@ -30,6 +30,7 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -44,6 +45,7 @@
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
 
+#include "../exif.h"
 #include "httpd.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
@@ -394,6 +396,56 @@ void update_client_timestamp(client_info *client)
 }
 #endif
 
+/******************************************************************************
+Description.: formats the motion headers of a frame, they are left out if the
+              input does not detect motion
+Input Value.: buffer of at least 96 bytes, motion of the frame
+Return Value: buffer
+******************************************************************************/
+static char *motion_headers(char *buffer, const input_motion *motion)
+{
+    buffer[0] = '\0';
+    if(motion->score >= 0)
+        sprintf(buffer, "X-Motion-Score: %d\r\n" \
+                "X-Motion: %s\r\n" \
+                "X-Motion-Events: %u\r\n", motion->score, motion->active ? "active" : "none", motion->events);
+    return buffer;
+}
+
+/******************************************************************************
+Description.: puts the capture metadata into a frame if the server was
+              started with -exif, the frame itself is not copied
+Input Value.: context_fd, the metadata copied along with the frame, the
+              frame and its size, segment of EXIF_SEGMENT_MAX bytes for the
+              metadata, splice receives the frame to send
+Return Value: -
+******************************************************************************/
+static void stamp_frame(cfd *context_fd, const exif_info *exif, const unsigned char *frame, int size,
+                        unsigned char *segment, jpeg_splice *splice)
+{
+    if(context_fd->pc->conf.exif != NULL)
+        exif_stamp(exif, context_fd->pc->conf.exif, frame, size, segment, splice);
+    else
+        jpeg_splice_init(splice, frame, size);
+}
+
+/******************************************************************************
+Description.: sends the headers of a frame and the frame, with one writev()
+              unless the socket takes only part of it
+Input Value.: fildescriptor, the headers and the frame as stamp_frame()
+              prepared it
+Return Value: 0 if ok, -1 if the client is gone
+******************************************************************************/
+static int send_frame(int fd, const char *headers, const jpeg_splice *splice)
+{
+    struct iovec iov[1 + JPEG_SPLICE_PIECES];
+
+    iov[0].iov_base = (void *)headers;
+    iov[0].iov_len = strlen(headers);
+    memcpy(iov + 1, splice->iov, splice->count * sizeof(struct iovec));
+    return jpeg_writev(fd, iov, 1 + splice->count);
+}
+
 /******************************************************************************
 Description.: Send a complete HTTP response and a single JPG-frame.
 Input Value.: fildescriptor fd to send the answer to
@@ -401,17 +453,20 @@ Return Value: -
 ******************************************************************************/
 void send_snapshot(cfd *context_fd, int input_number)
 {
-    unsigned char *frame = NULL;
+    unsigned char *frame = NULL, segment[EXIF_SEGMENT_MAX];
     int frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
+    char buffer[BUFFER_SIZE] = {0}, motion[96];
     struct timeval timestamp;
+    input_motion frame_motion;
+    exif_info exif;
+    jpeg_splice splice;
 
     /* wait for a fresh frame */
     pthread_mutex_lock(&pglobal->in[input_number].db);
     pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
     /* read buffer */
-    frame_size = pglobal->in[input_number].size;
+    frame_size = input_jpeg(&pglobal->in[input_number]);
 
     /* allocate a buffer for this single frame */
     if((frame = malloc(frame_size + 1)) == NULL) {
@@ -422,6 +477,9 @@ void send_snapshot(cfd *context_fd, int input_number)
     }
     /* copy v4l2_buffer timeval to user space */
     timestamp = pglobal->in[input_number].timestamp;
+    frame_motion = pglobal->in[input_number].motion;
+    if(context_fd->pc->conf.exif != NULL)
+        exif_capture(&exif, &pglobal->in[input_number]);
 
     memcpy(frame, pglobal->in[input_number].buf, frame_size);
     DBG("got frame (size: %d kB)\n", frame_size / 1024);
@@ -432,17 +490,19 @@ void send_snapshot(cfd *context_fd, int input_number)
     update_client_timestamp(context_fd->client);
     #endif
 
+    stamp_frame(context_fd, &exif, frame, frame_size, segment, &splice);
+
     /* write the response */
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
             "Access-Control-Allow-Origin: *\r\n" \
             STD_HEADER \
             "Content-type: image/jpeg\r\n" \
             "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
+            "%s" \
+            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec, motion_headers(motion, &frame_motion));
 
     /* send header and image now */
-    if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
-        write(context_fd->fd, frame, frame_size) < 0) {
+    if(send_frame(context_fd->fd, buffer, &splice) < 0) {
         free(frame);
         return;
     }
@@ -457,10 +517,13 @@ Return Value: -
 ******************************************************************************/
 void send_stream(cfd *context_fd, int input_number)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
+    unsigned char *frame = NULL, *tmp = NULL, segment[EXIF_SEGMENT_MAX];
     int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
+    char buffer[BUFFER_SIZE] = {0}, motion[96];
     struct timeval timestamp;
+    input_motion frame_motion;
+    exif_info exif;
+    jpeg_splice splice;
 
     DBG("preparing header\n");
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
@@ -484,7 +547,7 @@ void send_stream(cfd *context_fd, int input_number)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
 
         /* check if framebuffer is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -503,6 +566,9 @@ void send_stream(cfd *context_fd, int input_number)
 
         /* copy v4l2_buffer timeval to user space */
         timestamp = pglobal->in[input_number].timestamp;
+        frame_motion = pglobal->in[input_number].motion;
+        if(context_fd->pc->conf.exif != NULL)
+            exif_capture(&exif, &pglobal->in[input_number]);
 
         memcpy(frame, pglobal->in[input_number].buf, frame_size);
         DBG("got frame (size: %d kB)\n", frame_size / 1024);
@@ -513,6 +579,8 @@ void send_stream(cfd *context_fd, int input_number)
         update_client_timestamp(context_fd->client);
         #endif
 
+        stamp_frame(context_fd, &exif, frame, frame_size, segment, &splice);
+
         /*
          * print the individual mimetype and the length
          * sending the content-length fixes random stream disruption observed
@@ -521,12 +589,11 @@ void send_stream(cfd *context_fd, int input_number)
         sprintf(buffer, "Content-Type: image/jpeg\r\n" \
                 "Content-Length: %d\r\n" \
                 "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
-
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+                "%s" \
+                "\r\n", splice.size, (int)timestamp.tv_sec, (int)timestamp.tv_usec,
+                motion_headers(motion, &frame_motion));
+        DBG("sending intemdiate header and frame\n");
+        if(send_frame(context_fd->fd, buffer, &splice) < 0) break;
 
         DBG("sending boundary\n");
         sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
@@ -587,7 +654,7 @@ void send_stream_wxp(cfd *context_fd, int input_number)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
 
         /* check if framebuffer is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -1251,11 +1318,8 @@ void *client_thread(void *arg)
     if(query_suffixed) {
         char *sch = strchr(buffer, '_');
         if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
+            DBG("Suffix character: %s\n", sch + 1);
+            input_number = isdigit((unsigned char)sch[1]) ? atoi(sch + 1) : 0;
 
             if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
                 input_number--;
@@ -1320,16 +1384,22 @@ void *client_thread(void *arg)
     case A_SNAPSHOT_WXP:
     case A_SNAPSHOT:
         DBG("Request for snapshot from input: %d\n", input_number);
+        input_subscribe(&pglobal->in[input_number]);
         send_snapshot(&lcfd, input_number);
+        input_unsubscribe(&pglobal->in[input_number]);
         break;
     case A_STREAM:
         DBG("Request for stream from input: %d\n", input_number);
+        input_subscribe(&pglobal->in[input_number]);
         send_stream(&lcfd, input_number);
+        input_unsubscribe(&pglobal->in[input_number]);
         break;
     #ifdef WXP_COMPAT
     case A_STREAM_WXP:
         DBG("Request for WXP compat stream from input: %d\n", input_number);
+        input_subscribe(&pglobal->in[input_number]);
         send_stream_wxp(&lcfd, input_number);
+        input_unsubscribe(&pglobal->in[input_number]);
         break;
     #endif
     case A_COMMAND:
@@ -1405,7 +1475,9 @@ void *client_thread(void *arg)
             send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
         } else {
             if (ret == 0) {
+                input_subscribe(&pglobal->in[input_number]);
                 send_snapshot(&lcfd, input_number);
+                input_unsubscribe(&pglobal->in[input_number]);
             } else {
                 send_error(lcfd.fd, 404, "Taking snapshot failed!");
             }
@@ -124,6 +124,7 @@ typedef struct {
     char *credentials;
     char *www_folder;
     char nocommands;
+    char *exif;             // camera id for the frames, NULL to leave them as they are
 } config;
 
 /* context of each server thread */
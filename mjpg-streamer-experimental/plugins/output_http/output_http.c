@@ -39,6 +39,7 @@
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../exif.h"
 #include "httpd.h"
 
 #define OUTPUT_PLUGIN_NAME "HTTP output plugin"
@@ -64,6 +65,7 @@ void help(void)
 	    " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
+            EXIF_HELP
             " ---------------------------------------------------------------\n");
 }
 
@@ -81,7 +83,7 @@ int output_init(output_parameter *param, int id)
 {
     int i;
     int  port;
-    char *credentials, *www_folder, *hostname = NULL;
+    char *credentials, *www_folder, *hostname = NULL, *exif = NULL;
     char nocommands;
 
     DBG("output #%02d\n", param->id);
@@ -115,6 +117,7 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"exif", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -175,6 +178,12 @@ int output_init(output_parameter *param, int id)
             DBG("case 10,11\n");
             nocommands = 1;
             break;
+
+            /* exif */
+        case 12:
+            DBG("case 12\n");
+            exif = strdup(optarg);
+            break;
         }
     }
 
@@ -185,12 +194,14 @@ int output_init(output_parameter *param, int id)
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.exif = exif;
 
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port........: %d\n", ntohs(port));
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands.............: %s\n", (nocommands) ? "disabled" : "enabled");
+    OPRINT("Exif metadata........: %s\n", (exif == NULL) ? "disabled" : exif);
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
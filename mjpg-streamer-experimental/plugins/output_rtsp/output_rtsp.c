@@ -21,57 +21,127 @@
 *******************************************************************************/
 
 /*
-  This output plugin is based on code from output_file.c
-  Writen by Dimitrios Zachariadis
-  Version 0.1, May 2010
+  This output plugin streams the frames as RTP/JPEG (RFC 2435) and has an
+  RTSP server (RFC 2326) to control the streams. Clients get the packets by
+  UDP, interleaved in their RTSP connection, or from a multicast group that
+  all of them share.
 
-  It provides a mechanism to take snapshots with a trigger from a UDP packet.
-  The UDP msg contains the path for the snapshot jpeg file
-  It echoes the message received back to the sender, after taking the snapshot
+  Every frame is split into packets once, all clients get the same packets,
+  only the destinations differ. The UDP packets of a frame go out with a
+  few sendmmsg() calls, interleaved ones with sendmsg() per client.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <strings.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/socket.h>
-#include <resolv.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
 #include <time.h>
 #include <syslog.h>
 
-#include <dirent.h>
-
-
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
+#include "rtp_jpeg.h"
 
 #define OUTPUT_PLUGIN_NAME "RTSP output plugin"
 
-enum RTSP_State {
-    RTSP_State_Setup,
-    RTSP_State_Playing,
-    RTSP_State_Paused,
-    RTSP_State_Teardown,
+#define MAX_CLIENTS 32
+#define REQUEST_SIZE 4096
+#define REPLY_SIZE 4096
+#define SESSION_TIMEOUT 60          // s without a request or report from a UDP client
+#define REPORT_INTERVAL 5           // s between RTCP sender reports
+#define SEND_BATCH 64               // UDP packets per sendmmsg()
+#define REPLY_QUEUE (2 * REPLY_SIZE) // replies a client may leave unread
+
+enum _transport {
+    TRANSPORT_NONE,
+    TRANSPORT_UDP,
+    TRANSPORT_TCP,
+    TRANSPORT_MULTICAST
+};
+
+typedef struct _rtsp_client rtsp_client;
+struct _rtsp_client {
+    int sd;                         // RTSP connection, -1 if the slot is free
+    struct sockaddr_in peer;
+    char request[REQUEST_SIZE];
+    int request_length;
+
+    char session[9];                // empty until SETUP
+    int transport;
+    int playing;
+    struct sockaddr_in rtp, rtcp;   // unicast UDP
+    int channel;                    // interleaved RTP, RTCP is channel + 1
+    time_t last_seen;
+
+    /* interleaved data the socket did not take yet */
+    unsigned char *pending;
+    int pending_size, pending_capacity;
+
+    /* replies, they go out once the interleaved data is gone */
+    char reply[REPLY_QUEUE];
+    int reply_size;
 };
 
-static pthread_t worker;
+static pthread_t worker, server;
 static globals *pglobal;
-static int fd, max_frame_size;
+static int max_frame_size;
 static unsigned char *frame = NULL;
-static char *command = NULL;
 static int input_number = 0;
 
-// UDP port
-static int port = 554;
+static int port = 8554;
+static int udp_port = 6970;         // RTP, RTCP is udp_port + 1
+static int mtu = 1400;
+static struct in_addr multicast_group;
+static int multicast_port = 0, multicast_ttl = 1;
+
+static int listen_sd = -1, rtp_sd = -1, rtcp_sd = -1;
+static int server_running = 0, server_stop = 0, subscribed = 0;
+static rtsp_client clients[MAX_CLIENTS];
+static int players = 0, multicast_players = 0;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_changed = PTHREAD_COND_INITIALIZER;
+
+/* the stream, only used under clients_mutex */
+static rtp_jpeg rtp;
+static uint32_t rtp_base;           // random start of the RTP time
+static uint32_t last_rtp_time;
+static struct timeval last_frame_wall;
+
+/* read-only controls exporting the state of the server */
+enum {
+    CTRL_CLIENTS,
+    CTRL_PLAYING,
+    CTRL_MULTICAST,
+    CTRL_FRAMES_SENT,
+    CTRL_FRAMES_UNSUPPORTED,
+    CTRL_FRAMES_SKIPPED,
+    CTRL_PACKETS_SENT,
+    CTRL_COUNT
+};
+
+static const char *control_names[CTRL_COUNT] = {
+    "Connections",
+    "Clients playing",
+    "Multicast clients",
+    "Frames sent",
+    "Frames not carried",
+    "Frames skipped by slow clients",
+    "Packets sent"
+};
+static control *stats = NULL;
 
 /******************************************************************************
 Description.: print a help message
@@ -84,11 +154,680 @@ void help(void)
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
             " ---------------------------------------------------------------\n" \
             " The following parameters can be passed to this plugin:\n\n" \
-            " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n\n" \
+            " [-p | --port ]..........: RTSP port, default 8554\n" \
+            " [-u | --udp ]...........: UDP port the RTP packets are sent from,\n" \
+            "                           RTCP uses the next one, default 6970\n" \
+            " [-m | --multicast ].....: ADDRESS:PORT of a group that clients asking\n" \
+            "                           for multicast share\n" \
+            " [-ttl ].................: time to live of the multicast packets, default 1\n" \
+            " [-mtu ].................: bytes of an RTP packet, default 1400\n" \
             " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
             " ---------------------------------------------------------------\n");
 }
 
+/* RTP time of a frame taken at tv, 90 kHz */
+static uint32_t rtp_time(const struct timeval *tv)
+{
+    return rtp_base + (uint32_t)(tv->tv_sec * RTP_JPEG_CLOCK) + (uint32_t)(tv->tv_usec * 9 / 100);
+}
+
+/* RTP time of now, following the clock of the frames */
+static uint32_t rtp_time_now(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if(last_frame_wall.tv_sec == 0)
+        return rtp_time(&now);
+    return last_rtp_time +
+           (uint32_t)((now.tv_sec - last_frame_wall.tv_sec) * RTP_JPEG_CLOCK +
+                      (now.tv_usec - last_frame_wall.tv_usec) * 9 / 100);
+}
+
+/* writes as much of a queue as the socket takes, without waiting */
+static int send_queued(int sd, void *queue, int *size)
+{
+    ssize_t rc;
+
+    if(*size == 0)
+        return 0;
+    rc = send(sd, queue, *size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(rc < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    memmove(queue, (char *)queue + rc, *size - rc);
+    *size -= rc;
+    return 0;
+}
+
+/* writes what is left of the interleaved data and then the replies, the
+   server thread calls this again once the socket takes more */
+static int flush_pending(rtsp_client *c)
+{
+    if(send_queued(c->sd, c->pending, &c->pending_size) < 0)
+        return -1;
+    if(c->pending_size > 0)
+        return 0;
+    return send_queued(c->sd, c->reply, &c->reply_size);
+}
+
+/* stops sending to a client, called with clients_mutex held */
+static void stop_playing(rtsp_client *c)
+{
+    if(!c->playing)
+        return;
+    c->playing = 0;
+    players--;
+    if(c->transport == TRANSPORT_MULTICAST)
+        multicast_players--;
+    stats[CTRL_PLAYING].value = players;
+    stats[CTRL_MULTICAST].value = multicast_players;
+    pthread_cond_broadcast(&clients_changed);
+}
+
+/* closes the connection and ends the session, with clients_mutex held */
+static void drop_client(rtsp_client *c)
+{
+    DBG("dropping client %s\n", inet_ntoa(c->peer.sin_addr));
+    stop_playing(c);
+    close(c->sd);
+    c->sd = -1;
+    free(c->pending);
+    c->pending = NULL;
+    c->pending_size = c->pending_capacity = 0;
+    c->reply_size = 0;
+    stats[CTRL_CLIENTS].value--;
+}
+
+/******************************************************************************
+Description.: queues an RTSP reply behind the interleaved data that is still
+              pending, so it does not end up within a packet, and sends what
+              the socket takes right away. Nothing waits for the socket, the
+              clients are locked.
+Input Value.: client, status line, CSeq, further headers and a body, which
+              may be NULL
+Return Value: 0 if ok, -1 if the client has to be dropped, also if it left
+              more than REPLY_QUEUE bytes of replies unread
+******************************************************************************/
+static int reply(rtsp_client *c, const char *status, const char *cseq, const char *headers, const char *body)
+{
+    char buffer[REPLY_SIZE];
+    int length;
+
+    length = snprintf(buffer, sizeof(buffer),
+                      "RTSP/1.0 %s\r\n"
+                      "CSeq: %s\r\n"
+                      "Server: MJPG-Streamer/0.2\r\n"
+                      "%s%s%s"
+                      "%s",
+                      status, cseq,
+                      c->session[0] ? "Session: " : "", c->session, c->session[0] ? ";timeout=60\r\n" : "",
+                      headers != NULL ? headers : "");
+    if(body != NULL)
+        length += snprintf(buffer + length, sizeof(buffer) - length, "Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+    else
+        length += snprintf(buffer + length, sizeof(buffer) - length, "\r\n");
+    if(length >= (int)sizeof(buffer) || c->reply_size + length > (int)sizeof(c->reply))
+        return -1;
+
+    memcpy(c->reply + c->reply_size, buffer, length);
+    c->reply_size += length;
+    return flush_pending(c);
+}
+
+/* finds a header in a request, NULL if it is missing */
+static const char *header(const char *request, const char *name)
+{
+    const char *line = strstr(request, "\r\n");
+    int length = strlen(name);
+
+    while(line != NULL && line[2] != '\r') {
+        line += 2;
+        if(strncasecmp(line, name, length) == 0 && line[length] == ':') {
+            line += length + 1;
+            while(*line == ' ')
+                line++;
+            return line;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+/* copies a header value up to the end of its line */
+static void header_value(const char *request, const char *name, char *value, int size)
+{
+    const char *p = header(request, name);
+    int i = 0;
+
+    if(p != NULL)
+        while(i < size - 1 && p[i] != '\r' && p[i] != '\0') {
+            value[i] = p[i];
+            i++;
+        }
+    value[i] = '\0';
+}
+
+/******************************************************************************
+Description.: sets up the transport a client asked for
+Input Value.: client, its Transport header, the reply header is written to
+              answer
+Return Value: 0 if ok, -1 if the transport is not supported
+******************************************************************************/
+static int setup_transport(rtsp_client *c, const char *transport, char *answer, int size)
+{
+    const char *p;
+    int a, b;
+
+    stop_playing(c);
+
+    if(strstr(transport, "RTP/AVP/TCP") != NULL) {
+        a = 0;
+        b = 1;
+        if((p = strstr(transport, "interleaved=")) != NULL)
+            sscanf(p, "interleaved=%d-%d", &a, &b);
+        if(a < 0 || a > 254)
+            return -1;
+        c->transport = TRANSPORT_TCP;
+        c->channel = a;
+        snprintf(answer, size, "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+                 a, a + 1, rtp.ssrc);
+        return 0;
+    }
+
+    if(strstr(transport, "multicast") != NULL) {
+        if(multicast_port == 0)
+            return -1;
+        c->transport = TRANSPORT_MULTICAST;
+        snprintf(answer, size, "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\n",
+                 inet_ntoa(multicast_group), multicast_port, multicast_port + 1, multicast_ttl);
+        return 0;
+    }
+
+    /* both ports have to be given, RTCP does not have to follow RTP */
+    if((p = strstr(transport, "client_port=")) != NULL && sscanf(p, "client_port=%d-%d", &a, &b) == 2 &&
+       a > 0 && a <= 65535 && b > 0 && b <= 65535) {
+        c->transport = TRANSPORT_UDP;
+        c->rtp = c->peer;
+        c->rtp.sin_port = htons(a);
+        c->rtcp = c->peer;
+        c->rtcp.sin_port = htons(b);
+        snprintf(answer, size, "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\n",
+                 a, b, udp_port, udp_port + 1, rtp.ssrc);
+        return 0;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: answers an RTSP request, called with clients_mutex held
+Input Value.: client, the request up to the empty line
+Return Value: 0 if ok, -1 if the client has to be dropped
+******************************************************************************/
+static int handle_request(rtsp_client *c, const char *request)
+{
+    char method[32] = {0}, url[512] = {0}, cseq[32], session[64], value[512], answer[1024];
+    char body[1024], host[INET_ADDRSTRLEN];
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+
+    if(sscanf(request, "%31s %511s", method, url) != 2)
+        return reply(c, "400 Bad Request", "0", NULL, NULL);
+    header_value(request, "CSeq", cseq, sizeof(cseq));
+    header_value(request, "Session", session, sizeof(session));
+    strtok(session, ";");
+    DBG("%s %s from %s\n", method, url, inet_ntoa(c->peer.sin_addr));
+
+    if(session[0] != '\0' && strcmp(session, c->session) != 0)
+        return reply(c, "454 Session Not Found", cseq, NULL, NULL);
+
+    if(strcmp(method, "OPTIONS") == 0) {
+        return reply(c, "200 OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER\r\n", NULL);
+    }
+
+    if(strcmp(method, "DESCRIBE") == 0) {
+        getsockname(c->sd, (struct sockaddr *)&local, &length);
+        inet_ntop(AF_INET, &local.sin_addr, host, sizeof(host));
+        snprintf(body, sizeof(body),
+                 "v=0\r\n"
+                 "o=- %u 1 IN IP4 %s\r\n"
+                 "s=mjpg-streamer\r\n"
+                 "c=IN IP4 0.0.0.0\r\n"
+                 "t=0 0\r\n"
+                 "a=tool:mjpg-streamer\r\n"
+                 "a=control:*\r\n"
+                 "a=range:npt=0-\r\n"
+                 "m=video 0 RTP/AVP %d\r\n"
+                 "a=control:track0\r\n",
+                 rtp.ssrc, host, RTP_JPEG_PAYLOAD_TYPE);
+        snprintf(answer, sizeof(answer), "Content-Type: application/sdp\r\nContent-Base: %s%s\r\n",
+                 url, url[strlen(url) - 1] == '/' ? "" : "/");
+        return reply(c, "200 OK", cseq, answer, body);
+    }
+
+    if(strcmp(method, "SETUP") == 0) {
+        header_value(request, "Transport", value, sizeof(value));
+        if(setup_transport(c, value, answer, sizeof(answer)) < 0)
+            return reply(c, "461 Unsupported Transport", cseq, NULL, NULL);
+        if(c->session[0] == '\0')
+            snprintf(c->session, sizeof(c->session), "%08lX", random() & 0xFFFFFFFFUL);
+        return reply(c, "200 OK", cseq, answer, NULL);
+    }
+
+    if(strcmp(method, "PLAY") == 0) {
+        if(c->transport == TRANSPORT_NONE)
+            return reply(c, "455 Method Not Valid in This State", cseq, NULL, NULL);
+        if(!c->playing) {
+            c->playing = 1;
+            players++;
+            if(c->transport == TRANSPORT_MULTICAST)
+                multicast_players++;
+            stats[CTRL_PLAYING].value = players;
+            stats[CTRL_MULTICAST].value = multicast_players;
+            pthread_cond_broadcast(&clients_changed);
+        }
+        /* PLAY may name the presentation or the track */
+        snprintf(answer, sizeof(answer), "Range: npt=0.000-\r\nRTP-Info: url=%s%s;seq=%u;rtptime=%u\r\n", url,
+                 strstr(url, "track0") != NULL ? "" : url[strlen(url) - 1] == '/' ? "track0" : "/track0",
+                 rtp.sequence, rtp_time_now());
+        return reply(c, "200 OK", cseq, answer, NULL);
+    }
+
+    if(strcmp(method, "PAUSE") == 0) {
+        stop_playing(c);
+        return reply(c, "200 OK", cseq, NULL, NULL);
+    }
+
+    if(strcmp(method, "TEARDOWN") == 0) {
+        stop_playing(c);
+        c->transport = TRANSPORT_NONE;
+        if(reply(c, "200 OK", cseq, NULL, NULL) < 0)
+            return -1;
+        c->session[0] = '\0';
+        return 0;
+    }
+
+    if(strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0) {
+        return reply(c, "200 OK", cseq, NULL, NULL);
+    }
+
+    return reply(c, "501 Not Implemented", cseq, NULL, NULL);
+}
+
+/******************************************************************************
+Description.: reads from an RTSP connection and answers the requests that are
+              complete, RTCP packets interleaved by the client are skipped.
+              Called with clients_mutex held.
+Input Value.: client
+Return Value: 0 if ok, -1 if the client has to be dropped
+******************************************************************************/
+static int read_requests(rtsp_client *c)
+{
+    char *end;
+    const char *p;
+    ssize_t rc;
+    int length, body;
+
+    rc = recv(c->sd, c->request + c->request_length, sizeof(c->request) - 1 - c->request_length, MSG_DONTWAIT);
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if(rc <= 0)
+        return -1;
+    c->request_length += rc;
+    c->last_seen = time(NULL);
+
+    while(c->request_length > 0) {
+        if(c->request[0] == '$') {
+            if(c->request_length < 4)
+                break;
+            length = 4 + (((unsigned char)c->request[2] << 8) | (unsigned char)c->request[3]);
+            if(length > c->request_length) {
+                /* larger than the buffer, skip it in parts */
+                if(length >= (int)sizeof(c->request) - 1) {
+                    c->request[2] = (length - c->request_length) >> 8;
+                    c->request[3] = (length - c->request_length);
+                    c->request_length = 4;
+                }
+                break;
+            }
+        } else {
+            c->request[c->request_length] = '\0';
+            end = strstr(c->request, "\r\n\r\n");
+            if(end == NULL) {
+                if(c->request_length >= (int)sizeof(c->request) - 1)
+                    return -1;
+                break;
+            }
+            end[2] = '\0';
+            length = end + 4 - c->request;
+            body = (p = header(c->request, "Content-Length")) != NULL ? atoi(p) : 0;
+            if(body < 0 || length + body >= (int)sizeof(c->request))
+                return -1;
+            if(length + body > c->request_length) {
+                end[2] = '\r';
+                break;
+            }
+            if(handle_request(c, c->request) < 0)
+                return -1;
+            length += body;
+        }
+        memmove(c->request, c->request + length, c->request_length - length);
+        c->request_length -= length;
+    }
+    return 0;
+}
+
+/* takes a new connection, or turns it away if all slots are used */
+static void accept_client(void)
+{
+    struct sockaddr_in peer;
+    socklen_t length = sizeof(peer);
+    int sd, i;
+
+    sd = accept(listen_sd, (struct sockaddr *)&peer, &length);
+    if(sd < 0)
+        return;
+
+    pthread_mutex_lock(&clients_mutex);
+    for(i = 0; i < MAX_CLIENTS && clients[i].sd >= 0; i++);
+    if(i == MAX_CLIENTS) {
+        pthread_mutex_unlock(&clients_mutex);
+        OPRINT("too many clients, turning away %s\n", inet_ntoa(peer.sin_addr));
+        close(sd);
+        return;
+    }
+    memset(&clients[i], 0, sizeof(clients[i]));
+    clients[i].sd = sd;
+    clients[i].peer = peer;
+    clients[i].last_seen = time(NULL);
+    stats[CTRL_CLIENTS].value++;
+    pthread_mutex_unlock(&clients_mutex);
+
+    DBG("new client %s\n", inet_ntoa(peer.sin_addr));
+}
+
+/* RTCP receiver reports keep UDP sessions alive, their content is not used */
+static void read_reports(void)
+{
+    unsigned char buffer[1500];
+    struct sockaddr_in from;
+    socklen_t length = sizeof(from);
+    int i;
+
+    if(recvfrom(rtcp_sd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&from, &length) < 0)
+        return;
+
+    pthread_mutex_lock(&clients_mutex);
+    for(i = 0; i < MAX_CLIENTS; i++) {
+        if(clients[i].sd >= 0 && clients[i].transport != TRANSPORT_TCP &&
+           clients[i].peer.sin_addr.s_addr == from.sin_addr.s_addr)
+            clients[i].last_seen = time(NULL);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/******************************************************************************
+Description.: the RTSP server, waits for connections and requests
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *server_thread(void *arg)
+{
+    struct pollfd pfd[MAX_CLIENTS + 2];
+    int slot[MAX_CLIENTS + 2];
+    int count, i;
+    time_t now;
+
+    while(!pglobal->stop && !server_stop) {
+        pfd[0].fd = listen_sd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = rtcp_sd;
+        pfd[1].events = POLLIN;
+        count = 2;
+        pthread_mutex_lock(&clients_mutex);
+        for(i = 0; i < MAX_CLIENTS; i++) {
+            if(clients[i].sd < 0)
+                continue;
+            pfd[count].fd = clients[i].sd;
+            pfd[count].events = POLLIN;
+            if(clients[i].pending_size > 0 || clients[i].reply_size > 0)
+                pfd[count].events |= POLLOUT;
+            slot[count++] = i;
+        }
+        pthread_mutex_unlock(&clients_mutex);
+
+        if(poll(pfd, count, 1000) < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("poll()");
+            break;
+        }
+
+        if(pfd[0].revents & POLLIN)
+            accept_client();
+        if(pfd[1].revents & POLLIN)
+            read_reports();
+
+        now = time(NULL);
+        pthread_mutex_lock(&clients_mutex);
+        for(i = 2; i < count; i++) {
+            rtsp_client *c = &clients[slot[i]];
+            if(c->sd != pfd[i].fd)
+                continue;
+            if((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) && read_requests(c) < 0)
+                drop_client(c);
+            else if((pfd[i].revents & POLLOUT) && flush_pending(c) < 0)
+                drop_client(c);
+        }
+        for(i = 0; i < MAX_CLIENTS; i++) {
+            rtsp_client *c = &clients[i];
+            if(c->sd >= 0 && c->transport != TRANSPORT_TCP && c->transport != TRANSPORT_NONE &&
+               now - c->last_seen > SESSION_TIMEOUT) {
+                OPRINT("session of %s timed out\n", inet_ntoa(c->peer.sin_addr));
+                drop_client(c);
+            }
+        }
+        pthread_mutex_unlock(&clients_mutex);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: sends the packets of the frame to all UDP clients and the
+              multicast group, SEND_BATCH packets per system call. A full
+              socket buffer drops packets like the network would.
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void send_udp(void)
+{
+    static struct mmsghdr messages[SEND_BATCH];
+    static struct iovec iov[SEND_BATCH][2];
+    static struct sockaddr_in group;
+    int i, p, n = 0;
+    rtsp_client *c;
+
+    group.sin_family = AF_INET;
+    group.sin_addr = multicast_group;
+    group.sin_port = htons(multicast_port);
+
+    for(i = 0; i <= MAX_CLIENTS; i++) {
+        struct sockaddr_in *to;
+
+        if(i < MAX_CLIENTS) {
+            c = &clients[i];
+            if(c->sd < 0 || !c->playing || c->transport != TRANSPORT_UDP)
+                continue;
+            to = &c->rtp;
+        } else {
+            /* one copy for everyone in the group */
+            if(multicast_players == 0)
+                continue;
+            to = &group;
+        }
+
+        for(p = 0; p < rtp.count; p++) {
+            iov[n][0].iov_base = rtp.packets[p].header;
+            iov[n][0].iov_len = rtp.packets[p].header_size;
+            iov[n][1].iov_base = (void *)rtp.packets[p].data;
+            iov[n][1].iov_len = rtp.packets[p].data_size;
+            memset(&messages[n], 0, sizeof(messages[n]));
+            messages[n].msg_hdr.msg_name = to;
+            messages[n].msg_hdr.msg_namelen = sizeof(*to);
+            messages[n].msg_hdr.msg_iov = iov[n];
+            messages[n].msg_hdr.msg_iovlen = 2;
+            if(++n == SEND_BATCH) {
+                if(sendmmsg(rtp_sd, messages, n, MSG_DONTWAIT) < n)
+                    DBG("UDP packets dropped\n");
+                stats[CTRL_PACKETS_SENT].value += n;
+                n = 0;
+            }
+        }
+    }
+    if(n > 0) {
+        if(sendmmsg(rtp_sd, messages, n, MSG_DONTWAIT) < n)
+            DBG("UDP packets dropped\n");
+        stats[CTRL_PACKETS_SENT].value += n;
+    }
+}
+
+/******************************************************************************
+Description.: sends the packets of the frame into the connection of a client
+              that wants them interleaved. What the socket does not take is
+              kept and sent before anything else, the client skips frames
+              until it and the replies queued behind it are gone.
+Input Value.: client
+Return Value: 0 if ok, -1 if the client has to be dropped
+******************************************************************************/
+static int send_tcp(rtsp_client *c)
+{
+    static unsigned char prefix[RTP_JPEG_MAX_PACKETS][4];
+    static struct iovec iov[3 * RTP_JPEG_MAX_PACKETS];
+    struct msghdr msg;
+    struct iovec *next = iov;
+    int i, n = 0, left, total = 0;
+    ssize_t rc;
+
+    if(flush_pending(c) < 0)
+        return -1;
+    if(c->pending_size > 0 || c->reply_size > 0) {
+        stats[CTRL_FRAMES_SKIPPED].value++;
+        return 0;
+    }
+
+    for(i = 0; i < rtp.count; i++) {
+        int size = rtp.packets[i].header_size + rtp.packets[i].data_size;
+        prefix[i][0] = '$';
+        prefix[i][1] = c->channel;
+        prefix[i][2] = size >> 8;
+        prefix[i][3] = size;
+        iov[n].iov_base = prefix[i];
+        iov[n++].iov_len = 4;
+        iov[n].iov_base = rtp.packets[i].header;
+        iov[n++].iov_len = rtp.packets[i].header_size;
+        iov[n].iov_base = (void *)rtp.packets[i].data;
+        iov[n++].iov_len = rtp.packets[i].data_size;
+        total += 4 + size;
+    }
+
+    while(n > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = next;
+        msg.msg_iovlen = n < IOV_MAX ? n : IOV_MAX;
+        rc = sendmsg(c->sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(rc < 0)
+            break;
+        total -= rc;
+        while(n > 0 && (size_t)rc >= next->iov_len) {
+            rc -= next->iov_len;
+            next++;
+            n--;
+        }
+        if(n > 0) {
+            next->iov_base = (unsigned char *)next->iov_base + rc;
+            next->iov_len -= rc;
+        }
+    }
+    stats[CTRL_PACKETS_SENT].value += rtp.count;
+    if(n == 0)
+        return 0;
+
+    /* keep the rest of the frame for the next time */
+    if(total > c->pending_capacity) {
+        unsigned char *grown = realloc(c->pending, total);
+        if(grown == NULL)
+            return -1;
+        c->pending = grown;
+        c->pending_capacity = total;
+    }
+    for(left = 0; n > 0; next++, n--) {
+        memcpy(c->pending + left, next->iov_base, next->iov_len);
+        left += next->iov_len;
+    }
+    c->pending_size = left;
+    return 0;
+}
+
+/* sends RTCP sender reports to every client, called with clients_mutex held */
+static void send_reports(void)
+{
+    unsigned char report[4 + 28];
+    struct sockaddr_in group;
+    int i, size, multicast_sent = 0;
+
+    size = rtp_jpeg_sender_report(&rtp, report + 4, rtp_time_now());
+    group.sin_family = AF_INET;
+    group.sin_addr = multicast_group;
+    group.sin_port = htons(multicast_port + 1);
+
+    for(i = 0; i < MAX_CLIENTS; i++) {
+        rtsp_client *c = &clients[i];
+        if(c->sd < 0 || !c->playing)
+            continue;
+        switch(c->transport) {
+        case TRANSPORT_UDP:
+            sendto(rtcp_sd, report + 4, size, MSG_DONTWAIT, (struct sockaddr *)&c->rtcp, sizeof(c->rtcp));
+            break;
+        case TRANSPORT_MULTICAST:
+            if(!multicast_sent)
+                sendto(rtcp_sd, report + 4, size, MSG_DONTWAIT, (struct sockaddr *)&group, sizeof(group));
+            multicast_sent = 1;
+            break;
+        case TRANSPORT_TCP:
+            /* only between frames and replies, the report must not split
+               one, and what the socket does not take goes out later */
+            if(c->pending_size > 0 || c->reply_size > 0)
+                break;
+            if(c->pending_capacity < 4 + size) {
+                unsigned char *grown = realloc(c->pending, 4 + size);
+                if(grown == NULL)
+                    break;
+                c->pending = grown;
+                c->pending_capacity = 4 + size;
+            }
+            report[0] = '$';
+            report[1] = c->channel + 1;
+            report[2] = size >> 8;
+            report[3] = size;
+            memcpy(c->pending, report, 4 + size);
+            c->pending_size = 4 + size;
+            if(flush_pending(c) < 0)
+                drop_client(c);
+            break;
+        }
+    }
+}
+
+static void unlock_clients(void *arg)
+{
+    pthread_mutex_unlock(&clients_mutex);
+}
+
 /******************************************************************************
 Description.: clean up allocated resources
 Input Value.: unused argument
@@ -97,6 +836,7 @@ Return Value: -
 void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
+    int i;
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -106,62 +846,81 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
+    /* the server notices within a second */
+    if(server_running) {
+        server_stop = 1;
+        pthread_join(server, NULL);
+        server_running = 0;
+    }
+    if(subscribed) {
+        input_unsubscribe(&pglobal->in[input_number]);
+        subscribed = 0;
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    for(i = 0; i < MAX_CLIENTS; i++) {
+        if(clients[i].sd >= 0)
+            drop_client(&clients[i]);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    close(listen_sd);
+    close(rtp_sd);
+    close(rtcp_sd);
+    rtp_jpeg_free(&rtp);
+
     if(frame != NULL) {
         free(frame);
     }
-    close(fd);
 }
 
 /******************************************************************************
 Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and stores it to file
+              it loops forever, grabs a fresh frame and sends it to the
+              clients that are playing
 Input Value.:
 Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
-    char buffer1[1024] = {0};
+    int frame_size = 0, i, count, state;
     unsigned char *tmp_framebuffer = NULL;
+    struct timeval timestamp;
+    time_t last_report = 0, now;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
-    // set UDP server data structures ---------------------------
-    if(port <= 0) {
-        OPRINT("a valid UDP port must be provided\n");
+    if(pthread_create(&server, 0, server_thread, NULL) != 0) {
+        OPRINT("could not start the RTSP server\n");
         return NULL;
     }
-    struct sockaddr_in addr;
-    int sd;
-    int bytes;
-    unsigned int addr_len = sizeof(addr);
-    char udpbuffer[1024] = {0};
-    sd = socket(PF_INET, SOCK_DGRAM, 0);
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    if(bind(sd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-        perror("bind");
-    // -----------------------------------------------------------
-
-    while(ok >= 0 && !pglobal->stop) {
-        DBG("waiting for a UDP message\n");
-
-        // UDP receive ---------------------------------------------
-        memset(udpbuffer, 0, sizeof(udpbuffer));
-        bytes = recvfrom(sd, udpbuffer, sizeof(udpbuffer), 0, (struct sockaddr*)&addr, &addr_len);
-        // ---------------------------------------------------------
-
+    server_running = 1;
 
+    while(!pglobal->stop) {
+        /* frames are only wanted while someone plays them */
+        pthread_mutex_lock(&clients_mutex);
+        if(players == 0 && subscribed) {
+            pthread_mutex_unlock(&clients_mutex);
+            input_unsubscribe(&pglobal->in[input_number]);
+            subscribed = 0;
+            pthread_mutex_lock(&clients_mutex);
+        }
+        pthread_cleanup_push(unlock_clients, NULL);
+        while(players == 0 && !pglobal->stop)
+            pthread_cond_wait(&clients_changed, &clients_mutex);
+        pthread_cleanup_pop(1);
+        if(!subscribed) {
+            input_subscribe(&pglobal->in[input_number]);
+            subscribed = 1;
+        }
 
         DBG("waiting for fresh frame\n");
         pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
 
         /* check if buffer for frame is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -179,64 +938,68 @@ void *worker_thread(void *arg)
 
         /* copy frame to our local buffer now */
         memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        timestamp = pglobal->in[input_number].timestamp;
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
-        /* only save a file if a name came in with the UDP message */
-        if(strlen(udpbuffer) > 0) {
-            DBG("writing file: %s\n", udpbuffer);
+        /* sending must not be cancelled with the clients locked */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        pthread_mutex_lock(&clients_mutex);
+        gettimeofday(&last_frame_wall, NULL);
+        if(timestamp.tv_sec == 0 && timestamp.tv_usec == 0)
+            timestamp = last_frame_wall;
+        last_rtp_time = rtp_time(&timestamp);
 
-            /* open file for write. Path must pre-exist */
-            if((fd = open(udpbuffer, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                OPRINT("could not open the file %s\n", udpbuffer);
-                return NULL;
+        count = rtp_jpeg_packetize(&rtp, frame, frame_size, last_rtp_time);
+        if(count < 0) {
+            DBG("frame can not be sent as RTP/JPEG\n");
+            stats[CTRL_FRAMES_UNSUPPORTED].value++;
+        } else {
+            send_udp();
+            for(i = 0; i < MAX_CLIENTS; i++) {
+                rtsp_client *c = &clients[i];
+                if(c->sd >= 0 && c->playing && c->transport == TRANSPORT_TCP && send_tcp(c) < 0)
+                    drop_client(c);
             }
-
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", udpbuffer);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
-
-            close(fd);
+            stats[CTRL_FRAMES_SENT].value++;
         }
 
-        // send back client's message that came in udpbuffer
-        sendto(sd, udpbuffer, bytes, 0, (struct sockaddr*)&addr, sizeof(addr));
-
-        /* call the command if user specified one, pass current filename as argument */
-        if(command != NULL) {
-            memset(buffer1, 0, sizeof(buffer1));
-
-            /* udpbuffer still contains the filename, pass it to the command as parameter */
-            snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, udpbuffer);
-            DBG("calling command %s", buffer1);
-
-            /* in addition provide the filename as environment variable */
-            if((rc = setenv("MJPG_FILE", udpbuffer, 1)) != 0) {
-                LOG("setenv failed (return value %d)\n", rc);
-            }
-
-            /* execute the command now */
-            if((rc = system(buffer1)) != 0) {
-                LOG("command failed (return value %d)\n", rc);
-            }
+        now = time(NULL);
+        if(now - last_report >= REPORT_INTERVAL) {
+            send_reports();
+            last_report = now;
         }
+        pthread_mutex_unlock(&clients_mutex);
+        pthread_setcancelstate(state, NULL);
     }
 
-    // close UDP port
-    if(port > 0)
-        close(sd);
-
     /* cleanup now */
     pthread_cleanup_pop(1);
 
     return NULL;
 }
 
+/* opens a UDP socket bound to a port */
+static int udp_socket(int udp)
+{
+    struct sockaddr_in addr;
+    int sd = socket(PF_INET, SOCK_DGRAM, 0);
+
+    if(sd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(udp);
+    if(bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       setsockopt(sd, IPPROTO_IP, IP_MULTICAST_TTL, &multicast_ttl, sizeof(multicast_ttl)) != 0) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
 /*** plugin interface functions ***/
 /******************************************************************************
 Description.: this function is called first, in order to initialise
@@ -244,9 +1007,11 @@ Description.: this function is called first, in order to initialise
 Input Value.: parameters
 Return Value: 0 if everything is ok, non-zero otherwise
 ******************************************************************************/
-int output_init(output_parameter *param)
+int output_init(output_parameter *param, int id)
 {
-    int i;
+    struct sockaddr_in addr;
+    char *colon;
+    int i, on = 1;
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
 
@@ -266,6 +1031,12 @@ int output_init(output_parameter *param)
             {"port", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"u", required_argument, 0, 0},
+            {"udp", required_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"multicast", required_argument, 0, 0},
+            {"ttl", required_argument, 0, 0},
+            {"mtu", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -288,6 +1059,7 @@ int output_init(output_parameter *param)
             help();
             return 1;
             break;
+            /* p, port */
         case 2:
         case 3:
             DBG("case 2,3\n");
@@ -299,6 +1071,37 @@ int output_init(output_parameter *param)
             DBG("case 4,5\n");
             input_number = atoi(optarg);
             break;
+            /* u, udp */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            udp_port = atoi(optarg);
+            break;
+            /* m, multicast */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            colon = strchr(optarg, ':');
+            if(colon == NULL || (*colon = '\0', inet_aton(optarg, &multicast_group) == 0) ||
+               !IN_MULTICAST(ntohl(multicast_group.s_addr)) || (multicast_port = atoi(colon + 1)) <= 0) {
+                help();
+                return 1;
+            }
+            break;
+            /* ttl */
+        case 10:
+            DBG("case 10\n");
+            multicast_ttl = atoi(optarg);
+            break;
+            /* mtu */
+        case 11:
+            DBG("case 11\n");
+            mtu = atoi(optarg);
+            if(mtu < RTP_JPEG_MAX_HEADER + 64 || mtu > 65000) {
+                OPRINT("ERROR: the MTU must be between %d and 65000\n", RTP_JPEG_MAX_HEADER + 64);
+                return 1;
+            }
+            break;
         }
     }
 
@@ -308,8 +1111,57 @@ int output_init(output_parameter *param)
         return 1;
     }
 
+    for(i = 0; i < MAX_CLIENTS; i++)
+        clients[i].sd = -1;
+    if(rtp_jpeg_init(&rtp, mtu) < 0) {
+        OPRINT("not enough memory\n");
+        return 1;
+    }
+    rtp_base = random();
+
+    listen_sd = socket(PF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if(listen_sd < 0 || setsockopt(listen_sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+       bind(listen_sd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_sd, 10) != 0) {
+        OPRINT("could not listen on RTSP port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    if((rtp_sd = udp_socket(udp_port)) < 0 || (rtcp_sd = udp_socket(udp_port + 1)) < 0) {
+        OPRINT("could not bind UDP ports %d-%d: %s\n", udp_port, udp_port + 1, strerror(errno));
+        return 1;
+    }
+
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
-    OPRINT("UDP port..........: %d\n", port);
+    OPRINT("RTSP port.........: %d\n", port);
+    OPRINT("RTP/RTCP ports....: %d-%d\n", udp_port, udp_port + 1);
+    OPRINT("packet size.......: %d\n", mtu);
+    if(multicast_port > 0) {
+        OPRINT("multicast group...: %s:%d, ttl %d\n", inet_ntoa(multicast_group), multicast_port, multicast_ttl);
+    } else {
+        OPRINT("multicast group...: %s\n", "disabled");
+    }
+
+    param->global->out[id].parametercount = CTRL_COUNT;
+    param->global->out[id].out_parameters = (control*) calloc(CTRL_COUNT, sizeof(control));
+    stats = param->global->out[id].out_parameters;
+    for(i = 0; i < CTRL_COUNT; i++) {
+        stats[i].group = IN_CMD_GENERIC;
+        stats[i].menuitems = NULL;
+        stats[i].value = 0;
+        stats[i].class_id = 0;
+        stats[i].ctrl.id = V4L2_CID_PRIVATE_BASE + i;
+        stats[i].ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+        stats[i].ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+        snprintf((char*) stats[i].ctrl.name, sizeof(stats[i].ctrl.name), "%s", control_names[i]);
+        stats[i].ctrl.minimum = 0;
+        stats[i].ctrl.maximum = INT_MAX;
+        stats[i].ctrl.step = 1;
+        stats[i].ctrl.default_value = 0;
+    }
+
     return 0;
 }
 
@@ -337,5 +1189,3 @@ int output_run(int id)
     pthread_detach(worker);
     return 0;
 }
-
-
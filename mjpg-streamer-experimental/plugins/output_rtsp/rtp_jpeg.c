@@ -0,0 +1,224 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "rtp_jpeg.h"
+#include "../jpeg_tools.h"
+
+/* seconds between 1900, where NTP time starts, and 1970 */
+#define NTP_OFFSET 2208988800UL
+
+static unsigned char *put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+/******************************************************************************
+Description.: prepares a stream with a random SSRC and sequence number
+Input Value.: packetizer, maximum size of a packet
+Return Value: 0 if ok, -1 if there is not enough memory
+******************************************************************************/
+int rtp_jpeg_init(rtp_jpeg *rtp, int mtu)
+{
+    struct timeval now;
+
+    memset(rtp, 0, sizeof(*rtp));
+    gettimeofday(&now, NULL);
+    srandom(now.tv_sec ^ now.tv_usec);
+    rtp->ssrc = random();
+    rtp->sequence = random();
+    rtp->mtu = mtu;
+
+    rtp->headers = malloc(RTP_JPEG_MAX_HEADER + RTP_JPEG_MAX_PACKETS * (RTP_HEADER + 12));
+    return rtp->headers != NULL ? 0 : -1;
+}
+
+void rtp_jpeg_free(rtp_jpeg *rtp)
+{
+    free(rtp->headers);
+    rtp->headers = NULL;
+}
+
+/******************************************************************************
+Description.: compares two Huffman tables
+Input Value.: tables, 16 counts followed by the symbols
+Return Value: 1 if they are the same, 0 if not
+******************************************************************************/
+static int same_table(const unsigned char *a, const unsigned char *b)
+{
+    int i, total = 0;
+
+    if(memcmp(a, b, 16) != 0)
+        return 0;
+    for(i = 0; i < 16; i++)
+        total += b[i];
+    return memcmp(a + 16, b + 16, total) == 0;
+}
+
+/******************************************************************************
+Description.: splits a JPEG into RTP packets, the packets point into the
+              frame, so it must not change until they are sent
+Input Value.: packetizer, the JPEG, its RTP timestamp
+Return Value: number of packets, -1 if the frame can not be carried
+******************************************************************************/
+int rtp_jpeg_packetize(rtp_jpeg *rtp, const unsigned char *jpeg, int size, uint32_t timestamp)
+{
+    const unsigned char *scan;
+    int type, quant[2], scan_size, eoi, offset, i, table_size[2];
+    unsigned char *h = rtp->headers;
+    const unsigned char *std[2][4] = {{NULL}};
+    jpeg_info info;
+
+    /* find what the receiver needs to rebuild the headers */
+    if(jpeg_parse_header(jpeg, size, &info) < 0 || (info.sof != JPEG_SOF0 && info.sof != JPEG_SOF1) || info.precision != 8)
+        return -1;
+    if(info.subsampling == JPEG_SUBSAMPLING_422)
+        type = 0;
+    else if(info.subsampling == JPEG_SUBSAMPLING_420)
+        type = 1;
+    else
+        return -1;
+    quant[0] = info.tq[0];
+    quant[1] = info.tq[1];
+    if(info.tq[2] != quant[1] || info.dqt[quant[0]] == NULL || info.dqt[quant[1]] == NULL)
+        return -1;
+    if(info.width == 0 || info.height == 0 || info.width > 2040 || info.height > 2040)
+        return -1;
+
+    /* there is no way to send Huffman tables, the receiver uses the standard
+       ones, frames without a DHT segment use them too */
+    jpeg_parse_dht(jpeg_std_dht + 4, JPEG_STD_DHT_SIZE - 4, std);
+    for(i = 0; i < info.scan_components; i++) {
+        const unsigned char *dc = info.dht[0][info.scan_dc[i]];
+        const unsigned char *ac = info.dht[1][info.scan_ac[i]];
+        int id = info.scan_index[i] == 0 ? 0 : 1;
+        if((dc != NULL && !same_table(dc, std[0][id])) ||
+           (ac != NULL && !same_table(ac, std[1][id])))
+            return -1;
+    }
+
+    /* the scan ends before EOI */
+    scan = jpeg + info.scan_offset;
+    eoi = jpeg_eoi(jpeg, size);
+    scan_size = (eoi >= 0 ? eoi : size) - info.scan_offset;
+    if(scan_size < 0 || scan_size >= (1 << 24))
+        return -1;
+
+    for(i = 0; i < 2; i++)
+        table_size[i] = 64 * (info.dqt_precision[quant[i]] + 1);
+
+    rtp->count = 0;
+    for(offset = 0; offset < scan_size; rtp->count++) {
+        rtp_packet *packet = &rtp->packets[rtp->count];
+        unsigned char *start = h;
+        int room;
+
+        if(rtp->count == RTP_JPEG_MAX_PACKETS)
+            return -1;
+
+        *h++ = 0x80;
+        *h++ = RTP_JPEG_PAYLOAD_TYPE;   // the marker is set below
+        h = put16(h, rtp->sequence++);
+        h = put32(h, timestamp);
+        h = put32(h, rtp->ssrc);
+
+        *h++ = 0;                       // type specific
+        *h++ = offset >> 16;
+        h = put16(h, offset);
+        *h++ = type + (info.restart_interval ? 64 : 0);
+        *h++ = 255;                     // tables follow inline
+        *h++ = (info.width + 7) / 8;
+        *h++ = (info.height + 7) / 8;
+
+        if(info.restart_interval) {
+            h = put16(h, info.restart_interval);
+            h = put16(h, 0xFFFF);       // first and last, all the intervals
+        }
+
+        if(offset == 0) {
+            *h++ = 0;
+            *h++ = info.dqt_precision[quant[0]] | info.dqt_precision[quant[1]] << 1;
+            h = put16(h, table_size[0] + table_size[1]);
+            memcpy(h, info.dqt[quant[0]], table_size[0]);
+            h += table_size[0];
+            memcpy(h, info.dqt[quant[1]], table_size[1]);
+            h += table_size[1];
+        }
+
+        room = rtp->mtu - (h - start);
+        if(room < 1)
+            return -1;
+
+        packet->header = start;
+        packet->header_size = h - start;
+        packet->data = scan + offset;
+        packet->data_size = scan_size - offset < room ? scan_size - offset : room;
+        offset += packet->data_size;
+
+        rtp->packets_sent++;
+        rtp->octets_sent += packet->header_size - RTP_HEADER + packet->data_size;
+    }
+
+    /* the marker tells that the frame is complete */
+    if(rtp->count > 0)
+        rtp->packets[rtp->count - 1].header[1] |= 0x80;
+
+    return rtp->count;
+}
+
+/******************************************************************************
+Description.: builds an RTCP sender report, that maps the RTP time to the wall
+              clock, so the receiver knows when the frames were taken
+Input Value.: packetizer, buffer of at least 28 bytes, RTP time of now
+Return Value: size of the report
+******************************************************************************/
+int rtp_jpeg_sender_report(rtp_jpeg *rtp, unsigned char *buf, uint32_t timestamp)
+{
+    struct timeval now;
+    unsigned char *p = buf;
+
+    gettimeofday(&now, NULL);
+
+    *p++ = 0x80;
+    *p++ = 200;                         // SR
+    p = put16(p, 6);                    // length in words, minus one
+    p = put32(p, rtp->ssrc);
+    p = put32(p, now.tv_sec + NTP_OFFSET);
+    p = put32(p, (uint32_t)(((uint64_t)now.tv_usec << 32) / 1000000));
+    p = put32(p, timestamp);
+    p = put32(p, rtp->packets_sent);
+    p = put32(p, rtp->octets_sent);
+
+    return p - buf;
+}
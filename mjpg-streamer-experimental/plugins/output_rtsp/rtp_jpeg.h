@@ -0,0 +1,76 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef RTP_JPEG_H
+#define RTP_JPEG_H
+
+#include <stdint.h>
+
+/*
+ * RTP payload format for JPEG, RFC 2435. The JPEG headers are not sent, the
+ * receiver rebuilds them from the type, the size and the quantization
+ * tables, which go inline in the first packet of every frame (Q = 255).
+ * Only baseline frames with YUV 4:2:2 or 4:2:0 sampling and the standard
+ * Huffman tables can be carried, like every camera sends them.
+ *
+ * The packets are described, not copied: every packet has its headers in
+ * the packetizer and points into the scan data of the frame.
+ */
+
+#define RTP_JPEG_PAYLOAD_TYPE 26
+#define RTP_JPEG_CLOCK 90000
+#define RTP_JPEG_MAX_PACKETS 1024
+#define RTP_HEADER 12
+
+/* RTP, JPEG, restart marker and quantization table headers */
+#define RTP_JPEG_MAX_HEADER (RTP_HEADER + 8 + 4 + 4 + 4 * 128)
+
+typedef struct _rtp_packet rtp_packet;
+struct _rtp_packet {
+    unsigned char *header;
+    int header_size;
+    const unsigned char *data;  // part of the scan
+    int data_size;
+};
+
+typedef struct _rtp_jpeg rtp_jpeg;
+struct _rtp_jpeg {
+    /* stream */
+    uint32_t ssrc;
+    uint16_t sequence;
+    int mtu;                    // bytes of a packet, with the RTP header
+
+    /* packets of the last frame */
+    rtp_packet packets[RTP_JPEG_MAX_PACKETS];
+    int count;
+    unsigned char *headers;     // RTP_JPEG_MAX_HEADER for the first packet,
+                                // then RTP_HEADER + 12 for each other one
+
+    /* statistics for the sender reports */
+    uint32_t packets_sent;
+    uint32_t octets_sent;
+};
+
+int rtp_jpeg_init(rtp_jpeg *rtp, int mtu);
+void rtp_jpeg_free(rtp_jpeg *rtp);
+int rtp_jpeg_packetize(rtp_jpeg *rtp, const unsigned char *jpeg, int size, uint32_t timestamp);
+int rtp_jpeg_sender_report(rtp_jpeg *rtp, unsigned char *buf, uint32_t timestamp);
+
+#endif
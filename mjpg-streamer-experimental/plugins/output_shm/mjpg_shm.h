@@ -0,0 +1,288 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef MJPG_SHM_H
+#define MJPG_SHM_H
+
+/*
+ * Ring of frames that output_shm publishes in POSIX shared memory, and the
+ * reader for it. The reader is all in this header, include it and link
+ * nothing but librt on old systems. libmjpg_shm exports the same functions
+ * for languages that can not use a header.
+ *
+ * Layout, version 1, numbers in the byte order of the host:
+ *
+ *   mjpg_shm_header       magic, version, geometry, newest frame, futex
+ *   mjpg_shm_slot[slots]  one descriptor per slot, right after the header
+ *   ...                   padding up to header_size, a multiple of the page
+ *   slot data             slots * slot_size bytes, frame n is in slot n % slots
+ *
+ * Every slot is a seqlock: while the writer copies a frame in, its sequence
+ * is odd, once the frame is complete it is 2 * number + 2. A reader takes the
+ * sequence, reads the frame, and takes it again: if it did not change, the
+ * frame was not overwritten meanwhile. The frames are not copied out of the
+ * ring, a reader has slots - 1 frame intervals to use a frame before it is
+ * overwritten, and asks mjpg_shm_valid() afterwards if that happened.
+ *
+ * The futex word changes with every frame. Readers that wait for the next
+ * one sleep on it, the writer only wakes them if some are waiting. A reader
+ * that dies while it waits stays counted in waiters: once the wakes for 16
+ * frames in a row woke nobody, the writer takes that many waiters for dead
+ * and only wakes readers again when more than those are waiting, so it does
+ * not make a syscall for every frame forever.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MJPG_SHM_MAGIC 0x4D4A5348       // "MJSH"
+#define MJPG_SHM_VERSION 1
+#define MJPG_SHM_DEFAULT_NAME "/mjpg_streamer"
+
+typedef struct _mjpg_shm_slot mjpg_shm_slot;
+struct _mjpg_shm_slot {
+    uint64_t sequence;          // odd while written, 2 * number + 2 when done
+    uint64_t number;            // of the frame, counting from 0
+    int64_t timestamp_us;       // when it was taken, microseconds since 1970
+    int64_t published_us;       // when it was complete in the ring
+    uint32_t size;              // bytes of the JPEG
+    uint32_t reserved;
+};
+
+typedef struct _mjpg_shm_header mjpg_shm_header;
+struct _mjpg_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       // offset of the slot data
+    uint32_t slots;
+    uint64_t slot_size;         // largest frame that fits
+    uint64_t frames;            // published so far, the newest is frames - 1
+    uint32_t futex;             // changes with every frame
+    uint32_t waiters;           // readers sleeping on the futex, see above
+    uint32_t writer_pid;
+    uint32_t closed;            // the writer stopped, open the ring again
+    mjpg_shm_slot slot[];
+};
+
+/* a reader */
+typedef struct _mjpg_shm mjpg_shm;
+struct _mjpg_shm {
+    int fd;
+    size_t size;
+    mjpg_shm_header *header;
+    uint64_t next;              // number of the frame wanted next
+};
+
+/* a frame in the ring, data points into the shared memory */
+typedef struct _mjpg_shm_frame mjpg_shm_frame;
+struct _mjpg_shm_frame {
+    const unsigned char *data;
+    uint32_t size;
+    uint64_t number;
+    int64_t timestamp_us;
+    int64_t published_us;
+    uint64_t skipped;           // frames that came since the previous one
+    uint64_t sequence;
+    const mjpg_shm_slot *slot;
+};
+
+/* libmjpg_shm defines this to export the functions */
+#ifndef MJPG_SHM_API
+#define MJPG_SHM_API static inline
+#endif
+
+/* bytes before the slot data */
+static inline size_t mjpg_shm_header_size(uint32_t slots)
+{
+    size_t size = sizeof(mjpg_shm_header) + slots * sizeof(mjpg_shm_slot);
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page;
+}
+
+static inline unsigned char *mjpg_shm_slot_data(mjpg_shm_header *header, uint64_t number)
+{
+    return (unsigned char *)header + header->header_size + (number % header->slots) * header->slot_size;
+}
+
+static inline long mjpg_shm_futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/******************************************************************************
+Description.: maps the ring a writer published
+Input Value.: reader, name of the ring, NULL for MJPG_SHM_DEFAULT_NAME
+Return Value: 0 if ok, -1 with errno set, EPROTO if it is not a ring of
+              this version
+******************************************************************************/
+MJPG_SHM_API int mjpg_shm_open(mjpg_shm *shm, const char *name)
+{
+    struct stat st;
+    mjpg_shm_header *h;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = shm_open(name != NULL ? name : MJPG_SHM_DEFAULT_NAME, O_RDWR, 0);
+    if(shm->fd < 0)
+        return -1;
+    if(fstat(shm->fd, &st) < 0 || (size_t)st.st_size < sizeof(mjpg_shm_header)) {
+        close(shm->fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    shm->size = st.st_size;
+    h = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if(h == MAP_FAILED) {
+        close(shm->fd);
+        return -1;
+    }
+    if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != MJPG_SHM_MAGIC || h->version != MJPG_SHM_VERSION ||
+       h->slots == 0 || h->header_size < sizeof(mjpg_shm_header) + (uint64_t)h->slots * sizeof(mjpg_shm_slot) ||
+       h->header_size + (uint64_t)h->slots * h->slot_size > shm->size) {
+        munmap(h, shm->size);
+        close(shm->fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    shm->header = h;
+    shm->next = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+MJPG_SHM_API void mjpg_shm_close(mjpg_shm *shm)
+{
+    if(shm->header != NULL)
+        munmap(shm->header, shm->size);
+    if(shm->fd >= 0)
+        close(shm->fd);
+    shm->header = NULL;
+    shm->fd = -1;
+}
+
+/******************************************************************************
+Description.: tells if a frame was not overwritten while it was used
+Input Value.: reader, frame from mjpg_shm_latest() or mjpg_shm_next()
+Return Value: 1 if it is intact, 0 if it is gone
+******************************************************************************/
+MJPG_SHM_API int mjpg_shm_valid(const mjpg_shm *shm, const mjpg_shm_frame *frame)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->slot->sequence, __ATOMIC_RELAXED) == frame->sequence;
+}
+
+/******************************************************************************
+Description.: points at the newest frame in the ring
+Input Value.: reader, frame to fill
+Return Value: 1 if ok, 0 if there is none yet
+******************************************************************************/
+MJPG_SHM_API int mjpg_shm_latest(mjpg_shm *shm, mjpg_shm_frame *frame)
+{
+    mjpg_shm_header *h = shm->header;
+    uint64_t frames, sequence;
+    mjpg_shm_slot *s;
+
+    for(;;) {
+        frames = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+        if(frames == 0)
+            return 0;
+
+        s = &h->slot[(frames - 1) % h->slots];
+        sequence = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if(sequence != 2 * (frames - 1) + 2)
+            continue;           // overwritten right now, there is a newer one
+
+        frame->slot = s;
+        frame->sequence = sequence;
+        frame->number = s->number;
+        frame->size = s->size;
+        frame->timestamp_us = s->timestamp_us;
+        frame->published_us = s->published_us;
+        frame->data = mjpg_shm_slot_data(h, frame->number);
+        frame->skipped = frame->number > shm->next ? frame->number - shm->next : 0;
+        if(!mjpg_shm_valid(shm, frame) || frame->size > h->slot_size)
+            continue;
+
+        shm->next = frame->number + 1;
+        return 1;
+    }
+}
+
+/******************************************************************************
+Description.: waits for a frame newer than the one returned last, frames
+              that came in between are skipped, the newest one is returned
+Input Value.: reader, frame to fill, milliseconds to wait at most, -1 forever
+Return Value: 1 if there is a frame, 0 on timeout, -1 if the writer stopped
+******************************************************************************/
+MJPG_SHM_API int mjpg_shm_next(mjpg_shm *shm, mjpg_shm_frame *frame, int timeout)
+{
+    mjpg_shm_header *h = shm->header;
+    struct timespec until, now, left;
+    uint32_t word;
+
+    if(timeout >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += timeout / 1000;
+        until.tv_nsec += (timeout % 1000) * 1000000L;
+        if(until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for(;;) {
+        if(__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE))
+            return -1;
+
+        word = __atomic_load_n(&h->futex, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&h->frames, __ATOMIC_ACQUIRE) > shm->next)
+            return mjpg_shm_latest(shm, frame);
+
+        if(timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = until.tv_sec - now.tv_sec;
+            left.tv_nsec = until.tv_nsec - now.tv_nsec;
+            if(left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if(left.tv_sec < 0)
+                return 0;
+        }
+
+        /* the writer looks at waiters after it changed the futex word */
+        __atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&h->futex, __ATOMIC_SEQ_CST) == word)
+            mjpg_shm_futex(&h->futex, FUTEX_WAIT, word, timeout >= 0 ? &left : NULL);
+        __atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+#endif
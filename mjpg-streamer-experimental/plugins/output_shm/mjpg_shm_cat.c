@@ -0,0 +1,131 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Example reader of the ring output_shm publishes. It waits for the frames
+  and writes them to stdout, one JPEG after the other, or only tells how
+  many came and how long they took to get here.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "mjpg_shm.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void signal_handler(int sig)
+{
+    stop = 1;
+}
+
+static int64_t now_us(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = NULL;
+    int c, write_frames = 0, count = -1, rc;
+    unsigned long frames = 0, skipped = 0, overwritten = 0;
+    int64_t delay_total = 0, delay_max = 0, last_report;
+    mjpg_shm shm;
+    mjpg_shm_frame frame;
+
+    while((c = getopt(argc, argv, "n:oc:h")) != -1) {
+        switch(c) {
+        case 'n':
+            name = optarg;
+            break;
+        case 'o':
+            write_frames = 1;
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n NAME] [-o] [-c COUNT]\n\n" \
+                    " Reads the frames output_shm publishes.\n\n" \
+                    " [-n NAME]...: name of the shared memory, default "MJPG_SHM_DEFAULT_NAME"\n" \
+                    " [-o]........: write the frames to stdout, one after the other\n" \
+                    " [-c COUNT]..: stop after COUNT frames\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(mjpg_shm_open(&shm, name) < 0) {
+        perror(name != NULL ? name : MJPG_SHM_DEFAULT_NAME);
+        return 1;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    last_report = now_us();
+    while(!stop && count != 0) {
+        rc = mjpg_shm_next(&shm, &frame, 1000);
+        if(rc < 0) {
+            fprintf(stderr, "the writer stopped\n");
+            break;
+        }
+
+        if(rc > 0) {
+            int64_t delay = now_us() - frame.published_us;
+
+            /* the frame is used where it is, then checked */
+            if(write_frames && fwrite(frame.data, 1, frame.size, stdout) != frame.size)
+                break;
+            if(!mjpg_shm_valid(&shm, &frame)) {
+                overwritten++;
+                continue;
+            }
+
+            frames++;
+            skipped += frame.skipped;
+            delay_total += delay;
+            if(delay > delay_max)
+                delay_max = delay;
+            if(count > 0)
+                count--;
+        }
+
+        if(now_us() - last_report >= 1000000) {
+            fprintf(stderr, "%lu frames, %lu skipped, %lu overwritten while read, " \
+                    "%lld us from publishing on average, %lld us at most\n",
+                    frames, skipped, overwritten,
+                    frames ? (long long)(delay_total / frames) : 0LL, (long long)delay_max);
+            frames = skipped = overwritten = 0;
+            delay_total = delay_max = 0;
+            last_report = now_us();
+        }
+    }
+
+    mjpg_shm_close(&shm);
+    return 0;
+}
@@ -0,0 +1,425 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  This output plugin publishes the frames into a ring in POSIX shared memory,
+  for processes on the same host. They map the ring and use the frames where
+  they are, see mjpg_shm.h for the layout and the reader.
+
+  The frame is copied once, from the input straight into its slot.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "../../utils.h"
+#include "../../mjpg_streamer.h"
+#include "mjpg_shm.h"
+
+#define OUTPUT_PLUGIN_NAME "shared memory output plugin"
+#define MAX_MISSED_WAKES 16     // wakes in a row that woke nobody
+
+static pthread_t worker;
+static globals *pglobal;
+static int input_number = 0;
+
+static char *name = MJPG_SHM_DEFAULT_NAME;
+static int slots = 8;
+static int slot_size = 2048 << 10;
+static mode_t mode = 0600;
+
+static int fd = -1;
+static size_t ring_size;
+static mjpg_shm_header *ring = NULL;
+static uint32_t dead_waiters = 0;       // counted in waiters, but gone
+static int missed_wakes = 0;
+
+/* read-only controls exporting the state of the ring */
+enum {
+    CTRL_FRAMES_PUBLISHED,
+    CTRL_FRAMES_TOO_LARGE,
+    CTRL_READERS_WAITING,
+    CTRL_COUNT
+};
+
+static const char *control_names[CTRL_COUNT] = {
+    "Frames published",
+    "Frames too large",
+    "Readers waiting"
+};
+static control *stats = NULL;
+
+/******************************************************************************
+Description.: print a help message
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void help(void)
+{
+    fprintf(stderr, " ---------------------------------------------------------------\n" \
+            " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
+            " ---------------------------------------------------------------\n" \
+            " The following parameters can be passed to this plugin:\n\n" \
+            " [-n | --name ]..........: name of the shared memory, default "MJPG_SHM_DEFAULT_NAME"\n" \
+            " [-slots ]...............: frames the ring holds, default 8\n" \
+            " [-slotsize ]............: KB of the largest frame, default 2048\n" \
+            " [-mode ]................: permissions of the shared memory, default 0600,\n" \
+            "                           readers need to write to it to wait for frames\n" \
+            " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
+            " ---------------------------------------------------------------\n");
+}
+
+/******************************************************************************
+Description.: creates the shared memory and lays out the ring, a ring left
+              by an earlier run is replaced
+Input Value.: -
+Return Value: 0 if ok, -1 if not
+******************************************************************************/
+static int create_ring(void)
+{
+    size_t header_size = mjpg_shm_header_size(slots);
+
+    shm_unlink(name);
+    if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode)) < 0) {
+        perror("shm_open");
+        return -1;
+    }
+    /* the umask must not take away what readers need */
+    fchmod(fd, mode);
+
+    ring_size = header_size + (size_t)slots * slot_size;
+    if(ftruncate(fd, ring_size) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(ring == MAP_FAILED) {
+        perror("mmap");
+        ring = NULL;
+        return -1;
+    }
+
+    ring->version = MJPG_SHM_VERSION;
+    ring->header_size = header_size;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->writer_pid = getpid();
+
+    /* readers check the magic first, it goes in last */
+    __atomic_store_n(&ring->magic, MJPG_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/******************************************************************************
+Description.: tells the readers that a frame changed or the ring closed. A
+              reader that died while waiting never takes itself off waiters,
+              so once a number of wakes in a row woke nobody, that many
+              waiters are taken for dead and only those above it are woken
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void wake_readers(void)
+{
+    uint32_t waiters;
+
+    __atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+    waiters = __atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST);
+    if(waiters < dead_waiters)
+        dead_waiters = waiters;
+    if(waiters == dead_waiters)
+        return;
+
+    /* a reader may count itself before it sleeps, one miss proves nothing */
+    if(mjpg_shm_futex(&ring->futex, FUTEX_WAKE, INT_MAX, NULL) > 0) {
+        missed_wakes = 0;
+    } else if(++missed_wakes == MAX_MISSED_WAKES) {
+        DBG("%u readers died while waiting\n", waiters - dead_waiters);
+        dead_waiters = waiters;
+        missed_wakes = 0;
+    }
+}
+
+/******************************************************************************
+Description.: clean up allocated resources
+Input Value.: unused argument
+Return Value: -
+******************************************************************************/
+void worker_cleanup(void *arg)
+{
+    static unsigned char first_run = 1;
+
+    if(!first_run) {
+        DBG("already cleaned up resources\n");
+        return;
+    }
+
+    first_run = 0;
+    OPRINT("cleaning up resources allocated by worker thread\n");
+
+    input_unsubscribe(&pglobal->in[input_number]);
+
+    /* readers that hold the ring keep it until they let go */
+    if(ring != NULL) {
+        __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+        wake_readers();
+        munmap(ring, ring_size);
+    }
+    if(fd >= 0) {
+        close(fd);
+        shm_unlink(name);
+    }
+}
+
+static void unlock_db(void *arg)
+{
+    pthread_mutex_unlock(&((input *)arg)->db);
+}
+
+/******************************************************************************
+Description.: this is the main worker thread
+              it loops forever, grabs a fresh frame and copies it into the
+              next slot of the ring
+Input Value.:
+Return Value:
+******************************************************************************/
+void *worker_thread(void *arg)
+{
+    input *in = &pglobal->in[input_number];
+    uint64_t number = 0;
+    mjpg_shm_slot *s;
+    struct timeval now;
+    int frame_size;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, NULL);
+
+    /* readers map the segment without telling us, keep it filled */
+    input_subscribe(in);
+
+    while(!pglobal->stop) {
+        DBG("waiting for fresh frame\n");
+        pthread_mutex_lock(&in->db);
+        /* the cleanup must be able to unsubscribe and close the ring */
+        pthread_cleanup_push(unlock_db, in);
+        pthread_cond_wait(&in->db_update, &in->db);
+        pthread_cleanup_pop(0);
+
+        /* read buffer */
+        frame_size = input_jpeg(in);
+        if(frame_size > slot_size) {
+            pthread_mutex_unlock(&in->db);
+            DBG("frame of %d bytes does not fit into a slot\n", frame_size);
+            stats[CTRL_FRAMES_TOO_LARGE].value++;
+            continue;
+        }
+
+        /* readers see an odd sequence while the slot changes */
+        s = &ring->slot[number % slots];
+        __atomic_store_n(&s->sequence, 2 * number + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        memcpy(mjpg_shm_slot_data(ring, number), in->buf, frame_size);
+        s->number = number;
+        s->size = frame_size;
+        s->timestamp_us = (int64_t)in->timestamp.tv_sec * 1000000 + in->timestamp.tv_usec;
+
+        /* allow others to access the global buffer again */
+        pthread_mutex_unlock(&in->db);
+
+        gettimeofday(&now, NULL);
+        s->published_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+        __atomic_store_n(&s->sequence, 2 * number + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->frames, number + 1, __ATOMIC_RELEASE);
+        wake_readers();
+
+        number++;
+        stats[CTRL_FRAMES_PUBLISHED].value++;
+        stats[CTRL_READERS_WAITING].value = __atomic_load_n(&ring->waiters, __ATOMIC_RELAXED) - dead_waiters;
+    }
+
+    /* cleanup now */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+/*** plugin interface functions ***/
+/******************************************************************************
+Description.: this function is called first, in order to initialise
+              this plugin and pass a parameter string
+Input Value.: parameters, id of this output
+Return Value: 0 if everything is ok, non-zero otherwise
+******************************************************************************/
+int output_init(output_parameter *param, int id)
+{
+    int i;
+
+    param->argv[0] = OUTPUT_PLUGIN_NAME;
+
+    /* show all parameters for DBG purposes */
+    for(i = 0; i < param->argc; i++) {
+        DBG("argv[%d]=%s\n", i, param->argv[i]);
+    }
+
+    reset_getopt();
+    while(1) {
+        int option_index = 0, c = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0
+            },
+            {"help", no_argument, 0, 0},
+            {"n", required_argument, 0, 0},
+            {"name", required_argument, 0, 0},
+            {"i", required_argument, 0, 0},
+            {"input", required_argument, 0, 0},
+            {"slots", required_argument, 0, 0},
+            {"slotsize", required_argument, 0, 0},
+            {"mode", required_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(param->argc, param->argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help();
+            return 1;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            DBG("case 0,1\n");
+            help();
+            return 1;
+            break;
+            /* n, name */
+        case 2:
+        case 3:
+            DBG("case 2,3\n");
+            if(optarg[0] == '/') {
+                name = strdup(optarg);
+            } else {
+                name = malloc(strlen(optarg) + 2);
+                sprintf(name, "/%s", optarg);
+            }
+            break;
+            /* i, input */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            input_number = atoi(optarg);
+            break;
+            /* slots */
+        case 6:
+            DBG("case 6\n");
+            slots = atoi(optarg);
+            if(slots < 2 || slots > 1024) {
+                OPRINT("ERROR: the ring needs 2 to 1024 slots\n");
+                return 1;
+            }
+            break;
+            /* slotsize */
+        case 7:
+            DBG("case 7\n");
+            slot_size = atoi(optarg);
+            if(slot_size < 1 || slot_size > (1 << 20)) {
+                OPRINT("ERROR: a slot holds 1 KB to 1 GB\n");
+                return 1;
+            }
+            slot_size <<= 10;
+            break;
+            /* mode */
+        case 8:
+            DBG("case 8\n");
+            mode = strtol(optarg, NULL, 8) & 0777;
+            break;
+        }
+    }
+
+    pglobal = param->global;
+    if(!(input_number < pglobal->incnt)) {
+        OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, pglobal->incnt);
+        return 1;
+    }
+    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    OPRINT("shared memory.....: %s, mode %04o\n", name, (unsigned int)mode);
+    OPRINT("ring..............: %d slots of %d KB\n", slots, slot_size >> 10);
+
+    if(create_ring() < 0) {
+        OPRINT("ERROR: could not create the shared memory %s\n", name);
+        return 1;
+    }
+
+    param->global->out[id].parametercount = CTRL_COUNT;
+    param->global->out[id].out_parameters = (control*) calloc(CTRL_COUNT, sizeof(control));
+    stats = param->global->out[id].out_parameters;
+    for(i = 0; i < CTRL_COUNT; i++) {
+        stats[i].group = IN_CMD_GENERIC;
+        stats[i].menuitems = NULL;
+        stats[i].value = 0;
+        stats[i].class_id = 0;
+        stats[i].ctrl.id = V4L2_CID_PRIVATE_BASE + i;
+        stats[i].ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+        stats[i].ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+        snprintf((char*) stats[i].ctrl.name, sizeof(stats[i].ctrl.name), "%s", control_names[i]);
+        stats[i].ctrl.minimum = 0;
+        stats[i].ctrl.maximum = INT_MAX;
+        stats[i].ctrl.step = 1;
+        stats[i].ctrl.default_value = 0;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: calling this function stops the worker thread
+Input Value.: -
+Return Value: always 0
+******************************************************************************/
+int output_stop(int id)
+{
+    DBG("will cancel worker thread\n");
+    pthread_cancel(worker);
+    return 0;
+}
+
+/******************************************************************************
+Description.: calling this function creates and starts the worker thread
+Input Value.: -
+Return Value: always 0
+******************************************************************************/
+int output_run(int id)
+{
+    DBG("launching worker thread\n");
+    pthread_create(&worker, 0, worker_thread, NULL);
+    pthread_detach(worker);
+    return 0;
+}
@@ -28,6 +28,10 @@
   It provides a mechanism to take snapshots with a trigger from a UDP packet.
   The UDP msg contains the path for the snapshot jpeg file
   It echoes the message received back to the sender, after taking the snapshot
+
+  With --stream it also pushes every frame to a list of unicast or multicast
+  destinations, cut into numbered fragments, see udp_stream.h and the
+  mjpg_udp_receiver tool that puts them together again.
 */
 
 #include <stdio.h>
@@ -47,25 +51,78 @@
 #include <fcntl.h>
 #include <time.h>
 #include <syslog.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/uio.h>
 
 #include <dirent.h>
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
+#include "../command.h"
+#include "udp_stream.h"
 
 #define OUTPUT_PLUGIN_NAME "UDP output plugin"
 
+#define MAX_DESTINATIONS 8
+#define SEND_BATCH 64           // messages per sendmmsg()
+#define GSO_SEGMENTS 64         // datagrams the kernel cuts from one message
+#define GSO_MAX_PAYLOAD 65000   // and their bytes together
+#define IP_UDP_HEADERS 28
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
 static pthread_t worker;
 static globals *pglobal;
 static int fd, delay, max_frame_size;
 static char *folder = "/tmp";
 static unsigned char *frame = NULL;
 static char *command = NULL;
+static command_pool commands;
 static int input_number = 0;
 
 // UDP port
 static int port = 0;
 
+/* streaming, only used by the stream thread after output_init() */
+static pthread_t streamer;
+static struct sockaddr_in destinations[MAX_DESTINATIONS];
+static int destination_count = 0;
+static int mtu = 1400, ttl = 1, fec = 0, gso = 1;
+static int datagram;                // UDP payload that fits into the MTU
+static int stream_sd = -1, subscribed = 0;
+static unsigned char *stream_frame = NULL;
+static int stream_frame_size = 0;
+static unsigned char *headers = NULL, *parity = NULL;
+static struct iovec *segments = NULL;
+static int segment_capacity = 0;
+static uint32_t frame_number = 0;
+
+/* read-only controls exporting the state of the stream */
+enum {
+    CTRL_FRAMES_STREAMED,
+    CTRL_FRAMES_TOO_LARGE,
+    CTRL_DATAGRAMS_SENT,
+    CTRL_DATAGRAMS_DROPPED,
+    CTRL_GSO,
+    CTRL_COUNT
+};
+
+static const char *control_names[CTRL_COUNT] = {
+    "Frames streamed",
+    "Frames too large",
+    "Datagrams sent",
+    "Datagrams dropped",
+    "Segmentation offload"
+};
+static control *stats = NULL;
+
 /******************************************************************************
 Description.: print a help message
 Input Value.: -
@@ -80,7 +137,15 @@ void help(void)
             " [-f | --folder ]........: folder to save pictures\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-c | --command ].......: execute command after saveing picture\n" \
-            " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n\n" \
+            COMMAND_HELP \
+            " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n" \
+            " [-s | --stream ]........: ADDRESS:PORT[,ADDRESS:PORT...] to push every frame to,\n" \
+            "                           unicast or multicast, at most 8\n" \
+            " [-mtu ].................: bytes of the IP packets streamed, default 1400\n" \
+            " [-ttl ].................: time to live of multicast datagrams, 1 to 255, default 1\n" \
+            " [-fec ].................: add a parity datagram after every N, that lets\n" \
+            "                           the receiver rebuild one lost datagram, default 0 (off)\n" \
+            " [-nogso ]...............: do not let the kernel cut the datagrams (UDP GSO)\n\n" \
             " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
             " ---------------------------------------------------------------\n");
 }
@@ -102,6 +167,14 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
+    /* run the commands for the files that are still queued */
+    if(command != NULL) {
+        command_pool_stop(&commands);
+        OPRINT("commands run......: %u, %u failed, %u skipped, %llu ms on average, %u ms at most\n",
+               commands.done, commands.failed, commands.dropped,
+               commands.done ? commands.latency_total / commands.done : 0, commands.latency_max);
+    }
+
     if(frame != NULL) {
         free(frame);
     }
@@ -116,8 +189,7 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
-    char buffer1[1024] = {0};
+    int ok = 1, frame_size = 0;
     unsigned char *tmp_framebuffer = NULL;
 
     /* set cleanup handler to cleanup allocated resources */
@@ -128,6 +200,11 @@ void *worker_thread(void *arg)
         OPRINT("a valid UDP port must be provided\n");
         return NULL;
     }
+    if(command != NULL && command_pool_start(&commands, command) < 0) {
+        OPRINT("could not start the command threads\n");
+        command = NULL;
+        return NULL;
+    }
     struct sockaddr_in addr;
     int sd;
     int bytes;
@@ -152,12 +229,15 @@ void *worker_thread(void *arg)
 
 
 
+        /* a frame is only wanted now, the input may idle in between */
+        input_subscribe(&pglobal->in[input_number]);
+
         DBG("waiting for fresh frame\n");
         pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
 
         /* check if buffer for frame is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
@@ -178,6 +258,7 @@ void *worker_thread(void *arg)
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
+        input_unsubscribe(&pglobal->in[input_number]);
 
         /* only save a file if a name came in with the UDP message */
         if(strlen(udpbuffer) > 0) {
@@ -203,23 +284,10 @@ void *worker_thread(void *arg)
         // send back client's message that came in udpbuffer
         sendto(sd, udpbuffer, bytes, 0, (struct sockaddr*)&addr, sizeof(addr));
 
-        /* call the command if user specified one, pass current filename as argument */
+        /* queue the command if user specified one, udpbuffer still contains
+           the filename, it gets it as argument */
         if(command != NULL) {
-            memset(buffer1, 0, sizeof(buffer1));
-
-            /* udpbuffer still contains the filename, pass it to the command as parameter */
-            snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, udpbuffer);
-            DBG("calling command %s", buffer1);
-
-            /* in addition provide the filename as environment variable */
-            if((rc = setenv("MJPG_FILE", udpbuffer, 1)) != 0) {
-                LOG("setenv failed (return value %d)\n", rc);
-            }
-
-            /* execute the command now */
-            if((rc = system(buffer1)) != 0) {
-                LOG("command failed (return value %d)\n", rc);
-            }
+            command_submit(&commands, udpbuffer);
         }
 
         /* if specified, wait now */
@@ -238,14 +306,340 @@ void *worker_thread(void *arg)
     return NULL;
 }
 
+/******************************************************************************
+Description.: sends a batch of messages, one message carries several datagrams
+              when the kernel cuts them
+Input Value.: messages, the datagrams in each of them, their number
+Return Value: number of messages sent or dropped, less than count only if
+              segmentation offload does not work here, the message it
+              returns the index of and those behind it were not sent
+******************************************************************************/
+static int send_batch(struct mmsghdr *messages, const int *datagrams, int count)
+{
+    int done = 0, rc;
+
+    while(done < count) {
+        rc = sendmmsg(stream_sd, messages + done, count - done, 0);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            /* the device can not checksum what the kernel cuts, or the
+               datagrams are larger than the route allows */
+            if(gso && (errno == EIO || errno == EINVAL || errno == EMSGSIZE))
+                return done;
+            /* lose this message, not the rest of the frame */
+            DBG("sendmmsg: %s\n", strerror(errno));
+            stats[CTRL_DATAGRAMS_DROPPED].value += datagrams[done];
+            done++;
+            continue;
+        }
+        for(; rc > 0; rc--, done++)
+            stats[CTRL_DATAGRAMS_SENT].value += datagrams[done];
+    }
+    return done;
+}
+
+/******************************************************************************
+Description.: turns segmentation offload off and sends the messages it failed
+              for again, one datagram per message
+Input Value.: messages that were not sent, the datagrams in each of them,
+              their number
+Return Value: -
+******************************************************************************/
+static void send_without_gso(const struct mmsghdr *messages, const int *datagrams, int count)
+{
+    static struct mmsghdr single[SEND_BATCH];
+    static int ones[SEND_BATCH];
+    int i, j, n = 0;
+
+    OPRINT("UDP segmentation offload failed (%s), sending the datagrams one by one\n", strerror(errno));
+    gso = 0;
+    stats[CTRL_GSO].value = 0;
+    setsockopt(stream_sd, SOL_UDP, UDP_SEGMENT, &gso, sizeof(gso));
+
+    for(i = 0; i < count; i++) {
+        for(j = 0; j < datagrams[i]; j++) {
+            single[n].msg_hdr = messages[i].msg_hdr;
+            single[n].msg_hdr.msg_iov = messages[i].msg_hdr.msg_iov + 2 * j;
+            single[n].msg_hdr.msg_iovlen = 2;
+            ones[n] = 1;
+            if(++n == SEND_BATCH) {
+                send_batch(single, ones, n);
+                n = 0;
+            }
+        }
+    }
+    if(n > 0)
+        send_batch(single, ones, n);
+}
+
+/******************************************************************************
+Description.: cuts a frame into fragments, adds a parity fragment to every FEC
+              group and sends all of them to every destination. The payloads
+              point into the frame, only the headers and the parity are built.
+              With GSO a message carries a run of datagrams of the same size,
+              a shorter one can only end it.
+Input Value.: frame, its size and capture time
+Return Value: 0 if ok, -1 if the frame has too many fragments
+******************************************************************************/
+static int send_frame(unsigned char *data, int size, const struct timeval *timestamp)
+{
+    static struct mmsghdr messages[SEND_BATCH];
+    static int datagrams[SEND_BATCH];
+    int fragment = datagram - UDP_STREAM_HEADER;
+    int count = (size + fragment - 1) / fragment;
+    int groups = fec > 0 ? (count + fec - 1) / fec : 0;
+    int total = count + groups, per_message, i, j, g, m, n, d;
+    udp_fragment f;
+
+    if(count == 0 || count > 0xFFFF)
+        return -1;
+
+    if(total > segment_capacity) {
+        unsigned char *h = realloc(headers, total * UDP_STREAM_HEADER);
+        struct iovec *v = realloc(segments, 2 * total * sizeof(struct iovec));
+        unsigned char *x = realloc(parity, (size_t)(groups > 0 ? groups : 1) * fragment);
+        if(h != NULL) headers = h;
+        if(v != NULL) segments = v;
+        if(x != NULL) parity = x;
+        if(h == NULL || v == NULL || x == NULL)
+            return -1;
+        segment_capacity = total;
+    }
+
+    memset(&f, 0, sizeof(f));
+    f.frame = frame_number++;
+    f.count = count;
+    f.size = size;
+    f.fragment = fragment;
+    f.group = fec;
+    f.timestamp = (uint64_t)timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+
+    /* every group is followed by its parity */
+    n = 0;
+    for(g = 0; g < (groups > 0 ? groups : 1); g++) {
+        int first = g * fec, last = groups > 0 ? first + fec : count;
+        unsigned char *x = parity + (size_t)g * fragment;
+
+        if(last > count)
+            last = count;
+        for(i = first; i < last; i++) {
+            int length = i < count - 1 ? fragment : size - i * fragment;
+
+            if(groups > 0) {
+                if(i == first) {
+                    memcpy(x, data + i * fragment, length);
+                    memset(x + length, 0, fragment - length);
+                } else {
+                    for(j = 0; j < length; j++)
+                        x[j] ^= data[i * fragment + j];
+                }
+            }
+
+            f.flags = 0;
+            f.index = i;
+            udp_stream_pack(&f, headers + n * UDP_STREAM_HEADER);
+            segments[2 * n].iov_base = headers + n * UDP_STREAM_HEADER;
+            segments[2 * n].iov_len = UDP_STREAM_HEADER;
+            segments[2 * n + 1].iov_base = data + i * fragment;
+            segments[2 * n + 1].iov_len = length;
+            n++;
+        }
+        if(groups > 0) {
+            f.flags = UDP_STREAM_PARITY;
+            f.index = g;
+            udp_stream_pack(&f, headers + n * UDP_STREAM_HEADER);
+            segments[2 * n].iov_base = headers + n * UDP_STREAM_HEADER;
+            segments[2 * n].iov_len = UDP_STREAM_HEADER;
+            segments[2 * n + 1].iov_base = x;
+            segments[2 * n + 1].iov_len = fragment;
+            n++;
+        }
+    }
+
+    per_message = 1;
+    if(gso) {
+        per_message = GSO_MAX_PAYLOAD / datagram;
+        if(per_message > GSO_SEGMENTS)
+            per_message = GSO_SEGMENTS;
+    }
+
+    n = 0;
+    for(d = 0; d < destination_count; d++) {
+        for(i = 0; i < total; i += m) {
+            struct msghdr *h = &messages[n].msg_hdr;
+
+            for(m = 1; m < per_message && i + m < total; m++) {
+                if(segments[2 * (i + m) - 1].iov_len != (size_t)fragment)
+                    break;
+            }
+
+            memset(h, 0, sizeof(*h));
+            h->msg_name = &destinations[d];
+            h->msg_namelen = sizeof(destinations[d]);
+            h->msg_iov = &segments[2 * i];
+            h->msg_iovlen = 2 * m;
+            datagrams[n] = m;
+            if(++n == SEND_BATCH || (d == destination_count - 1 && i + m == total)) {
+                int sent = send_batch(messages, datagrams, n);
+
+                /* carry on where the kernel stopped, without GSO, so
+                   no datagram goes out twice */
+                if(sent < n) {
+                    send_without_gso(messages + sent, datagrams + sent, n - sent);
+                    per_message = 1;
+                }
+                n = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: clean up what the stream thread allocated
+Input Value.: unused argument
+Return Value: -
+******************************************************************************/
+void stream_cleanup(void *arg)
+{
+    static unsigned char first_run = 1;
+
+    if(!first_run) {
+        DBG("already cleaned up resources\n");
+        return;
+    }
+
+    first_run = 0;
+    OPRINT("cleaning up resources allocated by stream thread\n");
+
+    if(subscribed) {
+        input_unsubscribe(&pglobal->in[input_number]);
+        subscribed = 0;
+    }
+    if(stream_sd >= 0)
+        close(stream_sd);
+    free(stream_frame);
+    free(headers);
+    free(parity);
+    free(segments);
+}
+
+/******************************************************************************
+Description.: this is the stream thread
+              it loops forever, grabs a fresh frame and pushes it to the
+              destinations
+Input Value.:
+Return Value:
+******************************************************************************/
+void *stream_thread(void *arg)
+{
+    int frame_size = 0, buffer = 1 << 20;
+    unsigned char *tmp_framebuffer = NULL;
+    struct timeval timestamp;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(stream_cleanup, NULL);
+
+    if((stream_sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        return NULL;
+    }
+    setsockopt(stream_sd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    setsockopt(stream_sd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    /* from now on the kernel cuts every send larger than a datagram */
+    if(gso && setsockopt(stream_sd, SOL_UDP, UDP_SEGMENT, &datagram, sizeof(datagram)) != 0) {
+        OPRINT("UDP segmentation offload is not available\n");
+        gso = 0;
+    }
+    stats[CTRL_GSO].value = gso;
+
+    input_subscribe(&pglobal->in[input_number]);
+    subscribed = 1;
+
+    while(!pglobal->stop) {
+        DBG("waiting for fresh frame\n");
+        pthread_mutex_lock(&pglobal->in[input_number].db);
+        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+
+        /* read buffer */
+        frame_size = input_jpeg(&pglobal->in[input_number]);
+
+        /* check if buffer for frame is large enough, increase it if necessary */
+        if(frame_size > stream_frame_size) {
+            DBG("increasing buffer size to %d\n", frame_size);
+
+            stream_frame_size = frame_size + (1 << 16);
+            if((tmp_framebuffer = realloc(stream_frame, stream_frame_size)) == NULL) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                LOG("not enough memory\n");
+                return NULL;
+            }
+
+            stream_frame = tmp_framebuffer;
+        }
+
+        /* copy frame to our local buffer now */
+        memcpy(stream_frame, pglobal->in[input_number].buf, frame_size);
+        timestamp = pglobal->in[input_number].timestamp;
+
+        /* allow others to access the global buffer again */
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+        if(timestamp.tv_sec == 0 && timestamp.tv_usec == 0)
+            gettimeofday(&timestamp, NULL);
+
+        if(send_frame(stream_frame, frame_size, &timestamp) < 0) {
+            DBG("frame of %d bytes can not be streamed\n", frame_size);
+            stats[CTRL_FRAMES_TOO_LARGE].value++;
+        } else {
+            stats[CTRL_FRAMES_STREAMED].value++;
+        }
+    }
+
+    /* cleanup now */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: reads the list of destinations
+Input Value.: ADDRESS:PORT[,ADDRESS:PORT...]
+Return Value: 0 if ok, -1 if it is not a valid list
+******************************************************************************/
+static int parse_destinations(char *list)
+{
+    char *item, *colon, *save = NULL;
+
+    for(item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        struct sockaddr_in *to = &destinations[destination_count];
+
+        if(destination_count == MAX_DESTINATIONS)
+            return -1;
+        colon = strrchr(item, ':');
+        if(colon == NULL)
+            return -1;
+        *colon = '\0';
+        memset(to, 0, sizeof(*to));
+        to->sin_family = AF_INET;
+        to->sin_port = htons(atoi(colon + 1));
+        if(inet_aton(item, &to->sin_addr) == 0 || to->sin_port == 0)
+            return -1;
+        destination_count++;
+    }
+    return destination_count > 0 ? 0 : -1;
+}
+
 /*** plugin interface functions ***/
 /******************************************************************************
 Description.: this function is called first, in order to initialise
               this plugin and pass a parameter string
-Input Value.: parameters
+Input Value.: parameters, id of this output
 Return Value: 0 if everything is ok, non-zero otherwise
 ******************************************************************************/
-int output_init(output_parameter *param)
+int output_init(output_parameter *param, int id)
 {
     int i;
 
@@ -258,6 +652,8 @@ int output_init(output_parameter *param)
         DBG("argv[%d]=%s\n", i, param->argv[i]);
     }
 
+    command_pool_init(&commands);
+
     reset_getopt();
     while(1) {
         int option_index = 0, c = 0;
@@ -275,6 +671,15 @@ int output_init(output_parameter *param)
             {"port", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"cmdthreads", required_argument, 0, 0},
+            {"cmdqueue", required_argument, 0, 0},
+            {"cmdoverflow", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"stream", required_argument, 0, 0},
+            {"mtu", required_argument, 0, 0},
+            {"ttl", required_argument, 0, 0},
+            {"fec", required_argument, 0, 0},
+            {"nogso", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -333,6 +738,57 @@ int output_init(output_parameter *param)
             DBG("case 10,11\n");
             input_number = atoi(optarg);
             break;
+            /* cmdthreads, cmdqueue, cmdoverflow */
+        case 12:
+        case 13:
+        case 14:
+            DBG("case 12,13,14\n");
+            if(command_pool_option(&commands, long_options[option_index].name, optarg) < 0) {
+                help();
+                return 1;
+            }
+            break;
+            /* s, stream */
+        case 15:
+        case 16:
+            DBG("case 15,16\n");
+            if(parse_destinations(optarg) < 0) {
+                OPRINT("ERROR: --stream wants up to %d ADDRESS:PORT separated by commas\n", MAX_DESTINATIONS);
+                return 1;
+            }
+            break;
+            /* mtu */
+        case 17:
+            DBG("case 17\n");
+            mtu = atoi(optarg);
+            if(mtu < IP_UDP_HEADERS + UDP_STREAM_HEADER + 64 || mtu > 65535) {
+                OPRINT("ERROR: the MTU must be between %d and 65535\n", IP_UDP_HEADERS + UDP_STREAM_HEADER + 64);
+                return 1;
+            }
+            break;
+            /* ttl */
+        case 18:
+            DBG("case 18\n");
+            ttl = atoi(optarg);
+            if(ttl < 1 || ttl > 255) {
+                help();
+                return 1;
+            }
+            break;
+            /* fec */
+        case 19:
+            DBG("case 19\n");
+            fec = atoi(optarg);
+            if(fec < 0 || fec > 0xFFFF) {
+                help();
+                return 1;
+            }
+            break;
+            /* nogso */
+        case 20:
+            DBG("case 20\n");
+            gso = 0;
+            break;
         }
     }
 
@@ -345,36 +801,89 @@ int output_init(output_parameter *param)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("delay after save..: %d\n", delay);
     OPRINT("command...........: %s\n", (command == NULL) ? "disabled" : command);
+    if(command != NULL) {
+        OPRINT("command threads...: %d, %d queued, skipping the %s\n", commands.workers, commands.length,
+               commands.overflow == COMMAND_DROP_OLDEST ? "oldest" : "newest");
+    }
     if(port > 0) {
         OPRINT("UDP port..........: %d\n", port);
     } else {
         OPRINT("UDP port..........: %s\n", "disabled");
     }
+    for(i = 0; i < destination_count; i++) {
+        OPRINT("streaming to......: %s:%d\n", inet_ntoa(destinations[i].sin_addr), ntohs(destinations[i].sin_port));
+    }
+    if(destination_count > 0) {
+        OPRINT("MTU...............: %d\n", mtu);
+        if(fec > 0) {
+            OPRINT("FEC...............: 1 parity per %d datagrams\n", fec);
+        } else {
+            OPRINT("FEC...............: %s\n", "disabled");
+        }
+        OPRINT("GSO...............: %s\n", gso ? "if available" : "disabled");
+    }
+    datagram = mtu - IP_UDP_HEADERS;
+    if(port <= 0 && destination_count == 0) {
+        OPRINT("ERROR: a UDP port to listen on or a destination to stream to must be provided\n");
+        return 1;
+    }
+
+    param->global->out[id].parametercount = CTRL_COUNT;
+    param->global->out[id].out_parameters = (control*) calloc(CTRL_COUNT, sizeof(control));
+    stats = param->global->out[id].out_parameters;
+    for(i = 0; i < CTRL_COUNT; i++) {
+        stats[i].group = IN_CMD_GENERIC;
+        stats[i].menuitems = NULL;
+        stats[i].value = 0;
+        stats[i].class_id = 0;
+        stats[i].ctrl.id = V4L2_CID_PRIVATE_BASE + i;
+        stats[i].ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+        stats[i].ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+        snprintf((char*) stats[i].ctrl.name, sizeof(stats[i].ctrl.name), "%s", control_names[i]);
+        stats[i].ctrl.minimum = 0;
+        stats[i].ctrl.maximum = INT_MAX;
+        stats[i].ctrl.step = 1;
+        stats[i].ctrl.default_value = 0;
+    }
     return 0;
 }
 
 /******************************************************************************
-Description.: calling this function stops the worker thread
+Description.: calling this function stops the worker and stream threads
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
 int output_stop(int id)
 {
-    DBG("will cancel worker thread\n");
-    pthread_cancel(worker);
+    if(port > 0) {
+        DBG("will cancel worker thread\n");
+        pthread_cancel(worker);
+    }
+    if(destination_count > 0) {
+        DBG("will cancel stream thread\n");
+        pthread_cancel(streamer);
+    }
     return 0;
 }
 
 /******************************************************************************
 Description.: calling this function creates and starts the worker thread
+              for the picture requests and the stream thread
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
 int output_run(int id)
 {
-    DBG("launching worker thread\n");
-    pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
+    if(port > 0) {
+        DBG("launching worker thread\n");
+        pthread_create(&worker, 0, worker_thread, NULL);
+        pthread_detach(worker);
+    }
+    if(destination_count > 0) {
+        DBG("launching stream thread\n");
+        pthread_create(&streamer, 0, stream_thread, NULL);
+        pthread_detach(streamer);
+    }
     return 0;
 }
 
@@ -0,0 +1,482 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Reference receiver for the frames output_udp streams with --stream. It puts
+  the fragments together again, rebuilds single lost fragments from the FEC
+  parity and writes the frames into a folder or to stdout, one JPEG after the
+  other, which players read as an MJPEG stream.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "udp_stream.h"
+
+#define SLOTS 8                 // frames put together at the same time
+#define BATCH 64                // datagrams per recvmmsg()
+#define MAX_DATAGRAM 65536
+
+typedef struct _slot slot;
+struct _slot {
+    int used;
+    udp_fragment info;          // of the first fragment that came in
+    unsigned char *data;
+    unsigned char *have;        // per data fragment
+    unsigned char *parity;
+    unsigned char *have_parity; // per group
+    size_t data_capacity, parity_capacity;
+    int count_capacity, groups_capacity;
+    int missing;
+    int rebuilt;
+};
+
+static slot slots[SLOTS];
+static int started = 0;
+static uint32_t last_frame;
+
+static const char *output = NULL;
+static int out_fd = -1;
+static int loss = 0;
+static volatile sig_atomic_t stop = 0;
+
+typedef struct _statistics statistics;
+struct _statistics {
+    unsigned int frames, rebuilt, lost, datagrams, dropped, late, invalid;
+    double latency_total;
+    unsigned int latency_count;
+};
+
+static statistics counters, totals;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] PORT\n\n" \
+            " Receives the frames output_udp streams with --stream.\n\n" \
+            " [-g ADDRESS]..: join a multicast group\n" \
+            " [-o DIR|-]....: write every frame into DIR, or to stdout one after\n" \
+            "                 the other as an MJPEG stream\n" \
+            " [-l N]........: throw away N of every 1000 datagrams, to try the FEC\n" \
+            " [-q]..........: do not print statistics every second\n", name);
+}
+
+static void signal_handler(int sig)
+{
+    stop = 1;
+}
+
+/* makes a buffer at least size bytes large */
+static int grow(unsigned char **buf, size_t *capacity, size_t size)
+{
+    unsigned char *tmp;
+
+    if(size <= *capacity)
+        return 0;
+    if((tmp = realloc(*buf, size)) == NULL)
+        return -1;
+    *buf = tmp;
+    *capacity = size;
+    return 0;
+}
+
+/* bytes of a data fragment, the last one is shorter, 0 past the frame */
+static int fragment_length(const udp_fragment *f, int index)
+{
+    long long rest = (long long)f->size - (long long)index * f->fragment;
+
+    if(rest <= 0)
+        return 0;
+    return rest < f->fragment ? (int)rest : f->fragment;
+}
+
+/******************************************************************************
+Description.: writes a complete frame
+Input Value.: slot of the frame
+Return Value: -
+******************************************************************************/
+static void emit(slot *s)
+{
+    struct timeval now;
+    char name[1024];
+    int fd, left = s->info.size;
+    unsigned char *p = s->data;
+
+    gettimeofday(&now, NULL);
+    counters.latency_total += ((double)now.tv_sec * 1000000 + now.tv_usec - (double)s->info.timestamp) / 1000;
+    counters.latency_count++;
+    counters.frames++;
+    if(s->rebuilt)
+        counters.rebuilt++;
+
+    if(output == NULL)
+        return;
+
+    if(out_fd >= 0) {
+        fd = out_fd;
+    } else {
+        snprintf(name, sizeof(name), "%s/frame_%010u.jpg", output, s->info.frame);
+        if((fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, 0644)) < 0) {
+            perror(name);
+            return;
+        }
+    }
+
+    while(left > 0) {
+        ssize_t rc = write(fd, p, left);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0) {
+            perror("write");
+            stop = 1;
+            break;
+        }
+        p += rc;
+        left -= rc;
+    }
+
+    if(fd != out_fd)
+        close(fd);
+}
+
+/******************************************************************************
+Description.: rebuilds the lost fragment of a group from the parity, possible
+              when only one is missing
+Input Value.: slot of the frame, group
+Return Value: -
+******************************************************************************/
+static void rebuild(slot *s, int group)
+{
+    const udp_fragment *f = &s->info;
+    int first = group * f->group, last = first + f->group, lost = -1, i, j, length;
+    unsigned char *x;
+
+    if(!s->have_parity[group])
+        return;
+    if(last > f->count)
+        last = f->count;
+    for(i = first; i < last; i++) {
+        if(s->have[i])
+            continue;
+        if(lost >= 0)
+            return;
+        lost = i;
+    }
+    if(lost < 0)
+        return;
+
+    x = s->data + (size_t)lost * f->fragment;
+    length = fragment_length(f, lost);
+    memcpy(x, s->parity + (size_t)group * f->fragment, length);
+    for(i = first; i < last; i++) {
+        const unsigned char *d = s->data + (size_t)i * f->fragment;
+        int n = fragment_length(f, i) < length ? fragment_length(f, i) : length;
+
+        if(i == lost)
+            continue;
+        for(j = 0; j < n; j++)
+            x[j] ^= d[j];
+    }
+    s->have[lost] = 1;
+    s->missing--;
+    s->rebuilt = 1;
+}
+
+/******************************************************************************
+Description.: finds the slot of a frame, takes a free one or the one of the
+              oldest frame if it is new
+Input Value.: header of a fragment
+Return Value: slot, NULL if the frame does not fit
+******************************************************************************/
+static slot *find_slot(const udp_fragment *f)
+{
+    slot *s = NULL;
+    int i, groups;
+
+    for(i = 0; i < SLOTS; i++) {
+        if(slots[i].used && slots[i].info.frame == f->frame) {
+            s = &slots[i];
+            if(s->info.size != f->size || s->info.count != f->count ||
+               s->info.fragment != f->fragment || s->info.group != f->group)
+                return NULL;
+            return s;
+        }
+    }
+
+    for(i = 0; i < SLOTS; i++) {
+        if(!slots[i].used) {
+            s = &slots[i];
+            break;
+        }
+        if(s == NULL || (int32_t)(slots[i].info.frame - s->info.frame) < 0)
+            s = &slots[i];
+    }
+
+    groups = f->group > 0 ? (f->count + f->group - 1) / f->group : 0;
+    if(grow(&s->data, &s->data_capacity, (size_t)f->count * f->fragment) < 0 ||
+       grow(&s->parity, &s->parity_capacity, (size_t)groups * f->fragment) < 0)
+        return NULL;
+    if(f->count > s->count_capacity) {
+        size_t size = s->count_capacity;
+        if(grow(&s->have, &size, f->count) < 0)
+            return NULL;
+        s->count_capacity = f->count;
+    }
+    if(groups > s->groups_capacity) {
+        size_t size = s->groups_capacity;
+        if(grow(&s->have_parity, &size, groups) < 0)
+            return NULL;
+        s->groups_capacity = groups;
+    }
+
+    s->used = 1;
+    s->info = *f;
+    s->missing = f->count;
+    s->rebuilt = 0;
+    memset(s->have, 0, f->count);
+    if(groups > 0)
+        memset(s->have_parity, 0, groups);
+    return s;
+}
+
+/******************************************************************************
+Description.: takes in one datagram
+Input Value.: datagram and its size
+Return Value: -
+******************************************************************************/
+static void receive(const unsigned char *p, int size)
+{
+    udp_fragment f;
+    slot *s;
+    int i, groups;
+
+    if(udp_stream_unpack(&f, p, size) < 0) {
+        counters.invalid++;
+        return;
+    }
+    p += UDP_STREAM_HEADER;
+    size -= UDP_STREAM_HEADER;
+
+    /* a restarted sender counts from 0 again */
+    if(started && (int32_t)(f.frame - last_frame) < -1000)
+        started = 0;
+    if(started && (int32_t)(f.frame - last_frame) <= 0) {
+        /* the parity of a frame that came in whole is not needed */
+        if(!(f.flags & UDP_STREAM_PARITY))
+            counters.late++;
+        return;
+    }
+
+    groups = f.group > 0 ? (f.count + f.group - 1) / f.group : 0;
+    if(f.flags & UDP_STREAM_PARITY) {
+        if(f.index >= groups || size != f.fragment) {
+            counters.invalid++;
+            return;
+        }
+    } else {
+        if(f.index >= f.count || size != fragment_length(&f, f.index)) {
+            counters.invalid++;
+            return;
+        }
+    }
+
+    if((s = find_slot(&f)) == NULL) {
+        counters.invalid++;
+        return;
+    }
+
+    if(f.flags & UDP_STREAM_PARITY) {
+        if(s->have_parity[f.index]) {
+            counters.late++;
+            return;
+        }
+        memcpy(s->parity + (size_t)f.index * f.fragment, p, size);
+        s->have_parity[f.index] = 1;
+        rebuild(s, f.index);
+    } else {
+        if(s->have[f.index]) {
+            counters.late++;
+            return;
+        }
+        memcpy(s->data + (size_t)f.index * f.fragment, p, size);
+        s->have[f.index] = 1;
+        s->missing--;
+        if(f.group > 0)
+            rebuild(s, f.index / f.group);
+    }
+
+    if(s->missing > 0)
+        return;
+
+    /* frames that were skipped will not come anymore */
+    if(started)
+        counters.lost += f.frame - last_frame - 1;
+    started = 1;
+    last_frame = f.frame;
+    emit(s);
+    for(i = 0; i < SLOTS; i++) {
+        if(slots[i].used && (int32_t)(slots[i].info.frame - last_frame) <= 0)
+            slots[i].used = 0;
+    }
+}
+
+static void report(const char *what, const statistics *c)
+{
+    fprintf(stderr, "%s: %u frames, %u rebuilt by FEC, %u lost, %u datagrams, %u dropped on purpose, "
+            "%u late or twice, %u invalid, latency %.1f ms\n", what,
+            c->frames, c->rebuilt, c->lost, c->datagrams, c->dropped, c->late, c->invalid,
+            c->latency_count ? c->latency_total / c->latency_count : 0.0);
+}
+
+/* moves the counters of the last second into the totals */
+static void add_statistics(void)
+{
+    totals.frames += counters.frames;
+    totals.rebuilt += counters.rebuilt;
+    totals.lost += counters.lost;
+    totals.datagrams += counters.datagrams;
+    totals.dropped += counters.dropped;
+    totals.late += counters.late;
+    totals.invalid += counters.invalid;
+    totals.latency_total += counters.latency_total;
+    totals.latency_count += counters.latency_count;
+    memset(&counters, 0, sizeof(counters));
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned char buffers[BATCH][MAX_DATAGRAM];
+    struct mmsghdr messages[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    struct timeval timeout = { 1, 0 }, now, last_report;
+    const char *group = NULL;
+    int sd, c, i, n, quiet = 0, on = 1, buffer = 4 << 20;
+
+    while((c = getopt(argc, argv, "g:o:l:qh")) != -1) {
+        switch(c) {
+        case 'g':
+            group = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'l':
+            loss = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1 || atoi(argv[optind]) <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(output != NULL && strcmp(output, "-") == 0)
+        out_fd = STDOUT_FILENO;
+
+    if((sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(atoi(argv[optind]));
+    if(bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        return 1;
+    }
+
+    if(group != NULL) {
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_interface.s_addr = INADDR_ANY;
+        if(inet_aton(group, &mreq.imr_multiaddr) == 0 ||
+           setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+            fprintf(stderr, "could not join the group %s\n", group);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    for(i = 0; i < BATCH; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = MAX_DATAGRAM;
+    }
+
+    gettimeofday(&last_report, NULL);
+    while(!stop) {
+        for(i = 0; i < BATCH; i++) {
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        /* wait for the first, then take what is there */
+        n = recvmmsg(sd, messages, BATCH, MSG_WAITFORONE, NULL);
+        if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvmmsg");
+            break;
+        }
+        for(i = 0; i < n; i++) {
+            counters.datagrams++;
+            if(loss > 0 && random() % 1000 < loss) {
+                counters.dropped++;
+                continue;
+            }
+            receive(buffers[i], messages[i].msg_len);
+        }
+
+        gettimeofday(&now, NULL);
+        if(now.tv_sec - last_report.tv_sec >= 1) {
+            if(!quiet)
+                report("last second", &counters);
+            add_statistics();
+            last_report = now;
+        }
+    }
+
+    add_statistics();
+    report("total", &totals);
+
+    close(sd);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef UDP_STREAM_H
+#define UDP_STREAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Datagram format of the frames streamed by output_udp, shared with the
+ * receiver. A frame is cut into fragments of the same size, the last one
+ * may be shorter, and every fragment gets this header in front, numbers in
+ * network byte order:
+ *
+ *   0  magic "MJ"          2  version            3  flags
+ *   4  frame number        8  index             10  count of data fragments
+ *  12  size of the frame  16  fragment size     18  FEC group
+ *  20  capture time, microseconds since the epoch
+ *
+ * With FEC every group of data fragments is followed by a parity fragment,
+ * the XOR of the group padded to the fragment size, flagged as parity and
+ * with the number of the group as index. One lost fragment per group can be
+ * rebuilt from it.
+ */
+
+#define UDP_STREAM_MAGIC 0x4D4A
+#define UDP_STREAM_VERSION 1
+#define UDP_STREAM_PARITY 0x01
+#define UDP_STREAM_HEADER 28
+
+typedef struct _udp_fragment udp_fragment;
+struct _udp_fragment {
+    uint8_t flags;
+    uint32_t frame;
+    uint16_t index;             // of the data fragment or the parity group
+    uint16_t count;             // data fragments of the frame
+    uint32_t size;              // bytes of the frame
+    uint16_t fragment;          // payload of every fragment but the last
+    uint16_t group;             // data fragments per parity, 0 without FEC
+    uint64_t timestamp;
+};
+
+static inline void udp_stream_pack(const udp_fragment *f, unsigned char *p)
+{
+    int i;
+
+    p[0] = UDP_STREAM_MAGIC >> 8;
+    p[1] = UDP_STREAM_MAGIC & 0xFF;
+    p[2] = UDP_STREAM_VERSION;
+    p[3] = f->flags;
+    for(i = 0; i < 4; i++) {
+        p[4 + i] = f->frame >> (24 - 8 * i);
+        p[12 + i] = f->size >> (24 - 8 * i);
+    }
+    p[8] = f->index >> 8;
+    p[9] = f->index;
+    p[10] = f->count >> 8;
+    p[11] = f->count;
+    p[16] = f->fragment >> 8;
+    p[17] = f->fragment;
+    p[18] = f->group >> 8;
+    p[19] = f->group;
+    for(i = 0; i < 8; i++)
+        p[20 + i] = f->timestamp >> (56 - 8 * i);
+}
+
+/* reads the header of a datagram, -1 if it is not a fragment */
+static inline int udp_stream_unpack(udp_fragment *f, const unsigned char *p, int size)
+{
+    int i;
+
+    if(size < UDP_STREAM_HEADER || ((p[0] << 8) | p[1]) != UDP_STREAM_MAGIC || p[2] != UDP_STREAM_VERSION)
+        return -1;
+
+    memset(f, 0, sizeof(*f));
+    f->flags = p[3];
+    for(i = 0; i < 4; i++) {
+        f->frame = (f->frame << 8) | p[4 + i];
+        f->size = (f->size << 8) | p[12 + i];
+    }
+    f->index = (p[8] << 8) | p[9];
+    f->count = (p[10] << 8) | p[11];
+    f->fragment = (p[16] << 8) | p[17];
+    f->group = (p[18] << 8) | p[19];
+    for(i = 0; i < 8; i++)
+        f->timestamp = (f->timestamp << 8) | p[20 + i];
+
+    /* every fragment, the last one too, carries at least one byte */
+    if(f->fragment == 0 || f->count == 0 || f->size < 1 ||
+       f->size > (uint32_t)f->count * f->fragment || f->size <= (uint32_t)(f->count - 1) * f->fragment)
+        return -1;
+    return 0;
+}
+
+#endif
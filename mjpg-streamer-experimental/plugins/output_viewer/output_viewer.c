@@ -276,13 +276,16 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* the window shows every frame */
+    input_subscribe(&pglobal->in[input_number]);
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
         pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
         memcpy(frame, pglobal->in[input_number].buf, frame_size);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -325,6 +328,8 @@ void *worker_thread(void *arg)
         SDL_Flip(screen);
     }
 
+    input_unsubscribe(&pglobal->in[input_number]);
+
     pthread_cleanup_pop(1);
 
     /* get rid of the image */
@@ -21,6 +21,7 @@
 *******************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -64,12 +65,32 @@ static char *mjpgFileName = NULL;
 static char *zmqAddress = NULL;
 static int zmqBufferSize = 3;
 static int zmqBufferPos = 0;
+static int zmqMultipart = 0;              // one message per frame, no protobuf
+static int zmqHighWaterMark = -1;         // ZMQ_SNDHWM, -1 keeps the default
+static int zmqConflate = 0;               // ZMQ_CONFLATE
 static Pb__Package pbPackage = PB__PACKAGE__INIT; // Package
 
 static void *context;
 static void *publisher;
-static void *buf;                         // Buffer to store serialized data
-static int bufferSize;
+
+/*
+ * Buffers handed to ZMQ without copying. ZMQ calls shared_release() from its
+ * I/O thread once a message is sent to all subscribers, the buffer goes back
+ * to the free list when the worker and all messages are done with it.
+ */
+#define MAX_FREE_BUFFERS 8
+
+typedef struct _shared_buffer shared_buffer;
+struct _shared_buffer {
+    int references;
+    size_t capacity;
+    shared_buffer *next;        // in the free list
+    unsigned char data[];
+};
+
+static shared_buffer *free_buffers = NULL;
+static int free_count = 0;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static clock_t begin, end;
 
@@ -80,7 +101,6 @@ Return Value: -
 ******************************************************************************/
 void help(void)
 {
-    // TODO: Update available command line arguments.
     fprintf(stderr, " ---------------------------------------------------------------\n" \
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
             " ---------------------------------------------------------------\n" \
@@ -88,6 +108,15 @@ void help(void)
             " [-f | --folder ]........: folder to save pictures\n" \
             " [-m | --mjpeg ].........: save the frames to an mjpg file \n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
+            " [-a | --address ].......: ZMQ address to publish the frames on, e.g. tcp://*:5555\n" \
+            " [-b | --buffer_size ]...: frames packed into one protobuf message, default 3\n" \
+            " [-multipart ]...........: publish every frame as it comes, as a multipart message\n" \
+            "                           of topic, header and JPEG, without protobuf and copies\n" \
+            " [-hwm ].................: frames queued for a subscriber before it misses some\n" \
+            "                           (ZMQ_SNDHWM), default 1000\n" \
+            " [-conflate ]............: keep only the latest frame for each subscriber\n" \
+            "                           (ZMQ_CONFLATE), with -multipart the header and the\n" \
+            "                           JPEG go in one part\n" \
             " The following arguments are takes effect only if the current mode is not MJPG\n" \
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
@@ -122,12 +151,16 @@ void worker_cleanup(void *arg)
     }
     close(fd);
 
-    // cleanup zmq
+    // cleanup zmq, it lets go of all messages
     zmq_close (publisher);
     zmq_ctx_destroy (context);
 
-    // Free the allocated serialized buffer
-    free(buf);
+    // Free the buffers the messages used
+    while(free_buffers != NULL) {
+        shared_buffer *next = free_buffers->next;
+        free(free_buffers);
+        free_buffers = next;
+    }
 
     // Free protobuf message
     for (i = 0; i < pbPackage.n_frame; ++i)
@@ -137,6 +170,132 @@ void worker_cleanup(void *arg)
     free(pbPackage.frame);
 }
 
+/******************************************************************************
+Description.: takes a buffer from the free list or allocates a new one
+Input Value.: bytes needed
+Return Value: buffer with one reference for the caller, NULL without memory
+******************************************************************************/
+static shared_buffer *shared_get(size_t size)
+{
+    shared_buffer *b = NULL, **p;
+
+    pthread_mutex_lock(&buffers_mutex);
+    for(p = &free_buffers; *p != NULL; p = &(*p)->next) {
+        if((*p)->capacity >= size) {
+            b = *p;
+            *p = b->next;
+            free_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    if(b == NULL) {
+        if((b = malloc(sizeof(shared_buffer) + size + (1 << 16))) == NULL)
+            return NULL;
+        b->capacity = size + (1 << 16);
+    }
+    b->references = 1;
+    b->next = NULL;
+    return b;
+}
+
+/******************************************************************************
+Description.: drops a reference, called by ZMQ for the messages
+Input Value.: data of the message (unused), the buffer
+Return Value: -
+******************************************************************************/
+static void shared_release(void *data, void *hint)
+{
+    shared_buffer *b = hint;
+
+    pthread_mutex_lock(&buffers_mutex);
+    if(--b->references > 0) {
+        pthread_mutex_unlock(&buffers_mutex);
+        return;
+    }
+    if(free_count < MAX_FREE_BUFFERS) {
+        b->next = free_buffers;
+        free_buffers = b;
+        free_count++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    free(b);
+}
+
+/******************************************************************************
+Description.: sends a part of a buffer as a message that points into it
+Input Value.: buffer, start and size of the part, ZMQ flags
+Return Value: 0 if ok, -1 if ZMQ did not take it
+******************************************************************************/
+static int shared_send(shared_buffer *b, unsigned char *data, size_t size, int flags)
+{
+    zmq_msg_t msg;
+
+    pthread_mutex_lock(&buffers_mutex);
+    b->references++;
+    pthread_mutex_unlock(&buffers_mutex);
+
+    if(zmq_msg_init_data(&msg, data, size, shared_release, b) != 0) {
+        shared_release(data, b);
+        return -1;
+    }
+    if(zmq_msg_send(&msg, publisher, flags) < 0) {
+        zmq_msg_close(&msg);
+        return -1;
+    }
+    return 0;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/******************************************************************************
+Description.: publishes a frame as topic, header and JPEG, or as one part
+              of header and JPEG with ZMQ_CONFLATE, which can not keep multipart
+              messages. The header is written in front of the JPEG.
+Input Value.: buffer with ZMQ_FRAME_HEADER bytes free and then the JPEG,
+              size of the JPEG, its timestamp, number of the frame
+Return Value: -
+******************************************************************************/
+static void publish_frame(shared_buffer *b, int size, const struct timeval *timestamp, unsigned long long number)
+{
+    static const char topic[] = "frames";
+    unsigned char *h = b->data;
+    int rc, state;
+
+    put32(h, number >> 32);
+    put32(h + 4, number);
+    put32(h + 8, timestamp->tv_sec);
+    put32(h + 12, timestamp->tv_usec);
+    put32(h + 16, time(NULL));
+    put32(h + 20, size);
+
+    /* a message must not be left half sent by a cancel, and once a part
+       failed the parts behind it are not sent */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    if(zmqConflate)
+        rc = shared_send(b, h, ZMQ_FRAME_HEADER + size, 0);
+    else if(zmq_send(publisher, topic, strlen(topic), ZMQ_SNDMORE) < 0 ||
+            shared_send(b, h, ZMQ_FRAME_HEADER, ZMQ_SNDMORE) < 0 ||
+            shared_send(b, h + ZMQ_FRAME_HEADER, size, 0) < 0)
+        rc = -1;
+    else
+        rc = 0;
+    pthread_setcancelstate(state, NULL);
+
+    if(rc < 0) {
+        DBG("ZMQ Transmission failure: %s\n", zmq_strerror(zmq_errno()));
+    }
+}
+
 /******************************************************************************
 Description.: compares a directory entry with a pattern
 Input Value.: directory entry
@@ -236,10 +395,11 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int ok = 1, frame_size = 0, rc = 0, state;
     char buffer1[1024] = {0}, buffer2[1024] = {0};
     unsigned long long counter = 0;
     unsigned char *tmp_framebuffer = NULL;
+    shared_buffer *shared;
 
     //  Prepare our context and publisher
     //char zmqAddress[20];
@@ -251,6 +411,16 @@ void *worker_thread(void *arg)
     publisher = zmq_socket (context, ZMQ_PUB);
     //snprintf(zmqAddress, 20u, "epgm://eth0;239.1.1.1:%i", zmqPort);
 
+    /* these only apply to connections made after they are set */
+    if (zmqHighWaterMark >= 0 &&
+        zmq_setsockopt (publisher, ZMQ_SNDHWM, &zmqHighWaterMark, sizeof(zmqHighWaterMark)) == -1) {
+        LOG("Couldn't set ZMQ_SNDHWM: %s\n", zmq_strerror(zmq_errno()));
+    }
+    if (zmqConflate &&
+        zmq_setsockopt (publisher, ZMQ_CONFLATE, &zmqConflate, sizeof(zmqConflate)) == -1) {
+        LOG("Couldn't set ZMQ_CONFLATE: %s\n", zmq_strerror(zmq_errno()));
+    }
+
     if (zmq_bind (publisher, zmqAddress) == -1) {
         LOG("Couldn't create zmq socket.\n");
     }
@@ -260,7 +430,6 @@ void *worker_thread(void *arg)
     struct timeval timestamp;
     int i;
 
-    buf = NULL;
     for (i = 0; i < MAX_ZMQ_BUFFER_SIZE; ++i)
     {
         frames[i] = NULL;
@@ -280,6 +449,9 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated ressources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* the socket does not tell who listens, publish every frame */
+    input_subscribe(&pglobal->in[input_number]);
+
     while(ok >= 0 && !pglobal->stop) {
         DBG("waiting for fresh frame\n");
 
@@ -287,7 +459,24 @@ void *worker_thread(void *arg)
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        frame_size = input_jpeg(&pglobal->in[input_number]);
+
+        if (zmqMultipart && mjpgFileName == NULL) {
+            /* the only copy, ZMQ sends straight out of this buffer */
+            if ((shared = shared_get(ZMQ_FRAME_HEADER + frame_size)) == NULL) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                LOG("not enough memory\n");
+                return NULL;
+            }
+            memcpy(shared->data + ZMQ_FRAME_HEADER, pglobal->in[input_number].buf, frame_size);
+            timestamp = pglobal->in[input_number].timestamp;
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+            DBG("transmitting ZMQ: %lld\n", counter);
+            publish_frame(shared, frame_size, &timestamp, counter++);
+            shared_release(NULL, shared);
+            continue;
+        }
 
         /* set the right frame to store the data */
         frame = frames[zmqBufferPos];
@@ -305,10 +494,6 @@ void *worker_thread(void *arg)
                 return NULL;
             }
 
-            if ((setvbuf(stdout, NULL, _IOFBF, max_frame_size)) != 0) {
-                DBG("setvbuf failed.\n");
-            }
-
             frame = tmp_framebuffer;
         }
 
@@ -330,16 +515,6 @@ void *worker_thread(void *arg)
 
             begin = clock();
 
-            /* allocate enough memory to store a serialized string */
-            if ((buf == NULL) || (bufferSize < (max_frame_size * zmqBufferSize + 20)))
-            {
-                bufferSize = (max_frame_size * zmqBufferSize + 20);
-                buf = realloc(buf, bufferSize);
-                if (buf == NULL) {
-                    LOG("Not enough memory");
-                }
-            }
-
             /* fill protobuf data */
             pbPackage.frame[zmqBufferPos]->timestamp_unix = (u_int32_t)time(NULL);
             pbPackage.frame[zmqBufferPos]->timestamp_s = (u_int32_t)timestamp.tv_sec;
@@ -352,16 +527,24 @@ void *worker_thread(void *arg)
             if (zmqBufferPos == zmqBufferSize)
             {
                 DBG("transmitting ZMQ: %lld\n", counter);
-                /* pack protobuf data */
+                /* pack protobuf data into a buffer ZMQ sends without copying */
                 len = pb__package__get_packed_size(&pbPackage);
                 DBG("packing data: %i %i", max_frame_size, len);
-                pb__package__pack(&pbPackage, buf);
+                if ((shared = shared_get(len)) == NULL) {
+                    LOG("not enough memory\n");
+                    return NULL;
+                }
+                pb__package__pack(&pbPackage, shared->data);
 
                 DBG("sending data");
                 // send data using zmq
-                if ((zmq_send(publisher, topic, strlen(topic), ZMQ_SNDMORE) == -1) || (zmq_send(publisher, buf, len, 0) == -1)) {
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+                if ((zmq_send(publisher, topic, strlen(topic), ZMQ_SNDMORE) == -1) ||
+                    (shared_send(shared, shared->data, len, 0) == -1)) {
                     DBG("ZMQ Transmission failure");
                 }
+                pthread_setcancelstate(state, NULL);
+                shared_release(NULL, shared);
 
                 zmqBufferPos = 0;
             }
@@ -410,18 +593,18 @@ void *worker_thread(void *arg)
             DBG("Time3: %f\n", (double)(end-begin) / CLOCKS_PER_SEC);
 
         } else { // recording to MJPG file
-            DBG("Entered else branch!\n");
             /* save picture to file */
-            //if(write(fileno(stdout), frame, frame_size) < 0) {
-            if(fwrite(frame, sizeof(unsigned char), frame_size, stdout) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("fwrite()");
+            if(write(fd, frame, frame_size) < 0) {
+                OPRINT("could not write to file %s\n", mjpgFileName);
+                perror("write()");
                 close(fd);
                 return NULL;
             }
         }
     }
 
+    input_unsubscribe(&pglobal->in[input_number]);
+
     /* cleanup now */
     pthread_cleanup_pop(1);
 
@@ -471,6 +654,9 @@ int output_init(output_parameter *param, int id)
             {"address", required_argument, 0, 0},
             {"b", required_argument, 0, 0},
             {"buffer_size", required_argument, 0, 0},
+            {"multipart", no_argument, 0, 0},
+            {"hwm", required_argument, 0, 0},
+            {"conflate", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -541,6 +727,21 @@ int output_init(output_parameter *param, int id)
             DBG("case 14,15\n");
             zmqBufferSize = atoi(optarg);
             break;
+            /* multipart */
+        case 16:
+            DBG("case 16\n");
+            zmqMultipart = 1;
+            break;
+            /* hwm */
+        case 17:
+            DBG("case 17\n");
+            zmqHighWaterMark = atoi(optarg);
+            break;
+            /* conflate */
+        case 18:
+            DBG("case 18\n");
+            zmqConflate = 1;
+            break;
         }
     }
 
@@ -551,6 +752,10 @@ int output_init(output_parameter *param, int id)
 
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    if (mjpgFileName == NULL) {
+        OPRINT("ZMQ messages......: %s%s\n", zmqMultipart ? "one multipart message per frame" : "protobuf packages",
+               zmqConflate ? ", latest only" : "");
+    }
     if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
             OPRINT("ringbuffer size...: %d to %d\n", ringbuffer_size, ringbuffer_size + ringbuffer_exceed);
@@ -655,7 +860,7 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                         return -1;
                                     }
                                     /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
+                                    frame_size = input_jpeg(&pglobal->in[input_number]);
 
                                     /* check if buffer for frame is large enough, increase it if necessary */
                                     if(frame_size > max_frame_size) {
@@ -4,4 +4,16 @@
 #define OUT_FILE_CMD_TAKE           1
 #define OUT_FILE_CMD_FILENAME       2
 
+/*
+ * With -multipart every frame is published as the topic "frames", this
+ * header and the JPEG. With -conflate the header and the JPEG are one part.
+ * The numbers are in network byte order:
+ *
+ *   0  number of the frame, 64 bit
+ *   8  timestamp_s, 12 timestamp_us: when the frame was taken
+ *  16  timestamp_unix: when it was sent, seconds
+ *  20  size of the JPEG
+ */
+#define ZMQ_FRAME_HEADER            24
+
 #endif
@@ -0,0 +1,146 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Measures what the plugins pay per frame for jpeg_tools.c: walking all
+ * segments, which includes searching the scan for its end, parsing the
+ * headers, checking for the EOI, and splicing a segment in and gathering
+ * the result. Run it on frames of the camera that matters, e.g.
+ *
+ *   jpeg_tools_bench -n 100000 frames/frame_*.jpg
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../plugins/jpeg_tools.h"
+
+static volatile int sink;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* size is the number of bytes the operation goes through, 0 if that does
+   not depend on the frame size */
+static void report(const char *name, const char *operation, double seconds, int iterations, int size)
+{
+    printf("%-24s %-8s %9.1f ns/frame", name, operation, seconds * 1e9 / iterations);
+    if(size > 0)
+        printf(" %9.1f MB/s", (double)size * iterations / seconds / 1e6);
+    printf("\n");
+}
+
+static void bench(const char *path, const unsigned char *jpeg, int size, int iterations)
+{
+    static const unsigned char com[] = { 0xFF, JPEG_COM, 0x00, 0x0A, 'c', 'a', 'm', 'e', 'r', 'a', '-', '1' };
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    unsigned char *out = malloc(size + sizeof(com));
+    jpeg_segment s;
+    jpeg_splice splice;
+    jpeg_info info;
+    double start;
+    int i, count = 0;
+
+    start = now();
+    for(i = 0; i < iterations; i++) {
+        memset(&s, 0, sizeof(s));
+        while(jpeg_next_segment(jpeg, size, &s) > 0)
+            count++;
+    }
+    report(name, "walk", now() - start, iterations, size);
+
+    start = now();
+    for(i = 0; i < iterations; i++)
+        count += jpeg_parse_header(jpeg, size, &info);
+    report(name, "header", now() - start, iterations, info.scan_offset);
+
+    start = now();
+    for(i = 0; i < iterations; i++)
+        count += jpeg_eoi(jpeg, size);
+    report(name, "eoi", now() - start, iterations, 0);
+
+    start = now();
+    for(i = 0; i < iterations; i++) {
+        jpeg_splice_init(&splice, jpeg, size);
+        jpeg_splice_insert(&splice, jpeg_app_offset(jpeg, size), com, sizeof(com));
+        count += splice.count;
+    }
+    report(name, "splice", now() - start, iterations, 0);
+
+    start = now();
+    for(i = 0; i < iterations; i++)
+        count += jpeg_splice_copy(&splice, out);
+    report(name, "copy", now() - start, iterations, splice.size);
+
+    sink = count;
+    free(out);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 10000, usage = 0, c, i;
+
+    while((c = getopt(argc, argv, "n:")) != -1) {
+        switch(c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+    if(usage || optind >= argc || iterations < 1) {
+        fprintf(stderr, "Usage: %s [-n ITERATIONS] FILE...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for(i = optind; i < argc; i++) {
+        unsigned char *jpeg;
+        long size;
+        FILE *f;
+
+        if((f = fopen(argv[i], "rb")) == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        jpeg = malloc(size);
+        if(jpeg == NULL || fread(jpeg, 1, size, f) != (size_t)size) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        fclose(f);
+
+        bench(argv[i], jpeg, size, iterations);
+        free(jpeg);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,603 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Tests of the marker level JPEG code the plugins share, jpeg_tools.c. The
+ * frames in data/ are small versions of what cameras send, see README.md
+ * there, the broken ones are built here.
+ *
+ * Usage: jpeg_tools_test DIR, with DIR the data directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../plugins/jpeg_tools.h"
+
+static int failures = 0;
+
+#define CHECK(x) do { \
+        if(!(x)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, current, #x); \
+            failures++; \
+        } \
+    } while(0)
+
+static const char *current = "";
+
+/* what the frames in data/ have to parse as */
+static const struct {
+    const char *name;
+    int sof, width, height, components, subsampling, restart_interval;
+    int dht_segments;           // 0 for frames that rely on the default tables
+    int app_offset;             // behind the JFIF or Exif segment
+    int padding;                // zeros behind the EOI
+} fixtures[] = {
+    { "uvc_422.jpg", JPEG_SOF0, 160, 120, 3, JPEG_SUBSAMPLING_422, 0, 4, 20, 0 },
+    { "uvc_nodht_padded.jpg", JPEG_SOF0, 160, 120, 3, JPEG_SUBSAMPLING_422, 0, 0, 2, 61 },
+    { "exif_restart_420.jpg", JPEG_SOF0, 160, 120, 3, JPEG_SUBSAMPLING_420, 10, 4, 44, 0 },
+    { "gray.jpg", JPEG_SOF0, 96, 72, 1, JPEG_SUBSAMPLING_GRAY, 0, 2, 20, 0 },
+    { "progressive_444.jpg", JPEG_SOF2, 96, 72, 3, JPEG_SUBSAMPLING_444, 0, 2, 2, 0 },
+};
+
+#define FIXTURES (int)(sizeof(fixtures) / sizeof(fixtures[0]))
+
+static unsigned char *load(const char *dir, const char *name, int *size)
+{
+    char path[1024];
+    unsigned char *data;
+    long length;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if((f = fopen(path, "rb")) == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    rewind(f);
+    data = malloc(length);
+    if(data == NULL || fread(data, 1, length, f) != (size_t)length) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    *size = length;
+    return data;
+}
+
+/******************************************************************************
+Description.: walks a frame and checks every segment found lies within it,
+              starts at an 0xFF and is a marker the walk should stop at
+Input Value.: the JPEG and its size, markers receives the markers found
+              unless it is NULL, max is its size
+Return Value: number of segments, -1 if the walk failed
+******************************************************************************/
+static int walk(const unsigned char *jpeg, int size, int *markers, int max)
+{
+    jpeg_segment s;
+    int rc, count = 0;
+
+    memset(&s, 0, sizeof(s));
+    while((rc = jpeg_next_segment(jpeg, size, &s)) > 0) {
+        CHECK(s.offset >= 0 && s.offset + 2 <= size);
+        CHECK(jpeg[s.offset] == 0xFF && jpeg[s.offset + 1] == s.marker);
+        CHECK(s.marker != 0x00 && s.marker != 0xFF && s.marker != 0x01);
+        CHECK(s.marker < 0xD0 || s.marker > 0xD7);
+        CHECK(s.length >= 0 && s.data >= jpeg && s.data + s.length <= jpeg + size);
+        CHECK(s.next > s.offset && s.next <= size);
+        if(markers != NULL && count < max)
+            markers[count] = s.marker;
+        /* the walk always goes on, that it ends is part of the test */
+        if(++count > size)
+            return -1;
+    }
+    return rc < 0 ? -1 : count;
+}
+
+/* a frame built segment by segment */
+typedef struct {
+    unsigned char data[2048];
+    int size;
+} frame;
+
+static void put(frame *f, const void *p, int length)
+{
+    memcpy(f->data + f->size, p, length);
+    f->size += length;
+}
+
+static void put_marker(frame *f, int marker)
+{
+    unsigned char m[2] = { 0xFF, marker };
+    put(f, m, 2);
+}
+
+/* a segment, its length field says length, the payload is size bytes */
+static void put_segment_length(frame *f, int marker, const void *payload, int size, int length)
+{
+    unsigned char l[2] = { (length + 2) >> 8, length + 2 };
+
+    put_marker(f, marker);
+    put(f, l, 2);
+    put(f, payload, size);
+}
+
+static void put_segment(frame *f, int marker, const void *payload, int size)
+{
+    put_segment_length(f, marker, payload, size, size);
+}
+
+/* the parts of a small valid frame, 16x16 in 4:2:0 */
+static unsigned char dqt[65];
+static const unsigned char sof[] = { 8, 0, 16, 0, 16, 3, 1, 0x22, 0, 2, 0x11, 0, 3, 0x11, 0 };
+static const unsigned char dht[] = { 0x00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00 };
+static const unsigned char dri[] = { 0x00, 0x10 };
+static const unsigned char sos[] = { 3, 1, 0x00, 2, 0x00, 3, 0x00, 0, 63, 0 };
+static const unsigned char scan[] = { 0x12, 0xFF, 0x00, 0x34, 0xFF, 0xD0, 0x56, 0xFF, 0xD1, 0x78 };
+
+/* builds the frame, with the segment given in place of the one of the same
+   marker, or in front of the SOS if there is none */
+static void build(frame *f, int marker, const void *payload, int size, int length)
+{
+    static const struct {
+        int marker;
+        const unsigned char *payload;
+        int size;
+    } parts[] = {
+        { JPEG_DQT, dqt, sizeof(dqt) },
+        { JPEG_SOF0, sof, sizeof(sof) },
+        { JPEG_DHT, dht, sizeof(dht) },
+        { JPEG_DRI, dri, sizeof(dri) },
+    };
+    int i, placed = 0;
+
+    f->size = 0;
+    put_marker(f, JPEG_SOI);
+    for(i = 0; i < (int)(sizeof(parts) / sizeof(parts[0])); i++) {
+        if(parts[i].marker == marker) {
+            put_segment_length(f, marker, payload, size, length);
+            placed = 1;
+        } else {
+            put_segment(f, parts[i].marker, parts[i].payload, parts[i].size);
+        }
+    }
+    if(!placed && marker != 0)
+        put_segment_length(f, marker, payload, size, length);
+    put_segment(f, JPEG_SOS, sos, sizeof(sos));
+    put(f, scan, sizeof(scan));
+    put_marker(f, JPEG_EOI);
+}
+
+static int parse(const frame *f, jpeg_info *info)
+{
+    return jpeg_parse_header(f->data, f->size, info);
+}
+
+static void test_fixture(const char *dir, int n)
+{
+    int size, count, i, j, eoi, markers[64];
+    unsigned char *jpeg = load(dir, fixtures[n].name, &size);
+    jpeg_info info;
+
+    current = fixtures[n].name;
+
+    count = walk(jpeg, size, markers, 64);
+    CHECK(count > 2);
+    CHECK(markers[0] == JPEG_SOI);
+    CHECK(markers[count - 1] == JPEG_EOI);
+
+    eoi = jpeg_eoi(jpeg, size);
+    CHECK(eoi == size - 2 - fixtures[n].padding);
+
+    CHECK(jpeg_parse_header(jpeg, size, &info) == 0);
+    CHECK(info.sof == fixtures[n].sof);
+    CHECK(info.precision == 8);
+    CHECK(info.width == fixtures[n].width && info.height == fixtures[n].height);
+    CHECK(info.components == fixtures[n].components);
+    CHECK(info.subsampling == fixtures[n].subsampling);
+    CHECK(info.restart_interval == fixtures[n].restart_interval);
+    CHECK(info.dht_segments == fixtures[n].dht_segments);
+    CHECK(info.dqt[0] != NULL && info.dqt[0] > jpeg && info.dqt[0] + 64 <= jpeg + size);
+    CHECK(jpeg[info.sos_offset] == 0xFF && jpeg[info.sos_offset + 1] == JPEG_SOS);
+    CHECK(info.scan_offset > info.sos_offset && info.scan_offset < eoi);
+    CHECK(jpeg_app_offset(jpeg, size) == fixtures[n].app_offset);
+
+    /* restart markers and stuffed bytes in the scan do not end it */
+    if(fixtures[n].restart_interval > 0) {
+        int restarts = 0;
+        for(i = info.scan_offset; i < eoi; i++)
+            if(jpeg[i] == 0xFF && jpeg[i + 1] >= 0xD0 && jpeg[i + 1] <= 0xD7)
+                restarts++;
+        CHECK(restarts > 0);
+        CHECK(markers[count - 2] == JPEG_SOS);
+    }
+
+    /* every frame that was cut short: the walk stays inside, the frame is
+       not complete and the header only parses if the cut is behind it */
+    for(i = 0; i < size; i++) {
+        unsigned char *cut = malloc(i > 0 ? i : 1);
+        jpeg_info partial;
+
+        memcpy(cut, jpeg, i);
+        count = walk(cut, i, NULL, 0);
+        CHECK(count >= -1);
+        CHECK((jpeg_eoi(cut, i) >= 0) == (i >= eoi + 2));
+        j = jpeg_parse_header(cut, i, &partial);
+        CHECK(j == -1 || (j == 0 && i >= info.scan_offset && partial.width == info.width));
+        free(cut);
+        if(failures > 0)
+            break;
+    }
+
+    free(jpeg);
+}
+
+static void test_markers(void)
+{
+    static const unsigned char fill[] = { 0xFF, 0xD8, 0xFF, 0xFF, 0xFF, 0xFE, 0x00, 0x04, 'A', 'B', 0xFF, 0xD9 };
+    static const unsigned char rst[] = {
+        0xFF, 0xD8, 0xFF, 0xDA, 0x00, 0x02, 0x12, 0xFF, 0x00, 0x34, 0xFF, 0xD3,
+        0x56, 0xFF, 0xFF, 0xD7, 0x01, 0xFF, 0x01, 0xFF, 0xD9
+    };
+    static const unsigned char short_length[] = { 0xFF, 0xD8, 0xFF, 0xFE, 0x00, 0x01, 0x00 };
+    static const unsigned char long_length[] = { 0xFF, 0xD8, 0xFF, 0xFE, 0x00, 0x10, 0x00, 0x00 };
+    static const unsigned char no_length[] = { 0xFF, 0xD8, 0xFF, 0xFE, 0x00 };
+    static const unsigned char lone_ff[] = { 0xFF, 0xD8, 0x00, 0x00, 0xFF };
+    static const unsigned char not_jpeg[] = { 0x00, 0xD8, 0xFF, 0xD9 };
+    jpeg_segment s;
+
+    current = "markers";
+
+    /* fill bytes in front of a marker belong to it */
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(fill, sizeof(fill), &s) == 1 && s.marker == JPEG_SOI);
+    CHECK(jpeg_next_segment(fill, sizeof(fill), &s) == 1 && s.marker == JPEG_COM);
+    CHECK(s.offset == 4 && s.length == 2 && memcmp(s.data, "AB", 2) == 0 && s.next == 10);
+    CHECK(jpeg_next_segment(fill, sizeof(fill), &s) == 1 && s.marker == JPEG_EOI && s.offset == 10);
+    CHECK(jpeg_next_segment(fill, sizeof(fill), &s) == 0);
+    CHECK(jpeg_next_segment(fill, sizeof(fill), &s) == 0);
+
+    /* stuffed bytes, restart markers, fill bytes and 0xFF01 in the scan */
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(rst, sizeof(rst), &s) == 1 && s.marker == JPEG_SOI);
+    CHECK(jpeg_next_segment(rst, sizeof(rst), &s) == 1 && s.marker == JPEG_SOS && s.length == 0);
+    CHECK(jpeg_next_segment(rst, sizeof(rst), &s) == 1 && s.marker == JPEG_EOI);
+    CHECK(s.offset == (int)sizeof(rst) - 2);
+
+    /* lengths below 2 or past the end, a marker cut before its length */
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(short_length, sizeof(short_length), &s) == 1);
+    CHECK(jpeg_next_segment(short_length, sizeof(short_length), &s) == -1);
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(long_length, sizeof(long_length), &s) == 1);
+    CHECK(jpeg_next_segment(long_length, sizeof(long_length), &s) == -1);
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(no_length, sizeof(no_length), &s) == 1);
+    CHECK(jpeg_next_segment(no_length, sizeof(no_length), &s) == -1);
+
+    /* an 0xFF in the last byte is no marker yet */
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(lone_ff, sizeof(lone_ff), &s) == 1);
+    CHECK(jpeg_next_segment(lone_ff, sizeof(lone_ff), &s) == 0);
+
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(not_jpeg, sizeof(not_jpeg), &s) == -1);
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(fill, 1, &s) == -1);
+    memset(&s, 0, sizeof(s));
+    CHECK(jpeg_next_segment(fill, 0, &s) == -1);
+}
+
+/* random bytes behind a SOI, many of them 0xFF, the walk has to end */
+static void test_garbage(void)
+{
+    unsigned char data[512];
+    unsigned int seed = 12345;
+    int round, i, size;
+
+    current = "garbage";
+    for(round = 0; round < 20000; round++) {
+        size = 2 + round % (sizeof(data) - 2);
+        data[0] = 0xFF;
+        data[1] = JPEG_SOI;
+        for(i = 2; i < size; i++) {
+            seed = seed * 1103515245 + 12345;
+            data[i] = (seed >> 16) & 1 ? 0xFF : (seed >> 8) & 0xFF;
+        }
+        CHECK(walk(data, size, NULL, 0) >= -1);
+        if(jpeg_eoi(data, size) >= 0)
+            CHECK(data[jpeg_eoi(data, size) + 1] == JPEG_EOI);
+        if(failures > 0)
+            break;
+    }
+}
+
+static void test_header(void)
+{
+    unsigned char bad[128], two[1 + 64 + 1 + 128];
+    const unsigned char *tables[4] = { NULL };
+    int precision[4] = { 0 };
+    jpeg_info info;
+    frame f;
+
+    current = "header";
+
+    build(&f, 0, NULL, 0, 0);
+    CHECK(parse(&f, &info) == 0);
+    CHECK(info.width == 16 && info.height == 16 && info.subsampling == JPEG_SUBSAMPLING_420);
+    CHECK(info.restart_interval == 16);
+    CHECK(info.dht_segments == 1 && info.dht[0][0] != NULL && info.dht[1][0] == NULL);
+    CHECK(info.scan_components == 3 && info.scan_index[2] == 2);
+    CHECK(jpeg_eoi(f.data, f.size) == f.size - 2);
+
+    /* SOF shorter than its fixed part, or than its components */
+    build(&f, JPEG_SOF0, sof, 5, 5);
+    CHECK(parse(&f, &info) == -1);
+    build(&f, JPEG_SOF0, sof, sizeof(sof) - 1, sizeof(sof) - 1);
+    CHECK(parse(&f, &info) == -1);
+    memcpy(bad, sof, sizeof(sof));
+    bad[5] = 0;
+    build(&f, JPEG_SOF0, bad, sizeof(sof), sizeof(sof));
+    CHECK(parse(&f, &info) == -1);
+    bad[5] = 5;
+    build(&f, JPEG_SOF0, bad, sizeof(sof), sizeof(sof));
+    CHECK(parse(&f, &info) == -1);
+    memcpy(bad, sof, sizeof(sof));
+    bad[7] = 0x02;
+    build(&f, JPEG_SOF0, bad, sizeof(sof), sizeof(sof));
+    CHECK(parse(&f, &info) == -1);
+    memcpy(bad, sof, sizeof(sof));
+    bad[8] = 4;
+    build(&f, JPEG_SOF0, bad, sizeof(sof), sizeof(sof));
+    CHECK(parse(&f, &info) == -1);
+
+    /* a length field running past the frame */
+    build(&f, JPEG_SOF0, sof, sizeof(sof), 2000);
+    CHECK(parse(&f, &info) == -1);
+
+    /* DQT with an unknown precision or table, or cut short */
+    memcpy(bad, dqt, sizeof(dqt));
+    bad[0] = 0x20;
+    build(&f, JPEG_DQT, bad, sizeof(dqt), sizeof(dqt));
+    CHECK(parse(&f, &info) == -1);
+    bad[0] = 0x04;
+    build(&f, JPEG_DQT, bad, sizeof(dqt), sizeof(dqt));
+    CHECK(parse(&f, &info) == -1);
+    build(&f, JPEG_DQT, dqt, sizeof(dqt) - 1, sizeof(dqt) - 1);
+    CHECK(parse(&f, &info) == -1);
+    bad[0] = 0x10;
+    build(&f, JPEG_DQT, bad, sizeof(dqt), sizeof(dqt));
+    CHECK(parse(&f, &info) == -1);
+
+    /* two tables in one DQT, the second with 16 bit entries */
+    memset(two, 1, sizeof(two));
+    two[0] = 0x00;
+    two[65] = 0x13;
+    CHECK(jpeg_parse_dqt(two, sizeof(two), tables, precision) == 0);
+    CHECK(tables[0] == two + 1 && precision[0] == 0);
+    CHECK(tables[3] == two + 66 && precision[3] == 1);
+    CHECK(tables[1] == NULL && tables[2] == NULL);
+    CHECK(jpeg_parse_dqt(two, sizeof(two) - 1, tables, precision) == -1);
+    CHECK(jpeg_parse_dqt(two, 0, tables, precision) == 0);
+
+    /* DRI without its interval */
+    build(&f, JPEG_DRI, dri, 0, 0);
+    CHECK(parse(&f, &info) == -1);
+    build(&f, JPEG_DRI, dri, 1, 1);
+    CHECK(parse(&f, &info) == -1);
+
+    /* DHT with more codes than symbols, or cut short */
+    memcpy(bad, dht, sizeof(dht));
+    bad[16] = 255;
+    bad[15] = 2;
+    build(&f, JPEG_DHT, bad, sizeof(dht), sizeof(dht));
+    CHECK(parse(&f, &info) == -1);
+    build(&f, JPEG_DHT, dht, 16, 16);
+    CHECK(parse(&f, &info) == -1);
+    memcpy(bad, dht, sizeof(dht));
+    bad[0] = 0x20;
+    build(&f, JPEG_DHT, bad, sizeof(dht), sizeof(dht));
+    CHECK(parse(&f, &info) == -1);
+
+    /* the standard tables hold both DC and both AC tables */
+    {
+        const unsigned char *std[2][4] = { { NULL } };
+        CHECK(jpeg_std_dht[0] == 0xFF && jpeg_std_dht[1] == JPEG_DHT);
+        CHECK(((jpeg_std_dht[2] << 8) | jpeg_std_dht[3]) == JPEG_STD_DHT_SIZE - 2);
+        CHECK(jpeg_parse_dht(jpeg_std_dht + 4, JPEG_STD_DHT_SIZE - 4, std) == 0);
+        CHECK(std[0][0] != NULL && std[0][1] != NULL && std[1][0] != NULL && std[1][1] != NULL);
+        CHECK(std[0][2] == NULL && std[1][2] == NULL);
+    }
+
+    /* SOS before the SOF, or naming a component the frame does not have */
+    f.size = 0;
+    put_marker(&f, JPEG_SOI);
+    put_segment(&f, JPEG_SOS, sos, sizeof(sos));
+    put_segment(&f, JPEG_SOF0, sof, sizeof(sof));
+    put_marker(&f, JPEG_EOI);
+    CHECK(parse(&f, &info) == -1);
+    memcpy(bad, sos, sizeof(sos));
+    bad[5] = 9;
+    f.size = 0;
+    put_marker(&f, JPEG_SOI);
+    put_segment(&f, JPEG_SOF0, sof, sizeof(sof));
+    put_segment(&f, JPEG_SOS, bad, sizeof(sos));
+    put_marker(&f, JPEG_EOI);
+    CHECK(parse(&f, &info) == -1);
+
+    /* no scan at all */
+    f.size = 0;
+    put_marker(&f, JPEG_SOI);
+    put_segment(&f, JPEG_SOF0, sof, sizeof(sof));
+    put_marker(&f, JPEG_EOI);
+    CHECK(parse(&f, &info) == -1);
+    f.size -= 2;
+    CHECK(parse(&f, &info) == -1);
+}
+
+static void test_eoi(void)
+{
+    static const unsigned char complete[] = { 0xFF, 0xD8, 0x12, 0xFF, 0xD9 };
+    static const unsigned char padded[] = { 0xFF, 0xD8, 0x12, 0xFF, 0xD9, 0x00, 0x00, 0x00 };
+    static const unsigned char cut[] = { 0xFF, 0xD8, 0x12, 0xFF };
+    static const unsigned char zeros[] = { 0xFF, 0xD8, 0x00, 0x00, 0x00, 0x00 };
+    static const unsigned char bare[] = { 0xFF, 0xD8, 0xFF, 0xD9 };
+    static const unsigned char not_jpeg[] = { 0xFF, 0xD9, 0xFF, 0xD9 };
+
+    current = "eoi";
+    CHECK(jpeg_eoi(complete, sizeof(complete)) == 3);
+    CHECK(jpeg_eoi(padded, sizeof(padded)) == 3);
+    CHECK(jpeg_eoi(cut, sizeof(cut)) == -1);
+    CHECK(jpeg_eoi(zeros, sizeof(zeros)) == -1);
+    CHECK(jpeg_eoi(bare, sizeof(bare)) == 2);
+    CHECK(jpeg_eoi(bare, 3) == -1);
+    CHECK(jpeg_eoi(not_jpeg, sizeof(not_jpeg)) == -1);
+}
+
+/* compares a splice with what it should gather to */
+static int spliced(const jpeg_splice *splice, const char *expected)
+{
+    unsigned char out[256];
+    int length = strlen(expected);
+
+    if(splice->size != length || jpeg_splice_copy(splice, out) != length)
+        return 0;
+    return memcmp(out, expected, length) == 0;
+}
+
+static int unchanged(const jpeg_splice *a, const jpeg_splice *b)
+{
+    return a->count == b->count && a->size == b->size && memcmp(a->iov, b->iov, a->count * sizeof(a->iov[0])) == 0;
+}
+
+static void test_splice(const char *dir)
+{
+    static const char original[] = "0123456789abcdefghijklmnopqrstuv";
+    const unsigned char *frame = (const unsigned char *)original;
+    unsigned char *jpeg, *out, *back, com[] = { 0xFF, JPEG_COM, 0x00, 0x05, 'c', 'a', 'm' };
+    struct iovec iov[JPEG_SPLICE_PIECES];
+    FILE *tmp;
+    int size = sizeof(original) - 1, i, rc, at, markers[64], count;
+    jpeg_splice s, before;
+    jpeg_info info;
+
+    current = "splice";
+
+    jpeg_splice_init(&s, frame, size);
+    CHECK(s.count == 1 && spliced(&s, original));
+    jpeg_splice_init(&s, frame, 0);
+    CHECK(s.count == 0 && s.size == 0);
+
+    /* nothing of the frame is copied, the pieces point into it */
+    jpeg_splice_init(&s, frame, size);
+    CHECK(jpeg_splice_replace(&s, 10, 4, "XYZ", 3) == 0);
+    CHECK(spliced(&s, "0123456789XYZefghijklmnopqrstuv"));
+    CHECK(s.count == 3 && s.iov[0].iov_base == frame && s.iov[2].iov_base == frame + 14);
+
+    /* data put in at the same offset before stays in front */
+    CHECK(jpeg_splice_insert(&s, 10, "PQ", 2) == 0);
+    CHECK(spliced(&s, "0123456789XYZPQefghijklmnopqrstuv"));
+    CHECK(jpeg_splice_insert(&s, 0, "<", 1) == 0);
+    CHECK(jpeg_splice_insert(&s, size, ">", 1) == 0);
+    CHECK(spliced(&s, "<0123456789XYZPQefghijklmnopqrstuv>"));
+    CHECK(jpeg_splice_replace(&s, 20, 2, "", 0) == 0);
+    CHECK(spliced(&s, "<0123456789XYZPQefghijmnopqrstuv>"));
+    CHECK(jpeg_splice_replace(&s, 0, 5, "all", 3) == 0);
+    CHECK(spliced(&s, "<all56789XYZPQefghijmnopqrstuv>"));
+
+    /* parts outside of the frame leave the splice as it was */
+    jpeg_splice_init(&s, frame, size);
+    CHECK(jpeg_splice_insert(&s, 5, "-", 1) == 0);
+    before = s;
+    CHECK(jpeg_splice_replace(&s, size - 2, 3, "x", 1) == -1);
+    CHECK(jpeg_splice_replace(&s, -1, 1, "x", 1) == -1);
+    CHECK(jpeg_splice_replace(&s, 1, -1, "x", 1) == -1);
+    CHECK(jpeg_splice_insert(&s, size + 1, "x", 1) == -1);
+    CHECK(unchanged(&s, &before));
+
+    /* running out of pieces, the splice stays as it was */
+    jpeg_splice_init(&s, frame, size);
+    for(i = 1, rc = 0; i < size && rc == 0; i++) {
+        before = s;
+        rc = jpeg_splice_insert(&s, i, "+", 1);
+        CHECK(s.count <= JPEG_SPLICE_PIECES);
+    }
+    CHECK(rc == -1);
+    CHECK(unchanged(&s, &before));
+    CHECK(s.size == size + (i - 2));
+
+    /* a COM put into a real frame, the result still parses */
+    jpeg = load(dir, "exif_restart_420.jpg", &size);
+    at = jpeg_app_offset(jpeg, size);
+    jpeg_splice_init(&s, jpeg, size);
+    CHECK(jpeg_splice_insert(&s, at, com, sizeof(com)) == 0);
+    out = malloc(s.size);
+    CHECK(jpeg_splice_copy(&s, out) == size + (int)sizeof(com));
+    CHECK(memcmp(out, jpeg, at) == 0 && memcmp(out + at, com, sizeof(com)) == 0);
+    CHECK(memcmp(out + at + sizeof(com), jpeg + at, size - at) == 0);
+    count = walk(out, s.size, markers, 64);
+    CHECK(count > 3 && markers[1] == JPEG_APP1 && markers[2] == JPEG_COM);
+    CHECK(jpeg_parse_header(out, s.size, &info) == 0 && info.restart_interval == 10);
+    CHECK(jpeg_eoi(out, s.size) == s.size - 2);
+
+    /* written as it was gathered */
+    tmp = tmpfile();
+    memcpy(iov, s.iov, s.count * sizeof(struct iovec));
+    CHECK(jpeg_writev(fileno(tmp), iov, s.count) == 0);
+    rewind(tmp);
+    back = malloc(s.size + 1);
+    CHECK(fread(back, 1, s.size + 1, tmp) == (size_t)s.size && memcmp(back, out, s.size) == 0);
+    CHECK(jpeg_writev(-1, iov, s.count) == -1);
+    fclose(tmp);
+    free(back);
+    free(out);
+    free(jpeg);
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s DIR\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < 64; i++)
+        dqt[1 + i] = 1 + i;
+
+    for(i = 0; i < FIXTURES; i++)
+        test_fixture(argv[1], i);
+    test_markers();
+    test_garbage();
+    test_header();
+    test_eoi();
+    test_splice(argv[1]);
+
+    if(failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all checks passed\n");
+    return EXIT_SUCCESS;
+}